@@ -0,0 +1,313 @@
+// Client Microbenchmarks
+//
+// Times the client's parsing, encoding and piece assignment routines on
+// fixed-seed inputs from small to very large, and counts heap allocations
+// (every operator new) per call. Builds against client.cpp itself, with its
+// main() compiled out.
+//
+// Usage: micro [--filter=<substring>] [--min-time-ms=<ms>]
+
+#define P2P_NO_MAIN
+#include "../client.cpp"
+
+#include <cstdlib>
+#include <new>
+
+// ==================== ALLOCATION COUNTING ====================
+
+static atomic<uint64_t> allocation_count(0);
+static atomic<uint64_t> allocation_bytes(0);
+
+// GCC can't tell that these two are a matching pair
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocation_bytes.fetch_add(size, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+// ==================== HARNESS ====================
+
+string bench_filter;
+int min_time_ms = 200;
+size_t sink = 0;   // Results are folded in here so the work can't be optimized away
+
+// Run fn until min_time_ms has passed (at least once) and print its cost per call
+template <typename F>
+void bench(const string& name, F fn) {
+    if (!bench_filter.empty() && name.find(bench_filter) == string::npos) return;
+
+    fn();  // Warm up (and size any reused buffers)
+
+    long iterations = 0;
+    uint64_t allocs_before = allocation_count.load();
+    uint64_t bytes_before = allocation_bytes.load();
+    auto started = chrono::steady_clock::now();
+    auto deadline = started + chrono::milliseconds(min_time_ms);
+    long batch = 1;
+
+    while (true) {
+        for (long i = 0; i < batch; i++) fn();
+        iterations += batch;
+        if (chrono::steady_clock::now() >= deadline) break;
+        batch = min(batch * 2, 1L << 20);
+    }
+
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+    double allocs = (double)(allocation_count.load() - allocs_before) / iterations;
+    double bytes = (double)(allocation_bytes.load() - bytes_before) / iterations;
+    printf("%-52s %10ld %14.1f %12.1f %14.0f\n", name.c_str(), iterations, ns / iterations, allocs, bytes);
+}
+
+// ==================== INPUTS ====================
+
+mt19937 rng(42);
+
+vector<bool> random_bits(int n, double density) {
+    bernoulli_distribution have(density);
+    vector<bool> bits(n);
+    for (int i = 0; i < n; i++) bits[i] = have(rng);
+    return bits;
+}
+
+string random_ip() {
+    return "10." + to_string(rng() % 256) + "." + to_string(rng() % 256) + "." + to_string(rng() % 256);
+}
+
+// A tracker peer list; with partial set, every other peer has a run-length
+// piece encoding, and AVAIL is present
+string peers_response(int num_peers, int num_pieces, bool partial) {
+    string response = "PEERS:";
+    for (int i = 0; i < num_peers; i++) {
+        response += " " + random_ip() + ":" + to_string(6000 + rng() % 1000);
+        if (partial && i % 2 == 1) {
+            response += "/r" + to_string(num_pieces / 2) + "," + to_string(num_pieces - num_pieces / 2);
+        }
+    }
+    response += " SIZE:" + to_string((long)num_pieces * PIECE_SIZE) + " PIECES:" + to_string(num_pieces);
+    if (partial) {
+        response += " AVAIL:" + to_string(num_peers) + "x" + to_string(num_pieces / 2) + "," +
+                    to_string(num_peers / 2) + "x" + to_string(num_pieces - num_pieces / 2);
+    }
+    return response;
+}
+
+vector<PeerInfo> random_peers(int num_peers, int num_pieces, double density) {
+    vector<PeerInfo> peers(num_peers);
+    for (int i = 0; i < num_peers; i++) {
+        peers[i].ip = random_ip();
+        peers[i].port = 6000 + i;
+        peers[i].bit_vector = random_bits(num_pieces, density);
+    }
+    return peers;
+}
+
+// ==================== BENCHMARKS ====================
+
+void bench_split_string() {
+    string command = "download_file group1 some_file_name.bin 50";
+    bench("split_string/command", [&] { sink += split_string(command, ' ').size(); });
+
+    for (int n : {50, 10000}) {
+        string line = peers_response(n, 1000, false);
+        bench("split_string/peers_" + to_string(n), [&] { sink += split_string(line, ' ').size(); });
+    }
+}
+
+void bench_bitvectors() {
+    for (int n : {1000, 100000, 1000000}) {
+        vector<bool> bits = random_bits(n, 0.5);
+        string response = build_bitvector_response(bits);
+        string label = to_string(n);
+
+        bench("bitvector_response/build_" + label, [&] { sink += build_bitvector_response(bits).size(); });
+        bench("bitvector_response/parse_" + label, [&] { sink += parse_bitvector_response(response).size(); });
+
+        // The tracker-side encoding of the same bits, for comparison
+        string encoded = encode_pieces(bits);
+        vector<bool> decoded;
+        bench("pieces_encoding/encode_random_" + label, [&] { sink += encode_pieces(bits).size(); });
+        bench("pieces_encoding/decode_random_" + label, [&] {
+            sink += decode_pieces(encoded, n, decoded);
+        });
+
+        vector<bool> prefix(n, false);
+        for (int i = 0; i < n / 2; i++) prefix[i] = true;
+        bench("pieces_encoding/encode_prefix_" + label, [&] { sink += encode_pieces(prefix).size(); });
+    }
+}
+
+void bench_assignment() {
+    struct Shape { int peers; int pieces; };
+    for (Shape shape : {Shape{10, 1000}, Shape{50, 100000}, Shape{10, 1000000}, Shape{10000, 1000}}) {
+        vector<PeerInfo> peers = random_peers(shape.peers, shape.pieces, 0.8);
+        vector<int> counts(shape.pieces);
+        for (int i = 0; i < shape.pieces; i++) counts[i] = 1 + rng() % shape.peers;
+        string label = to_string(shape.peers) + "x" + to_string(shape.pieces);
+
+        // Clearing keeps each peer's capacity, so this is the steady state
+        bench("assign_pieces_round_robin/" + label, [&] {
+            for (PeerInfo& peer : peers) peer.assigned_pieces.clear();
+            assign_pieces_round_robin(peers, shape.pieces);
+            sink += peers[0].assigned_pieces.size();
+        });
+        bench("assign_pieces_rarest_first/" + label, [&] {
+            for (PeerInfo& peer : peers) peer.assigned_pieces.clear();
+            assign_pieces_rarest_first(peers, shape.pieces, counts);
+            sink += peers[0].assigned_pieces.size();
+        });
+    }
+}
+
+void bench_peers_parser() {
+    for (int n : {50, 10000}) {
+        for (bool partial : {false, true}) {
+            string response = peers_response(n, 10000, partial);
+            bench("parse_peers_response/" + to_string(n) + (partial ? "_partial" : "_complete"), [&] {
+                PeerListing listing;
+                parse_peers_response(response, listing);
+                sink += listing.peers.size();
+            });
+        }
+    }
+}
+
+void bench_compression() {
+    // One piece of CSV rows, and one of random bytes
+    string text;
+    for (int i = 1; text.size() < PIECE_SIZE; i++) {
+        text += to_string(i) + ",user" + to_string(10000 + rng() % 50000) + "," +
+                (rng() % 2 ? "active" : "inactive") + "," + to_string(rng() % 100000 / 100.0) + "\n";
+    }
+    text.resize(PIECE_SIZE);
+    string noise(PIECE_SIZE, '\0');
+    for (char& c : noise) c = (char)rng();
+    
+    for (const auto& input : {make_pair(string("text"), &text), make_pair(string("random"), &noise)}) {
+        const string& piece = *input.second;
+        string packed;
+        bool fits = lz_compress(piece.data(), piece.size(), packed, piece.size());
+        printf("# lz_compress/%s: %zu -> %zu bytes%s\n", input.first.c_str(), piece.size(), packed.size(),
+               fits ? "" : " (incompressible)");
+        
+        bench("lz_compress/" + input.first, [&] {
+            sink += lz_compress(piece.data(), piece.size(), packed, piece.size());
+        });
+        if (fits) {
+            vector<char> out(piece.size());
+            bench("lz_decompress/" + input.first, [&] {
+                sink += lz_decompress(packed.data(), packed.size(), out.data(), out.size());
+            });
+        }
+    }
+}
+
+void bench_hashing() {
+    string piece(PIECE_SIZE, '\0');
+    for (char& c : piece) c = (char)rng();
+    bench("sha256/piece", [&] { sink += (unsigned char)sha256(piece.data(), piece.size())[0]; });
+    string digest = sha256(piece.data(), piece.size());
+    bench("sha256/verify_piece", [&] { sink += sha256_matches(piece.data(), piece.size(), digest); });
+}
+
+void bench_piece_buffers() {
+    bench("piece_buffer/get_put", [&] {
+        PieceBuffer buffer = PieceBuffer::get();
+        sink += (size_t)buffer.data() & 1;
+    });
+}
+
+#ifndef _WIN32
+// One GET_PIECE round trip per call over a socket pair, with the peer side
+// served by handle_peer_request (in its own thread) from a shared file of
+// text pieces: the whole per-piece path, both ends
+void bench_piece_transfer() {
+    const int num_pieces = 64;
+    char path[] = "/tmp/p2p-micro-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    string text;
+    for (int i = 1; text.size() < (size_t)num_pieces * PIECE_SIZE; i++) {
+        text += to_string(i) + ",user" + to_string(10000 + rng() % 50000) + "," + to_string(rng() % 1000) + "\n";
+    }
+    text.resize((size_t)num_pieces * PIECE_SIZE);
+    if (write(fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    
+    LocalFileInfo info;
+    info.filepath = path;
+    info.file_size = (long)text.size();
+    info.num_pieces = num_pieces;
+    info.bit_vector.assign(num_pieces, true);
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        add_shared_file("micro", "pieces.csv", info);
+    }
+    
+    for (bool compressed : {false, true}) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) break;
+        thread server(handle_peer_request, fds[1], string("127.0.0.1"));
+        bool pex;
+        if (compressed && negotiate_hello(fds[0], false, pex) != 1) {
+            close(fds[0]);
+            server.join();
+            break;
+        }
+        
+        PieceBuffer piece = PieceBuffer::get();
+        PieceBuffer packed = PieceBuffer::get();
+        string request;
+        int next = 0;
+        bench(string("piece_transfer/") + (compressed ? "lz" : "raw"), [&] {
+            request.assign("GET_PIECE micro pieces.csv ").append(to_string(next));
+            next = (next + 1) % num_pieces;
+            uint32_t piece_size = 0;
+            uint32_t wire_size = 0;
+            sink += fetch_piece(fds[0], compressed, request, piece.data(), packed.data(), piece_size, wire_size);
+            sink += wire_size;
+        });
+        close(fds[0]);
+        server.join();
+    }
+    unlink(path);
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--filter=") == 0) bench_filter = arg.substr(9);
+        else if (arg.find("--min-time-ms=") == 0) min_time_ms = max(1, atoi(arg.c_str() + 14));
+        else {
+            cout << "Usage: micro [--filter=<substring>] [--min-time-ms=<ms>]" << endl;
+            return 1;
+        }
+    }
+
+    printf("%-52s %10s %14s %12s %14s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+    bench_split_string();
+    bench_bitvectors();
+    bench_assignment();
+    bench_peers_parser();
+    bench_compression();
+    bench_hashing();
+    bench_piece_buffers();
+#ifndef _WIN32
+    bench_piece_transfer();
+#endif
+
+    return sink == 42 ? 1 : 0;  // Never true in practice; keeps sink live
+}
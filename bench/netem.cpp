@@ -0,0 +1,485 @@
+// Network Condition Emulator (Linux)
+//
+// A TCP forwarder that puts WAN-like conditions between processes on one
+// box. Each link in the scenario file listens on a local port and forwards
+// every connection to a target, adding one-way latency and jitter, capping
+// bandwidth (shared by all of the link's connections, per direction), stalling
+// the stream now and then, and resetting connections after a random lifetime.
+// Point clients at a link in front of the tracker, and start each client with
+// --advertise-port=<its link's port> so other peers reach it through its link.
+//
+// Scenario file, one link per line:
+//   <name> <listen ip:port> <target ip:port> [option=value ...]
+//
+//   latency=<dur>        One-way delay in each direction (RTT is twice this)
+//   jitter=<dur>         Extra delay, uniform in [0, jitter]; order is kept
+//   rate=<rate>          Bandwidth cap in each direction
+//   rate_to=<rate>       ... towards the target only (e.g. requests to a peer)
+//   rate_from=<rate>     ... from the target only (e.g. a peer's uploads)
+//   stall=<every>/<dur>  Pause the stream for <dur> at random intervals
+//                        averaging <every>
+//   reset=<dur>          Reset connections after a random lifetime averaging
+//                        <dur>
+//
+// Durations take us, ms or s (bare numbers are ms); rates take bit, kbit,
+// mbit, gbit (per second) or B, KB, MB, GB (bytes per second; bare numbers
+// are bytes).
+//
+// Usage: netem <scenario file> [--seed=<n>] [--report=<sec>]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+#define CHUNK_SIZE 16384             // Largest read from a socket
+#define SLICE_SIZE 4096              // Paced sends are split to this size
+#define MAX_QUEUED_BYTES (256 * 1024) // Per direction; the reader waits beyond this
+
+// ==================== SCENARIO ====================
+
+struct Shape {
+    double latency_ms = 0;
+    double jitter_ms = 0;
+    double rate_to = 0;          // Bytes/sec towards the target; 0 = unlimited
+    double rate_from = 0;        // Bytes/sec from the target
+    double stall_every_ms = 0;   // Mean time between stalls; 0 = never
+    double stall_ms = 0;
+    double reset_after_ms = 0;   // Mean connection lifetime; 0 = never reset
+};
+
+// Bandwidth of one direction of a link, shared by its connections
+struct Pacer {
+    mutex m;
+    double rate = 0;
+    Clock::time_point free_at;
+
+    // When `bytes` may be sent, given they can't go before `earliest`
+    Clock::time_point reserve(size_t bytes, Clock::time_point earliest) {
+        if (rate <= 0) return earliest;
+        lock_guard<mutex> lock(m);
+        Clock::time_point start = max(earliest, free_at);
+        free_at = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(bytes / rate));
+        return start;
+    }
+};
+
+struct Link {
+    string name;
+    string listen_ip;
+    int listen_port = 0;
+    string target_ip;
+    int target_port = 0;
+    Shape shape;
+    Pacer to;
+    Pacer from;
+    atomic<uint64_t> connections{0};
+    atomic<uint64_t> resets{0};
+    atomic<uint64_t> bytes_to{0};
+    atomic<uint64_t> bytes_from{0};
+};
+
+vector<unique_ptr<Link>> links;
+unsigned seed_base = 1;
+atomic<unsigned> connection_counter(0);
+
+bool parse_addr(const string& text, string& ip, int& port) {
+    size_t colon = text.find(':');
+    if (colon == string::npos) return false;
+    ip = text.substr(0, colon);
+    port = atoi(text.c_str() + colon + 1);
+    return port > 0 && port < 65536;
+}
+
+// "<n>us", "<n>ms", "<n>s" or bare milliseconds
+bool parse_duration_ms(const string& text, double& ms) {
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    string unit = end;
+    if (end == text.c_str() || value < 0) return false;
+    if (unit == "" || unit == "ms") ms = value;
+    else if (unit == "us") ms = value / 1000;
+    else if (unit == "s") ms = value * 1000;
+    else return false;
+    return true;
+}
+
+// Bits or bytes per second, to bytes per second
+bool parse_rate(const string& text, double& bytes_per_sec) {
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    string unit = end;
+    if (end == text.c_str() || value < 0) return false;
+    if (unit == "" || unit == "B") bytes_per_sec = value;
+    else if (unit == "KB") bytes_per_sec = value * 1024;
+    else if (unit == "MB") bytes_per_sec = value * 1024 * 1024;
+    else if (unit == "GB") bytes_per_sec = value * 1024 * 1024 * 1024;
+    else if (unit == "bit") bytes_per_sec = value / 8;
+    else if (unit == "kbit") bytes_per_sec = value * 1000 / 8;
+    else if (unit == "mbit") bytes_per_sec = value * 1000 * 1000 / 8;
+    else if (unit == "gbit") bytes_per_sec = value * 1000 * 1000 * 1000 / 8;
+    else return false;
+    return true;
+}
+
+bool parse_option(const string& option, Shape& shape) {
+    size_t eq = option.find('=');
+    if (eq == string::npos) return false;
+    string key = option.substr(0, eq);
+    string value = option.substr(eq + 1);
+
+    if (key == "latency") return parse_duration_ms(value, shape.latency_ms);
+    if (key == "jitter") return parse_duration_ms(value, shape.jitter_ms);
+    if (key == "rate") {
+        if (!parse_rate(value, shape.rate_to)) return false;
+        shape.rate_from = shape.rate_to;
+        return true;
+    }
+    if (key == "rate_to") return parse_rate(value, shape.rate_to);
+    if (key == "rate_from") return parse_rate(value, shape.rate_from);
+    if (key == "stall") {
+        size_t slash = value.find('/');
+        return slash != string::npos && parse_duration_ms(value.substr(0, slash), shape.stall_every_ms) &&
+               parse_duration_ms(value.substr(slash + 1), shape.stall_ms);
+    }
+    if (key == "reset") return parse_duration_ms(value, shape.reset_after_ms);
+    return false;
+}
+
+bool load_scenario(const string& path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        cerr << "ERROR: Cannot open scenario file " << path << endl;
+        return false;
+    }
+
+    string line;
+    int line_no = 0;
+    while (getline(file, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+        stringstream ss(line);
+        vector<string> words;
+        string word;
+        while (ss >> word) words.push_back(word);
+        if (words.empty()) continue;
+
+        unique_ptr<Link> link(new Link());
+        link->name = words[0];
+        bool ok = words.size() >= 3 && parse_addr(words[1], link->listen_ip, link->listen_port) &&
+                  parse_addr(words[2], link->target_ip, link->target_port);
+        for (size_t i = 3; ok && i < words.size(); i++) {
+            ok = parse_option(words[i], link->shape);
+        }
+        if (!ok) {
+            cerr << "ERROR: " << path << ":" << line_no << ": expected <name> <listen ip:port> "
+                 << "<target ip:port> [option=value ...]" << endl;
+            return false;
+        }
+
+        link->to.rate = link->shape.rate_to;
+        link->from.rate = link->shape.rate_from;
+        links.push_back(move(link));
+    }
+
+    if (links.empty()) {
+        cerr << "ERROR: No links in " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// ==================== FORWARDING ====================
+
+struct Chunk {
+    vector<char> data;
+    Clock::time_point due;   // Not delivered before this (latency + jitter)
+};
+
+// One direction of a connection: a reader thread queues what arrives, a
+// writer thread delivers it once due, paced by the link's bandwidth
+struct Pipe {
+    mutex m;
+    condition_variable cv;
+    deque<Chunk> queue;
+    size_t queued_bytes = 0;
+    bool eof = false;
+};
+
+struct Connection {
+    Link* link;
+    int client;
+    int target;
+    Pipe to;      // client -> target
+    Pipe from;    // target -> client
+    atomic<bool> dead{false};
+    atomic<int> directions_open{2};
+    Clock::time_point reset_at = Clock::time_point::max();
+    mutex rng_mutex;      // rng is shared by the connection's four threads
+    mt19937 rng;
+
+    Connection(Link* l, int c, int t) : link(l), client(c), target(t), rng(seed_base + connection_counter++) {}
+
+    ~Connection() {
+        close(client);
+        close(target);
+    }
+
+    // Abort both sides; with rst, the final close sends RST instead of FIN
+    void kill(bool rst) {
+        if (dead.exchange(true)) return;
+        if (rst) {
+            struct linger hard = {1, 0};
+            setsockopt(client, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+            setsockopt(target, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+        }
+        // Wake the readers without sending anything; the writers see dead
+        shutdown(client, SHUT_RD);
+        shutdown(target, SHUT_RD);
+        for (Pipe* pipe : {&to, &from}) {
+            lock_guard<mutex> lock(pipe->m);
+            pipe->cv.notify_all();
+        }
+    }
+
+    double exponential_ms(double mean_ms) {
+        lock_guard<mutex> lock(rng_mutex);
+        exponential_distribution<double> dist(1.0 / mean_ms);
+        return dist(rng);
+    }
+
+    unsigned thread_seed() {
+        lock_guard<mutex> lock(rng_mutex);
+        return rng();
+    }
+};
+
+Clock::time_point after_ms(Clock::time_point t, double ms) {
+    return t + chrono::duration_cast<Clock::duration>(chrono::duration<double, milli>(ms));
+}
+
+void read_side(shared_ptr<Connection> conn, int src, Pipe* pipe) {
+    const Shape& shape = conn->link->shape;
+    uniform_real_distribution<double> jitter(0, shape.jitter_ms);
+    mt19937 rng(conn->thread_seed());
+    Clock::time_point last_due;
+    vector<char> buffer(CHUNK_SIZE);
+
+    while (!conn->dead) {
+        int r = (int)recv(src, buffer.data(), buffer.size(), 0);
+        if (r <= 0) break;
+
+        Chunk chunk;
+        chunk.data.assign(buffer.begin(), buffer.begin() + r);
+        double delay = shape.latency_ms + (shape.jitter_ms > 0 ? jitter(rng) : 0);
+        chunk.due = max(last_due, after_ms(Clock::now(), delay));  // TCP keeps order
+        last_due = chunk.due;
+
+        unique_lock<mutex> lock(pipe->m);
+        pipe->cv.wait(lock, [&] { return pipe->queued_bytes < MAX_QUEUED_BYTES || conn->dead; });
+        pipe->queued_bytes += r;
+        pipe->queue.push_back(move(chunk));
+        pipe->cv.notify_all();
+    }
+
+    lock_guard<mutex> lock(pipe->m);
+    pipe->eof = true;
+    pipe->cv.notify_all();
+}
+
+void write_side(shared_ptr<Connection> conn, int dst, Pipe* pipe, Pacer* pacer, atomic<uint64_t>* counter) {
+    const Shape& shape = conn->link->shape;
+    Clock::time_point next_stall = shape.stall_every_ms > 0
+        ? after_ms(Clock::now(), conn->exponential_ms(shape.stall_every_ms)) : Clock::time_point::max();
+
+    while (true) {
+        Chunk chunk;
+        {
+            unique_lock<mutex> lock(pipe->m);
+            pipe->cv.wait(lock, [&] { return !pipe->queue.empty() || pipe->eof || conn->dead; });
+            if (conn->dead) break;
+            if (pipe->queue.empty()) {
+                shutdown(dst, SHUT_WR);  // Pass the EOF on
+                break;
+            }
+            chunk = move(pipe->queue.front());
+            pipe->queue.pop_front();
+            pipe->queued_bytes -= chunk.data.size();
+            pipe->cv.notify_all();
+        }
+
+        this_thread::sleep_until(chunk.due);
+
+        for (size_t sent = 0; sent < chunk.data.size() && !conn->dead; ) {
+            Clock::time_point now = Clock::now();
+            if (now >= conn->reset_at) {
+                conn->link->resets++;
+                conn->kill(true);
+                break;
+            }
+            if (now >= next_stall) {
+                this_thread::sleep_for(chrono::duration<double, milli>(shape.stall_ms));
+                next_stall = after_ms(Clock::now(), conn->exponential_ms(shape.stall_every_ms));
+            }
+
+            size_t slice = min((size_t)SLICE_SIZE, chunk.data.size() - sent);
+            this_thread::sleep_until(pacer->reserve(slice, Clock::now()));
+
+            int r = (int)send(dst, chunk.data.data() + sent, slice, MSG_NOSIGNAL);
+            if (r <= 0) {
+                conn->kill(true);  // Pass the breakage on to the other side
+                break;
+            }
+            sent += r;
+            *counter += r;
+        }
+    }
+
+    if (--conn->directions_open == 0) conn->kill(false);
+}
+
+void accept_loop(Link* link) {
+    int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int opt = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(link->listen_ip.c_str());
+    addr.sin_port = htons(link->listen_port);
+
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 128) < 0) {
+        cerr << "ERROR: Cannot listen on " << link->listen_ip << ":" << link->listen_port
+             << " for link " << link->name << endl;
+        exit(1);
+    }
+
+    while (true) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int client = accept(server, (struct sockaddr*)&peer, &peer_len);
+        if (client < 0) continue;
+
+        // Connect from the same address the client came from, so the target
+        // (e.g. the tracker, which identifies peers by IP) sees it on loopback
+        // aliases; fall back to any address
+        int target = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        peer.sin_port = 0;
+        bind(target, (struct sockaddr*)&peer, sizeof(peer));
+
+        struct sockaddr_in target_addr;
+        memset(&target_addr, 0, sizeof(target_addr));
+        target_addr.sin_family = AF_INET;
+        target_addr.sin_addr.s_addr = inet_addr(link->target_ip.c_str());
+        target_addr.sin_port = htons(link->target_port);
+
+        if (connect(target, (struct sockaddr*)&target_addr, sizeof(target_addr)) < 0) {
+            struct linger hard = {1, 0};
+            setsockopt(client, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+            close(client);   // Refused, as the target would have
+            close(target);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(target, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        shared_ptr<Connection> conn = make_shared<Connection>(link, client, target);
+        if (link->shape.reset_after_ms > 0) {
+            conn->reset_at = after_ms(Clock::now(), conn->exponential_ms(link->shape.reset_after_ms));
+        }
+        link->connections++;
+
+        thread(read_side, conn, client, &conn->to).detach();
+        thread(write_side, conn, target, &conn->to, &link->to, &link->bytes_to).detach();
+        thread(read_side, conn, target, &conn->from).detach();
+        thread(write_side, conn, client, &conn->from, &link->from, &link->bytes_from).detach();
+    }
+}
+
+// ==================== MAIN ====================
+
+atomic<bool> stopping(false);
+
+void on_signal(int) {
+    stopping = true;
+}
+
+void report() {
+    for (const auto& link : links) {
+        printf("%-16s connections=%llu resets=%llu bytes_to=%llu bytes_from=%llu\n", link->name.c_str(),
+               (unsigned long long)link->connections.load(), (unsigned long long)link->resets.load(),
+               (unsigned long long)link->bytes_to.load(), (unsigned long long)link->bytes_from.load());
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cout << "Usage: netem <scenario file> [--seed=<n>] [--report=<sec>]" << endl;
+        return 1;
+    }
+
+    int report_sec = 0;
+    for (int i = 2; i < argc; i++) {
+        string opt = argv[i];
+        if (opt.find("--seed=") == 0) seed_base = (unsigned)atoi(opt.c_str() + 7);
+        else if (opt.find("--report=") == 0) report_sec = atoi(opt.c_str() + 9);
+        else {
+            cerr << "ERROR: Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+
+    if (!load_scenario(argv[1])) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (const auto& link : links) {
+        thread(accept_loop, link.get()).detach();
+        printf("%-16s %s:%d -> %s:%d\n", link->name.c_str(), link->listen_ip.c_str(), link->listen_port,
+               link->target_ip.c_str(), link->target_port);
+    }
+    fflush(stdout);
+
+    Clock::time_point next_report = after_ms(Clock::now(), report_sec * 1000.0);
+    while (!stopping) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        if (report_sec > 0 && Clock::now() >= next_report) {
+            report();
+            next_report = after_ms(Clock::now(), report_sec * 1000.0);
+        }
+    }
+
+    report();
+    return 0;
+}
@@ -0,0 +1,348 @@
+#!/usr/bin/env bash
+# Loopback swarm benchmark (Linux)
+#
+# Starts a tracker, SEEDERS seeding clients and LEECHERS downloading clients
+# on 127.0.0.1, drives them through their stdin, and reports aggregate
+# throughput, per-download completion time percentiles, and CPU time and peak
+# RSS per role. Every download is compared against its source afterwards.
+#
+# Usage: bench/swarm.sh            (or: make bench-swarm SEEDERS=4 LEECHERS=8)
+#
+# Settings (environment):
+#   SEEDERS=2           Clients that share the files
+#   LEECHERS=4          Clients that download every file at the same time
+#   FILES=1             Files to share
+#   SIZE_KB=1024        Size of each file
+#   CONTENT=random      File contents: random (incompressible) or text (CSV
+#                       rows, which compress about 2:1)
+#   TRACKER_PORT=5400   Tracker port; clients use CLIENT_PORT, CLIENT_PORT+1, ...
+#   CLIENT_PORT=7400
+#   CLIENT_ARGS=        Extra client options, e.g. "--log-level=debug"
+#   TRACKER_ARGS=       Extra tracker options
+#   STREAM=             Set to 1 to have leechers stream_file each download into
+#                       a named pipe read by cat; with CLIENT_ARGS=--log-level=info
+#                       the time to the first streamed bytes is reported too
+#   DHT=                Set to 1 to have clients find each other through the
+#                       DHT (node 0 is everyone's bootstrap node); with
+#                       CLIENT_ARGS=--log-level=info the lookup times are
+#                       reported too
+#   TIMEOUT=300         Seconds to wait for any step before giving up
+#   LINK=               Network conditions in front of every client, as netem
+#                       options, e.g. "latency=20ms rate_from=2mbit"; LINK_<i>
+#                       overrides it for node i (seeders are nodes 0..SEEDERS-1)
+#   TRACKER_LINK=       Network conditions in front of the tracker
+#   WORK_DIR=           Keep files and logs here instead of a temporary directory
+
+set -u
+
+SEEDERS=${SEEDERS:-2}
+LEECHERS=${LEECHERS:-4}
+FILES=${FILES:-1}
+SIZE_KB=${SIZE_KB:-1024}
+CONTENT=${CONTENT:-random}
+TRACKER_PORT=${TRACKER_PORT:-5400}
+CLIENT_PORT=${CLIENT_PORT:-7400}
+CLIENT_ARGS=${CLIENT_ARGS:-}
+TRACKER_ARGS=${TRACKER_ARGS:-}
+DHT=${DHT:-}
+STREAM=${STREAM:-}
+TIMEOUT=${TIMEOUT:-300}
+LINK=${LINK:-}
+TRACKER_LINK=${TRACKER_LINK:-}
+NETEM_PORT_OFFSET=1000    # A node's link listens this far above its own port
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TRACKER_BIN=$ROOT/tracker
+CLIENT_BIN=$ROOT/client
+NETEM_BIN=$ROOT/netem
+
+if [ -n "${WORK_DIR:-}" ]; then
+    WORK=$WORK_DIR
+    mkdir -p "$WORK"
+else
+    WORK=$(mktemp -d /tmp/p2p-bench.XXXXXX)
+fi
+
+NODES=$((SEEDERS + LEECHERS))
+CLK_TCK=$(getconf CLK_TCK)
+
+declare -a PIDS FDS
+TRACKER_PID=
+NETEM_PID=
+
+# Put the emulator in between when any link is configured
+USE_NETEM=
+if [ -n "$LINK$TRACKER_LINK" ] || compgen -v LINK_ > /dev/null; then
+    USE_NETEM=1
+fi
+
+fail() {
+    echo "bench-swarm: $*" >&2
+    echo "bench-swarm: logs are in $WORK" >&2
+    cleanup
+    exit 1
+}
+
+cleanup() {
+    for fd in "${FDS[@]:-}"; do
+        [ -n "$fd" ] && eval "exec $fd>&-" 2>/dev/null
+    done
+    for pid in "${PIDS[@]:-}"; do
+        [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    done
+    [ -n "$TRACKER_PID" ] && kill "$TRACKER_PID" 2>/dev/null
+    [ -n "$NETEM_PID" ] && kill "$NETEM_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+
+now_ms() {
+    date +%s%3N
+}
+
+# Send one command line to node $1
+send() {
+    echo "$2" >&"${FDS[$1]}"
+}
+
+# Wait until node $1's output holds $3 lines matching $2
+await() {
+    local deadline=$(( $(date +%s) + TIMEOUT ))
+    while [ "$(grep -c -- "$2" "$WORK/node$1.log")" -lt "$3" ]; do
+        kill -0 "${PIDS[$1]}" 2>/dev/null || fail "node $1 exited (see $WORK/node$1.log)"
+        [ "$(date +%s)" -ge "$deadline" ] && fail "timed out waiting for '$2' from node $1"
+        sleep 0.05
+    done
+}
+
+# utime + stime in seconds, and peak RSS in KB, of process $1
+cpu_seconds() {
+    awk -v tck="$CLK_TCK" '{ sub(/^.*\) /, ""); printf "%.2f", ($12 + $13) / tck }' "/proc/$1/stat"
+}
+
+peak_rss_kb() {
+    awk '/^VmHWM:/ { print $2 }' "/proc/$1/status"
+}
+
+# p-th percentile (0-100) of the numbers on stdin
+percentile() {
+    sort -n | awk -v p="$1" '{ v[NR] = $1 } END {
+        if (NR == 0) { print "n/a"; exit }
+        i = int((p / 100) * NR + 0.999999); if (i < 1) i = 1; if (i > NR) i = NR
+        printf "%.3f", v[i] }'
+}
+
+[ -x "$TRACKER_BIN" ] && [ -x "$CLIENT_BIN" ] || fail "build the tracker and client first (make)"
+[ -z "$USE_NETEM" ] || [ -x "$NETEM_BIN" ] || fail "build the network emulator first (make netem)"
+[ "$SEEDERS" -ge 1 ] || fail "SEEDERS must be at least 1"
+[ "$CONTENT" = random ] || [ "$CONTENT" = text ] || fail "CONTENT must be random or text"
+
+echo "bench-swarm: $SEEDERS seeders, $LEECHERS leechers, $FILES x ${SIZE_KB}KB files, work dir $WORK"
+
+# ---- Files ----
+
+mkdir -p "$WORK/files"
+for f in $(seq 1 "$FILES"); do
+    if [ "$CONTENT" = text ]; then
+        awk -v seed="$f" 'BEGIN { srand(seed); for (i = 1; ; i++)
+            printf "%d,user%05d,%s,%.2f,%d\n", i, int(rand() * 50000),
+                   (rand() < 0.5 ? "active" : "inactive"), rand() * 1000, 1700000000 + i }' \
+            | head -c $((SIZE_KB * 1024)) > "$WORK/files/file$f.bin"
+    else
+        head -c $((SIZE_KB * 1024)) /dev/urandom > "$WORK/files/file$f.bin"
+    fi
+done
+
+# ---- Tracker ----
+
+echo "127.0.0.1:$TRACKER_PORT" > "$WORK/tracker_info.txt"
+# shellcheck disable=SC2086
+"$TRACKER_BIN" "$WORK/tracker_info.txt" 1 --no-persist --log-level=warn $TRACKER_ARGS \
+    > "$WORK/tracker.log" 2>&1 &
+TRACKER_PID=$!
+sleep 0.3
+kill -0 "$TRACKER_PID" 2>/dev/null || fail "tracker did not start (see $WORK/tracker.log)"
+
+# ---- Network emulator: one link in front of the tracker and one per client ----
+
+CLIENT_TRACKER_INFO=$WORK/tracker_info.txt
+ADVERTISE=()
+if [ -n "$USE_NETEM" ]; then
+    {
+        echo "tracker 127.0.0.1:$((TRACKER_PORT + NETEM_PORT_OFFSET)) 127.0.0.1:$TRACKER_PORT $TRACKER_LINK"
+        for i in $(seq 0 $((NODES - 1))); do
+            var=LINK_$i
+            echo "node$i 127.0.0.1:$((CLIENT_PORT + NETEM_PORT_OFFSET + i)) 127.0.0.1:$((CLIENT_PORT + i)) ${!var:-$LINK}"
+        done
+    } > "$WORK/scenario.txt"
+
+    "$NETEM_BIN" "$WORK/scenario.txt" > "$WORK/netem.log" 2>&1 &
+    NETEM_PID=$!
+    sleep 0.3
+    kill -0 "$NETEM_PID" 2>/dev/null || fail "netem did not start (see $WORK/netem.log)"
+
+    CLIENT_TRACKER_INFO=$WORK/client_tracker_info.txt
+    echo "127.0.0.1:$((TRACKER_PORT + NETEM_PORT_OFFSET))" > "$CLIENT_TRACKER_INFO"
+    for i in $(seq 0 $((NODES - 1))); do
+        ADVERTISE[$i]=--advertise-port=$((CLIENT_PORT + NETEM_PORT_OFFSET + i))
+    done
+fi
+
+# ---- Clients: nodes 0..SEEDERS-1 seed, the rest download ----
+
+declare -a DHT_ARGS
+if [ -n "$DHT" ]; then
+    DHT_ARGS[0]=--dht
+    for i in $(seq 1 $((NODES - 1))); do
+        DHT_ARGS[$i]=--dht-bootstrap=127.0.0.1:$CLIENT_PORT
+    done
+fi
+
+for i in $(seq 0 $((NODES - 1))); do
+    rm -f "$WORK/node$i.in"
+    mkfifo "$WORK/node$i.in"
+    # shellcheck disable=SC2086
+    "$CLIENT_BIN" "127.0.0.1:$((CLIENT_PORT + i))" "$CLIENT_TRACKER_INFO" --log-level=warn --no-persist ${ADVERTISE[$i]:-} ${DHT_ARGS[$i]:-} $CLIENT_ARGS \
+        < "$WORK/node$i.in" > "$WORK/node$i.log" 2>&1 &
+    PIDS[$i]=$!
+    exec {fd}>"$WORK/node$i.in"
+    FDS[$i]=$fd
+done
+
+for i in $(seq 0 $((NODES - 1))); do
+    send "$i" "create_user node$i pw"
+    send "$i" "login node$i pw"
+done
+for i in $(seq 0 $((NODES - 1))); do
+    await "$i" "Login successful" 1
+done
+
+# Node 0 owns the group and lets everyone in
+send 0 "create_group bench"
+await 0 "Group created" 1
+for i in $(seq 1 $((NODES - 1))); do
+    send "$i" "join_group bench"
+done
+for i in $(seq 1 $((NODES - 1))); do
+    await "$i" "Join request sent" 1
+    send 0 "accept_request bench node$i"
+done
+await 0 "User added to group" $((NODES - 1))
+
+for i in $(seq 0 $((SEEDERS - 1))); do
+    for f in $(seq 1 "$FILES"); do
+        send "$i" "upload_file $WORK/files/file$f.bin bench"
+    done
+done
+for i in $(seq 0 $((SEEDERS - 1))); do
+    await "$i" "File uploaded successfully" "$FILES"
+done
+
+for i in $(seq 0 $((NODES - 1))); do
+    if grep -q "> ERROR" "$WORK/node$i.log"; then
+        fail "node $i: $(grep -m1 -o "ERROR.*" "$WORK/node$i.log")"
+    fi
+done
+
+# Seeders announce their files to the DHT within a second or two
+[ -n "$DHT" ] && sleep 3
+
+# ---- Downloads ----
+
+start_ms=$(now_ms)
+for i in $(seq "$SEEDERS" $((NODES - 1))); do
+    mkdir -p "$WORK/leecher$i"
+    for f in $(seq 1 "$FILES"); do
+        if [ -n "$STREAM" ]; then
+            mkfifo "$WORK/leecher$i/file$f.pipe"
+            cat "$WORK/leecher$i/file$f.pipe" > "$WORK/leecher$i/file$f.stream" &
+            send "$i" "stream_file bench file$f.bin $WORK/leecher$i/file$f.bin $WORK/leecher$i/file$f.pipe"
+        else
+            send "$i" "download_file bench file$f.bin $WORK/leecher$i/file$f.bin"
+        fi
+    done
+    send "$i" "stats json $WORK/leecher$i/stats.json"
+done
+for i in $(seq "$SEEDERS" $((NODES - 1))); do
+    await "$i" "Stats written to" 1
+done
+end_ms=$(now_ms)
+
+# ---- Report ----
+
+mismatches=0
+for i in $(seq "$SEEDERS" $((NODES - 1))); do
+    for f in $(seq 1 "$FILES"); do
+        cmp -s "$WORK/files/file$f.bin" "$WORK/leecher$i/file$f.bin" || mismatches=$((mismatches + 1))
+        if [ -n "$STREAM" ]; then
+            cmp -s "$WORK/files/file$f.bin" "$WORK/leecher$i/file$f.stream" || mismatches=$((mismatches + 1))
+        fi
+    done
+done
+failed=0
+for i in $(seq "$SEEDERS" $((NODES - 1))); do
+    failed=$((failed + $(grep -c "Download failed" "$WORK/node$i.log")))
+done
+
+# Completion time of every download, from the leechers' own stats
+grep -ho '"seconds":[0-9.e+-]*' "$WORK"/leecher*/stats.json | cut -d: -f2 > "$WORK/times.txt"
+
+wall=$(awk -v s="$start_ms" -v e="$end_ms" 'BEGIN { printf "%.3f", (e - s) / 1000 }')
+bytes=$((LEECHERS * FILES * SIZE_KB * 1024))
+rate=$(awk -v b="$bytes" -v w="$wall" 'BEGIN { printf "%.2f", (w > 0 ? b / w / 1048576 : 0) }')
+
+role_usage() {
+    local cpu=0 rss=0 pid
+    for pid in "$@"; do
+        cpu=$(awk -v a="$cpu" -v b="$(cpu_seconds "$pid")" 'BEGIN { printf "%.2f", a + b }')
+        local r
+        r=$(peak_rss_kb "$pid")
+        [ "${r:-0}" -gt "$rss" ] && rss=$r
+    done
+    echo "cpu_sec=$cpu max_rss_kb=$rss"
+}
+
+echo
+echo "downloads        $((LEECHERS * FILES)) ($failed failed, $mismatches corrupt)"
+echo "wall_sec         $wall"
+echo "throughput_MBps  $rate"
+echo "completion_sec   p50=$(percentile 50 < "$WORK/times.txt") p90=$(percentile 90 < "$WORK/times.txt") p99=$(percentile 99 < "$WORK/times.txt") max=$(percentile 100 < "$WORK/times.txt")"
+if [ -n "$STREAM" ]; then
+    grep -ho "First [0-9]* bytes out .* after [0-9]*ms" "$WORK"/node*.log | sed 's/.* after \([0-9]*\)ms/\1/' \
+        | awk '{ printf "%.3f\n", $1 / 1000 }' > "$WORK/first_bytes.txt"
+    if [ -s "$WORK/first_bytes.txt" ]; then
+        echo "first_byte_sec   p50=$(percentile 50 < "$WORK/first_bytes.txt") p90=$(percentile 90 < "$WORK/first_bytes.txt") max=$(percentile 100 < "$WORK/first_bytes.txt")"
+    fi
+fi
+if [ -n "$DHT" ]; then
+    grep -ho "providers of .* in [0-9]*ms" "$WORK"/node*.log | sed 's/.* in \([0-9]*\)ms/\1/' > "$WORK/lookups.txt"
+    if [ -s "$WORK/lookups.txt" ]; then
+        echo "dht_lookup_ms    p50=$(percentile 50 < "$WORK/lookups.txt") p90=$(percentile 90 < "$WORK/lookups.txt") max=$(percentile 100 < "$WORK/lookups.txt")"
+    fi
+    echo "tracker_lookups  $(grep -c "No providers of" "$WORK"/node*.log | awk -F: '{ n += $2 } END { print n }')"
+fi
+echo "tracker          $(role_usage "$TRACKER_PID")"
+echo "seeders          $(role_usage "${PIDS[@]:0:$SEEDERS}")"
+echo "leechers         $(role_usage "${PIDS[@]:$SEEDERS}")"
+
+# ---- Shutdown: end of input makes each client log out and exit ----
+
+for i in $(seq 0 $((NODES - 1))); do
+    eval "exec ${FDS[$i]}>&-"
+    FDS[$i]=
+done
+for i in $(seq 0 $((NODES - 1))); do
+    wait "${PIDS[$i]}" 2>/dev/null
+    PIDS[$i]=
+done
+kill "$TRACKER_PID" 2>/dev/null
+wait "$TRACKER_PID" 2>/dev/null
+TRACKER_PID=
+if [ -n "$NETEM_PID" ]; then
+    kill "$NETEM_PID" 2>/dev/null
+    wait "$NETEM_PID" 2>/dev/null
+    NETEM_PID=
+fi
+
+[ -z "${WORK_DIR:-}" ] && rm -rf "$WORK"
+
+[ "$failed" -eq 0 ] && [ "$mismatches" -eq 0 ]
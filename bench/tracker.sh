@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+# Tracker capacity benchmark (Linux)
+#
+# Starts a fresh tracker on loopback and runs tracker_load against it.
+#
+# Usage: bench/tracker.sh        (or: make bench-tracker LOAD_ARGS="--sessions=5000 --steps=4 --users=1000000")
+#
+# Settings (environment):
+#   TRACKER_PORT=5500   Tracker port
+#   TRACKER_ARGS=       Extra tracker options (default: --no-persist); e.g.
+#                       "--data-dir=/tmp/bench-data" to include the WAL
+#   LOAD_ARGS=          tracker_load options, see tracker_load --help
+
+set -u
+
+TRACKER_PORT=${TRACKER_PORT:-5500}
+TRACKER_ARGS=${TRACKER_ARGS:---no-persist}
+LOAD_ARGS=${LOAD_ARGS:-}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/p2p-tracker-bench.XXXXXX)
+
+# One socket (and tracker thread) per session
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+echo "127.0.0.1:$TRACKER_PORT" > "$WORK/tracker_info.txt"
+# shellcheck disable=SC2086
+"$ROOT/tracker" "$WORK/tracker_info.txt" 1 --log-level=warn $TRACKER_ARGS > "$WORK/tracker.log" 2>&1 &
+TRACKER_PID=$!
+sleep 0.3
+if ! kill -0 "$TRACKER_PID" 2>/dev/null; then
+    echo "bench-tracker: tracker did not start:" >&2
+    cat "$WORK/tracker.log" >&2
+    exit 1
+fi
+
+# shellcheck disable=SC2086
+"$ROOT/tracker_load" --tracker=127.0.0.1:"$TRACKER_PORT" --tracker-pid="$TRACKER_PID" $LOAD_ARGS
+status=$?
+
+kill "$TRACKER_PID" 2>/dev/null
+wait "$TRACKER_PID" 2>/dev/null
+rm -rf "$WORK"
+exit $status
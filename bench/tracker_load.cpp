@@ -0,0 +1,716 @@
+// Tracker Load Generator
+//
+// Opens many concurrent tracker sessions and drives a weighted mix of
+// commands against them for a fixed time, then reports sustained ops/s and
+// latency percentiles per command type, with the tracker's user, group and
+// file counts and (given its pid, on Linux) its RSS. The tracker can first be
+// populated with large numbers of users, groups and files through the batch
+// API; with --steps the population grows in stages with a timed run after
+// each, giving a capacity curve. udp_announce and udp_peers in the mix time
+// the tracker's UDP protocol against its TCP counterparts.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #pragma comment(lib, "Ws2_32.lib")
+    typedef int socklen_t;
+    #define CLOSE_SOCKET closesocket
+#else
+    #include <sys/socket.h>
+    #include <sys/resource.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <signal.h>
+    #define CLOSE_SOCKET close
+    typedef int SOCKET;
+    #define INVALID_SOCKET -1
+    #define SOCKET_ERROR -1
+#endif
+
+using namespace std;
+
+#define BATCH_COMMANDS 1000        // Commands per batch while populating
+#define BULK_FILES_PER_COMMAND 500 // Files per upload_files command
+#define FILE_SIZE 1048576          // Size of every generated file
+#define FILE_PIECES 205            // Pieces of FILE_SIZE at 5KB
+#define SESSION_PORT_BASE 10000    // Sessions log in with ports from here up
+#define ANNOUNCE_EVERY_SEC 10      // Keeps the preloaded files' seeder live
+#define UDP_TIMEOUT_MS 1000        // A UDP request unanswered by then counts as an error
+#define UDP_CONN_ID_SEC 60         // Get a new connection id this often
+
+// ==================== CONFIGURATION ====================
+
+// Commands the mix can contain; "login" logs out and back in, and both are
+// timed under their own names
+enum Op { OP_CREATE_USER, OP_LOGIN, OP_LOGOUT, OP_JOIN_GROUP, OP_UPLOAD_FILE, OP_LIST_FILES,
+          OP_DOWNLOAD_FILE, OP_UDP_ANNOUNCE, OP_UDP_PEERS, NUM_OPS };
+const char* const OP_NAMES[NUM_OPS] = {
+    "create_user", "login", "logout", "join_group", "upload_file", "list_files", "download_file",
+    "udp_announce", "udp_peers"
+};
+
+struct Config {
+    string tracker_ip = "127.0.0.1";
+    int tracker_port = 5000;
+    int sessions = 1000;
+    int threads = 32;
+    int duration_sec = 10;
+    long users = 0;           // Preloaded users, besides the sessions' own
+    long groups = 100;
+    long files = 1000;
+    int steps = 1;
+    int list_limit = 100;
+    int tracker_pid = 0;
+    string prefix;            // Keeps names from separate runs apart
+    int weights[NUM_OPS] = {5, 5, 0, 10, 10, 30, 40, 0, 0};
+};
+
+Config config;
+
+// "create_user:5,login:5,..." Commands left out get weight 0.
+bool parse_mix(const string& spec, int* weights) {
+    for (int i = 0; i < NUM_OPS; i++) weights[i] = 0;
+
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == string::npos) return false;
+        string name = item.substr(0, colon);
+        int weight = atoi(item.c_str() + colon + 1);
+
+        int op = -1;
+        for (int i = 0; i < NUM_OPS; i++) {
+            if (name == OP_NAMES[i] && i != OP_LOGOUT) op = i;
+        }
+        if (op < 0 || weight < 0) return false;
+        weights[op] = weight;
+    }
+    return true;
+}
+
+// ==================== CONNECTION ====================
+
+SOCKET connect_to_tracker() {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(config.tracker_ip.c_str());
+    addr.sin_port = htons(config.tracker_port);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    return sock;
+}
+
+bool send_all(SOCKET sock, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int r = send(sock, data.data() + sent, (int)(data.size() - sent), 0);
+        if (r <= 0) return false;
+        sent += r;
+    }
+    return true;
+}
+
+bool recv_exact(SOCKET sock, char* data, size_t len) {
+    while (len > 0) {
+        int r = recv(sock, data, (int)len, 0);
+        if (r <= 0) return false;
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Responses are [u32 length, network byte order][bytes] chunks ending with
+// an empty chunk; a batch response has one chunk per command
+bool request(SOCKET sock, const string& command, vector<string>& chunks) {
+    chunks.clear();
+    if (!send_all(sock, command)) return false;
+
+    while (true) {
+        uint32_t n;
+        if (!recv_exact(sock, (char*)&n, 4)) return false;
+        n = ntohl(n);
+        if (n == 0) return true;
+
+        chunks.push_back(string(n, '\0'));
+        if (!recv_exact(sock, &chunks.back()[0], n)) return false;
+    }
+}
+
+bool request(SOCKET sock, const string& command, string& response) {
+    vector<string> chunks;
+    if (!request(sock, command, chunks)) return false;
+
+    response.clear();
+    for (const string& chunk : chunks) response += chunk;
+    return true;
+}
+
+// Runs commands in batches; returns how many failed
+long run_batched(SOCKET sock, const vector<string>& commands) {
+    long errors = 0;
+    for (size_t start = 0; start < commands.size(); start += BATCH_COMMANDS) {
+        size_t end = min(commands.size(), start + BATCH_COMMANDS);
+        string body;
+        for (size_t i = start; i < end; i++) body += commands[i] + "\n";
+
+        vector<string> results;
+        if (!request(sock, "batch " + to_string(end - start) + " " + to_string(body.size()) + "\n" + body, results)) {
+            cerr << "ERROR: Lost connection to tracker while populating" << endl;
+            exit(1);
+        }
+        if (results.size() != end - start) {
+            cerr << "ERROR: Batch rejected: " << (results.empty() ? "" : results[0]) << endl;
+            exit(1);
+        }
+        for (const string& result : results) {
+            if (result.compare(0, 5, "ERROR") == 0) errors++;
+        }
+    }
+    return errors;
+}
+
+// UDP requests are [u64 connection_id][u32 action][u32 txn][body]; replies
+// start [u32 action][u32 txn], action 3 being an error
+void put_net(string& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+uint64_t get_net(const char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+struct UdpChannel {
+    SOCKET sock = INVALID_SOCKET;
+    uint64_t conn_id = 0;
+    uint32_t next_txn = 1;
+    chrono::steady_clock::time_point conn_expires;
+};
+
+// One datagram out, the matching one back. Returns false on timeout.
+bool udp_exchange(UdpChannel& udp, uint32_t action, const string& body, string& reply) {
+    string request;
+    uint32_t txn = udp.next_txn++;
+    put_net(request, action == 0 ? 0x41727101980ULL : udp.conn_id, 8);
+    put_net(request, action, 4);
+    put_net(request, txn, 4);
+    request += body;
+    if (send(udp.sock, request.data(), (int)request.size(), 0) <= 0) return false;
+
+    char buffer[8192];
+    while (true) {
+        int n = recv(udp.sock, buffer, sizeof(buffer), 0);
+        if (n < 0) return false;
+        if (n >= 8 && (uint32_t)get_net(buffer + 4, 4) == txn) {
+            reply.assign(buffer, n);
+            return true;
+        }
+    }
+}
+
+bool udp_request(UdpChannel& udp, uint32_t action, const string& body, string& reply) {
+    if (udp.sock == INVALID_SOCKET) {
+        udp.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(config.tracker_ip.c_str());
+        addr.sin_port = htons(config.tracker_port);
+        connect(udp.sock, (struct sockaddr*)&addr, sizeof(addr));
+#ifdef _WIN32
+        DWORD tv = UDP_TIMEOUT_MS;
+#else
+        struct timeval tv;
+        tv.tv_sec = UDP_TIMEOUT_MS / 1000;
+        tv.tv_usec = (UDP_TIMEOUT_MS % 1000) * 1000;
+#endif
+        setsockopt(udp.sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+    }
+    if (chrono::steady_clock::now() >= udp.conn_expires) {
+        string connected;
+        if (!udp_exchange(udp, 0, "", connected) || connected.size() < 16) return false;
+        udp.conn_id = get_net(connected.data() + 8, 8);
+        udp.conn_expires = chrono::steady_clock::now() + chrono::seconds(UDP_CONN_ID_SEC);
+    }
+    return udp_exchange(udp, action, body, reply);
+}
+
+// ==================== POPULATION ====================
+
+string user_name(long i) { return config.prefix + "u" + to_string(i); }
+string session_user(int i) { return config.prefix + "s" + to_string(i); }
+string group_name(long i) { return config.prefix + "g" + to_string(i); }
+string file_path(long i) { return "/load/" + config.prefix + "f" + to_string(i); }
+string file_name(long i) { return config.prefix + "f" + to_string(i); }
+
+// What has been created so far
+long populated_users = 0;
+long populated_groups = 0;
+long populated_files = 0;
+
+// Grow the tracker to the given counts. Groups are owned by the admin and
+// file i lives in group i % groups, seeded by the admin.
+void populate(SOCKET admin, long users, long groups, long files) {
+    auto started = chrono::steady_clock::now();
+    long created = 0;
+    long errors = 0;
+    vector<string> commands;
+
+    for (long i = populated_users; i < users; i++) {
+        commands.push_back("create_user " + user_name(i) + " pw");
+    }
+    for (long i = populated_groups; i < groups; i++) {
+        commands.push_back("create_group " + group_name(i));
+    }
+    created += commands.size();
+    errors += run_batched(admin, commands);
+    populated_users = max(populated_users, users);
+    populated_groups = max(populated_groups, groups);
+
+    // Each upload_files command holds files of one group
+    commands.clear();
+    map<long, vector<long>> by_group;
+    for (long i = populated_files; i < files; i++) by_group[i % populated_groups].push_back(i);
+    for (const auto& group : by_group) {
+        for (size_t start = 0; start < group.second.size(); start += BULK_FILES_PER_COMMAND) {
+            string command = "upload_files " + group_name(group.first);
+            size_t end = min(group.second.size(), start + BULK_FILES_PER_COMMAND);
+            for (size_t j = start; j < end; j++) {
+                command += " " + file_path(group.second[j]) + " " + to_string(FILE_SIZE) + " " +
+                           to_string(FILE_PIECES);
+            }
+            commands.push_back(command);
+        }
+    }
+    created += max(0L, files - populated_files);
+    errors += run_batched(admin, commands);
+    populated_files = max(populated_files, files);
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    if (created > 0) {
+        printf("populated %ld users/groups/files in %.2fs (%.0f/s, %ld errors)\n", created, secs,
+               secs > 0 ? created / secs : 0.0, errors);
+    }
+}
+
+// ==================== SESSIONS ====================
+
+struct Session {
+    SOCKET sock = INVALID_SOCKET;
+    int index = 0;
+    long group = 0;
+    int uploads = 0;
+    string token;      // Session token from the last login, for UDP requests
+};
+
+// Keep the token a login answers with ("... SESSION:<token>")
+void note_login(Session& s, const string& response) {
+    size_t at = response.find(" SESSION:");
+    if (at != string::npos) s.token = response.substr(at + 9);
+}
+
+vector<Session> sessions;
+
+// Connect and log in sessions [first, last) and have them ask to join their
+// group; the admin accepts them afterwards
+bool open_sessions(int first, int last) {
+    for (int i = first; i < last; i++) {
+        Session& s = sessions[i];
+        s.index = i;
+        s.group = i % populated_groups;
+        s.sock = connect_to_tracker();
+        if (s.sock == INVALID_SOCKET) {
+            cerr << "ERROR: Cannot open session " << i << " (file descriptor limit?)" << endl;
+            return false;
+        }
+
+        string response;
+        bool ok = request(s.sock, "login " + session_user(i) + " pw " + to_string(SESSION_PORT_BASE + i), response) &&
+                  response.find("SUCCESS") != string::npos;
+        if (ok) note_login(s, response);
+        if (!ok || !request(s.sock, "join_group " + group_name(s.group), response)) {
+            cerr << "ERROR: Session " << i << " login failed: " << response << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ==================== WORKLOAD ====================
+
+struct WorkerStats {
+    vector<uint64_t> latency_ns[NUM_OPS];
+    long errors[NUM_OPS] = {0};
+    bool broken = false;
+};
+
+atomic<bool> measuring(false);
+atomic<long> users_created(0);    // By the mix's create_user
+
+uint64_t timed_request(Session& s, const string& command, string& response, bool& ok) {
+    auto started = chrono::steady_clock::now();
+    ok = request(s.sock, command, response);
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+}
+
+void worker(int id, WorkerStats* stats) {
+    mt19937 rng(random_device{}() + id);
+    int total_weight = 0;
+    for (int i = 0; i < NUM_OPS; i++) total_weight += config.weights[i];
+
+    // This worker's sessions
+    vector<Session*> mine;
+    for (size_t i = id; i < sessions.size(); i += config.threads) mine.push_back(&sessions[i]);
+    if (mine.empty() || total_weight == 0) return;
+
+    long files_per_group = populated_groups > 0 ? populated_files / populated_groups : 0;
+    size_t next = 0;
+    string response;
+    bool ok;
+    UdpChannel udp;
+
+    while (measuring) {
+        Session& s = *mine[next];
+        next = (next + 1) % mine.size();
+
+        int pick = (int)(rng() % total_weight);
+        int op = 0;
+        while (pick >= config.weights[op]) pick -= config.weights[op++];
+
+        string command;
+        switch (op) {
+        case OP_CREATE_USER:
+            command = "create_user " + config.prefix + "c" + to_string(users_created++) + " pw";
+            break;
+        case OP_LOGIN: {
+            uint64_t ns = timed_request(s, "logout", response, ok);
+            if (!ok) { stats->broken = true; return; }
+            stats->latency_ns[OP_LOGOUT].push_back(ns);
+            if (response.compare(0, 5, "ERROR") == 0) stats->errors[OP_LOGOUT]++;
+            command = "login " + session_user(s.index) + " pw " + to_string(SESSION_PORT_BASE + s.index);
+            break;
+        }
+        case OP_JOIN_GROUP:
+            command = "join_group " + group_name((long)(rng() % populated_groups));
+            break;
+        case OP_UPLOAD_FILE:
+            command = "upload_file /load/" + session_user(s.index) + "_" + to_string(s.uploads++) + " " +
+                      group_name(s.group) + " " + to_string(FILE_SIZE) + " " + to_string(FILE_PIECES);
+            break;
+        case OP_LIST_FILES:
+            command = "list_files " + group_name(s.group) + " limit=" + to_string(config.list_limit);
+            break;
+        case OP_DOWNLOAD_FILE: {
+            long file = files_per_group > 0 ? s.group + populated_groups * (long)(rng() % files_per_group) : 0;
+            command = "download_file " + group_name(s.group) + " " + file_name(file) + " 50";
+            break;
+        }
+        case OP_UDP_ANNOUNCE:
+        case OP_UDP_PEERS: {
+            // An empty heartbeat, or the UDP form of download_file
+            string body;
+            put_net(body, SESSION_PORT_BASE + s.index, 2);
+            put_net(body, s.token.size(), 1);
+            body += s.token;
+            if (op == OP_UDP_ANNOUNCE) {
+                put_net(body, 0, 2);
+            } else {
+                long file = files_per_group > 0 ? s.group + populated_groups * (long)(rng() % files_per_group) : 0;
+                string group = group_name(s.group), name = file_name(file);
+                put_net(body, 0, 1);
+                put_net(body, 50, 2);
+                put_net(body, group.size(), 1);
+                body += group;
+                put_net(body, name.size(), 1);
+                body += name;
+            }
+            auto started = chrono::steady_clock::now();
+            ok = udp_request(udp, op == OP_UDP_ANNOUNCE ? 1 : 2, body, response);
+            stats->latency_ns[op].push_back(
+                (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+            if (!ok || get_net(response.data(), 4) == 3) stats->errors[op]++;
+            continue;
+        }
+        }
+
+        uint64_t ns = timed_request(s, command, response, ok);
+        if (!ok) { stats->broken = true; return; }
+        stats->latency_ns[op].push_back(ns);
+        if (response.compare(0, 5, "ERROR") == 0) stats->errors[op]++;
+        if (op == OP_LOGIN) note_login(s, response);
+    }
+    if (udp.sock != INVALID_SOCKET) CLOSE_SOCKET(udp.sock);
+}
+
+// ==================== REPORTING ====================
+
+long tracker_rss_kb() {
+#ifndef _WIN32
+    if (config.tracker_pid <= 0) return -1;
+    ifstream status("/proc/" + to_string(config.tracker_pid) + "/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) return atol(line.c_str() + 6);
+    }
+#endif
+    return -1;
+}
+
+// The tracker's own counts, from the first line of its stats
+string tracker_counts(SOCKET admin) {
+    string response;
+    if (!request(admin, "stats", response)) return "";
+    string first = response.substr(0, response.find('\n'));
+
+    string out;
+    stringstream ss(first);
+    string field;
+    while (ss >> field) {
+        if (field.compare(0, 6, "users=") == 0 || field.compare(0, 7, "groups=") == 0 ||
+            field.compare(0, 6, "files=") == 0 || field.compare(0, 9, "sessions=") == 0) {
+            out += " " + field;
+        }
+    }
+    return out;
+}
+
+double percentile_us(vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)(p / 100.0 * sorted.size());
+    if (rank >= sorted.size()) rank = sorted.size() - 1;
+    return sorted[rank] / 1000.0;
+}
+
+void report(vector<WorkerStats>& stats, double secs) {
+    printf("%-14s %10s %10s %8s %10s %10s %10s %10s\n", "command", "ops", "ops/s", "errors",
+           "p50_us", "p99_us", "p999_us", "max_us");
+
+    vector<uint64_t> all;
+    long all_errors = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        vector<uint64_t> merged;
+        long errors = 0;
+        for (WorkerStats& w : stats) {
+            merged.insert(merged.end(), w.latency_ns[op].begin(), w.latency_ns[op].end());
+            errors += w.errors[op];
+        }
+        if (merged.empty()) continue;
+
+        sort(merged.begin(), merged.end());
+        printf("%-14s %10zu %10.0f %8ld %10.1f %10.1f %10.1f %10.1f\n", OP_NAMES[op], merged.size(),
+               merged.size() / secs, errors, percentile_us(merged, 50), percentile_us(merged, 99),
+               percentile_us(merged, 99.9), merged.back() / 1000.0);
+        all.insert(all.end(), merged.begin(), merged.end());
+        all_errors += errors;
+    }
+
+    sort(all.begin(), all.end());
+    printf("%-14s %10zu %10.0f %8ld %10.1f %10.1f %10.1f %10.1f\n", "total", all.size(), all.size() / secs,
+           all_errors, percentile_us(all, 50), percentile_us(all, 99), percentile_us(all, 99.9),
+           all.empty() ? 0.0 : all.back() / 1000.0);
+}
+
+// ==================== MAIN ====================
+
+void print_usage() {
+    cout << "Usage: tracker_load [options]" << endl;
+    cout << "  --tracker=<ip>:<port>   Tracker to load (default 127.0.0.1:5000)" << endl;
+    cout << "  --sessions=<n>          Concurrent logged-in sessions (default 1000)" << endl;
+    cout << "  --threads=<n>           Request loops; sessions are shared out among them (default 32)" << endl;
+    cout << "  --duration=<sec>        Length of each timed run (default 10)" << endl;
+    cout << "  --users=<n>             Extra users to create first (default 0)" << endl;
+    cout << "  --groups=<n>            Groups to create first (default 100)" << endl;
+    cout << "  --files=<n>             Files to share first, spread over the groups (default 1000)" << endl;
+    cout << "  --steps=<n>             Reach those counts in n stages, with a timed run after each (default 1)" << endl;
+    cout << "  --mix=<cmd>:<w>,...     Command weights (default create_user:5,login:5,join_group:10," << endl;
+    cout << "                          upload_file:10,list_files:30,download_file:40; also" << endl;
+    cout << "                          udp_announce and udp_peers)" << endl;
+    cout << "  --list-limit=<n>        limit= for list_files (default 100)" << endl;
+    cout << "  --tracker-pid=<pid>     Report the tracker's RSS (Linux)" << endl;
+    cout << "  --prefix=<str>          Name prefix for everything created (default random)" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    mt19937 seed(random_device{}());
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "L%05x", (unsigned)(seed() & 0xfffff));
+    config.prefix = prefix;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "--tracker" && value.find(':') != string::npos) {
+            config.tracker_ip = value.substr(0, value.find(':'));
+            config.tracker_port = atoi(value.c_str() + value.find(':') + 1);
+        }
+        else if (name == "--sessions") config.sessions = atoi(value.c_str());
+        else if (name == "--threads") config.threads = atoi(value.c_str());
+        else if (name == "--duration") config.duration_sec = atoi(value.c_str());
+        else if (name == "--users") config.users = atol(value.c_str());
+        else if (name == "--groups") config.groups = atol(value.c_str());
+        else if (name == "--files") config.files = atol(value.c_str());
+        else if (name == "--steps") config.steps = atoi(value.c_str());
+        else if (name == "--list-limit") config.list_limit = atoi(value.c_str());
+        else if (name == "--tracker-pid") config.tracker_pid = atoi(value.c_str());
+        else if (name == "--prefix" && !value.empty()) config.prefix = value;
+        else if (name == "--mix") {
+            if (!parse_mix(value, config.weights)) {
+                cerr << "ERROR: Invalid --mix: " << value << endl;
+                return 1;
+            }
+        }
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (config.sessions < 1 || config.threads < 1 || config.groups < 1 || config.steps < 1 ||
+        config.duration_sec < 1 || config.sessions > 65535 - SESSION_PORT_BASE) {
+        cerr << "ERROR: Need sessions in 1.." << 65535 - SESSION_PORT_BASE
+             << ", and threads, groups, steps, duration >= 1" << endl;
+        return 1;
+    }
+    config.threads = min(config.threads, config.sessions);
+
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN);
+
+    // One socket per session
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+
+    SOCKET admin = connect_to_tracker();
+    if (admin == INVALID_SOCKET) {
+        cerr << "ERROR: Cannot connect to tracker " << config.tracker_ip << ":" << config.tracker_port << endl;
+        return 1;
+    }
+
+    string response;
+    request(admin, "create_user " + config.prefix + "admin pw", response);
+    if (!request(admin, "login " + config.prefix + "admin pw " + to_string(SESSION_PORT_BASE - 1), response) ||
+        response.find("SUCCESS") == string::npos) {
+        cerr << "ERROR: Admin login failed: " << response << endl;
+        return 1;
+    }
+
+    printf("tracker_load: %s:%d, %d sessions on %d threads, prefix %s\n", config.tracker_ip.c_str(),
+           config.tracker_port, config.sessions, config.threads, config.prefix.c_str());
+
+    for (int step = 1; step <= config.steps; step++) {
+        populate(admin, config.users * step / config.steps, max(1L, config.groups * step / config.steps),
+                 config.files * step / config.steps);
+
+        if (step == 1) {
+            // The sessions' users, logins, join requests and acceptance
+            auto started = chrono::steady_clock::now();
+            vector<string> commands;
+            for (int i = 0; i < config.sessions; i++) commands.push_back("create_user " + session_user(i) + " pw");
+            run_batched(admin, commands);
+
+            sessions.resize(config.sessions);
+            vector<thread> openers;
+            atomic<bool> opened(true);
+            for (int t = 0; t < config.threads; t++) {
+                int first = (int)((long)config.sessions * t / config.threads);
+                int last = (int)((long)config.sessions * (t + 1) / config.threads);
+                openers.emplace_back([first, last, &opened] {
+                    if (!open_sessions(first, last)) opened = false;
+                });
+            }
+            for (thread& t : openers) t.join();
+            if (!opened) return 1;
+
+            commands.clear();
+            for (int i = 0; i < config.sessions; i++) {
+                commands.push_back("accept_request " + group_name(sessions[i].group) + " " + session_user(i));
+            }
+            run_batched(admin, commands);
+            printf("opened %d sessions in %.2fs\n", config.sessions,
+                   chrono::duration<double>(chrono::steady_clock::now() - started).count());
+        }
+
+        // Timed run
+        vector<WorkerStats> stats(config.threads);
+        vector<thread> workers;
+        measuring = true;
+        auto started = chrono::steady_clock::now();
+        for (int t = 0; t < config.threads; t++) workers.emplace_back(worker, t, &stats[t]);
+
+        for (int sec = 1; sec <= config.duration_sec; sec++) {
+            this_thread::sleep_for(chrono::seconds(1));
+            if (sec % ANNOUNCE_EVERY_SEC == 0) request(admin, "announce", response);
+        }
+        measuring = false;
+        for (thread& t : workers) t.join();
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        long broken = 0;
+        for (const WorkerStats& w : stats) broken += w.broken;
+
+        long rss = tracker_rss_kb();
+        printf("\nstep %d/%d:%s", step, config.steps, tracker_counts(admin).c_str());
+        if (rss >= 0) printf(" tracker_rss_kb=%ld", rss);
+        printf(" run_sec=%.2f\n", secs);
+        report(stats, secs);
+
+        if (broken > 0) {
+            cerr << "ERROR: " << broken << " threads lost their tracker connection" << endl;
+            return 1;
+        }
+    }
+
+    for (Session& s : sessions) {
+        string ignored;
+        request(s.sock, "logout", ignored);
+        CLOSE_SOCKET(s.sock);
+    }
+    request(admin, "logout", response);
+    CLOSE_SOCKET(admin);
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
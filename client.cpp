@@ -5,20 +5,29 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
 #include <set>
 #include <sstream>
 #include <cstring>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <fstream>
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <cerrno>
+
+#include "logger.h"
 
 
 #ifdef _WIN32
     #define WIN32_LEAN_AND_MEAN
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <direct.h>
     #pragma comment(lib, "Ws2_32.lib")
     typedef int socklen_t;
     #define CLOSE_SOCKET closesocket
@@ -28,7 +37,14 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <signal.h>
     #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <sys/ioctl.h>
+    #include <dirent.h>
+    #ifdef __linux__
+        #include <linux/fs.h>   // FICLONE
+    #endif
     #define CLOSE_SOCKET close
     typedef int SOCKET;
     #define INVALID_SOCKET -1
@@ -39,6 +55,9 @@ using namespace std;
 
 #define BUFFER_SIZE 65536
 #define PIECE_SIZE 5120  // 5KB
+#define DEFAULT_NUMWANT 50   // Peers to ask the tracker for per request
+#define MAX_PEER_ROUNDS 3    // Follow-up more_peers requests per download
+#define DEFAULT_HEARTBEAT_SEC 30  // Until the tracker tells us its interval
 
 // ==================== DATA STRUCTURES ====================
 
@@ -48,18 +67,37 @@ struct LocalFileInfo {
     long file_size;
     int num_pieces;
     vector<bool> bit_vector;  // Which pieces this peer has (1 = has, 0 = doesn't have)
+    vector<string> piece_hashes;   // SHA-256 of each piece; empty if unknown (see CONTENT INDEX)
+    vector<uint32_t> weak_sums;    // Rolling checksum of each piece, to find it in older versions
+    string root;                   // Hex SHA-256 over piece_hashes
+    long long mtime = -1;          // When the hashes were taken, for files we shared complete
 };
 
 // peer_file_map[group_id][filename] = LocalFileInfo
 map<string, map<string, LocalFileInfo>> peer_file_map;
 mutex file_map_mutex;
+atomic<bool> shares_changed(false);   // peer_file_map not saved since it changed (see SHARE INDEX)
+
+// filepath -> a group and filename it is shared under, to find what we know
+// about a path without a scan (an entry may since have moved elsewhere)
+map<string, pair<string, string>> shared_paths;
+
+// Put a file into peer_file_map. Caller must hold file_map_mutex.
+void add_shared_file(const string& group_id, const string& filename, const LocalFileInfo& info) {
+    peer_file_map[group_id][filename] = info;
+    shared_paths[info.filepath] = make_pair(group_id, filename);
+    shares_changed = true;
+}
 
 // Global variables
 string my_ip;
 int my_port;
-string tracker_ip;
-int tracker_port;
+int advertised_port;   // Port other peers reach us on (see --advertise-port)
+string my_zone;    // Locality hints sent at login (see --zone / --coord)
+string my_coord;
 atomic<bool> running(true);
+atomic<bool> logged_in_session(false);      // Heartbeats are only sent while logged in
+atomic<int> heartbeat_interval_sec(DEFAULT_HEARTBEAT_SEC);
 
 // ==================== HELPER FUNCTIONS ====================
 
@@ -75,12 +113,36 @@ vector<string> split_string(const string& str, char delimiter) {
     return tokens;
 }
 
+// split_string on spaces, into a vector kept by the caller so its strings
+// reuse their storage from one request to the next
+void split_words(const char* str, size_t len, vector<string>& words) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; ) {
+        if (str[i] == ' ') {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < len && str[i] != ' ') i++;
+        if (n == words.size()) words.emplace_back();
+        words[n++].assign(str + start, i - start);
+    }
+    words.resize(n);
+}
+
 long get_file_size(const string& filepath) {
     struct stat stat_buf;
     int rc = stat(filepath.c_str(), &stat_buf);
     return rc == 0 ? stat_buf.st_size : -1;
 }
 
+// Last modification time in seconds; -1 if the file can't be read
+long long get_file_mtime(const string& filepath) {
+    struct stat stat_buf;
+    int rc = stat(filepath.c_str(), &stat_buf);
+    return rc == 0 ? (long long)stat_buf.st_mtime : -1;
+}
+
 int calculate_num_pieces(long file_size) {
     return (int)((file_size + PIECE_SIZE - 1) / PIECE_SIZE);
 }
@@ -93,11 +155,113 @@ string get_filename(const string& filepath) {
     return filepath;
 }
 
+// Piece availability travels in a compact text form:
+//   "*"             every piece
+//   "-"             no piece
+//   "r<n>,<n>,..."  run lengths, alternating present/missing, starting with present
+//   "x<hex>"        bitmap, four pieces per hex digit, most significant bit first
+// encode_pieces picks whichever is shortest.
+string encode_pieces(const vector<bool>& pieces) {
+    size_t have = count(pieces.begin(), pieces.end(), true);
+    if (have == pieces.size()) return "*";
+    if (have == 0) return "-";
+    
+    string runs = "r";
+    bool present = true;
+    size_t run = 0;
+    for (size_t i = 0; i <= pieces.size(); i++) {
+        if (i < pieces.size() && pieces[i] == present) {
+            run++;
+            continue;
+        }
+        if (runs.size() > 1) runs += ",";
+        runs += to_string(run);
+        if (i == pieces.size()) break;
+        present = !present;
+        run = 1;
+    }
+    
+    string hex = "x";
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < pieces.size(); i += 4) {
+        int v = 0;
+        for (size_t b = 0; b < 4; b++) {
+            if (i + b < pieces.size() && pieces[i + b]) v |= 8 >> b;
+        }
+        hex += digits[v];
+    }
+    
+    return runs.size() <= hex.size() ? runs : hex;
+}
+
+bool decode_pieces(const string& enc, int num_pieces, vector<bool>& out) {
+    out.assign(num_pieces, false);
+    if (enc == "*") {
+        out.assign(num_pieces, true);
+        return true;
+    }
+    if (enc == "-") return true;
+    if (enc.size() < 2) return false;
+    
+    if (enc[0] == 'r') {
+        long piece = 0;
+        bool present = true;
+        size_t pos = 1;
+        while (pos < enc.size()) {
+            char* end;
+            long run = strtol(enc.c_str() + pos, &end, 10);
+            if (end == enc.c_str() + pos || run < 0 || (*end != ',' && *end != '\0')) return false;
+            
+            for (long i = piece; i < piece + run && i < num_pieces; i++) out[i] = present;
+            piece += run;
+            present = !present;
+            pos = (end - enc.c_str()) + 1;
+        }
+        return true;
+    }
+    
+    if (enc[0] == 'x') {
+        for (size_t i = 1; i < enc.size(); i++) {
+            char c = enc[i];
+            int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (v < 0) return false;
+            for (int b = 0; b < 4; b++) {
+                size_t piece = (i - 1) * 4 + b;
+                if (piece < (size_t)num_pieces && (v & (8 >> b))) out[piece] = true;
+            }
+        }
+        return true;
+    }
+    
+    return false;
+}
+
 // ==================== NETWORK FUNCTIONS ====================
 
-// Global persistent tracker connection
-SOCKET tracker_socket = INVALID_SOCKET;
+// Trackers from the tracker info file. Writes go to the primary; reads are
+// spread across all trackers, and both fail over when a tracker dies.
+struct TrackerConn {
+    string ip;
+    int port;
+    SOCKET sock;
+    chrono::steady_clock::time_point retry_after;  // Skip a dead tracker until then
+    chrono::steady_clock::time_point last_used;
+    bool closed_when_idle = false;  // See close_idle_trackers
+};
+
+vector<TrackerConn> trackers;
+size_t primary_tracker = 0;
+size_t next_read_tracker = 0;
 mutex tracker_mutex;
+bool reannounce_pending = false;  // Reconnected to a live session; re-announce seeded files
+string session_token;             // Handed out by our last login; attach presents it
+string session_path;              // "" = not persisted (--no-persist)
+
+#define TRACKER_TIMEOUT_MS 10000
+#define TRACKER_RETRY_MS 1000
+#define TRACKER_FAILOVER_ATTEMPTS 20
+#define BATCH_MAX_COMMANDS 64
+#define BULK_ITEMS_PER_COMMAND 500
 
 SOCKET connect_to_server(const string& ip, int port) {
     SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -109,6 +273,18 @@ SOCKET connect_to_server(const string& ip, int port) {
     server_addr.sin_addr.s_addr = inet_addr(ip.c_str());
     server_addr.sin_port = htons(port);
     
+    // Connect from our advertised address, so the tracker (which ranks peers
+    // by subnet) sees it even on a multi-homed host or a loopback alias. If it
+    // isn't a local address, let the OS choose.
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(my_ip.c_str());
+    local_addr.sin_port = 0;
+    if (local_addr.sin_addr.s_addr != INADDR_ANY && local_addr.sin_addr.s_addr != INADDR_NONE) {
+        bind(sock, (struct sockaddr*)&local_addr, sizeof(local_addr));
+    }
+    
     if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
         CLOSE_SOCKET(sock);
         return INVALID_SOCKET;
@@ -117,285 +293,4285 @@ SOCKET connect_to_server(const string& ip, int port) {
     return sock;
 }
 
-bool connect_to_tracker() {
-    if (tracker_socket != INVALID_SOCKET) {
+void set_recv_timeout(SOCKET sock, int ms) {
+#ifdef _WIN32
+    DWORD tv = ms;
+#else
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+}
+
+bool send_all(SOCKET sock, const char* data, size_t len) {
+    while (len > 0) {
+        int sent = send(sock, data, (int)min(len, (size_t)BUFFER_SIZE), 0);
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// A header and a body in one send, without copying them together
+bool send_parts(SOCKET sock, const char* header, size_t header_len, const char* body, size_t body_len) {
+    while (header_len + body_len > 0) {
+#ifdef _WIN32
+        WSABUF bufs[2] = { { (ULONG)header_len, (char*)header }, { (ULONG)body_len, (char*)body } };
+        DWORD sent_bytes = 0;
+        if (WSASend(sock, header_len > 0 ? bufs : bufs + 1, header_len > 0 ? 2 : 1, &sent_bytes, 0, NULL, NULL) != 0 ||
+            sent_bytes == 0) {
+            return false;
+        }
+        size_t sent = sent_bytes;
+#else
+        struct iovec iov[2] = { { (void*)header, header_len }, { (void*)body, body_len } };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = header_len > 0 ? iov : iov + 1;
+        msg.msg_iovlen = header_len > 0 ? 2 : 1;
+        ssize_t sent = sendmsg(sock, &msg, 0);
+        if (sent <= 0) return false;
+#endif
+        size_t from_header = min((size_t)sent, header_len);
+        header += from_header;
+        header_len -= from_header;
+        body += sent - from_header;
+        body_len -= sent - from_header;
+    }
+    return true;
+}
+
+bool recv_exact(SOCKET sock, char* data, size_t len) {
+    while (len > 0) {
+        int r = recv(sock, data, (int)min(len, (size_t)BUFFER_SIZE), 0);
+        if (r <= 0) return false;
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Tracker responses arrive as length-prefixed chunks ([u32 length, network
+// byte order][bytes]) ending with an empty chunk. A batch response carries
+// one chunk per command.
+bool read_response_chunks(SOCKET sock, vector<string>& chunks) {
+    chunks.clear();
+    while (true) {
+        uint32_t n;
+        if (!recv_exact(sock, (char*)&n, 4)) return false;
+        n = ntohl(n);
+        if (n == 0) return true;
+        
+        chunks.push_back(string(n, '\0'));
+        if (!recv_exact(sock, &chunks.back()[0], n)) return false;
+    }
+}
+
+bool read_response(SOCKET sock, string& response) {
+    vector<string> chunks;
+    if (!read_response_chunks(sock, chunks)) return false;
+    
+    response.clear();
+    for (const string& chunk : chunks) response += chunk;
+    return true;
+}
+
+// Caller must hold tracker_mutex
+void drop_tracker(size_t idx) {
+    TrackerConn& t = trackers[idx];
+    if (t.sock != INVALID_SOCKET) {
+        CLOSE_SOCKET(t.sock);
+        t.sock = INVALID_SOCKET;
+    }
+    t.retry_after = chrono::steady_clock::now() + chrono::milliseconds(TRACKER_RETRY_MS);
+}
+
+// Caller must hold tracker_mutex
+bool connect_to_tracker(size_t idx) {
+    TrackerConn& t = trackers[idx];
+    if (t.sock != INVALID_SOCKET) {
         return true; // Already connected
     }
+    if (chrono::steady_clock::now() < t.retry_after) {
+        return false; // Recently failed
+    }
     
-    tracker_socket = connect_to_server(tracker_ip, tracker_port);
-    if (tracker_socket == INVALID_SOCKET) {
-        cerr << "ERROR: Cannot connect to tracker" << endl;
+    t.sock = connect_to_server(t.ip, t.port);
+    if (t.sock == INVALID_SOCKET) {
+        drop_tracker(idx);
         return false;
     }
+    set_recv_timeout(t.sock, TRACKER_TIMEOUT_MS);
+    
+    // Re-identify our listening port so a session that outlived the previous
+    // connection (or a tracker restart, or lives on another replica) is picked
+    // up without logging in again
+    string attach = "attach " + to_string(advertised_port);
+    if (!session_token.empty()) attach += " " + session_token;
+    string response;
+    if (send(t.sock, attach.c_str(), (int)attach.length(), 0) <= 0 || !read_response(t.sock, response)) {
+        drop_tracker(idx);
+        return false;
+    }
+    if (response.find("Attached as") != string::npos) {
+        reannounce_pending = reannounce_pending || !t.closed_when_idle;
+        logged_in_session = true;
+    }
+    t.closed_when_idle = false;
     
-    cout << "[CLIENT] Connected to tracker" << endl;
+    LOG_INFO("[CLIENT] Connected to tracker " << t.ip << ":" << t.port);
     return true;
 }
 
-string send_to_tracker(const string& message) {
-    lock_guard<mutex> lock(tracker_mutex);
+// One request/response with a single tracker. Returns false if the tracker
+// is unreachable or the connection broke. Caller must hold tracker_mutex.
+bool tracker_request_chunks(size_t idx, const string& message, vector<string>& chunks) {
+    if (!connect_to_tracker(idx)) return false;
     
-    if (tracker_socket == INVALID_SOCKET) {
-        if (!connect_to_tracker()) {
-            return "ERROR: Cannot connect to tracker";
-        }
+    SOCKET sock = trackers[idx].sock;
+    trackers[idx].last_used = chrono::steady_clock::now();
+    if (!send_all(sock, message.data(), message.size())) {
+        drop_tracker(idx);
+        return false;
     }
     
-    // Send message
-    int sent = send(tracker_socket, message.c_str(), (int)message.length(), 0);
-    if (sent <= 0) {
-        // Connection lost, try to reconnect
-        CLOSE_SOCKET(tracker_socket);
-        tracker_socket = INVALID_SOCKET;
-        if (!connect_to_tracker()) {
-            return "ERROR: Connection lost";
-        }
-        send(tracker_socket, message.c_str(), (int)message.length(), 0);
+    if (!read_response_chunks(sock, chunks) || chunks.empty()) {
+        drop_tracker(idx);
+        return false;
     }
     
-    // Receive response
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    int received = recv(tracker_socket, buffer, BUFFER_SIZE - 1, 0);
+    return true;
+}
+
+// As above, with the response joined. Returns "" on failure.
+string tracker_request(size_t idx, const string& message) {
+    vector<string> chunks;
+    if (!tracker_request_chunks(idx, message, chunks)) return "";
+    
+    string response;
+    for (const string& chunk : chunks) response += chunk;
+    return response;
+}
+
+// Commands that don't change tracker state and may be served by any replica
+bool is_read_command(const string& cmd) {
+    return cmd == "list_groups" || cmd == "list_files" || cmd == "list_requests" ||
+           cmd == "download_file" || cmd == "more_peers" || cmd == "file_info";
+}
+
+// Caller must hold tracker_mutex
+bool send_to_primary_chunks(const string& message, vector<string>& chunks) {
+    for (int attempt = 0; attempt < TRACKER_FAILOVER_ATTEMPTS; attempt++) {
+        if (!tracker_request_chunks(primary_tracker, message, chunks)) {
+            // Primary unreachable: try the next tracker, pausing after each
+            // full pass to give the survivors time to elect a new primary
+            primary_tracker = (primary_tracker + 1) % trackers.size();
+            if (primary_tracker == 0) {
+                this_thread::sleep_for(chrono::milliseconds(500));
+            }
+            continue;
+        }
+        
+        const string& response = chunks[0];
+        if (response.find("ERROR: NOT_PRIMARY") == 0) {
+            // "ERROR: NOT_PRIMARY <ip:port>" names the primary if known
+            string addr = response.length() > 19 ? response.substr(19) : "-";
+            size_t next = (primary_tracker + 1) % trackers.size();
+            for (size_t i = 0; i < trackers.size(); i++) {
+                if (trackers[i].ip + ":" + to_string(trackers[i].port) == addr) next = i;
+            }
+            primary_tracker = next;
+            this_thread::sleep_for(chrono::milliseconds(200));
+            continue;
+        }
+        
+        return true;
+    }
     
-    if (received <= 0) {
-        // Connection lost
-        CLOSE_SOCKET(tracker_socket);
-        tracker_socket = INVALID_SOCKET;
-        return "ERROR: Connection lost";
+    return false;
+}
+
+// Caller must hold tracker_mutex
+string send_to_primary(const string& message) {
+    vector<string> chunks;
+    if (!send_to_primary_chunks(message, chunks)) {
+        return "ERROR: Cannot connect to tracker";
     }
     
-    return string(buffer);
+    string response;
+    for (const string& chunk : chunks) response += chunk;
+    return response;
 }
 
-// ==================== PIECE SELECTION ALGORITHM ====================
+void reannounce_seeded_files();
+string udp_tracker_request(const string& message);
+void close_idle_trackers();
+void forget_idle_closes();
 
-struct PeerInfo {
-    string ip;
-    int port;
-    vector<bool> bit_vector;
-    vector<int> assigned_pieces;
-};
+// Keep the session token across restarts, readable only by us, so a
+// restarted client re-attaches to its session. Caller must hold tracker_mutex.
+void save_session() {
+    if (session_path.empty()) return;
+    if (session_token.empty()) {
+        remove(session_path.c_str());
+        return;
+    }
+#ifdef _WIN32
+    ofstream out(session_path.c_str(), ios::trunc);
+    out << session_token << "\n";
+    bool ok = (bool)out;
+#else
+    int fd = open(session_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    string line = session_token + "\n";
+    bool ok = fd >= 0 && write(fd, line.data(), line.size()) == (ssize_t)line.size();
+    if (fd >= 0) close(fd);
+#endif
+    if (!ok) LOG_WARN("[CLIENT] Cannot save the session to " << session_path);
+}
 
-// Get bit vector from a peer
-vector<bool> get_peer_bit_vector(const string& ip, int port, const string& group_id, const string& filename) {
-    SOCKET sock = connect_to_server(ip, port);
-    if (sock == INVALID_SOCKET) {
-        return vector<bool>();
+void load_session() {
+    if (session_path.empty()) return;
+    ifstream in(session_path.c_str());
+    lock_guard<mutex> lock(tracker_mutex);
+    if (in) in >> session_token;
+}
+
+// A login hands out a new session token and a logout ends it. Connections
+// attached before don't carry the new token, so they are closed and attach
+// again on their next use. Caller must hold tracker_mutex.
+void note_session(const string& cmd, string& response) {
+    if (cmd == "login") {
+        size_t at = response.find(" SESSION:");
+        if (at == string::npos) return;
+        session_token = response.substr(at + 9);
+        response.erase(at);
     }
+    else if (cmd == "logout" && response.find("SUCCESS") == 0) {
+        session_token.clear();
+    }
+    else {
+        return;
+    }
+    save_session();
     
-    string request = "GET_BITVECTOR " + group_id + " " + filename;
-    send(sock, request.c_str(), (int)request.length(), 0);
+    for (size_t i = 0; i < trackers.size(); i++) {
+        if (i == primary_tracker || trackers[i].sock == INVALID_SOCKET) continue;
+        CLOSE_SOCKET(trackers[i].sock);
+        trackers[i].sock = INVALID_SOCKET;
+        trackers[i].closed_when_idle = true;   // No re-announce: login does that itself
+    }
+}
+
+string send_to_tracker(const string& message) {
+    string cmd = message.substr(0, message.find(' '));
     
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    CLOSE_SOCKET(sock);
+    // Peer lookups go over UDP when the tracker takes it; errors are left to
+    // the TCP path, which knows about replicas and failover
+    if (cmd == "download_file" || cmd == "more_peers") {
+        string response = udp_tracker_request(message);
+        if (response.compare(0, 6, "PEERS:") == 0) return response;
+    }
     
-    string response(buffer);
-    if (response.find("BITVECTOR:") == string::npos) {
-        return vector<bool>();
+    string response;
+    bool reannounce;
+    {
+        lock_guard<mutex> lock(tracker_mutex);
+        
+        if (is_read_command(cmd)) {
+            for (size_t attempt = 0; attempt < trackers.size() && response.empty(); attempt++) {
+                size_t idx = next_read_tracker++ % trackers.size();
+                response = tracker_request(idx, message);
+                
+                // A backup may lag behind the primary (e.g. a login that hasn't
+                // replicated yet); let the primary have the final word on errors
+                if (idx != primary_tracker && response.find("ERROR") == 0) {
+                    string retry = tracker_request(primary_tracker, message);
+                    if (!retry.empty()) response = retry;
+                }
+            }
+        }
+        
+        if (response.empty()) {
+            response = send_to_primary(message);
+        }
+        note_session(cmd, response);
+        
+        reannounce = reannounce_pending;
+        reannounce_pending = false;
     }
     
-    // Parse bit vector
-    vector<bool> bit_vec;
-    size_t pos = response.find("BITVECTOR:") + 10;
-    string bits = response.substr(pos);
+    if (reannounce) {
+        reannounce_seeded_files();
+    }
+    return response;
+}
+
+// Send many commands in one round trip (see "batch" in the tracker). Returns
+// one result per command.
+vector<string> send_batch(const vector<string>& commands) {
+    string body;
+    for (const string& command : commands) {
+        body += command + "\n";
+    }
+    string message = "batch " + to_string(commands.size()) + " " + to_string(body.size()) + "\n" + body;
     
-    stringstream ss(bits);
-    int bit;
-    while (ss >> bit) {
-        bit_vec.push_back(bit == 1);
+    vector<string> results;
+    {
+        lock_guard<mutex> lock(tracker_mutex);
+        if (!send_to_primary_chunks(message, results)) {
+            results.clear();
+            results.push_back("ERROR: Cannot connect to tracker");
+        }
     }
     
-    return bit_vec;
+    // A malformed batch is answered with a single error
+    if (results.size() != commands.size()) {
+        string error = results.empty() ? "ERROR: Invalid batch response" : results[0];
+        results.assign(commands.size(), error);
+    }
+    return results;
 }
 
-// Round-robin piece assignment
-void assign_pieces_round_robin(vector<PeerInfo>& peers, int num_pieces) {
-    if (peers.empty()) return;
+// Run bulk commands of the form "<prefix> <item> <item> ...", packing up to
+// BULK_ITEMS_PER_COMMAND items per command and BATCH_MAX_COMMANDS commands per
+// round trip. Returns the tracker's results.
+vector<string> send_bulk(const string& prefix, const vector<string>& items) {
+    vector<string> commands;
+    string command;
+    int in_command = 0;
     
-    int num_peers = (int)peers.size();
+    for (const string& item : items) {
+        if (in_command == 0) command = prefix;
+        command += " " + item;
+        if (++in_command == BULK_ITEMS_PER_COMMAND) {
+            commands.push_back(command);
+            in_command = 0;
+        }
+    }
+    if (in_command > 0) commands.push_back(command);
     
-    for (int piece = 0; piece < num_pieces; piece++) {
-        // Round-robin: try to assign to peer (piece % num_peers)
-        // If that peer doesn't have it, try next peer
-        for (int i = 0; i < num_peers; i++) {
-            int peer_idx = (piece + i) % num_peers;
+    vector<string> results;
+    for (size_t i = 0; i < commands.size(); i += BATCH_MAX_COMMANDS) {
+        size_t end = min(commands.size(), i + BATCH_MAX_COMMANDS);
+        vector<string> batch_results = send_batch(vector<string>(commands.begin() + i, commands.begin() + end));
+        results.insert(results.end(), batch_results.begin(), batch_results.end());
+    }
+    return results;
+}
+
+// After reattaching to an existing session (tracker restart or failover), or
+// logging in with files restored from the share index, re-announce every file
+// we seed in a handful of batched round trips. Files still downloading are
+// reported by the heartbeat instead; the root hash keeps the tracker from
+// taking us for a seeder of a version we don't have.
+void reannounce_seeded_files() {
+    map<string, vector<string>> by_group;
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        for (const auto& group : peer_file_map) {
+            for (const auto& file : group.second) {
+                const vector<bool>& bits = file.second.bit_vector;
+                if (find(bits.begin(), bits.end(), false) != bits.end()) continue;
+                string root = file.second.root.empty() ? "" : " root=" + file.second.root;
+                by_group[group.first].push_back(file.first + root);
+            }
+        }
+    }
+    
+    for (const auto& group : by_group) {
+        int problems = 0;
+        string example;
+        for (const string& result : send_bulk("update_seeders " + group.first, group.second)) {
+            if (result.find("SUCCESS") == 0 && result.find("skipped") == string::npos) continue;
+            if (problems++ == 0) example = result;
+        }
+        if (problems > 0) {
+            LOG_WARN("[CLIENT] Re-announcing " << group.second.size() << " files of " << group.first << ": "
+                     << example << (problems > 1 ? " (and " + to_string(problems - 1) + " more)" : string()));
+        }
+    }
+}
+
+// Keep our seeders in the tracker's peer lists: the tracker drops users whose
+// heartbeat lapses
+void heartbeat_thread_func() {
+    auto last = chrono::steady_clock::now();
+    bool announced = false;  // Announce right after login to learn the interval
+    
+    while (running) {
+        this_thread::sleep_for(chrono::milliseconds(500));
+        if (!logged_in_session) {
+            announced = false;
+            continue;
+        }
+        
+        auto now = chrono::steady_clock::now();
+        if (announced && now - last < chrono::seconds(heartbeat_interval_sec.load())) continue;
+        last = now;
+        announced = true;
+        
+        // Report the pieces of files still downloading so the tracker can
+        // hand us out as a source: "announce [<group_id> <filename> <pieces> ...]"
+        string message = "announce";
+        {
+            lock_guard<mutex> lock(file_map_mutex);
+            for (const auto& group : peer_file_map) {
+                for (const auto& file : group.second) {
+                    const vector<bool>& bits = file.second.bit_vector;
+                    if (find(bits.begin(), bits.end(), false) == bits.end()) continue;
+                    
+                    string entry = " " + group.first + " " + file.first + " " + encode_pieces(bits);
+                    if (message.size() + entry.size() > BUFFER_SIZE / 2) break;
+                    message += entry;
+                }
+            }
+        }
+        
+        // "SUCCESS: INTERVAL <sec>", over UDP unless that fails
+        string response = udp_tracker_request(message);
+        if (response.find("SUCCESS") == 0) {
+            close_idle_trackers();
+        } else {
+            forget_idle_closes();
+            response = send_to_tracker(message);
+        }
+        size_t pos = response.find("INTERVAL ");
+        if (pos != string::npos) {
+            heartbeat_interval_sec = max(1, atoi(response.c_str() + pos + 9));
+        }
+    }
+}
+
+// ==================== UDP ANNOUNCE ====================
+
+// Heartbeats and peer lookups are small and frequent, so they go to the
+// primary tracker as single UDP datagrams (see UDP ANNOUNCE in tracker.cpp)
+// instead of over the TCP command channel. A lost datagram is sent again
+// after 250, 500, 1000 and 2000ms; if all of those go unanswered the tracker
+// probably doesn't take UDP (or a firewall drops it), so we stay on TCP for
+// UDP_BACKOFF_SEC before trying again. With UDP working, TCP connections that
+// sit idle are closed, so a client that only heartbeats holds none.
+
+#define UDP_PROTOCOL_ID 0x41727101980ULL
+#define UDP_CONNECT 0
+#define UDP_ANNOUNCE 1
+#define UDP_PEERS 2
+#define UDP_ERROR 3
+#define UDP_MAX_DATAGRAM 8192
+#define SESSION_TOKEN_CHARS 32   // Hex digits of the login session token every request carries
+#define UDP_ATTEMPTS 4
+#define UDP_FIRST_TIMEOUT_MS 250
+#define UDP_CONN_ID_TTL_SEC 60   // The tracker accepts an id for at least this long
+#define UDP_BACKOFF_SEC 300
+#define TRACKER_IDLE_CLOSE_SEC 60
+
+bool udp_enabled = true;
+mutex udp_mutex;
+SOCKET udp_sock = INVALID_SOCKET;
+string udp_target;               // "ip:port" udp_sock is connected to
+uint64_t udp_conn_id = 0;
+chrono::steady_clock::time_point udp_conn_expires;
+chrono::steady_clock::time_point udp_retry_after;  // Backing off to TCP until then
+uint32_t udp_next_txn = 0;
+
+void put_net(string& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+uint64_t get_net(const char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+// Caller must hold udp_mutex
+bool udp_open(const string& ip, int port) {
+    string target = ip + ":" + to_string(port);
+    if (udp_sock != INVALID_SOCKET && udp_target == target) return true;
+    if (udp_sock != INVALID_SOCKET) CLOSE_SOCKET(udp_sock);
+    udp_conn_id = 0;
+    udp_target = target;
+    
+    udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_sock == INVALID_SOCKET) return false;
+    
+    // Send from our advertised address, which with the port in each request
+    // names our session (as in connect_to_server)
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(my_ip.c_str());
+    local_addr.sin_port = 0;
+    if (local_addr.sin_addr.s_addr != INADDR_ANY && local_addr.sin_addr.s_addr != INADDR_NONE) {
+        bind(udp_sock, (struct sockaddr*)&local_addr, sizeof(local_addr));
+    }
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    server_addr.sin_port = htons(port);
+    if (connect(udp_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        CLOSE_SOCKET(udp_sock);
+        udp_sock = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+// Send a request (whose bytes 8-11 are its action, 12-15 its transaction id)
+// until the matching reply arrives, backing off between attempts. Caller must
+// hold udp_mutex.
+bool udp_exchange(string request, string& reply) {
+    uint32_t txn = udp_next_txn++;
+    for (int i = 0; i < 4; i++) request[12 + i] = (char)((txn >> (8 * (3 - i))) & 0xff);
+    
+    vector<char> buffer(UDP_MAX_DATAGRAM);
+    for (int attempt = 0; attempt < UDP_ATTEMPTS; attempt++) {
+        if (send(udp_sock, request.data(), (int)request.size(), 0) <= 0) return false;
+        
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(UDP_FIRST_TIMEOUT_MS << attempt);
+        while (true) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (left <= 0) break;
+            set_recv_timeout(udp_sock, (int)max(1LL, (long long)left));
+            int n = recv(udp_sock, buffer.data(), (int)buffer.size(), 0);
+#ifdef _WIN32
+            if (n < 0 && WSAGetLastError() == WSAETIMEDOUT) continue;
+#else
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+#endif
+            if (n < 0) return false;  // e.g. ICMP port unreachable: nothing listens there
             
-            // Check if this peer has the piece (piece must be within bit_vector bounds)
-            if (piece < (int)peers[peer_idx].bit_vector.size() && 
-                peers[peer_idx].bit_vector[piece]) {
-                peers[peer_idx].assigned_pieces.push_back(piece);
-                break;
+            // Replies to earlier attempts (or to requests we gave up on) are skipped
+            if (n < 8 || (uint32_t)get_net(buffer.data() + 4, 4) != txn) continue;
+            reply.assign(buffer.data(), n);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send one request to the primary tracker and return the reply's body: the
+// part after action and transaction id, or the error text. Returns false if
+// UDP isn't usable, after which the caller goes over TCP.
+bool udp_request(uint32_t action, const string& body, string& reply) {
+    string ip;
+    int port;
+    string session;
+    {
+        lock_guard<mutex> lock(tracker_mutex);
+        ip = trackers[primary_tracker].ip;
+        port = trackers[primary_tracker].port;
+        session = session_token;
+    }
+    
+    lock_guard<mutex> lock(udp_mutex);
+    auto now = chrono::steady_clock::now();
+    if (!udp_enabled || now < udp_retry_after) return false;
+    if (udp_next_txn == 0) udp_next_txn = random_device()();
+    
+    for (int tries = 0; tries < 2; tries++) {
+        bool ok = udp_open(ip, port);
+        
+        if (ok && (udp_conn_id == 0 || now >= udp_conn_expires)) {
+            string connect, response;
+            put_net(connect, UDP_PROTOCOL_ID, 8);
+            put_net(connect, UDP_CONNECT, 4);
+            put_net(connect, 0, 4);
+            ok = udp_exchange(connect, response) && response.size() >= 16 && get_net(response.data(), 4) == UDP_CONNECT;
+            if (ok) {
+                udp_conn_id = get_net(response.data() + 8, 8);
+                udp_conn_expires = now + chrono::seconds(UDP_CONN_ID_TTL_SEC);
             }
         }
+        
+        string request, response;
+        if (ok) {
+            put_net(request, udp_conn_id, 8);
+            put_net(request, action, 4);
+            put_net(request, 0, 4);
+            put_net(request, advertised_port, 2);
+            put_net(request, session.size(), 1);
+            request += session;
+            request += body;
+            ok = udp_exchange(request, response);
+        }
+        if (!ok) {
+            LOG_WARN("[CLIENT] No UDP reply from tracker " << udp_target << ", using TCP for "
+                     << UDP_BACKOFF_SEC << "s");
+            if (udp_sock != INVALID_SOCKET) CLOSE_SOCKET(udp_sock);
+            udp_sock = INVALID_SOCKET;
+            udp_retry_after = chrono::steady_clock::now() + chrono::seconds(UDP_BACKOFF_SEC);
+            return false;
+        }
+        
+        reply = response.substr(8);
+        if (get_net(response.data(), 4) != UDP_ERROR) return true;
+        
+        // Our id outlived the tracker's key (e.g. it restarted): get a new one
+        if (reply.find("Invalid connection id") == string::npos) return true;
+        udp_conn_id = 0;
+    }
+    return true;
+}
+
+// The UDP form of an announce, download_file or more_peers command, answered
+// the way the tracker answers it over TCP. Returns "" if the command can't go
+// over UDP (UDP unusable, or the request doesn't fit in a datagram).
+string udp_tracker_request(const string& message) {
+    vector<string> args = split_string(message, ' ');
+    if (args.empty()) return "";
+    
+    string body;
+    uint32_t action;
+    if (args[0] == "announce") {
+        action = UDP_ANNOUNCE;
+        put_net(body, (args.size() - 1) / 3, 2);
+        for (size_t i = 1; i + 2 < args.size(); i += 3) {
+            if (args[i].size() > 255 || args[i + 1].size() > 255 || args[i + 2].size() > 65535) return "";
+            put_net(body, args[i].size(), 1);
+            body += args[i];
+            put_net(body, args[i + 1].size(), 1);
+            body += args[i + 1];
+            put_net(body, args[i + 2].size(), 2);
+            body += args[i + 2];
+        }
+    }
+    else if ((args[0] == "download_file" || args[0] == "more_peers") && args.size() >= 3) {
+        action = UDP_PEERS;
+        if (args[1].size() > 255 || args[2].size() > 255) return "";
+        put_net(body, args[0] == "more_peers" ? 1 : 0, 1);
+        put_net(body, args.size() >= 4 ? (uint64_t)max(0, min(atoi(args[3].c_str()), 65535)) : 0, 2);
+        put_net(body, args[1].size(), 1);
+        body += args[1];
+        put_net(body, args[2].size(), 1);
+        body += args[2];
+    }
+    else {
+        return "";
+    }
+    if (body.size() + 19 + SESSION_TOKEN_CHARS > UDP_MAX_DATAGRAM) return "";   // Header and session
+    
+    string reply;
+    if (!udp_request(action, body, reply)) return "";
+    if (reply.compare(0, 5, "ERROR") == 0) return reply;
+    if (action == UDP_ANNOUNCE) {
+        if (reply.size() < 4) return "";
+        return "SUCCESS: INTERVAL " + to_string(get_net(reply.data(), 4));
+    }
+    return reply;
+}
+
+// Close TCP connections to trackers unused for TRACKER_IDLE_CLOSE_SEC, once
+// UDP carries our heartbeats. Reconnecting later reattaches to the same
+// session, which the heartbeats kept alive, so nothing needs re-announcing.
+void close_idle_trackers() {
+    lock_guard<mutex> lock(tracker_mutex);
+    auto now = chrono::steady_clock::now();
+    for (TrackerConn& t : trackers) {
+        if (t.sock == INVALID_SOCKET || now - t.last_used < chrono::seconds(TRACKER_IDLE_CLOSE_SEC)) continue;
+        CLOSE_SOCKET(t.sock);
+        t.sock = INVALID_SOCKET;
+        t.closed_when_idle = true;
+        LOG_DEBUG("[CLIENT] Closed idle connection to tracker " << t.ip << ":" << t.port);
+    }
+}
+
+// Our session may have lapsed or moved without UDP heartbeats, so the next
+// reattach re-announces after all
+void forget_idle_closes() {
+    lock_guard<mutex> lock(tracker_mutex);
+    for (TrackerConn& t : trackers) t.closed_when_idle = false;
+}
+
+// ==================== TRANSFER STATS ====================
+
+// Bytes and piece latencies per peer we download from, per requester we
+// serve, and per file, for the "stats" command and for scheduling (a peer's
+// recent throughput decides how much work it is planned).
+
+#define RATE_EWMA_WEIGHT 0.3   // Weight of the newest piece in a peer's smoothed rate
+
+struct TransferStats {
+    uint64_t bytes = 0;
+    uint64_t wire_bytes = 0;        // As sent, after any compression
+    uint64_t pieces = 0;
+    uint64_t failures = 0;
+    uint64_t latency_ns = 0;        // Sum over pieces
+    uint64_t max_latency_ns = 0;
+    double rate_ewma = 0;           // Bytes/sec over recent pieces
+    
+    void add_piece(size_t piece_bytes, size_t piece_wire_bytes, uint64_t ns) {
+        bytes += piece_bytes;
+        wire_bytes += piece_wire_bytes;
+        pieces++;
+        latency_ns += ns;
+        max_latency_ns = max(max_latency_ns, ns);
+        
+        double rate = ns > 0 ? piece_bytes * 1e9 / ns : 0;
+        rate_ewma = pieces == 1 ? rate : RATE_EWMA_WEIGHT * rate + (1 - RATE_EWMA_WEIGHT) * rate_ewma;
+    }
+    
+    double avg_latency_ms() const {
+        return pieces > 0 ? latency_ns / 1e6 / pieces : 0;
+    }
+};
+
+struct FileProgress {
+    int num_pieces = 0;
+    int done_pieces = 0;
+    int local_pieces = 0;           // Of done_pieces, copied from our own files
+    long file_size = 0;
+    uint64_t bytes = 0;             // From the network
+    uint64_t local_bytes = 0;
+    bool active = false;
+    bool complete = false;
+    chrono::steady_clock::time_point started;
+    chrono::steady_clock::time_point finished;
+    
+    double seconds() const {
+        auto end = active ? chrono::steady_clock::now() : finished;
+        return chrono::duration<double>(end - started).count();
+    }
+    
+    double rate() const {
+        double secs = seconds();
+        return secs > 0 ? bytes / secs : 0;
+    }
+    
+    // Seconds left at the average rate so far; -1 if unknown
+    double eta() const {
+        double r = rate();
+        if (!active || r <= 0) return -1;
+        return max(0.0, (file_size - (double)bytes - (double)local_bytes) / r);
+    }
+};
+
+mutex stats_mutex;
+map<string, TransferStats> download_peer_stats;   // "ip:port" -> pieces fetched from it
+map<string, TransferStats> upload_peer_stats;     // requester ip -> pieces served to it
+map<string, TransferStats> upload_file_stats;     // "group/filename" -> pieces served
+map<string, FileProgress> download_progress;      // "group/filename" -> our download
+
+void record_download_piece(const string& peer, const string& file_key, size_t bytes, size_t wire_bytes,
+                           uint64_t ns) {
+    lock_guard<mutex> lock(stats_mutex);
+    download_peer_stats[peer].add_piece(bytes, wire_bytes, ns);
+    FileProgress& progress = download_progress[file_key];
+    progress.done_pieces++;
+    progress.bytes += bytes;
+}
+
+void record_local_pieces(const string& file_key, int pieces, uint64_t bytes) {
+    lock_guard<mutex> lock(stats_mutex);
+    FileProgress& progress = download_progress[file_key];
+    progress.done_pieces += pieces;
+    progress.local_pieces += pieces;
+    progress.local_bytes += bytes;
+}
+
+void record_download_failure(const string& peer) {
+    lock_guard<mutex> lock(stats_mutex);
+    download_peer_stats[peer].failures++;
+}
+
+void record_upload_piece(const string& requester, const string& file_key, size_t bytes, size_t wire_bytes,
+                         uint64_t ns) {
+    lock_guard<mutex> lock(stats_mutex);
+    upload_peer_stats[requester].add_piece(bytes, wire_bytes, ns);
+    upload_file_stats[file_key].add_piece(bytes, wire_bytes, ns);
+}
+
+// Smoothed throughput seen from a peer in earlier transfers; 0 if unknown
+double peer_rate(const string& peer) {
+    lock_guard<mutex> lock(stats_mutex);
+    auto it = download_peer_stats.find(peer);
+    return it == download_peer_stats.end() ? 0 : it->second.rate_ewma;
+}
+
+string format_rate(double bytes_per_sec) {
+    char buf[32];
+    if (bytes_per_sec >= 1024 * 1024) snprintf(buf, sizeof(buf), "%.2f MB/s", bytes_per_sec / (1024 * 1024));
+    else snprintf(buf, sizeof(buf), "%.1f KB/s", bytes_per_sec / 1024);
+    return buf;
+}
+
+string json_string(const string& str) {
+    string out = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+            continue;
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+string stats_text() {
+    lock_guard<mutex> lock(stats_mutex);
+    stringstream out;
+    char line[256];
+    
+    out << "=== DOWNLOADS ===\n";
+    for (const auto& pair : download_progress) {
+        const FileProgress& p = pair.second;
+        double eta = p.eta();
+        snprintf(line, sizeof(line), "%-32s %d/%d pieces (%d local)  %llu bytes  %s  %s\n", pair.first.c_str(),
+                 p.done_pieces, p.num_pieces, p.local_pieces, (unsigned long long)p.bytes, format_rate(p.rate()).c_str(),
+                 p.active ? (eta >= 0 ? ("ETA " + to_string((long)eta) + "s").c_str() : "ETA ?")
+                          : (p.complete ? "done" : "incomplete"));
+        out << line;
+    }
+    
+    out << "=== PEERS (downloading from) ===\n";
+    for (const auto& pair : download_peer_stats) {
+        const TransferStats& t = pair.second;
+        snprintf(line, sizeof(line),
+                 "%-22s %llu pieces  %llu bytes (%llu on wire)  %llu failures  avg %.2f ms  max %.2f ms  %s\n",
+                 pair.first.c_str(), (unsigned long long)t.pieces, (unsigned long long)t.bytes,
+                 (unsigned long long)t.wire_bytes,
+                 (unsigned long long)t.failures, t.avg_latency_ms(), t.max_latency_ns / 1e6,
+                 format_rate(t.rate_ewma).c_str());
+        out << line;
+    }
+    
+    out << "=== SERVING (per requester) ===\n";
+    for (const auto& pair : upload_peer_stats) {
+        const TransferStats& t = pair.second;
+        snprintf(line, sizeof(line), "%-22s %llu pieces  %llu bytes (%llu on wire)  avg %.2f ms\n",
+                 pair.first.c_str(), (unsigned long long)t.pieces, (unsigned long long)t.bytes,
+                 (unsigned long long)t.wire_bytes, t.avg_latency_ms());
+        out << line;
+    }
+    
+    out << "=== SERVING (per file) ===\n";
+    for (const auto& pair : upload_file_stats) {
+        const TransferStats& t = pair.second;
+        snprintf(line, sizeof(line), "%-32s %llu pieces  %llu bytes (%llu on wire)\n", pair.first.c_str(),
+                 (unsigned long long)t.pieces, (unsigned long long)t.bytes, (unsigned long long)t.wire_bytes);
+        out << line;
+    }
+    
+    return out.str();
+}
+
+void stats_json_transfers(stringstream& out, const map<string, TransferStats>& stats, const char* key_name) {
+    bool first = true;
+    for (const auto& pair : stats) {
+        const TransferStats& t = pair.second;
+        out << (first ? "" : ",") << "{\"" << key_name << "\":" << json_string(pair.first)
+            << ",\"pieces\":" << t.pieces << ",\"bytes\":" << t.bytes << ",\"wire_bytes\":" << t.wire_bytes << ",\"failures\":" << t.failures
+            << ",\"avg_latency_ms\":" << t.avg_latency_ms() << ",\"max_latency_ms\":" << t.max_latency_ns / 1e6
+            << ",\"rate_bps\":" << t.rate_ewma << "}";
+        first = false;
+    }
+}
+
+// Machine-readable form of stats_text()
+string stats_json() {
+    lock_guard<mutex> lock(stats_mutex);
+    stringstream out;
+    
+    out << "{\"downloads\":[";
+    bool first = true;
+    for (const auto& pair : download_progress) {
+        const FileProgress& p = pair.second;
+        out << (first ? "" : ",") << "{\"file\":" << json_string(pair.first)
+            << ",\"pieces\":" << p.num_pieces << ",\"pieces_done\":" << p.done_pieces
+            << ",\"pieces_local\":" << p.local_pieces
+            << ",\"size\":" << p.file_size << ",\"bytes\":" << p.bytes << ",\"local_bytes\":" << p.local_bytes
+            << ",\"seconds\":" << p.seconds() << ",\"rate_bps\":" << p.rate()
+            << ",\"eta_sec\":" << p.eta() << ",\"active\":" << (p.active ? "true" : "false")
+            << ",\"complete\":" << (p.complete ? "true" : "false") << "}";
+        first = false;
+    }
+    out << "],\"peers\":[";
+    stats_json_transfers(out, download_peer_stats, "peer");
+    out << "],\"serving_peers\":[";
+    stats_json_transfers(out, upload_peer_stats, "requester");
+    out << "],\"serving_files\":[";
+    stats_json_transfers(out, upload_file_stats, "file");
+    out << "]}";
+    return out.str();
+}
+
+// ==================== COMPRESSION ====================
+
+// Pieces can travel LZ-compressed when both ends agree in the peer handshake
+// ("HELLO compress=lz"). The codec is a small LZ77 byte-oriented format in the
+// style of LZ4: each sequence is a token (literal count << 4 | match length -
+// 4), the literals, and a 16-bit little-endian match offset; counts of 15 or
+// more continue in extra bytes of 255. The last sequence has literals only.
+// A piece whose compressed form isn't clearly smaller is sent raw.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_END_LITERALS 12           // Matches stop this close to the end
+#define COMPRESS_MIN_SAVING 0.1      // Send raw unless compression saves this much
+#define INCOMPRESSIBLE_STREAK 8      // After this many raw pieces in a row, stop trying on a file...
+#define INCOMPRESSIBLE_PROBE_EVERY 64 // ...except for every this many pieces
+#define DEFAULT_COMPRESS_CACHE_MB 16
+
+bool compression_enabled = true;     // Offer/accept compression (see --compress)
+size_t compress_cache_limit = (size_t)DEFAULT_COMPRESS_CACHE_MB * 1024 * 1024;
+
+void lz_put_length(string& out, size_t length) {
+    while (length >= 255) {
+        out += (char)255;
+        length -= 255;
+    }
+    out += (char)length;
+}
+
+// Compress src into out. Returns false (out unspecified) once out would
+// reach max_out bytes.
+bool lz_compress(const char* src, size_t n, string& out, size_t max_out) {
+    out.clear();
+    static thread_local vector<int> table(1 << LZ_HASH_BITS);   // Reused, so serving a piece doesn't allocate
+    fill(table.begin(), table.end(), -1);
+    size_t anchor = 0;   // Start of pending literals
+    size_t i = 0;
+    
+    auto hash = [&](size_t pos) {
+        uint32_t v;
+        memcpy(&v, src + pos, 4);
+        return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    };
+    
+    while (n >= LZ_END_LITERALS && i + LZ_END_LITERALS <= n) {
+        uint32_t h = hash(i);
+        int candidate = table[h];
+        table[h] = (int)i;
+        
+        if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        
+        size_t length = LZ_MIN_MATCH;
+        while (i + length + LZ_END_LITERALS <= n && src[candidate + length] == src[i + length]) length++;
+        
+        size_t literals = i - anchor;
+        size_t match_extra = length - LZ_MIN_MATCH;
+        out += (char)((min(literals, (size_t)15) << 4) | min(match_extra, (size_t)15));
+        if (literals >= 15) lz_put_length(out, literals - 15);
+        out.append(src + anchor, literals);
+        size_t offset = i - candidate;
+        out += (char)(offset & 0xff);
+        out += (char)(offset >> 8);
+        if (match_extra >= 15) lz_put_length(out, match_extra - 15);
+        if (out.size() >= max_out) return false;
+        
+        i += length;
+        anchor = i;
+    }
+    
+    size_t literals = n - anchor;
+    out += (char)(min(literals, (size_t)15) << 4);
+    if (literals >= 15) lz_put_length(out, literals - 15);
+    out.append(src + anchor, literals);
+    return out.size() < max_out;
+}
+
+// Decompress into exactly raw_size bytes at dst; false if src is malformed
+bool lz_decompress(const char* src, size_t n, char* dst, size_t raw_size) {
+    size_t in = 0;
+    size_t out = 0;
+    
+    auto get_length = [&](size_t base, size_t& length) {
+        length = base;
+        if (base < 15) return true;
+        while (true) {
+            if (in >= n) return false;
+            unsigned char b = (unsigned char)src[in++];
+            length += b;
+            if (b != 255) return true;
+        }
+    };
+    
+    while (in < n) {
+        unsigned char token = (unsigned char)src[in++];
+        size_t literals;
+        if (!get_length(token >> 4, literals) || in + literals > n || out + literals > raw_size) return false;
+        memcpy(dst + out, src + in, literals);
+        in += literals;
+        out += literals;
+        if (in == n) break;   // Last sequence
+        
+        if (in + 2 > n) return false;
+        size_t offset = (unsigned char)src[in] | ((size_t)(unsigned char)src[in + 1] << 8);
+        in += 2;
+        size_t length;
+        if (!get_length(token & 15, length)) return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || out + length > raw_size) return false;
+        for (size_t k = 0; k < length; k++, out++) dst[out] = dst[out - offset];  // May overlap
+    }
+    return out == raw_size;
+}
+
+// Seeder side: compressed pieces by "<content>:<piece>", least recently used
+// first out, and a run of raw pieces per file so files that don't compress
+// stop costing CPU. An entry with empty data means "send raw". The content
+// key must change whenever the file does: its root hash, or its path and
+// modification time when it has none.
+struct CompressCache {
+    mutex m;
+    list<string> lru;
+    map<string, pair<string, list<string>::iterator>> entries;
+    size_t bytes = 0;
+    map<string, int> raw_streak;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+CompressCache compress_cache;
+
+// What to send for a piece: its compressed form, copied to out (which holds
+// size bytes), and its length; 0 to send it raw. The key and compression
+// scratch are kept per thread, so serving a cached piece allocates nothing.
+size_t compress_piece(const string& content, int piece, const char* data, size_t size, char* out) {
+    static thread_local string key;
+    static thread_local string packed;
+    key.assign(content).append(":").append(to_string(piece));
+    {
+        lock_guard<mutex> lock(compress_cache.m);
+        auto it = compress_cache.entries.find(key);
+        if (it != compress_cache.entries.end()) {
+            compress_cache.lru.splice(compress_cache.lru.end(), compress_cache.lru, it->second.second);
+            compress_cache.hits++;
+            memcpy(out, it->second.first.data(), it->second.first.size());
+            return it->second.first.size();
+        }
+        compress_cache.misses++;
+        auto streak = compress_cache.raw_streak.find(content);
+        if (streak != compress_cache.raw_streak.end() && streak->second >= INCOMPRESSIBLE_STREAK &&
+            piece % INCOMPRESSIBLE_PROBE_EVERY != 0) {
+            return 0;
+        }
+    }
+    
+    if (!lz_compress(data, size, packed, (size_t)(size * (1 - COMPRESS_MIN_SAVING)))) packed.clear();
+    
+    lock_guard<mutex> lock(compress_cache.m);
+    int& streak = compress_cache.raw_streak[content];
+    streak = packed.empty() ? streak + 1 : 0;
+    
+    if (!compress_cache.entries.count(key)) {
+        compress_cache.lru.push_back(key);
+        compress_cache.entries[key] = make_pair(packed, prev(compress_cache.lru.end()));
+        compress_cache.bytes += packed.size() + key.size();
+        while (compress_cache.bytes > compress_cache_limit && !compress_cache.lru.empty()) {
+            auto oldest = compress_cache.entries.find(compress_cache.lru.front());
+            compress_cache.bytes -= oldest->second.first.size() + oldest->first.size();
+            compress_cache.entries.erase(oldest);
+            compress_cache.lru.pop_front();
+        }
+    }
+    memcpy(out, packed.data(), packed.size());
+    return packed.size();
+}
+
+// Offer compression (if enabled) and, with offer_pex, peer exchange on a fresh
+// peer connection ("HELLO compress=lz pex"); pex is set if the peer takes PEX
+// too. Returns 1 if the peer agreed to compression, 0 if it answered without
+// it, and -1 if it didn't answer (a client from before the handshake ignores
+// HELLO; the connection can't be trusted after).
+#define HELLO_TIMEOUT_MS 2000
+#define PEER_REPLY_TIMEOUT_MS 10000   // For one-off requests to a peer (hashes, manifest, PEX)
+
+int negotiate_hello(SOCKET sock, bool offer_pex, bool& pex) {
+    pex = false;
+    string hello = "HELLO";
+    if (compression_enabled) hello += " compress=lz";
+    if (offer_pex) hello += " pex";
+    if (!send_all(sock, hello.c_str(), hello.size())) return -1;
+    
+    set_recv_timeout(sock, HELLO_TIMEOUT_MS);
+    char reply[256];
+    int r = recv(sock, reply, sizeof(reply) - 1, 0);
+    set_recv_timeout(sock, 0);
+    if (r <= 0) return -1;
+    
+    reply[r] = '\0';
+    vector<string> args = split_string(reply, ' ');
+    if (args.empty() || args[0] != "HELLO") return -1;
+    int agreed = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "compress=lz" && compression_enabled) agreed = 1;
+        if (args[i] == "pex" && offer_pex) pex = true;
+    }
+    return agreed;
+}
+
+// ==================== PIECE BUFFERS ====================
+
+// Piece data lives in buffers from one shared pool instead of per-piece
+// allocations: a download receives, decompresses, verifies and writes each
+// piece in pooled buffers and hands them on (to the stream writer) by moving
+// them, and a seeder reads pieces into them. Buffers are aligned and sized
+// in whole blocks, as O_DIRECT wants. Each thread keeps a few free buffers of
+// its own, so getting and returning one normally takes no lock; the rest go
+// back to a shared free list, which keeps up to PIECE_POOL_MAX_FREE.
+
+#define PIECE_BUFFER_ALIGN 4096
+#define PIECE_POOL_THREAD_CACHE 4
+#define PIECE_POOL_MAX_FREE 256
+
+const size_t PIECE_BUFFER_SIZE = (PIECE_SIZE + PIECE_BUFFER_ALIGN - 1) / PIECE_BUFFER_ALIGN * PIECE_BUFFER_ALIGN;
+
+struct PiecePool {
+    mutex m;
+    vector<char*> free_list;
+    atomic<uint64_t> allocated;   // Buffers ever allocated
+    
+    PiecePool() : allocated(0) {
+        free_list.reserve(PIECE_POOL_MAX_FREE);
+    }
+};
+
+PiecePool piece_pool;
+
+char* piece_pool_get_shared() {
+    {
+        lock_guard<mutex> lock(piece_pool.m);
+        if (!piece_pool.free_list.empty()) {
+            char* buffer = piece_pool.free_list.back();
+            piece_pool.free_list.pop_back();
+            return buffer;
+        }
+    }
+    piece_pool.allocated++;
+#ifdef _WIN32
+    char* buffer = (char*)_aligned_malloc(PIECE_BUFFER_SIZE, PIECE_BUFFER_ALIGN);
+#else
+    void* p = NULL;
+    char* buffer = posix_memalign(&p, PIECE_BUFFER_ALIGN, PIECE_BUFFER_SIZE) == 0 ? (char*)p : NULL;
+#endif
+    if (!buffer) throw bad_alloc();
+    return buffer;
+}
+
+void piece_pool_put_shared(char* buffer) {
+    {
+        lock_guard<mutex> lock(piece_pool.m);
+        if (piece_pool.free_list.size() < PIECE_POOL_MAX_FREE) {
+            piece_pool.free_list.push_back(buffer);
+            return;
+        }
+    }
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+// A thread's own free buffers, handed back to the pool when it exits
+struct PieceCache {
+    char* buffers[PIECE_POOL_THREAD_CACHE];
+    int count;
+    
+    PieceCache() : count(0) {}
+    
+    ~PieceCache() {
+        while (count > 0) piece_pool_put_shared(buffers[--count]);
+    }
+};
+
+thread_local PieceCache piece_cache;
+
+// Owns one pooled buffer of PIECE_BUFFER_SIZE bytes (or none); moving it
+// hands the buffer on, and it goes back to the pool when its owner is done
+class PieceBuffer {
+public:
+    PieceBuffer() : data_(NULL) {}
+    PieceBuffer(PieceBuffer&& other) : data_(other.data_) { other.data_ = NULL; }
+    
+    PieceBuffer& operator=(PieceBuffer&& other) {
+        if (this != &other) {
+            reset();
+            data_ = other.data_;
+            other.data_ = NULL;
+        }
+        return *this;
+    }
+    
+    ~PieceBuffer() {
+        reset();
+    }
+    
+    // A buffer from the pool; its contents are whatever its last user left
+    static PieceBuffer get() {
+        PieceBuffer buffer;
+        buffer.data_ = piece_cache.count > 0 ? piece_cache.buffers[--piece_cache.count] : piece_pool_get_shared();
+        return buffer;
+    }
+    
+    char* data() const { return data_; }
+    explicit operator bool() const { return data_ != NULL; }
+    
+    void reset() {
+        if (!data_) return;
+        if (piece_cache.count < PIECE_POOL_THREAD_CACHE) piece_cache.buffers[piece_cache.count++] = data_;
+        else piece_pool_put_shared(data_);
+        data_ = NULL;
+    }
+    
+private:
+    char* data_;
+    
+    PieceBuffer(const PieceBuffer&) = delete;
+    PieceBuffer& operator=(const PieceBuffer&) = delete;
+};
+
+// ==================== PIECE FILES ====================
+
+// A bundle shares a directory as one object: its files, in manifest order,
+// concatenated into a single byte range that is split into pieces like any
+// file, so pieces span file boundaries and a small file doesn't cost a piece
+// of its own. The manifest has one "<size> <path>" line per file, the path
+// relative to the bundle's directory with '/' separators; offsets follow from
+// the order. Its SHA-256 is registered with the tracker next to the root hash.
+
+struct BundleEntry {
+    string path;
+    long offset;    // In the bundle
+    long size;
+};
+
+typedef shared_ptr<const vector<BundleEntry>> Manifest;
+
+string manifest_text(const vector<BundleEntry>& entries) {
+    string text;
+    for (const BundleEntry& entry : entries) text += to_string(entry.size) + " " + entry.path + "\n";
+    return text;
+}
+
+// A manifest path must stay inside the bundle's directory
+bool safe_relative_path(const string& path) {
+    if (path.empty() || path[0] == '/' || path.find_first_of("\\:") != string::npos) return false;
+    for (const string& part : split_string(path, '/')) {
+        if (part.empty() || part == "." || part == "..") return false;
+    }
+    return path.back() != '/' && path.find("//") == string::npos;
+}
+
+bool parse_manifest(const string& text, vector<BundleEntry>& entries) {
+    entries.clear();
+    long offset = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == string::npos) return false;
+        string line = text.substr(start, end - start);
+        start = end + 1;
+        
+        size_t space = line.find(' ');
+        if (space == string::npos) return false;
+        char* num_end;
+        long size = strtol(line.c_str(), &num_end, 10);
+        if (num_end != line.c_str() + space || size < 0) return false;
+        
+        BundleEntry entry;
+        entry.path = line.substr(space + 1);
+        entry.offset = offset;
+        entry.size = size;
+        if (!safe_relative_path(entry.path)) return false;
+        entries.push_back(entry);
+        offset += size;
+    }
+    return true;
+}
+
+// Bundle directories we share or download into -> their files; any other
+// path is a plain file
+mutex bundle_mutex;
+map<string, Manifest> bundle_manifests;
+
+void register_bundle(const string& dir, const Manifest& manifest) {
+    lock_guard<mutex> lock(bundle_mutex);
+    bundle_manifests[dir] = manifest;
+}
+
+Manifest find_bundle(const string& path) {
+    lock_guard<mutex> lock(bundle_mutex);
+    auto it = bundle_manifests.find(path);
+    return it == bundle_manifests.end() ? Manifest() : it->second;
+}
+
+string parent_dir(const string& path) {
+    size_t pos = path.find_last_of("/\\");
+    return pos == string::npos ? "" : path.substr(0, pos);
+}
+
+// Create a directory and any missing parents
+bool make_dirs(const string& dir) {
+    if (dir.empty()) return true;
+    struct stat stat_buf;
+    if (stat(dir.c_str(), &stat_buf) == 0) return (stat_buf.st_mode & S_IFDIR) != 0;
+    if (!make_dirs(parent_dir(dir))) return false;
+#ifdef _WIN32
+    return _mkdir(dir.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Regular files under dir, recursively, as paths relative to it
+bool list_directory(const string& dir, const string& prefix, vector<BundleEntry>& out) {
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) return false;
+    do {
+        string name = data.cFileName;
+        if (name == "." || name == "..") continue;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            list_directory(dir + "\\" + name, prefix + name + "/", out);
+        } else {
+            out.push_back(BundleEntry{prefix + name, 0,
+                                      (long)(((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow)});
+        }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+    return true;
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    while (struct dirent* item = readdir(d)) {
+        string name = item->d_name;
+        if (name == "." || name == "..") continue;
+        struct stat stat_buf;
+        if (stat((dir + "/" + name).c_str(), &stat_buf) != 0) continue;
+        if (S_ISDIR(stat_buf.st_mode)) {
+            list_directory(dir + "/" + name, prefix + name + "/", out);
+        } else if (S_ISREG(stat_buf.st_mode)) {
+            out.push_back(BundleEntry{prefix + name, 0, (long)stat_buf.st_size});
+        }
+    }
+    closedir(d);
+    return true;
+#endif
+}
+
+// Last modification of a file, or of any file of a bundle; -1 if one is missing
+long long content_mtime(const string& path) {
+    Manifest manifest = find_bundle(path);
+    if (!manifest) return get_file_mtime(path);
+    long long latest = -1;
+    for (const BundleEntry& entry : *manifest) {
+        long long mtime = get_file_mtime(path + "/" + entry.path);
+        if (mtime < 0) return -1;
+        latest = max(latest, mtime);
+    }
+    return latest;
+}
+
+// Whether a file, or every file of a bundle, still has the size it had
+bool content_size_matches(const string& path, long size) {
+    Manifest manifest = find_bundle(path);
+    if (!manifest) return get_file_size(path) == size;
+    for (const BundleEntry& entry : *manifest) {
+        if (get_file_size(path + "/" + entry.path) != entry.size) return false;
+    }
+    return true;
+}
+
+// Byte ranges of a shared file or bundle, read or written in place. A bundle
+// keeps one member file open at a time, which suits piece-sized accesses in
+// manifest order. Accesses are whole pieces, so handles are unbuffered: each
+// is one system call on the caller's buffer, and a handle kept open sees
+// what other handles wrote.
+class PieceFile {
+public:
+    PieceFile(const string& path, bool writable)
+        : path_(path), manifest_(find_bundle(path)), writable_(writable), fp_(NULL), open_entry_(-1) {
+        if (!manifest_) fp_ = open_data(path);
+    }
+    
+    ~PieceFile() {
+        if (fp_) fclose(fp_);
+    }
+    
+    bool is_open() const {
+        return manifest_ || fp_;
+    }
+    
+    // Bytes read; short only at the end of the data
+    size_t read(long offset, char* buf, size_t len) {
+        return transfer(offset, buf, len, false);
+    }
+    
+    bool write(long offset, const char* buf, size_t len) {
+        return transfer(offset, (char*)buf, len, true) == len;
+    }
+    
+    void flush() {
+        if (fp_) fflush(fp_);
+    }
+    
+private:
+    string path_;
+    Manifest manifest_;
+    bool writable_;
+    FILE* fp_;
+    int open_entry_;
+    
+    size_t transfer(long offset, char* buf, size_t len, bool writing) {
+        if (!manifest_) {
+            if (!fp_ || fseek(fp_, offset, SEEK_SET) != 0) return 0;
+            return writing ? fwrite(buf, 1, len, fp_) : fread(buf, 1, len, fp_);
+        }
+        
+        // The last file starting at or before offset, then onwards
+        const vector<BundleEntry>& entries = *manifest_;
+        size_t i = upper_bound(entries.begin(), entries.end(), offset,
+                               [](long off, const BundleEntry& e) { return off < e.offset; }) - entries.begin();
+        if (i > 0) i--;
+        
+        size_t done = 0;
+        for (; done < len && i < entries.size(); i++) {
+            const BundleEntry& entry = entries[i];
+            if (offset >= entry.offset + entry.size) continue;
+            long within = offset - entry.offset;
+            size_t n = (size_t)min((long)(len - done), entry.size - within);
+            
+            FILE* fp = open_member((int)i);
+            if (!fp || fseek(fp, within, SEEK_SET) != 0) break;
+            size_t moved = writing ? fwrite(buf + done, 1, n, fp) : fread(buf + done, 1, n, fp);
+            done += moved;
+            offset += (long)moved;
+            if (moved < n) break;
+        }
+        return done;
+    }
+    
+    FILE* open_member(int i) {
+        if (open_entry_ == i) return fp_;
+        if (fp_) fclose(fp_);
+        fp_ = open_data(path_ + "/" + (*manifest_)[i].path);
+        open_entry_ = fp_ ? i : -1;
+        return fp_;
+    }
+    
+    FILE* open_data(const string& path) {
+        FILE* fp = fopen(path.c_str(), writable_ ? "r+b" : "rb");
+        if (fp) setvbuf(fp, NULL, _IONBF, 0);
+        return fp;
+    }
+};
+
+// Create (or reuse) every file of a download at its full size before any
+// piece is written into it
+bool create_piece_file(const string& path, long size, const Manifest& manifest, bool reuse) {
+    if (manifest) {
+        for (const BundleEntry& entry : *manifest) {
+            if (!create_piece_file(path + "/" + entry.path, entry.size, Manifest(), false)) return false;
+        }
+        return true;
+    }
+    
+    if (!make_dirs(parent_dir(path))) return false;
+    FILE* fp = reuse ? fopen(path.c_str(), "r+b") : NULL;
+    if (!fp) fp = fopen(path.c_str(), "wb");
+    if (!fp) return false;
+    if (size > 0) {
+        fseek(fp, size - 1, SEEK_SET);
+        fputc('\0', fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+// Move a finished download over the copy it replaces; a bundle file by file,
+// leaving any of the old version's files that the new one doesn't have
+bool replace_piece_file(const string& from, const string& to, const Manifest& manifest) {
+    if (manifest) {
+        for (const BundleEntry& entry : *manifest) {
+            string target = to + "/" + entry.path;
+            if (!make_dirs(parent_dir(target)) ||
+                !replace_piece_file(from + "/" + entry.path, target, Manifest())) return false;
+        }
+        // Then the emptied directories, deepest first
+        vector<string> dirs;
+        for (const BundleEntry& entry : *manifest) {
+            for (string dir = parent_dir(entry.path); !dir.empty(); dir = parent_dir(dir)) dirs.push_back(dir);
+        }
+        sort(dirs.begin(), dirs.end(), [](const string& a, const string& b) {
+            return a.size() != b.size() ? a.size() > b.size() : a < b;
+        });
+        dirs.erase(unique(dirs.begin(), dirs.end()), dirs.end());
+        dirs.push_back("");
+        for (const string& dir : dirs) {
+            string path = dir.empty() ? from : from + "/" + dir;
+#ifdef _WIN32
+            _rmdir(path.c_str());
+#else
+            rmdir(path.c_str());
+#endif
+        }
+        return true;
+    }
+    
+#ifdef _WIN32
+    remove(to.c_str());   // rename() doesn't replace files on Windows
+#endif
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+// ==================== CONTENT INDEX ====================
+
+// Every piece we hold is known by its SHA-256 digest, whichever group and file
+// it came from, so a download can copy pieces we already have on disk instead
+// of fetching them. A file's root hash (SHA-256 over its piece digests, in
+// hex) is registered with the tracker at upload; a downloader gets the piece
+// digests from a peer (GET_HASHES) and checks them against the root before
+// trusting them. Pieces fetched from the network are verified against them.
+
+#define SHA256_SIZE 32
+
+struct Sha256 {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char block[64];
+    size_t block_len = 0;
+    uint64_t total = 0;
+    
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    
+    void compress(const unsigned char* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) | ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    
+    void update(const char* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        total += n;
+        while (n > 0) {
+            if (block_len == 0 && n >= 64) {
+                compress(p);
+                p += 64;
+                n -= 64;
+                continue;
+            }
+            size_t take = min(n, 64 - block_len);
+            memcpy(block + block_len, p, take);
+            block_len += take;
+            p += take;
+            n -= take;
+            if (block_len == 64) {
+                compress(block);
+                block_len = 0;
+            }
+        }
+    }
+    
+    // The 32-byte digest, into digest
+    void finish(char* digest) {
+        uint64_t bits = total * 8;
+        unsigned char pad[72] = { 0x80 };
+        size_t pad_len = (block_len < 56 ? 56 : 120) - block_len;
+        for (int i = 0; i < 8; i++) pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+        update((const char*)pad, pad_len + 8);
+        
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++) digest[4 * i + j] = (char)(h[i] >> (24 - 8 * j));
+        }
+    }
+    
+    string finish() {
+        string digest(SHA256_SIZE, '\0');
+        finish(&digest[0]);
+        return digest;
+    }
+};
+
+string sha256(const char* data, size_t n) {
+    Sha256 ctx;
+    ctx.update(data, n);
+    return ctx.finish();
+}
+
+// Whether data hashes to digest, without building a string for it
+bool sha256_matches(const char* data, size_t n, const string& digest) {
+    char actual[SHA256_SIZE];
+    Sha256 ctx;
+    ctx.update(data, n);
+    ctx.finish(actual);
+    return digest.size() == SHA256_SIZE && memcmp(actual, digest.data(), SHA256_SIZE) == 0;
+}
+
+string to_hex(const string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned char c : bytes) {
+        hex += digits[c >> 4];
+        hex += digits[c & 15];
+    }
+    return hex;
+}
+
+// Root hash of a file from its piece digests
+string root_hash(const vector<string>& hashes) {
+    Sha256 ctx;
+    for (const string& digest : hashes) ctx.update(digest.data(), digest.size());
+    return to_hex(ctx.finish());
+}
+
+long piece_length(long file_size, int piece) {
+    return min((long)PIECE_SIZE, file_size - (long)piece * PIECE_SIZE);
+}
+
+// rsync's weak checksum: two 16-bit sums that can be rolled one byte along a
+// file in constant time, so a piece can be looked for at every offset of an
+// older version of the file; a match is then confirmed by SHA-256
+struct RollingSum {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t len = 0;
+    
+    void reset(const char* data, size_t n) {
+        a = b = 0;
+        len = n;
+        for (size_t i = 0; i < n; i++) {
+            a += (unsigned char)data[i];
+            b += (uint32_t)(n - i) * (unsigned char)data[i];
+        }
+    }
+    
+    // Slide the window one byte: out leaves at the front, in enters at the back
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - (uint32_t)len * out;
+    }
+    
+    uint32_t value() const { return (a & 0xffff) | (b << 16); }
+};
+
+uint32_t weak_checksum(const char* data, size_t n) {
+    RollingSum sum;
+    sum.reset(data, n);
+    return sum.value();
+}
+
+bool hash_file_pieces(const string& filepath, long file_size, vector<string>& hashes, vector<uint32_t>& weak_sums) {
+    PieceFile file(filepath, false);
+    if (!file.is_open()) return false;
+    
+    int num_pieces = calculate_num_pieces(file_size);
+    hashes.assign(num_pieces, string());
+    weak_sums.assign(num_pieces, 0);
+    vector<char> buffer(PIECE_SIZE);
+    bool ok = true;
+    for (int i = 0; i < num_pieces && ok; i++) {
+        size_t len = (size_t)piece_length(file_size, i);
+        ok = file.read((long)i * PIECE_SIZE, buffer.data(), len) == len;
+        hashes[i] = sha256(buffer.data(), len);
+        weak_sums[i] = weak_checksum(buffer.data(), len);
+    }
+    return ok;
+}
+
+// digest -> where a piece with it can be read. One location per digest; it
+// is checked on use, as the file may have changed or gone since.
+struct PieceLocation {
+    int file;       // Index into indexed_files
+    int piece;
+};
+
+mutex content_index_mutex;
+map<string, PieceLocation> content_index;
+vector<string> indexed_files;
+map<string, int> indexed_file_ids;
+
+void index_piece(const string& filepath, int piece, const string& digest) {
+    lock_guard<mutex> lock(content_index_mutex);
+    auto id = indexed_file_ids.find(filepath);
+    if (id == indexed_file_ids.end()) {
+        id = indexed_file_ids.insert({filepath, (int)indexed_files.size()}).first;
+        indexed_files.push_back(filepath);
+    }
+    content_index[digest] = PieceLocation{id->second, piece};
+}
+
+void index_file_pieces(const string& filepath, const vector<string>& hashes) {
+    for (size_t i = 0; i < hashes.size(); i++) index_piece(filepath, (int)i, hashes[i]);
+}
+
+// Copy a piece we already have somewhere on disk into place; false if we
+// don't have it (any more). buffer must hold PIECE_SIZE bytes.
+bool copy_local_piece(const string& digest, size_t len, PieceFile& dest, long offset, char* buffer) {
+    string source;
+    long source_offset;
+    {
+        lock_guard<mutex> lock(content_index_mutex);
+        auto it = content_index.find(digest);
+        if (it == content_index.end()) return false;
+        source = indexed_files[it->second.file];
+        source_offset = (long)it->second.piece * PIECE_SIZE;
+    }
+    
+    PieceFile file(source, false);
+    if (file.read(source_offset, buffer, len) != len || sha256(buffer, len) != digest) return false;
+    return dest.write(offset, buffer, len);
+}
+
+// Find pieces of a new version of a file in an older one, wherever an edit
+// moved them: roll the weak checksum over every offset of the old file, as
+// rsync does, and copy the windows whose SHA-256 matches a wanted piece. Only
+// pieces of length len are looked for; wanted maps weak checksum -> piece.
+int copy_shifted_pieces(const string& basis, size_t len, multimap<uint32_t, int>& wanted,
+                        const vector<string>& hashes, PieceFile& dest, vector<bool>& local) {
+    PieceFile in(basis, false);
+    if (!in.is_open() || len == 0) return 0;
+    
+    // A 64K-entry filter on the checksum keeps the multimap off the per-byte path
+    vector<bool> tags(1 << 16, false);
+    for (const auto& entry : wanted) tags[(entry.first ^ (entry.first >> 16)) & 0xffff] = true;
+    
+    const size_t chunk = 1 << 20;
+    vector<char> buf;
+    long buf_start = 0;   // File offset of buf[0]
+    long pos = 0;         // File offset of the window
+    bool eof = false;
+    
+    // Make [pos, end) readable in buf, dropping what lies before pos
+    auto ensure = [&](long end) {
+        while (buf_start + (long)buf.size() < end && !eof) {
+            if (pos - buf_start >= (long)chunk) {
+                buf.erase(buf.begin(), buf.begin() + (pos - buf_start));
+                buf_start = pos;
+            }
+            size_t old_size = buf.size();
+            buf.resize(old_size + chunk);
+            size_t n = in.read(buf_start + (long)old_size, buf.data() + old_size, chunk);
+            buf.resize(old_size + n);
+            if (n < chunk) eof = true;
+        }
+        return buf_start + (long)buf.size() >= end;
+    };
+    
+    RollingSum sum;
+    bool fresh = true;
+    int copied = 0;
+    while (!wanted.empty() && ensure(pos + (long)len)) {
+        const char* window = buf.data() + (pos - buf_start);
+        if (fresh) {
+            sum.reset(window, len);
+            fresh = false;
+        }
+        
+        uint32_t value = sum.value();
+        bool matched = false;
+        if (tags[(value ^ (value >> 16)) & 0xffff] && wanted.count(value)) {
+            string digest = sha256(window, len);
+            auto range = wanted.equal_range(value);
+            for (auto it = range.first; it != range.second;) {
+                int piece = it->second;
+                if (hashes[piece] != digest) {
+                    ++it;
+                    continue;
+                }
+                if (dest.write((long)piece * PIECE_SIZE, window, len)) {
+                    local[piece] = true;
+                    copied++;
+                    matched = true;
+                }
+                it = wanted.erase(it);
+            }
+        }
+        
+        if (matched) {
+            pos += (long)len;
+            fresh = true;
+            continue;
+        }
+        if (!ensure(pos + (long)len + 1)) break;
+        window = buf.data() + (pos - buf_start);
+        sum.roll((unsigned char)window[0], (unsigned char)window[len]);
+        pos++;
+    }
+    
+    return copied;
+}
+
+// Share the blocks of a whole local copy of the file, where the filesystem
+// can (Btrfs, XFS); false means copy it piece by piece instead
+bool reflink_file(const string& source, const string& dest) {
+#ifdef FICLONE
+    int in = open(source.c_str(), O_RDONLY);
+    if (in < 0) return false;
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0) close(out);
+    close(in);
+    return ok;
+#else
+    (void)source;
+    (void)dest;
+    return false;
+#endif
+}
+
+// Everything about a complete local file we are about to share, with its
+// pieces hashed and indexed; a file already shared under another name or
+// group, and not modified since, isn't read again. False if it can't be read.
+bool describe_local_file(const string& filepath, LocalFileInfo& info) {
+    info.filepath = filepath;
+    info.file_size = get_file_size(filepath);
+    info.mtime = get_file_mtime(filepath);
+    if (info.file_size < 0) return false;
+    info.num_pieces = calculate_num_pieces(info.file_size);
+    info.bit_vector.assign(info.num_pieces, true);
+    info.piece_hashes.clear();
+    info.weak_sums.clear();
+    
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        auto path = shared_paths.find(filepath);
+        auto group = path == shared_paths.end() ? peer_file_map.end() : peer_file_map.find(path->second.first);
+        if (group != peer_file_map.end() && group->second.count(path->second.second)) {
+            const LocalFileInfo& known = group->second[path->second.second];
+            if (known.filepath == filepath && known.file_size == info.file_size && known.mtime == info.mtime &&
+                (int)known.piece_hashes.size() == info.num_pieces) {
+                info.piece_hashes = known.piece_hashes;
+                info.weak_sums = known.weak_sums;
+                info.root = known.root;
+                return true;
+            }
+        }
+    }
+    
+    if (!hash_file_pieces(filepath, info.file_size, info.piece_hashes, info.weak_sums)) return false;
+    info.root = root_hash(info.piece_hashes);
+    index_file_pieces(filepath, info.piece_hashes);
+    return true;
+}
+
+// The same for a directory shared as a bundle: its files in path order make
+// up the manifest, whose hash is returned in manifest_hash. False if the
+// directory can't be read, has no files, or has a name a manifest can't hold.
+bool describe_local_bundle(const string& dir, LocalFileInfo& info, string& manifest_hash) {
+    shared_ptr<vector<BundleEntry>> entries = make_shared<vector<BundleEntry>>();
+    if (!list_directory(dir, "", *entries) || entries->empty()) return false;
+    sort(entries->begin(), entries->end(), [](const BundleEntry& a, const BundleEntry& b) {
+        return a.path < b.path;
+    });
+    
+    long offset = 0;
+    for (BundleEntry& entry : *entries) {
+        if (!safe_relative_path(entry.path) || entry.path.find('\n') != string::npos) {
+            LOG_ERROR("[UPLOAD] Cannot put " << entry.path << " in a bundle manifest");
+            return false;
+        }
+        entry.offset = offset;
+        offset += entry.size;
+    }
+    
+    string text = manifest_text(*entries);
+    manifest_hash = to_hex(sha256(text.data(), text.size()));
+    register_bundle(dir, entries);
+    
+    info.filepath = dir;
+    info.file_size = offset;
+    info.mtime = content_mtime(dir);
+    info.num_pieces = calculate_num_pieces(offset);
+    info.bit_vector.assign(info.num_pieces, true);
+    if (!hash_file_pieces(dir, info.file_size, info.piece_hashes, info.weak_sums)) return false;
+    info.root = root_hash(info.piece_hashes);
+    index_file_pieces(dir, info.piece_hashes);
+    return true;
+}
+
+// Piece digests of a file from a peer: [u32 count][count x (32-byte SHA-256,
+// u32 weak checksum)], numbers in network order; count 0 if it doesn't have
+// them. Empty unless the digests match root (the weak sums are only hints).
+#define HASH_ENTRY_SIZE (SHA256_SIZE + 4)
+
+vector<string> get_peer_piece_hashes(const string& ip, int port, const string& group_id, const string& filename,
+                                     int num_pieces, const string& root, vector<uint32_t>& weak_sums) {
+    vector<string> hashes;
+    weak_sums.clear();
+    SOCKET sock = connect_to_server(ip, port);
+    if (sock == INVALID_SOCKET) return hashes;
+    set_recv_timeout(sock, PEER_REPLY_TIMEOUT_MS);   // An older peer doesn't answer
+    
+    string request = "GET_HASHES " + group_id + " " + filename;
+    uint32_t count = 0;
+    if (send_all(sock, request.c_str(), request.size()) && recv_exact(sock, (char*)&count, 4) &&
+        ntohl(count) == (uint32_t)num_pieces) {
+        string all((size_t)num_pieces * HASH_ENTRY_SIZE, '\0');
+        if (recv_exact(sock, &all[0], all.size())) {
+            for (int i = 0; i < num_pieces; i++) {
+                const char* entry = all.data() + (size_t)i * HASH_ENTRY_SIZE;
+                uint32_t weak;
+                memcpy(&weak, entry + SHA256_SIZE, 4);
+                hashes.push_back(string(entry, SHA256_SIZE));
+                weak_sums.push_back(ntohl(weak));
+            }
+        }
+    }
+    CLOSE_SOCKET(sock);
+    
+    if (!hashes.empty() && root_hash(hashes) != root) {
+        LOG_WARN("[DOWNLOAD] Piece hashes from " << ip << ":" << port << " don't match the root hash");
+        hashes.clear();
+        weak_sums.clear();
+    }
+    return hashes;
+}
+
+#define MAX_MANIFEST_SIZE (64 * 1024 * 1024)
+
+// A bundle's manifest, checked against the hash the tracker has for it
+Manifest get_peer_manifest(const string& ip, int port, const string& group_id, const string& filename,
+                           const string& manifest_hash, long bundle_size) {
+    SOCKET sock = connect_to_server(ip, port);
+    if (sock == INVALID_SOCKET) return Manifest();
+    set_recv_timeout(sock, PEER_REPLY_TIMEOUT_MS);   // An older peer doesn't answer
+
+    string request = "GET_MANIFEST " + group_id + " " + filename;
+    uint32_t length = 0;
+    string text;
+    if (send_all(sock, request.c_str(), request.size()) && recv_exact(sock, (char*)&length, 4) &&
+        ntohl(length) <= MAX_MANIFEST_SIZE) {
+        text.assign(ntohl(length), '\0');
+        if (!recv_exact(sock, &text[0], text.size())) text.clear();
+    }
+    CLOSE_SOCKET(sock);
+
+    shared_ptr<vector<BundleEntry>> entries = make_shared<vector<BundleEntry>>();
+    if (text.empty() || to_hex(sha256(text.data(), text.size())) != manifest_hash ||
+        !parse_manifest(text, *entries) || entries->empty() ||
+        entries->back().offset + entries->back().size != bundle_size) {
+        LOG_WARN("[DOWNLOAD] Manifest from " << ip << ":" << port << " doesn't match the tracker's");
+        return Manifest();
+    }
+    return entries;
+}
+
+// ==================== SHARE INDEX ====================
+
+// What we share survives a restart: every entry of peer_file_map, with its
+// piece digests, bitfield and (for a bundle) manifest, is saved a few seconds
+// after it changes and on exit. At startup an entry whose files still have the
+// size and mtime they had is trusted without reading them; the others are
+// hashed again in the background and keep the pieces that still match. The
+// restored files are re-announced to the tracker in bulk.
+//
+// File: [magic "P2PSHRS\0"][u32 version][u32 count][count x entry][u32 checksum]
+// entry: group, filename, filepath, u64 size, u64 mtime, root, bitfield (8
+//        pieces a byte), digests (32 bytes each), weak sums, manifest text
+// Integers are little-endian; strings are [u32 length][bytes].
+
+#define SHARE_INDEX_MAGIC "P2PSHRS"
+#define SHARE_INDEX_VERSION 1
+#define SHARE_INDEX_SAVE_MS 5000   // Longest a change waits to be saved
+
+string share_index_path;   // "" = not persisted (--no-persist)
+
+uint32_t checksum32(const char* data, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void put_u32(string& out, uint32_t v) {
+    char b[4];
+    for (int i = 0; i < 4; i++) b[i] = (char)((v >> (8 * i)) & 0xff);
+    out.append(b, 4);
+}
+
+void put_u64(string& out, uint64_t v) {
+    put_u32(out, (uint32_t)(v & 0xffffffffu));
+    put_u32(out, (uint32_t)(v >> 32));
+}
+
+void put_str(string& out, const string& s) {
+    put_u32(out, (uint32_t)s.size());
+    out += s;
+}
+
+// Bounds-checked reader over an in-memory buffer; ok turns false on overrun
+struct ByteReader {
+    const char* p;
+    const char* end;
+    bool ok;
+    
+    ByteReader(const char* data, size_t len) : p(data), end(data + len), ok(true) {}
+    
+    size_t remaining() const { return (size_t)(end - p); }
+    
+    uint32_t u32() {
+        if (remaining() < 4) { ok = false; p = end; return 0; }
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++) v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+        p += 4;
+        return v;
+    }
+    
+    uint64_t u64() {
+        uint64_t lo = u32();
+        uint64_t hi = u32();
+        return lo | (hi << 32);
+    }
+    
+    string str() {
+        uint32_t len = u32();
+        if (remaining() < len) { ok = false; p = end; return ""; }
+        string s(p, len);
+        p += len;
+        return s;
+    }
+};
+
+struct SavedShare {
+    string group_id;
+    string filename;
+    LocalFileInfo info;
+    Manifest manifest;
+};
+
+// Changed files not re-checked yet; saved as they were, to be re-checked on
+// the next start if we stop first
+mutex recheck_mutex;
+list<SavedShare> shares_to_recheck;
+
+void put_share(string& out, const string& group_id, const string& filename, const LocalFileInfo& info,
+               long long mtime) {
+    put_str(out, group_id);
+    put_str(out, filename);
+    put_str(out, info.filepath);
+    put_u64(out, (uint64_t)info.file_size);
+    put_u64(out, (uint64_t)mtime);
+    put_str(out, info.root);
+    string bits((info.bit_vector.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < info.bit_vector.size(); i++) {
+        if (info.bit_vector[i]) bits[i / 8] |= (char)(1 << (i % 8));
+    }
+    put_str(out, bits);
+    string digests;
+    digests.reserve(info.piece_hashes.size() * SHA256_SIZE);
+    for (const string& digest : info.piece_hashes) digests += digest;
+    put_str(out, digests);
+    put_u32(out, (uint32_t)info.weak_sums.size());
+    for (uint32_t weak : info.weak_sums) put_u32(out, weak);
+    Manifest manifest = find_bundle(info.filepath);
+    put_str(out, manifest ? manifest_text(*manifest) : string());
+}
+
+string serialize_shares() {
+    string out(SHARE_INDEX_MAGIC, 8);
+    put_u32(out, SHARE_INDEX_VERSION);
+    size_t count_pos = out.size();
+    uint32_t count = 0;
+    put_u32(out, 0);
+    
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        for (const auto& group : peer_file_map) {
+            for (const auto& file : group.second) {
+                const LocalFileInfo& info = file.second;
+                if ((int)info.bit_vector.size() != info.num_pieces) continue;
+                
+                // A file still downloading changes under us; its bitfield is
+                // as of now, so take its mtime now too
+                bool complete = find(info.bit_vector.begin(), info.bit_vector.end(), false) ==
+                                info.bit_vector.end();
+                put_share(out, group.first, file.first, info, complete ? info.mtime : content_mtime(info.filepath));
+                count++;
+            }
+        }
+    }
+    {
+        lock_guard<mutex> lock(recheck_mutex);
+        for (const SavedShare& share : shares_to_recheck) {
+            put_share(out, share.group_id, share.filename, share.info, -1);
+            count++;
+        }
+    }
+    for (int i = 0; i < 4; i++) out[count_pos + i] = (char)((count >> (8 * i)) & 0xff);
+    
+    put_u32(out, checksum32(out.data(), out.size()));
+    return out;
+}
+
+bool parse_shares(const string& data, vector<SavedShare>& shares) {
+    if (data.size() < 20 || memcmp(data.data(), SHARE_INDEX_MAGIC, 8) != 0) return false;
+    size_t body_len = data.size() - 4;
+    ByteReader tail(data.data() + body_len, 4);
+    if (tail.u32() != checksum32(data.data(), body_len)) return false;
+    
+    ByteReader in(data.data() + 8, body_len - 8);
+    if (in.u32() != SHARE_INDEX_VERSION) return false;
+    uint32_t count = in.u32();
+    for (uint32_t i = 0; i < count && in.ok; i++) {
+        SavedShare share;
+        LocalFileInfo& info = share.info;
+        share.group_id = in.str();
+        share.filename = in.str();
+        info.filepath = in.str();
+        info.file_size = (long)in.u64();
+        info.mtime = (long long)in.u64();
+        info.root = in.str();
+        info.num_pieces = calculate_num_pieces(info.file_size);
+        
+        string bits = in.str();
+        if (bits.size() != ((size_t)info.num_pieces + 7) / 8) return false;
+        info.bit_vector.resize(info.num_pieces);
+        for (int p = 0; p < info.num_pieces; p++) info.bit_vector[p] = (bits[p / 8] >> (p % 8)) & 1;
+        
+        string digests = in.str();
+        uint32_t weak_count = in.u32();
+        if (digests.size() % SHA256_SIZE != 0 || in.remaining() / 4 < weak_count) return false;
+        for (size_t off = 0; off < digests.size(); off += SHA256_SIZE) {
+            info.piece_hashes.push_back(digests.substr(off, SHA256_SIZE));
+        }
+        for (uint32_t w = 0; w < weak_count; w++) info.weak_sums.push_back(in.u32());
+        
+        string text = in.str();
+        if (!text.empty()) {
+            shared_ptr<vector<BundleEntry>> entries = make_shared<vector<BundleEntry>>();
+            if (!parse_manifest(text, *entries)) return false;
+            share.manifest = entries;
+        }
+        shares.push_back(share);
+    }
+    return in.ok;
+}
+
+void save_shares() {
+    if (share_index_path.empty()) return;
+    shares_changed = false;
+    string data = serialize_shares();
+    
+    string tmp_path = share_index_path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    bool ok = fp && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    if (fp) ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    if (ok) remove(share_index_path.c_str());
+#endif
+    if (!ok || rename(tmp_path.c_str(), share_index_path.c_str()) != 0) {
+        LOG_WARN("[SHARES] Cannot save the share index to " << share_index_path);
+        shares_changed = true;
+    }
+}
+
+// Saves the share index once it has changed, at most every SHARE_INDEX_SAVE_MS
+void share_index_thread_func() {
+    auto last = chrono::steady_clock::now();
+    while (running) {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        auto now = chrono::steady_clock::now();
+        if (!shares_changed || now - last < chrono::milliseconds(SHARE_INDEX_SAVE_MS)) continue;
+        last = now;
+        save_shares();
+    }
+}
+
+// Put a share back into peer_file_map, unless it was shared again meanwhile,
+// and index the pieces we hold
+void add_restored_share(const SavedShare& share) {
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        if (peer_file_map[share.group_id].count(share.filename)) return;
+        add_shared_file(share.group_id, share.filename, share.info);
+    }
+    const LocalFileInfo& info = share.info;
+    for (int i = 0; i < info.num_pieces && i < (int)info.piece_hashes.size(); i++) {
+        if (info.bit_vector[i]) index_piece(info.filepath, i, info.piece_hashes[i]);
+    }
+}
+
+// Hash changed files again (shares_to_recheck) and keep the pieces that still
+// match their digests
+void recheck_shares() {
+    auto started = chrono::steady_clock::now();
+    size_t checked = 0;
+    int kept = 0;
+    while (running) {
+        SavedShare share;
+        {
+            lock_guard<mutex> lock(recheck_mutex);
+            if (shares_to_recheck.empty()) break;
+            share = shares_to_recheck.front();
+        }
+        LocalFileInfo& info = share.info;
+        
+        long long mtime = content_mtime(info.filepath);
+        vector<string> hashes;
+        vector<uint32_t> weak_sums;
+        int held = 0;
+        if (hash_file_pieces(info.filepath, info.file_size, hashes, weak_sums)) {
+            for (int i = 0; i < info.num_pieces; i++) {
+                info.bit_vector[i] = hashes[i] == info.piece_hashes[i];
+                if (info.bit_vector[i]) held++;
+            }
+        }
+        
+        if (held == 0) {
+            LOG_WARN("[SHARES] " << info.filepath << " no longer has any piece of " << share.group_id << "/"
+                     << share.filename << "; not sharing it");
+        } else {
+            if (held < info.num_pieces) {
+                LOG_WARN("[SHARES] " << info.filepath << " changed: sharing the " << held << "/" << info.num_pieces
+                         << " pieces of " << share.group_id << "/" << share.filename
+                         << " it still has (upload_file shares the new content)");
+            }
+            info.mtime = mtime;
+            add_restored_share(share);
+            kept++;
+        }
+        {
+            lock_guard<mutex> lock(recheck_mutex);
+            shares_to_recheck.pop_front();
+        }
+        shares_changed = true;
+        checked++;
+    }
+    
+    if (checked == 0) return;
+    if (kept > 0 && logged_in_session) reannounce_seeded_files();
+    LOG_INFO("[SHARES] Re-checked " << checked << " changed files in "
+             << chrono::duration<double>(chrono::steady_clock::now() - started).count() << "s; kept " << kept);
+}
+
+// Load the share index and put back what is unchanged; the rest is queued
+// for recheck_shares
+void restore_shares() {
+    string data;
+    if (share_index_path.empty()) return;
+    {
+        ifstream in(share_index_path.c_str(), ios::binary);
+        if (!in) return;
+        data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    
+    auto started = chrono::steady_clock::now();
+    vector<SavedShare> shares;
+    if (!parse_shares(data, shares)) {
+        LOG_WARN("[SHARES] Ignoring damaged share index " << share_index_path);
+        return;
+    }
+    
+    list<SavedShare> changed;    
+    int unchanged = 0;
+    int dropped = 0;
+    for (const SavedShare& share : shares) {
+        const LocalFileInfo& info = share.info;
+        if (share.manifest) register_bundle(info.filepath, share.manifest);
+        
+        bool hashed = (int)info.piece_hashes.size() == info.num_pieces &&
+                      info.weak_sums.size() == info.piece_hashes.size();
+        if (!content_size_matches(info.filepath, info.file_size)) {
+            LOG_WARN("[SHARES] " << info.filepath << " is gone or resized; not sharing " << share.group_id << "/"
+                     << share.filename);
+            dropped++;
+        } else if (info.mtime >= 0 && content_mtime(info.filepath) == info.mtime) {
+            add_restored_share(share);
+            unchanged++;
+        } else if (hashed) {
+            changed.push_back(share);
+        } else {
+            LOG_WARN("[SHARES] " << info.filepath << " changed and has no piece hashes; not sharing "
+                     << share.group_id << "/" << share.filename);
+            dropped++;
+        }
+    }
+    
+    LOG_INFO("[SHARES] Restored " << unchanged << " files from " << share_index_path << " in "
+             << chrono::duration<double>(chrono::steady_clock::now() - started).count() << "s"
+             << (changed.empty() ? "" : "; " + to_string(changed.size()) + " changed, re-checking")
+             << (dropped > 0 ? "; " + to_string(dropped) + " dropped" : ""));
+    shares_changed = dropped > 0;   // Putting the rest back changed nothing
+    
+    lock_guard<mutex> lock(recheck_mutex);
+    shares_to_recheck.swap(changed);
+}
+
+// ==================== PIECE SELECTION ALGORITHM ====================
+
+struct PeerInfo {
+    string ip;
+    int port;
+    vector<bool> bit_vector;
+    vector<int> assigned_pieces;
+    double speed = 1.0;   // Expected throughput relative to the other peers
+};
+
+// "BITVECTOR: 1 0 1 ..." as sent in answer to GET_BITVECTOR
+string build_bitvector_response(const vector<bool>& bit_vector) {
+    string response = "BITVECTOR:";
+    for (bool bit : bit_vector) {
+        response += " " + to_string(bit ? 1 : 0);
+    }
+    return response;
+}
+
+vector<bool> parse_bitvector_response(const string& response) {
+    if (response.find("BITVECTOR:") == string::npos) {
+        return vector<bool>();
+    }
+    
+    vector<bool> bit_vec;
+    size_t pos = response.find("BITVECTOR:") + 10;
+    string bits = response.substr(pos);
+    
+    stringstream ss(bits);
+    int bit;
+    while (ss >> bit) {
+        bit_vec.push_back(bit == 1);
+    }
+    
+    return bit_vec;
+}
+
+// Get bit vector from a peer
+vector<bool> get_peer_bit_vector(const string& ip, int port, const string& group_id, const string& filename) {
+    SOCKET sock = connect_to_server(ip, port);
+    if (sock == INVALID_SOCKET) {
+        return vector<bool>();
+    }
+    
+    string request = "GET_BITVECTOR " + group_id + " " + filename;
+    send(sock, request.c_str(), (int)request.length(), 0);
+    
+    char buffer[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(sock, buffer, BUFFER_SIZE - 1, 0);
+    CLOSE_SOCKET(sock);
+    
+    return parse_bitvector_response(string(buffer));
+}
+
+// A tracker peer list:
+// "PEERS: ip1:port1 ip2:port2/<pieces> ... SIZE:xyz PIECES:n AVAIL:<c>x<n>,... [ROOT:<sha256>] [VERSION:<n>]
+//  [MANIFEST:<sha256>]"
+struct PeerListing {
+    vector<pair<string, int>> peers;
+    vector<string> pieces;        // Per peer, encoded ("*" = all); empty if the tracker didn't say
+    vector<int> piece_counts;     // Swarm-wide holders of each piece; empty if unknown
+    long file_size = 0;
+    int num_pieces = 0;
+    string root;                  // Root hash of the file's pieces; empty if the uploader gave none
+    int version = 1;              // Uploads of changed content so far
+    string manifest;              // SHA-256 of a bundle's manifest; empty for a plain file
+    bool trackerless = false;     // Peers came from the DHT, so don't ask the tracker for more
+};
+
+// Also takes a file_info reply ("FILE: ..."), which has no peers
+bool parse_peers_response(const string& response, PeerListing& listing) {
+    if (response.find("PEERS:") == string::npos && response.find("FILE:") != 0) {
+        return false;
+    }
+    
+    stringstream ss(response);
+    string token;
+    string avail;
+    
+    while (ss >> token) {
+        if (token.find("SIZE:") == 0) {
+            listing.file_size = stol(token.substr(5));
+        }
+        else if (token.find("PIECES:") == 0) {
+            listing.num_pieces = stoi(token.substr(7));
+        }
+        else if (token.find("AVAIL:") == 0) {
+            avail = token.substr(6);
+        }
+        else if (token.find("ROOT:") == 0) {
+            listing.root = token.substr(5);
+        }
+        else if (token.find("VERSION:") == 0) {
+            listing.version = atoi(token.c_str() + 8);
+        }
+        else if (token.find("MANIFEST:") == 0) {
+            listing.manifest = token.substr(9);
+        }
+        else if (token.find(':') != string::npos && token != "PEERS:" && token != "FILE:") {
+            size_t colon = token.find(':');
+            size_t slash = token.find('/', colon);
+            string ip = token.substr(0, colon);
+            int port = stoi(token.substr(colon + 1));
+            listing.peers.push_back({ip, port});
+            listing.pieces.push_back(slash == string::npos ? "*" : token.substr(slash + 1));
+        }
+    }
+    
+    // Older trackers don't report availability; peers must be asked directly
+    if (avail.empty()) {
+        listing.pieces.clear();
+        return true;
+    }
+    
+    for (const string& run : split_string(avail, ',')) {
+        size_t x = run.find('x');
+        if (x == string::npos) break;
+        int holders = atoi(run.c_str());
+        int length = atoi(run.c_str() + x + 1);
+        listing.piece_counts.insert(listing.piece_counts.end(), length, holders);
+    }
+    if ((int)listing.piece_counts.size() != listing.num_pieces) listing.piece_counts.clear();
+    
+    return true;
+}
+
+// Round-robin piece assignment
+void assign_pieces_round_robin(vector<PeerInfo>& peers, int num_pieces) {
+    if (peers.empty()) return;
+    
+    int num_peers = (int)peers.size();
+    
+    for (int piece = 0; piece < num_pieces; piece++) {
+        // Round-robin: try to assign to peer (piece % num_peers)
+        // If that peer doesn't have it, try next peer
+        for (int i = 0; i < num_peers; i++) {
+            int peer_idx = (piece + i) % num_peers;
+            
+            // Check if this peer has the piece (piece must be within bit_vector bounds)
+            if (piece < (int)peers[peer_idx].bit_vector.size() && 
+                peers[peer_idx].bit_vector[piece]) {
+                peers[peer_idx].assigned_pieces.push_back(piece);
+                break;
+            }
+        }
+    }
+}
+
+// Rarest-first assignment: pieces held by the fewest peers swarm-wide are
+// scheduled first, each to the sampled peer that would finish it soonest
+// given the work it already has and its speed
+void assign_pieces_rarest_first(vector<PeerInfo>& peers, int num_pieces, const vector<int>& piece_counts) {
+    if (peers.empty()) return;
+    
+    static thread_local mt19937 rng(random_device{}());
+    
+    // Shuffle first so equally rare pieces are requested in a different order
+    // by each downloader
+    vector<int> order(num_pieces);
+    for (int i = 0; i < num_pieces; i++) order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return piece_counts[a] < piece_counts[b];
+    });
+    
+    for (int piece : order) {
+        PeerInfo* best = NULL;
+        for (PeerInfo& peer : peers) {
+            if (piece >= (int)peer.bit_vector.size() || !peer.bit_vector[piece]) continue;
+            if (!best || (peer.assigned_pieces.size() + 1) / peer.speed <
+                         (best->assigned_pieces.size() + 1) / best->speed) best = &peer;
+        }
+        if (best) best->assigned_pieces.push_back(piece);
+    }
+}
+
+// ==================== PEER EXCHANGE ====================
+
+// Peers of a file tell each other which other peers they know for it, so a
+// downloader finds more sources without going back to the tracker:
+//
+//   PEX <group_id> <filename> <our ip:port>  ->  [u32 length]"PEX: +<ip:port> ... -<ip:port> ..."
+//
+// Lists are kept per group and file: an address is only ever handed out for
+// the file it was learned for, only by a client sharing that file in a group
+// it hasn't left. Addresses get in from the tracker's peer lists (which only
+// hold members), once we have fetched that file's bit vector from them, or
+// when they ask us for that file themselves (from the IP they give). Each
+// connection gets deltas: its first PEX brings what we
+// know, later ones only peers added (+) or dropped (-) since, at most
+// PEX_MAX_PEERS per reply and one reply per PEX_MIN_INTERVAL_MS.
+
+#define PEX_MAX_PEERS 50          // Changes per reply; the rest follow in later replies
+#define PEX_MAX_KNOWN 500         // Live addresses kept per file
+#define PEX_INTERVAL_MS 5000      // How often a download asks each of its peers
+#define PEX_MIN_INTERVAL_MS 1000  // How often we answer one connection
+#define PEX_PEER_TTL_SEC 600      // Forget addresses not heard of for this long
+#define PEX_BOOTSTRAP_PEERS 3     // Peers asked before a more_peers round trip
+#define PEX_MIN_SOURCES 8         // A download takes on peers it is told of while it has fewer
+
+bool pex_enabled = true;
+
+struct PexEntry {
+    uint64_t seq;       // Of its latest change
+    bool live;          // false: dropped, kept to pass the drop on
+    chrono::steady_clock::time_point seen;
+};
+
+struct PexSwarm {
+    map<string, PexEntry> entries;   // "ip:port" -> entry
+    map<uint64_t, string> changes;   // seq -> address; one per entry, in order of change
+    size_t live = 0;
+};
+
+map<string, PexSwarm> pex_swarms;    // "group_id/filename" -> swarm
+set<string> pex_left_groups;         // Groups we left: nothing is exchanged for them
+uint64_t pex_seq = 0;
+mutex pex_mutex;
+
+// Caller must hold pex_mutex
+void pex_change(PexSwarm& swarm, const string& addr, PexEntry& entry, bool live) {
+    swarm.changes.erase(entry.seq);
+    entry.seq = ++pex_seq;
+    entry.live = live;
+    swarm.changes[entry.seq] = addr;
+}
+
+// Caller must hold pex_mutex
+void pex_expire(PexSwarm& swarm) {
+    auto now = chrono::steady_clock::now();
+    for (auto it = swarm.entries.begin(); it != swarm.entries.end(); ) {
+        if (now - it->second.seen < chrono::seconds(PEX_PEER_TTL_SEC)) {
+            ++it;
+        } else if (it->second.live) {
+            // Passed on as dropped for another TTL, then forgotten
+            pex_change(swarm, it->first, it->second, false);
+            it->second.seen = now;
+            swarm.live--;
+            ++it;
+        } else {
+            swarm.changes.erase(it->second.seq);
+            it = swarm.entries.erase(it);
+        }
+    }
+}
+
+void pex_add(const string& group_id, const string& filename, const string& addr) {
+    if (addr == my_ip + ":" + to_string(advertised_port)) return;
+    
+    lock_guard<mutex> lock(pex_mutex);
+    if (pex_left_groups.count(group_id)) return;
+    PexSwarm& swarm = pex_swarms[group_id + "/" + filename];
+    
+    auto it = swarm.entries.find(addr);
+    if (it != swarm.entries.end() && it->second.live) {
+        it->second.seen = chrono::steady_clock::now();
+        return;
+    }
+    if (swarm.live >= PEX_MAX_KNOWN) {
+        pex_expire(swarm);
+        if (swarm.live >= PEX_MAX_KNOWN) return;
+    }
+    
+    PexEntry& entry = swarm.entries[addr];
+    entry.seen = chrono::steady_clock::now();
+    pex_change(swarm, addr, entry, true);
+    swarm.live++;
+}
+
+// A peer we couldn't reach
+void pex_drop(const string& group_id, const string& filename, const string& addr) {
+    lock_guard<mutex> lock(pex_mutex);
+    auto swarm = pex_swarms.find(group_id + "/" + filename);
+    if (swarm == pex_swarms.end()) return;
+    auto it = swarm->second.entries.find(addr);
+    if (it == swarm->second.entries.end() || !it->second.live) return;
+    
+    pex_change(swarm->second, addr, it->second, false);
+    it->second.seen = chrono::steady_clock::now();
+    swarm->second.live--;
+}
+
+void pex_leave_group(const string& group_id) {
+    lock_guard<mutex> lock(pex_mutex);
+    pex_left_groups.insert(group_id);
+    string prefix = group_id + "/";
+    for (auto it = pex_swarms.lower_bound(prefix); it != pex_swarms.end() && it->first.compare(0, prefix.size(), prefix) == 0; ) {
+        it = pex_swarms.erase(it);
+    }
+}
+
+// The tracker just treated us as a member of the group again
+void pex_join_group(const string& group_id) {
+    lock_guard<mutex> lock(pex_mutex);
+    pex_left_groups.erase(group_id);
+}
+
+// Our answer to a PEX on a connection that has seen the changes up to
+// cursor; moves cursor past what it includes. "" if we may not answer.
+string pex_delta(const string& group_id, const string& filename, const string& requester, uint64_t& cursor) {
+    lock_guard<mutex> lock(pex_mutex);
+    if (!pex_enabled || pex_left_groups.count(group_id)) return "";
+    
+    string response = "PEX:";
+    auto swarm = pex_swarms.find(group_id + "/" + filename);
+    if (swarm == pex_swarms.end()) return response;
+    pex_expire(swarm->second);
+    
+    uint64_t start = cursor;
+    int listed = 0;
+    for (auto it = swarm->second.changes.upper_bound(cursor);
+         it != swarm->second.changes.end() && listed < PEX_MAX_PEERS; ++it) {
+        cursor = it->first;
+        if (it->second == requester) continue;
+        bool live = swarm->second.entries[it->second].live;
+        // A peer that was never passed on needn't be dropped
+        if (!live && start == 0) continue;
+        response += (live ? " +" : " -") + it->second;
+        listed++;
+    }
+    return response;
+}
+
+bool parse_pex_response(const string& response, vector<string>& added, vector<string>& dropped) {
+    if (response.compare(0, 4, "PEX:") != 0) return false;
+    for (const string& item : split_string(response.substr(4), ' ')) {
+        if (item.size() < 2 || item.find(':') == string::npos) continue;
+        (item[0] == '+' ? added : dropped).push_back(item.substr(1));
+    }
+    return true;
+}
+
+// One PEX exchange on an open peer connection
+bool request_pex(SOCKET sock, const string& group_id, const string& filename, vector<string>& added,
+                 vector<string>& dropped) {
+    string request = "PEX " + group_id + " " + filename + " " + my_ip + ":" + to_string(advertised_port);
+    if (!send_all(sock, request.data(), request.size())) return false;
+    
+    uint32_t length;
+    if (!recv_exact(sock, (char*)&length, 4)) return false;
+    length = ntohl(length);
+    if (length > BUFFER_SIZE) return false;
+    string response(length, '\0');
+    if (length > 0 && !recv_exact(sock, &response[0], length)) return false;
+    return response.empty() || parse_pex_response(response, added, dropped);   // Empty: it won't say
+}
+
+// Peers that the given ones know for the file, asked over short connections.
+// These are only hearsay: the caller adds one to pex_peers once it has
+// answered with a bit vector of its own
+vector<string> pex_from_peers(const string& group_id, const string& filename, const vector<string>& peers) {
+    vector<string> found;
+    for (const string& peer : peers) {
+        size_t colon = peer.rfind(':');
+        SOCKET sock = connect_to_server(peer.substr(0, colon), atoi(peer.c_str() + colon + 1));
+        if (sock == INVALID_SOCKET) continue;
+        set_recv_timeout(sock, PEER_REPLY_TIMEOUT_MS);
+        
+        vector<string> added, dropped;
+        if (request_pex(sock, group_id, filename, added, dropped)) {
+            found.insert(found.end(), added.begin(), added.end());
+        }
+        CLOSE_SOCKET(sock);
+    }
+    return found;
+}
+
+// Sources a running download learns about from its peers, for download_file
+// to start workers on
+struct PexFeed {
+    mutex feed_mutex;
+    set<string> known;        // Every peer the download has used or queued
+    vector<string> queued;
+    int found = 0;
+    
+    void offer(const string& addr) {
+        lock_guard<mutex> lock(feed_mutex);
+        if (!known.insert(addr).second) return;
+        queued.push_back(addr);
+        found++;
+    }
+    
+    void withdraw(const string& addr) {
+        lock_guard<mutex> lock(feed_mutex);
+        queued.erase(remove(queued.begin(), queued.end(), addr), queued.end());
+    }
+    
+    bool take(string& addr) {
+        lock_guard<mutex> lock(feed_mutex);
+        if (queued.empty()) return false;
+        addr = queued.front();
+        queued.erase(queued.begin());
+        return true;
+    }
+};
+
+// ==================== DHT ====================
+
+// With --dht, clients find each other's files without the tracker: providers
+// of a file are stored in a Kademlia overlay among the clients, under the
+// key SHA-256("<group_id>/<filename>") cut to DHT_ID_BYTES. The tracker still
+// checks logins and group membership and describes the file (file_info); only
+// the peer lists come from the DHT.
+//
+// Nodes talk over UDP on the client's own port. Every message starts with
+// [u8 type][u32 txn][sender id]; numbers are in network byte order.
+//
+//   PING                                   -> PONG
+//   FIND_NODE      [target]                -> NODES      [u8 n][n x (id, u32 ip, u16 port)]
+//   GET_PROVIDERS  [key]                   -> PROVIDERS  [u32 token][u8 n][n x node][u8 m][m x (u32 ip, u16 tcp port)]
+//   ADD_PROVIDER   [key][u16 port][u32 token] -> ACK
+//
+// A node keeps up to DHT_K contacts per bucket of its routing table (one
+// bucket per length of the prefix shared with its own id), preferring the
+// ones it has heard from recently. Lookups are iterative, with DHT_ALPHA
+// queries in flight, and end when the DHT_K closest nodes seen have all
+// answered. A provider is stored on the DHT_K nodes closest to its key, with
+// its IP taken from the datagram and a token the node handed out to that
+// address (so a node can't announce someone else), and expires unless
+// re-announced; every file we share is re-announced each DHT_REANNOUNCE_SEC.
+
+#define DHT_ID_BYTES 20
+#define DHT_K 8                      // Bucket size and replication factor
+#define DHT_ALPHA 3                  // Parallel queries per lookup
+#define DHT_TIMEOUT_MS 500           // A query unanswered by then has failed
+#define DHT_MAX_PROVIDERS 50         // Providers per reply
+#define DHT_MAX_STORED 200           // Providers kept per key
+#define DHT_MAX_KEYS 100000          // Keys kept for others
+#define DHT_PROVIDER_TTL_SEC 1800
+#define DHT_REANNOUNCE_SEC 600
+#define DHT_REFRESH_SEC 300          // How often the routing table is refreshed with lookups
+#define DHT_STALE_SEC 900            // A contact not heard from this long may be replaced
+#define DHT_TOKEN_SEC 300            // Tokens are valid for one or two of these
+#define DHT_ANNOUNCES_PER_TICK 16    // Announce lookups per second at most
+
+enum DhtType { DHT_PING, DHT_PONG, DHT_FIND_NODE, DHT_NODES, DHT_GET_PROVIDERS, DHT_PROVIDERS,
+               DHT_ADD_PROVIDER, DHT_ACK };
+
+typedef string NodeId;   // DHT_ID_BYTES bytes
+
+struct DhtContact {
+    NodeId id;
+    uint32_t ip;         // Network byte order
+    uint16_t port;       // Host byte order
+    chrono::steady_clock::time_point seen;
+    int fails = 0;       // Queries unanswered since it was last heard from
+};
+
+// An outstanding query; the receive thread fills in the reply
+struct DhtCall {
+    uint32_t ip = 0;     // Node asked (network order); a reply must come from it
+    uint16_t port = 0;
+    bool done = false;
+    string reply;
+};
+
+bool dht_enabled = false;
+vector<string> dht_bootstrap;        // "ip:port" of nodes to join through
+SOCKET dht_sock = INVALID_SOCKET;
+NodeId dht_id;
+uint8_t dht_secret[16];
+
+mutex dht_mutex;                     // Routing table, provider store, announce times
+vector<list<DhtContact>> dht_buckets(DHT_ID_BYTES * 8);
+map<NodeId, map<string, chrono::steady_clock::time_point>> dht_providers;   // key -> "ip:port" -> expiry
+map<string, chrono::steady_clock::time_point> dht_announced;               // "group/file" -> last announce
+
+mutex dht_calls_mutex;
+condition_variable dht_calls_cv;
+map<uint32_t, shared_ptr<DhtCall>> dht_calls;
+atomic<uint32_t> dht_next_txn(0);     // Starts at random in start_dht, so replies are hard to guess
+
+inline uint64_t rotl64(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline uint64_t load_le64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// SipHash-2-4, as in the tracker's UDP connection ids
+uint64_t siphash24(const uint8_t key[16], const uint8_t* in, size_t len) {
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    auto round = [&]() {
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    };
+    
+    size_t full = len - len % 8;
+    for (size_t i = 0; i < full; i += 8) {
+        uint64_t m = load_le64(in + i);
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++) last |= (uint64_t)in[full + i] << (8 * i);
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+NodeId dht_key(const string& group_id, const string& filename) {
+    return sha256((group_id + "/" + filename).data(), group_id.size() + 1 + filename.size()).substr(0, DHT_ID_BYTES);
+}
+
+NodeId dht_distance(const NodeId& a, const NodeId& b) {
+    NodeId d(DHT_ID_BYTES, '\0');
+    for (int i = 0; i < DHT_ID_BYTES; i++) d[i] = (char)(a[i] ^ b[i]);
+    return d;
+}
+
+// Which bucket a contact goes in: the number of leading bits it shares with
+// us, so bucket 0 covers half the id space and the last ones our neighbours
+int dht_bucket(const NodeId& id) {
+    for (int i = 0; i < DHT_ID_BYTES; i++) {
+        uint8_t x = (uint8_t)(id[i] ^ dht_id[i]);
+        if (x == 0) continue;
+        int bit = 0;
+        while (!(x & 0x80)) { x <<= 1; bit++; }
+        return i * 8 + bit;
+    }
+    return DHT_ID_BYTES * 8 - 1;   // Our own id
+}
+
+string dht_addr(uint32_t ip, uint16_t port) {
+    struct in_addr a;
+    a.s_addr = ip;
+    return string(inet_ntoa(a)) + ":" + to_string(port);
+}
+
+uint32_t dht_token(uint32_t ip, uint16_t port, uint64_t epoch) {
+    uint8_t in[14];
+    memcpy(in, &ip, 4);
+    memcpy(in + 4, &port, 2);
+    for (int i = 0; i < 8; i++) in[6 + i] = (uint8_t)(epoch >> (8 * i));
+    return (uint32_t)siphash24(dht_secret, in, sizeof(in));
+}
+
+uint64_t dht_token_epoch() {
+    return (uint64_t)chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch()).count() / DHT_TOKEN_SEC;
+}
+
+// A node we heard from. Caller must hold dht_mutex.
+void dht_saw(const NodeId& id, uint32_t ip, uint16_t port) {
+    if (id == dht_id) return;
+    list<DhtContact>& bucket = dht_buckets[dht_bucket(id)];
+    auto now = chrono::steady_clock::now();
+    
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+        if (it->id != id) continue;
+        DhtContact contact = *it;
+        contact.ip = ip;
+        contact.port = port;
+        contact.seen = now;
+        contact.fails = 0;
+        bucket.erase(it);
+        bucket.push_back(contact);   // Most recently seen last
+        return;
+    }
+    
+    // A full bucket keeps its old contacts unless the longest-unheard one
+    // stopped answering or went quiet
+    if (bucket.size() >= DHT_K) {
+        const DhtContact& oldest = bucket.front();
+        if (oldest.fails == 0 && now - oldest.seen < chrono::seconds(DHT_STALE_SEC)) return;
+        bucket.pop_front();
+    }
+    DhtContact contact;
+    contact.id = id;
+    contact.ip = ip;
+    contact.port = port;
+    contact.seen = now;
+    bucket.push_back(contact);
+}
+
+// Caller must hold dht_mutex
+void dht_failed(const NodeId& id) {
+    list<DhtContact>& bucket = dht_buckets[dht_bucket(id)];
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+        if (it->id != id) continue;
+        if (++it->fails >= 3) bucket.erase(it);
+        return;
+    }
+}
+
+// Caller must hold dht_mutex
+vector<DhtContact> dht_closest(const NodeId& target, size_t count) {
+    vector<DhtContact> all;
+    for (const auto& bucket : dht_buckets) {
+        all.insert(all.end(), bucket.begin(), bucket.end());
+    }
+    size_t n = min(count, all.size());
+    partial_sort(all.begin(), all.begin() + n, all.end(), [&](const DhtContact& a, const DhtContact& b) {
+        return dht_distance(a.id, target) < dht_distance(b.id, target);
+    });
+    all.resize(n);
+    return all;
+}
+
+size_t dht_size() {
+    lock_guard<mutex> lock(dht_mutex);
+    size_t n = 0;
+    for (const auto& bucket : dht_buckets) n += bucket.size();
+    return n;
+}
+
+string dht_header(DhtType type, uint32_t txn) {
+    string out;
+    out += (char)type;
+    put_net(out, txn, 4);
+    out += dht_id;
+    return out;
+}
+
+void dht_put_node(string& out, const DhtContact& c) {
+    out += c.id;
+    out.append((const char*)&c.ip, 4);
+    put_net(out, c.port, 2);
+}
+
+void dht_send(uint32_t ip, uint16_t port, const string& message) {
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = ip;
+    to.sin_port = htons(port);
+    sendto(dht_sock, message.data(), (int)message.size(), 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+// Send a query whose reply will be left in the returned call
+shared_ptr<DhtCall> dht_query(uint32_t ip, uint16_t port, DhtType type, const string& body) {
+    uint32_t txn = dht_next_txn++;
+    auto call = make_shared<DhtCall>();
+    call->ip = ip;
+    call->port = port;
+    {
+        lock_guard<mutex> lock(dht_calls_mutex);
+        dht_calls[txn] = call;
+    }
+    dht_send(ip, port, dht_header(type, txn) + body);
+    return call;
+}
+
+void dht_forget_call(const shared_ptr<DhtCall>& call) {
+    lock_guard<mutex> lock(dht_calls_mutex);
+    for (auto it = dht_calls.begin(); it != dht_calls.end(); ++it) {
+        if (it->second == call) {
+            dht_calls.erase(it);
+            return;
+        }
+    }
+}
+
+// Answer a query, or hand a reply to whoever waits for it
+void dht_handle(const char* data, size_t len, const struct sockaddr_in& from) {
+    size_t header = 5 + DHT_ID_BYTES;
+    if (len < header) return;
+    DhtType type = (DhtType)(uint8_t)data[0];
+    uint32_t txn = (uint32_t)get_net(data + 1, 4);
+    NodeId sender(data + 5, DHT_ID_BYTES);
+    const char* body = data + header;
+    size_t body_len = len - header;
+    uint32_t ip = from.sin_addr.s_addr;
+    uint16_t port = ntohs(from.sin_port);
+    
+    // A reply only counts from the node it was asked of; anything else is
+    // dropped before it can touch the routing table
+    if (type == DHT_PONG || type == DHT_NODES || type == DHT_PROVIDERS || type == DHT_ACK) {
+        {
+            lock_guard<mutex> lock(dht_calls_mutex);
+            auto it = dht_calls.find(txn);
+            if (it == dht_calls.end() || it->second->ip != ip || it->second->port != port) return;
+            it->second->reply.assign(data, len);
+            it->second->done = true;
+            dht_calls.erase(it);
+            dht_calls_cv.notify_all();
+        }
+        lock_guard<mutex> lock(dht_mutex);
+        dht_saw(sender, ip, port);
+        return;
+    }
+    
+    {
+        lock_guard<mutex> lock(dht_mutex);
+        dht_saw(sender, ip, port);
+    }
+    
+    string reply;
+    if (type == DHT_PING) {
+        reply = dht_header(DHT_PONG, txn);
+    }
+    else if ((type == DHT_FIND_NODE || type == DHT_GET_PROVIDERS) && body_len >= DHT_ID_BYTES) {
+        NodeId target(body, DHT_ID_BYTES);
+        lock_guard<mutex> lock(dht_mutex);
+        vector<DhtContact> closest = dht_closest(target, DHT_K);
+        
+        string nodes;
+        put_net(nodes, closest.size(), 1);
+        for (const DhtContact& c : closest) dht_put_node(nodes, c);
+        
+        if (type == DHT_FIND_NODE) {
+            reply = dht_header(DHT_NODES, txn) + nodes;
+        } else {
+            reply = dht_header(DHT_PROVIDERS, txn);
+            put_net(reply, dht_token(ip, port, dht_token_epoch()), 4);
+            reply += nodes;
+            
+            string providers;
+            int count = 0;
+            auto stored = dht_providers.find(target);
+            if (stored != dht_providers.end()) {
+                auto now = chrono::steady_clock::now();
+                for (const auto& p : stored->second) {
+                    if (count == DHT_MAX_PROVIDERS) break;
+                    if (p.second < now) continue;
+                    size_t colon = p.first.rfind(':');
+                    uint32_t pip = inet_addr(p.first.substr(0, colon).c_str());
+                    providers.append((const char*)&pip, 4);
+                    put_net(providers, atoi(p.first.c_str() + colon + 1), 2);
+                    count++;
+                }
+            }
+            put_net(reply, count, 1);
+            reply += providers;
+        }
+    }
+    else if (type == DHT_ADD_PROVIDER && body_len >= DHT_ID_BYTES + 6) {
+        NodeId key(body, DHT_ID_BYTES);
+        uint16_t tcp_port = (uint16_t)get_net(body + DHT_ID_BYTES, 2);
+        uint32_t token = (uint32_t)get_net(body + DHT_ID_BYTES + 2, 4);
+        uint64_t epoch = dht_token_epoch();
+        if (token != dht_token(ip, port, epoch) && token != dht_token(ip, port, epoch - 1)) return;
+        
+        lock_guard<mutex> lock(dht_mutex);
+        auto stored = dht_providers.find(key);
+        if (stored == dht_providers.end() && dht_providers.size() >= DHT_MAX_KEYS) return;
+        auto& providers = dht_providers[key];
+        string addr = dht_addr(ip, tcp_port);
+        if (providers.size() >= DHT_MAX_STORED && !providers.count(addr)) return;
+        providers[addr] = chrono::steady_clock::now() + chrono::seconds(DHT_PROVIDER_TTL_SEC);
+        reply = dht_header(DHT_ACK, txn);
+    }
+    
+    if (!reply.empty()) dht_send(ip, port, reply);
+}
+
+bool dht_parse_nodes(const char*& p, const char* end, vector<DhtContact>& nodes) {
+    if (end - p < 1) return false;
+    int n = (uint8_t)*p++;
+    for (int i = 0; i < n; i++) {
+        if (end - p < DHT_ID_BYTES + 6) return false;
+        DhtContact c;
+        c.id.assign(p, DHT_ID_BYTES);
+        memcpy(&c.ip, p + DHT_ID_BYTES, 4);
+        c.port = (uint16_t)get_net(p + DHT_ID_BYTES + 4, 2);
+        p += DHT_ID_BYTES + 6;
+        nodes.push_back(c);
+    }
+    return true;
+}
+
+// The nodes a lookup ended on, each with the token it gave us
+struct DhtLookup {
+    vector<pair<DhtContact, uint32_t>> closest;
+    vector<string> providers;   // "ip:port", for GET_PROVIDERS
+    int queries = 0;
+};
+
+// Iterative lookup of target: FIND_NODE, or GET_PROVIDERS to also collect providers
+DhtLookup dht_lookup(const NodeId& target, bool providers) {
+    struct Candidate {
+        DhtContact contact;
+        enum { FRESH, ASKED, ANSWERED, FAILED } state = FRESH;
+        shared_ptr<DhtCall> call;
+        chrono::steady_clock::time_point sent;
+        uint32_t token = 0;
+    };
+    map<NodeId, Candidate> shortlist;   // distance -> candidate, closest first
+    set<string> found;
+    DhtLookup result;
+    
+    auto add = [&](const DhtContact& c) {
+        if (c.id == dht_id) return;
+        NodeId d = dht_distance(c.id, target);
+        if (!shortlist.count(d)) shortlist[d].contact = c;
+    };
+    {
+        lock_guard<mutex> lock(dht_mutex);
+        for (const DhtContact& c : dht_closest(target, DHT_K)) add(c);
+    }
+    
+    while (true) {
+        // Query the closest fresh candidates among the DHT_K closest live ones
+        int in_flight = 0;
+        int live = 0;
+        bool pending = false;
+        for (auto& entry : shortlist) {
+            Candidate& c = entry.second;
+            if (c.state == Candidate::FAILED) continue;
+            if (live++ >= DHT_K) break;
+            if (c.state == Candidate::ASKED) in_flight++;
+            if (c.state == Candidate::FRESH) pending = true;
+        }
+        if (in_flight == 0 && !pending) break;
+        
+        live = 0;
+        for (auto& entry : shortlist) {
+            if (in_flight >= DHT_ALPHA) break;
+            Candidate& c = entry.second;
+            if (c.state == Candidate::FAILED) continue;
+            if (live++ >= DHT_K) break;
+            if (c.state != Candidate::FRESH) continue;
+            c.call = dht_query(c.contact.ip, c.contact.port, providers ? DHT_GET_PROVIDERS : DHT_FIND_NODE, target);
+            c.sent = chrono::steady_clock::now();
+            c.state = Candidate::ASKED;
+            in_flight++;
+            result.queries++;
+        }
+        
+        // Wait for any answer (or for one to time out)
+        {
+            unique_lock<mutex> lock(dht_calls_mutex);
+            dht_calls_cv.wait_for(lock, chrono::milliseconds(20));
+        }
+        
+        auto now = chrono::steady_clock::now();
+        vector<DhtContact> learned;
+        for (auto& entry : shortlist) {
+            Candidate& c = entry.second;
+            if (c.state != Candidate::ASKED) continue;
+            
+            bool done;
+            string reply;
+            {
+                lock_guard<mutex> lock(dht_calls_mutex);
+                done = c.call->done;
+                if (done) reply.swap(c.call->reply);
+            }
+            if (!done) {
+                if (now - c.sent < chrono::milliseconds(DHT_TIMEOUT_MS)) continue;
+                dht_forget_call(c.call);
+                c.state = Candidate::FAILED;
+                lock_guard<mutex> lock(dht_mutex);
+                dht_failed(c.contact.id);
+                continue;
+            }
+            
+            const char* p = reply.data() + 5 + DHT_ID_BYTES;
+            const char* end = reply.data() + reply.size();
+            c.state = Candidate::ANSWERED;
+            if (providers) {
+                if (end - p < 4) continue;
+                c.token = (uint32_t)get_net(p, 4);
+                p += 4;
+            }
+            if (!dht_parse_nodes(p, end, learned) || !providers || end - p < 1) continue;
+            int m = (uint8_t)*p++;
+            for (int i = 0; i < m && end - p >= 6; i++, p += 6) {
+                uint32_t ip;
+                memcpy(&ip, p, 4);
+                string addr = dht_addr(ip, (uint16_t)get_net(p + 4, 2));
+                if (found.insert(addr).second) result.providers.push_back(addr);
+            }
+        }
+        for (const DhtContact& c : learned) add(c);
+    }
+    
+    for (auto& entry : shortlist) {
+        if (entry.second.state != Candidate::ANSWERED) continue;
+        result.closest.push_back(make_pair(entry.second.contact, entry.second.token));
+        if (result.closest.size() == DHT_K) break;
+    }
+    return result;
+}
+
+// Providers of a file other than us
+vector<string> dht_find_providers(const string& group_id, const string& filename) {
+    auto started = chrono::steady_clock::now();
+    DhtLookup lookup = dht_lookup(dht_key(group_id, filename), true);
+    
+    string self = my_ip + ":" + to_string(advertised_port);
+    vector<string> providers;
+    for (const string& addr : lookup.providers) {
+        if (addr != self) providers.push_back(addr);
+    }
+    LOG_INFO("[DHT] " << providers.size() << " providers of " << group_id << "/" << filename << " in "
+             << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count()
+             << "ms, " << lookup.queries << " queries");
+    return providers;
+}
+
+// Store ourselves as a provider on the nodes closest to the file's key
+void dht_announce(const string& group_id, const string& filename) {
+    NodeId key = dht_key(group_id, filename);
+    DhtLookup lookup = dht_lookup(key, true);
+    
+    string body = key;
+    put_net(body, advertised_port, 2);
+    for (const auto& node : lookup.closest) {
+        string message = body;
+        put_net(message, node.second, 4);
+        dht_send(node.first.ip, node.first.port, dht_header(DHT_ADD_PROVIDER, dht_next_txn++) + message);
+    }
+    LOG_DEBUG("[DHT] Announced " << group_id << "/" << filename << " to " << lookup.closest.size() << " nodes");
+}
+
+void dht_receive_thread() {
+    vector<char> buffer(2048);
+    while (running) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(dht_sock, buffer.data(), (int)buffer.size(), 0, (struct sockaddr*)&from, &from_len);
+        if (n > 0) dht_handle(buffer.data(), n, from);
+    }
+}
+
+// Join through the bootstrap nodes, keep the routing table fresh, expire
+// stored providers and announce (and re-announce) every file we share
+void dht_maintenance_thread() {
+    auto last_refresh = chrono::steady_clock::time_point();
+    auto last_scan = chrono::steady_clock::time_point();
+    vector<pair<string, string>> due;
+    
+    while (running) {
+        auto now = chrono::steady_clock::now();
+        
+        if (now - last_refresh >= chrono::seconds(DHT_REFRESH_SEC) || dht_size() == 0) {
+            last_refresh = now;
+            if (dht_size() == 0) {
+                // A PONG puts the node in the routing table; unanswered pings
+                // (e.g. the bootstrap node is down) are forgotten
+                vector<shared_ptr<DhtCall>> pings;
+                for (const string& node : dht_bootstrap) {
+                    size_t colon = node.rfind(':');
+                    pings.push_back(dht_query(inet_addr(node.substr(0, colon).c_str()),
+                                              (uint16_t)atoi(node.c_str() + colon + 1), DHT_PING, ""));
+                }
+                this_thread::sleep_for(chrono::milliseconds(DHT_TIMEOUT_MS));
+                for (const auto& ping : pings) dht_forget_call(ping);
+            }
+            // Our own neighbourhood, then a random spot for the far buckets
+            dht_lookup(dht_id, false);
+            NodeId random_id(DHT_ID_BYTES, '\0');
+            for (char& c : random_id) c = (char)rand();
+            dht_lookup(random_id, false);
+            
+            lock_guard<mutex> lock(dht_mutex);
+            for (auto it = dht_providers.begin(); it != dht_providers.end(); ) {
+                for (auto p = it->second.begin(); p != it->second.end(); ) {
+                    p = p->second < now ? it->second.erase(p) : next(p);
+                }
+                it = it->second.empty() ? dht_providers.erase(it) : next(it);
+            }
+        }
+        
+        // Files not announced for DHT_REANNOUNCE_SEC, a few per second
+        if (due.empty() && now - last_scan >= chrono::seconds(1)) {
+            last_scan = now;
+            lock_guard<mutex> files_lock(file_map_mutex);
+            lock_guard<mutex> lock(dht_mutex);
+            for (const auto& group : peer_file_map) {
+                for (const auto& file : group.second) {
+                    auto announced = dht_announced.find(group.first + "/" + file.first);
+                    if (announced == dht_announced.end() ||
+                        now - announced->second >= chrono::seconds(DHT_REANNOUNCE_SEC)) {
+                        due.push_back(make_pair(group.first, file.first));
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < DHT_ANNOUNCES_PER_TICK && !due.empty() && dht_size() > 0; i++) {
+            dht_announce(due.back().first, due.back().second);
+            lock_guard<mutex> lock(dht_mutex);
+            dht_announced[due.back().first + "/" + due.back().second] = chrono::steady_clock::now();
+            due.pop_back();
+        }
+        
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+}
+
+bool start_dht() {
+    dht_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (dht_sock == INVALID_SOCKET) return false;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(my_ip.c_str());
+    addr.sin_port = htons(my_port);
+    if (bind(dht_sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        CLOSE_SOCKET(dht_sock);
+        dht_sock = INVALID_SOCKET;
+        return false;
+    }
+    set_recv_timeout(dht_sock, 500);   // To notice shutdown
+    
+    random_device rd;
+    for (uint8_t& b : dht_secret) b = (uint8_t)rd();
+    dht_next_txn = rd();
+    string seed = my_ip + ":" + to_string(my_port);
+    for (int i = 0; i < 8; i++) seed += (char)rd();
+    dht_id = sha256(seed.data(), seed.size()).substr(0, DHT_ID_BYTES);
+    
+    thread(dht_receive_thread).detach();
+    thread(dht_maintenance_thread).detach();
+    LOG_INFO("[DHT] Node " << to_hex(dht_id).substr(0, 12) << " on UDP " << my_ip << ":" << my_port);
+    return true;
+}
+
+// ==================== DOWNLOAD FUNCTIONS ====================
+
+#define MAX_PIECE_ATTEMPTS 3   // A piece that fails this often is given up on
+#define PROGRESS_LOG_MS 1000   // Interval between progress lines while downloading
+#define MAX_HASH_SOURCES 3     // Peers asked for a file's piece hashes before going without
+#define DEFAULT_READ_AHEAD 64  // Pieces past the stream's position that may be fetched
+
+// Pieces of one download, shared by its per-peer threads. Each thread works
+// through its planned pieces, then takes over pieces that are still pending
+// (planned for a slower peer, or put back after a failure), so a fast peer
+// ends up serving more of the file than the plan gave it.
+//
+// A streamed download has a window instead: pieces are handed out in
+// priority (file) order and only up to window pieces past the first one not
+// yet done, so the file fills in from the front; a peer with nothing to
+// fetch in the window waits for it to move.
+class PieceScheduler {
+public:
+    PieceScheduler(int num_pieces, const vector<int>& order, int window = 0)
+        : state_(num_pieces, PIECE_PENDING), attempts_(num_pieces, 0), order_(order),
+          remaining_(num_pieces), window_(window), front_(0), waiting_(0), closed_(false) {}
+    
+    // Next piece for a peer: from its plan first, then any pending piece it
+    // has, in priority order. -1 when nothing it can fetch is left.
+    int claim(const vector<bool>& have, const vector<int>& plan, size_t& plan_pos) {
+        unique_lock<mutex> lock(mutex_);
+        while (plan_pos < plan.size()) {
+            int piece = plan[plan_pos++];
+            if (state_[piece] == PIECE_PENDING) return take(piece);
+        }
+        while (true) {
+            bool ahead = false;   // It has pending pieces past the window
+            for (int piece : order_) {
+                if (state_[piece] != PIECE_PENDING || piece >= (int)have.size() || !have[piece]) continue;
+                if (window_ > 0 && piece >= front_ + window_) {
+                    ahead = true;
+                    break;
+                }
+                return take(piece);
+            }
+            if (!ahead || closed_) return -1;
+            waiting_++;
+            changed_.wait(lock);
+            waiting_--;
+        }
+    }
+    
+    void done(int piece) {
+        lock_guard<mutex> lock(mutex_);
+        state_[piece] = PIECE_DONE;
+        remaining_--;
+        while (front_ < (int)state_.size() && state_[front_] == PIECE_DONE) front_++;
+        changed_.notify_all();
+    }
+    
+    // Put a piece back for another peer to try
+    void failed(int piece) {
+        lock_guard<mutex> lock(mutex_);
+        state_[piece] = attempts_[piece] < MAX_PIECE_ATTEMPTS ? PIECE_PENDING : PIECE_ABANDONED;
+        changed_.notify_all();
+    }
+    
+    int remaining() {
+        lock_guard<mutex> lock(mutex_);
+        return remaining_;
+    }
+    
+    // Pieces from the start of the file that are done
+    int front() {
+        lock_guard<mutex> lock(mutex_);
+        return front_;
+    }
+    
+    // Wait up to ms for the front to move past piece (or for close); returns the front
+    int wait_front(int piece, int ms) {
+        unique_lock<mutex> lock(mutex_);
+        changed_.wait_for(lock, chrono::milliseconds(ms), [&] { return front_ > piece || closed_; });
+        return front_;
+    }
+    
+    // Every one of the download's workers is waiting for the window, so no
+    // peer can serve the piece at the front: fetch the rest in any order
+    bool unblock_window(int workers) {
+        lock_guard<mutex> lock(mutex_);
+        if (window_ == 0 || workers == 0 || waiting_ < workers) return false;
+        window_ = 0;
+        changed_.notify_all();
+        return true;
+    }
+    
+    // The download is over: wake everyone waiting
+    void close() {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        changed_.notify_all();
+    }
+    
+    bool closed() {
+        lock_guard<mutex> lock(mutex_);
+        return closed_;
+    }
+    
+private:
+    enum PieceState { PIECE_PENDING, PIECE_IN_FLIGHT, PIECE_DONE, PIECE_ABANDONED };
+    
+    mutex mutex_;
+    condition_variable changed_;
+    vector<PieceState> state_;
+    vector<int> attempts_;
+    vector<int> order_;       // Priority order for pieces taken over from other peers
+    int remaining_;
+    int window_;              // Read-ahead of a streamed download; 0 for none
+    int front_;               // First piece not done
+    int waiting_;             // Threads in claim() waiting for the window
+    bool closed_;
+    
+    int take(int piece) {
+        state_[piece] = PIECE_IN_FLIGHT;
+        attempts_[piece]++;
+        return piece;
+    }
+};
+
+// Verified pieces on their way from the download threads to the stream
+// writer, so it needn't read them back: one slot per piece of the window
+// ahead of the writer. Pieces further ahead (once the window is dropped),
+// and ones copied locally, are read from the file instead.
+class StreamHandoff {
+public:
+    explicit StreamHandoff(int slots) : slots_(slots), next_(0), stopped_(false) {}
+    
+    // Take over a piece's buffer if the writer will want it
+    bool offer(int piece, PieceBuffer& buffer) {
+        lock_guard<mutex> lock(mutex_);
+        if (stopped_ || piece < next_ || piece >= next_ + (int)slots_.size()) return false;
+        Slot& slot = slots_[piece % slots_.size()];
+        slot.piece = piece;
+        slot.buffer = move(buffer);
+        return true;
+    }
+    
+    // The writer's next piece, if it was handed over; an empty buffer if not
+    PieceBuffer take(int piece) {
+        lock_guard<mutex> lock(mutex_);
+        next_ = piece + 1;
+        Slot& slot = slots_[piece % slots_.size()];
+        return slot.piece == piece ? move(slot.buffer) : PieceBuffer();
+    }
+    
+    // The writer is gone: keep nothing more for it
+    void stop() {
+        lock_guard<mutex> lock(mutex_);
+        stopped_ = true;
+        for (Slot& slot : slots_) slot.buffer.reset();
+    }
+    
+private:
+    struct Slot {
+        int piece = -1;
+        PieceBuffer buffer;
+    };
+    
+    mutex mutex_;
+    vector<Slot> slots_;
+    int next_;        // The writer's next piece
+    bool stopped_;
+};
+
+struct DownloadTask {
+    string peer_ip;
+    int peer_port;
+    string group_id;
+    string filename;
+    string dest_path;
+    vector<int> pieces;       // Planned pieces
+    vector<bool> have;        // Pieces the peer holds
+    long file_size;
+    bool share_pieces;   // Serve pieces to others as soon as they arrive
+    StreamHandoff* stream;   // Where pieces go for streaming (see stream_pieces); null if not streamed
+    const vector<string>* piece_hashes;   // Expected digests; empty if unknown
+    PexFeed* pex;        // Where peers this one tells us about go; null for no PEX
+};
+
+enum FetchResult { FETCH_OK, FETCH_LOST, FETCH_MISSING, FETCH_CORRUPT };
+
+// Ask for a piece on a peer connection and receive it into piece; packed
+// takes it off the wire when it comes compressed. Both hold PIECE_SIZE bytes.
+FetchResult fetch_piece(SOCKET sock, bool compressed, const string& request, char* piece, char* packed,
+                        uint32_t& piece_size, uint32_t& wire_size) {
+    if (!send_all(sock, request.data(), request.size())) return FETCH_LOST;
+    
+    // First receive the size header: the piece size (4 bytes), or with
+    // compression the piece size and the size on the wire (network order)
+    if (compressed) {
+        uint32_t header[2];
+        if (!recv_exact(sock, (char*)header, sizeof(header))) return FETCH_LOST;
+        piece_size = ntohl(header[0]);
+        wire_size = ntohl(header[1]);
+    } else {
+        if (!recv_exact(sock, (char*)&piece_size, 4)) return FETCH_LOST;
+        wire_size = piece_size;
+    }
+    if (piece_size == 0 || piece_size > PIECE_SIZE || wire_size == 0 || wire_size > piece_size) {
+        return FETCH_MISSING;
+    }
+    
+    // Now receive the piece data
+    bool packed_piece = wire_size < piece_size;
+    if (!recv_exact(sock, packed_piece ? packed : piece, wire_size)) return FETCH_LOST;
+    if (packed_piece && !lz_decompress(packed, wire_size, piece, piece_size)) {
+        return FETCH_CORRUPT;   // The stream is still in step, so only this piece is lost
+    }
+    return FETCH_OK;
+}
+
+void download_from_peer(DownloadTask task, PieceScheduler* scheduler, atomic<int>* workers) {
+    string peer = task.peer_ip + ":" + to_string(task.peer_port);
+    string file_key = task.group_id + "/" + task.filename;
+    LOG_INFO("[DOWNLOAD] Connecting to peer " << peer);
+    
+    // A source found by peer exchange: learn what it has first
+    if (task.have.empty()) {
+        task.have = get_peer_bit_vector(task.peer_ip, task.peer_port, task.group_id, task.filename);
+        if (task.have.empty()) {
+            LOG_DEBUG("[DOWNLOAD] Peer " << peer << " doesn't share " << file_key);
+            pex_drop(task.group_id, task.filename, peer);
+            (*workers)--;
+            return;
+        }
+        pex_add(task.group_id, task.filename, peer);
+    }
+    
+    // Peer exchange goes only to peers that take it: an older one would
+    // leave the PEX request unanswered
+    SOCKET sock = connect_to_server(task.peer_ip, task.peer_port);
+    bool compressed = false;
+    bool offer_pex = task.pex && pex_enabled;
+    bool peer_pex = false;
+    if (sock != INVALID_SOCKET && (compression_enabled || offer_pex)) {
+        int agreed = negotiate_hello(sock, offer_pex, peer_pex);
+        if (agreed < 0) {
+            // Start over without the handshake
+            CLOSE_SOCKET(sock);
+            sock = connect_to_server(task.peer_ip, task.peer_port);
+        }
+        compressed = agreed > 0;
+    }
+    if (sock == INVALID_SOCKET) {
+        // Its planned pieces stay pending for the other peers to take over
+        LOG_WARN("[DOWNLOAD] Failed to connect to peer " << peer);
+        record_download_failure(peer);
+        pex_drop(task.group_id, task.filename, peer);
+        (*workers)--;
+        return;
+    }
+    
+    PieceFile dest(task.dest_path, true);
+    if (!dest.is_open()) {
+        LOG_ERROR("[DOWNLOAD] Cannot open destination file");
+        CLOSE_SOCKET(sock);
+        (*workers)--;
+        return;
+    }
+    
+    size_t plan_pos = 0;
+    int piece;
+    int fetched = 0;
+    string request;
+    PieceBuffer buffer = PieceBuffer::get();
+    PieceBuffer packed = PieceBuffer::get();
+    chrono::steady_clock::time_point next_pex;   // Right away
+    
+    while ((piece = scheduler->claim(task.have, task.pieces, plan_pos)) >= 0) {
+        auto started = chrono::steady_clock::now();
+        if (peer_pex && started >= next_pex) {
+            next_pex = started + chrono::milliseconds(PEX_INTERVAL_MS);
+            vector<string> added, dropped;
+            set_recv_timeout(sock, PEER_REPLY_TIMEOUT_MS);
+            bool answered = request_pex(sock, task.group_id, task.filename, added, dropped);
+            set_recv_timeout(sock, 0);
+            if (answered) {
+                for (const string& addr : added) task.pex->offer(addr);
+                for (const string& addr : dropped) task.pex->withdraw(addr);
+            } else {
+                LOG_WARN("[DOWNLOAD] Lost connection to " << peer << " during peer exchange");
+                scheduler->failed(piece);
+                break;
+            }
+        }
+        request.assign("GET_PIECE ").append(task.group_id).append(" ").append(task.filename).append(" ")
+               .append(to_string(piece));
+        uint32_t piece_size = 0;
+        uint32_t wire_size = 0;
+        FetchResult result = fetch_piece(sock, compressed, request, buffer.data(), packed.data(), piece_size,
+                                         wire_size);
+        
+        if (result == FETCH_LOST) {
+            LOG_WARN("[DOWNLOAD] Lost connection to " << peer << " during piece " << piece);
+            scheduler->failed(piece);
+            record_download_failure(peer);
+            break;
+        }
+        if (result == FETCH_MISSING) {
+            // The peer doesn't have it after all; don't ask it again
+            LOG_WARN("[DOWNLOAD] Peer " << peer << " could not serve piece " << piece);
+            scheduler->failed(piece);
+            record_download_failure(peer);
+            task.have[piece] = false;
+            continue;
+        }
+        if (result == FETCH_CORRUPT) {
+            LOG_WARN("[DOWNLOAD] Corrupt compressed piece " << piece << " from " << peer);
+            scheduler->failed(piece);
+            record_download_failure(peer);
+            continue;
+        }
+        int total_received = (int)piece_size;
+        
+        bool verified = !task.piece_hashes->empty();
+        if (verified) {
+            if (!sha256_matches(buffer.data(), total_received, (*task.piece_hashes)[piece]) ||
+                total_received != piece_length(task.file_size, piece)) {
+                LOG_WARN("[DOWNLOAD] Piece " << piece << " from " << peer << " failed verification");
+                scheduler->failed(piece);
+                record_download_failure(peer);
+                continue;
+            }
+        }
+        
+        uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - started).count();
+        
+        // Write piece to correct position in file
+        long offset = (long)piece * PIECE_SIZE;
+        dest.write(offset, buffer.data(), total_received);
+        
+        // Peers we serve and the stream read it back from the file
+        if (task.share_pieces || task.stream) dest.flush();
+        if (task.share_pieces) {
+            lock_guard<mutex> lock(file_map_mutex);
+            auto group = peer_file_map.find(task.group_id);
+            if (group != peer_file_map.end() && group->second.count(task.filename)) {
+                LocalFileInfo& info = group->second[task.filename];
+                if (piece < (int)info.bit_vector.size()) info.bit_vector[piece] = true;
+                shares_changed = true;
+            }
+        }
+        
+        if (verified) index_piece(task.dest_path, piece, (*task.piece_hashes)[piece]);
+        
+        // A streamed piece goes on to the stream writer in its buffer
+        if (task.stream && task.stream->offer(piece, buffer)) buffer = PieceBuffer::get();
+        scheduler->done(piece);
+        record_download_piece(peer, file_key, total_received, wire_size, ns);
+        fetched++;
+        
+        LOG_SAMPLED(LOG_LEVEL_DEBUG, "[DOWNLOAD] Piece " << piece << " downloaded from " << peer << " ("
+                    << total_received << " bytes, " << ns / 1000 << " us)");
+    }
+    
+    CLOSE_SOCKET(sock);
+    (*workers)--;
+    
+    LOG_INFO("[DOWNLOAD] Finished downloading from " << peer << " (" << fetched << " pieces, "
+             << task.pieces.size() << " planned)");
+}
+
+// Weight each peer by the throughput it gave us before, relative to the
+// median of the known ones; peers never seen count as average
+void weight_peers_by_history(vector<PeerInfo>& peers) {
+    vector<double> rates;
+    for (PeerInfo& peer : peers) {
+        peer.speed = peer_rate(peer.ip + ":" + to_string(peer.port));
+        if (peer.speed > 0) rates.push_back(peer.speed);
+    }
+    if (rates.empty()) {
+        for (PeerInfo& peer : peers) peer.speed = 1.0;
+        return;
+    }
+    
+    nth_element(rates.begin(), rates.begin() + rates.size() / 2, rates.end());
+    double median = rates[rates.size() / 2];
+    for (PeerInfo& peer : peers) {
+        peer.speed = peer.speed > 0 ? min(10.0, max(0.1, peer.speed / median)) : 1.0;
+    }
+}
+
+// Copy every piece of a download we already have on disk, under any name or
+// group, into place: the whole file by reflink if we hold a complete copy,
+// otherwise piece by piece from the content index, then whatever can be found
+// at shifted offsets of basis (our older version of the file, if any). Marks
+// them done.
+int copy_local_pieces(const string& dest_path, const string& root, long file_size, const vector<string>& hashes,
+                      const vector<uint32_t>& weak_sums, const string& basis, PieceScheduler& scheduler,
+                      vector<bool>& local) {
+    int num_pieces = (int)hashes.size();
+    local.assign(num_pieces, false);
+    
+    string whole_copy;
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        for (const auto& group : peer_file_map) {
+            for (const auto& file : group.second) {
+                const LocalFileInfo& info = file.second;
+                if (info.root == root && info.filepath != dest_path && info.file_size == file_size &&
+                    find(info.bit_vector.begin(), info.bit_vector.end(), false) == info.bit_vector.end()) {
+                    whole_copy = info.filepath;
+                }
+            }
+        }
+    }
+    bool reflinked = !whole_copy.empty() && !find_bundle(whole_copy) && !find_bundle(dest_path) &&
+                     reflink_file(whole_copy, dest_path);
+    
+    PieceFile dest(dest_path, true);
+    if (!dest.is_open()) return 0;
+    
+    vector<char> buffer(PIECE_SIZE);
+    int copied = 0;
+    for (int i = 0; i < num_pieces; i++) {
+        size_t len = (size_t)piece_length(file_size, i);
+        bool have;
+        if (reflinked) {
+            // Already in place; check it, as the source may have changed
+            have = dest.read((long)i * PIECE_SIZE, buffer.data(), len) == len &&
+                   sha256(buffer.data(), len) == hashes[i];
+        } else {
+            have = copy_local_piece(hashes[i], len, dest, (long)i * PIECE_SIZE, buffer.data());
+        }
+        if (!have) continue;
+        
+        local[i] = true;
+        copied++;
+    }
+    
+    int shifted = 0;
+    if (!basis.empty() && copied < num_pieces && weak_sums.size() == hashes.size()) {
+        // Full pieces, then the short last piece, which needs its own window
+        multimap<uint32_t, int> wanted;
+        multimap<uint32_t, int> wanted_tail;
+        for (int i = 0; i < num_pieces; i++) {
+            if (local[i]) continue;
+            (piece_length(file_size, i) == PIECE_SIZE ? wanted : wanted_tail).insert({weak_sums[i], i});
+        }
+        shifted += copy_shifted_pieces(basis, PIECE_SIZE, wanted, hashes, dest, local);
+        if (!wanted_tail.empty()) {
+            size_t tail = (size_t)piece_length(file_size, num_pieces - 1);
+            shifted += copy_shifted_pieces(basis, tail, wanted_tail, hashes, dest, local);
+        }
+    }
+    dest.flush();
+    
+    for (int i = 0; i < num_pieces; i++) {
+        if (!local[i]) continue;
+        scheduler.done(i);
+        index_piece(dest_path, i, hashes[i]);
+    }
+    if (copied + shifted > 0) {
+        LOG_INFO("[DOWNLOAD] " << copied + shifted << "/" << num_pieces << " pieces copied locally"
+                 << (reflinked ? " (reflinked)" : "")
+                 << (shifted > 0 ? " (" + to_string(shifted) + " found in " + basis + ")" : string()));
     }
+    return copied + shifted;
 }
 
-// ==================== DOWNLOAD FUNCTIONS ====================
+int read_ahead = DEFAULT_READ_AHEAD;
 
-struct DownloadTask {
-    string peer_ip;
-    int peer_port;
-    string group_id;
-    string filename;
-    string dest_path;
-    vector<int> pieces;
-    long file_size;
-};
+// Open where a download is streamed to. A named pipe can't be opened for
+// writing until its reader opens it, so that is retried without blocking,
+// to give up if the download fails or the client exits first.
+FILE* open_stream(const string& out_path, PieceScheduler* scheduler, int num_pieces) {
+#ifdef _WIN32
+    (void)scheduler;
+    (void)num_pieces;
+    return fopen(out_path.c_str(), "wb");
+#else
+    while (running) {
+        int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            return fdopen(fd, "wb");
+        }
+        if (errno != ENXIO) return NULL;
+        if (scheduler->closed() && scheduler->front() < num_pieces) return NULL;
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    return NULL;
+#endif
+}
 
-void download_from_peer(DownloadTask task) {
-    cout << "[DOWNLOAD] Connecting to peer " << task.peer_ip << ":" << task.peer_port << endl;
-    
-    SOCKET sock = connect_to_server(task.peer_ip, task.peer_port);
-    if (sock == INVALID_SOCKET) {
-        cerr << "[DOWNLOAD] Failed to connect to peer" << endl;
+// Copy a download's pieces to out_path (a file or a named pipe) in order as
+// the front of the file completes, so a consumer such as a player can start
+// after a few pieces rather than the whole file. Runs until every piece is
+// out, the download ends without them, or the consumer goes away.
+void stream_pieces(string path, string out_path, long file_size, int num_pieces, PieceScheduler* scheduler,
+                   StreamHandoff* handoff, chrono::steady_clock::time_point started) {
+    FILE* out = open_stream(out_path, scheduler, num_pieces);
+    if (!out) {
+        LOG_ERROR("[STREAM] Cannot open " << out_path << " for streaming");
+        handoff->stop();
         return;
     }
     
-    // Open destination file
-    FILE* fp = fopen(task.dest_path.c_str(), "r+b");
-    if (!fp) {
-        // Create file if doesn't exist
-        fp = fopen(task.dest_path.c_str(), "wb");
-        if (!fp) {
-            cerr << "[DOWNLOAD] Cannot open destination file" << endl;
-            CLOSE_SOCKET(sock);
-            return;
+    // Pieces not handed over are read back from the file
+    PieceFile src(path, false);
+    PieceBuffer buffer = PieceBuffer::get();
+    int next = 0;
+    long sent = 0;
+    bool first = true;
+    while (next < num_pieces) {
+        int front = scheduler->wait_front(next, 200);
+        if (front <= next) {
+            if (scheduler->closed()) break;
+            continue;
         }
         
-        // Pre-allocate file
-        fseek(fp, task.file_size - 1, SEEK_SET);
-        fputc('\0', fp);
-        fclose(fp);
-        fp = fopen(task.dest_path.c_str(), "r+b");
+        bool ok = true;
+        for (; ok && next < front; next++) {
+            size_t len = (size_t)piece_length(file_size, next);
+            PieceBuffer handed = handoff->take(next);
+            const char* data = handed ? handed.data() : buffer.data();
+            ok = (handed || (src.is_open() && src.read((long)next * PIECE_SIZE, buffer.data(), len) == len)) &&
+                 fwrite(data, 1, len, out) == len;
+            if (ok) sent += (long)len;
+        }
+        if (!ok || fflush(out) != 0) {
+            LOG_WARN("[STREAM] Stopped streaming to " << out_path << " after " << sent << " bytes");
+            break;
+        }
+        if (first) {
+            first = false;
+            LOG_INFO("[STREAM] First " << sent << " bytes out to " << out_path << " after "
+                     << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count()
+                     << "ms");
+        }
     }
+    handoff->stop();
+    fclose(out);
+    if (next == num_pieces) LOG_INFO("[STREAM] Streamed " << sent << " bytes to " << out_path);
+}
+
+bool download_file(const string& group_id, const string& filename, const string& dest_path,
+                   const PeerListing& listing, vector<string>& piece_hashes, vector<uint32_t>& weak_sums,
+                   const string& stream_path) {
+    long file_size = listing.file_size;
+    int num_pieces = listing.num_pieces;
+    string file_key = group_id + "/" + filename;
+    bool streaming = !stream_path.empty();
+    auto started = chrono::steady_clock::now();
     
-    // Download each assigned piece
-    for (int piece : task.pieces) {
-        string request = "GET_PIECE " + task.group_id + " " + task.filename + " " + to_string(piece);
-        send(sock, request.c_str(), (int)request.length(), 0);
-        
-        // First receive the 4-byte size header
-        uint32_t piece_size = 0;
-        int header_received = 0;
-        while (header_received < 4) {
-            int r = recv(sock, ((char*)&piece_size) + header_received, 4 - header_received, 0);
-            if (r <= 0) break;
-            header_received += r;
-        }
-        
-        if (piece_size == 0 || header_received < 4) {
-            cerr << "[DOWNLOAD] Failed to receive piece " << piece << endl;
-            continue;
+    LOG_INFO("[DOWNLOAD] Starting parallel download of " << filename);
+    LOG_INFO("[DOWNLOAD] File size: " << file_size << " bytes, Pieces: " << num_pieces);
+    LOG_INFO("[DOWNLOAD] Available peers: " << listing.peers.size());
+    
+    // Get bit vectors from all peers: straight from the tracker's listing when
+    // it reports availability, otherwise by asking each peer. The tracker only
+    // hands out a bounded sample of the swarm; if those peers don't cover every
+    // piece, ask a few of them which other peers they know, and failing that
+    // the tracker (which rotates through the swarm), a few times.
+    vector<PeerInfo> peers;
+    set<string> seen;
+    set<string> pex_asked;
+    PeerListing candidates = listing;
+    vector<bool> covered(num_pieces, false);
+    int uncovered = num_pieces;
+    
+    for (int round = 0; ; round++) {
+        for (size_t c = 0; c < candidates.peers.size(); c++) {
+            const auto& p = candidates.peers[c];
+            if (!seen.insert(p.first + ":" + to_string(p.second)).second) continue;
+            
+            PeerInfo peer;
+            peer.ip = p.first;
+            peer.port = p.second;
+            if (c < candidates.pieces.size()) {
+                if (!decode_pieces(candidates.pieces[c], num_pieces, peer.bit_vector)) continue;
+            } else {
+                peer.bit_vector = get_peer_bit_vector(p.first, p.second, group_id, filename);
+                if (!peer.bit_vector.empty()) {
+                    LOG_DEBUG("[DOWNLOAD] Got bit vector from " << p.first << ":" << p.second);
+                }
+            }
+            
+            if (!peer.bit_vector.empty()) {
+                pex_add(group_id, filename, p.first + ":" + to_string(p.second));
+                for (int i = 0; i < num_pieces && i < (int)peer.bit_vector.size(); i++) {
+                    if (peer.bit_vector[i] && !covered[i]) {
+                        covered[i] = true;
+                        uncovered--;
+                    }
+                }
+                peers.push_back(peer);
+            }
         }
         
-        // Now receive the piece data
-        char buffer[PIECE_SIZE + 100];
-        memset(buffer, 0, sizeof(buffer));
+        if (uncovered == 0 || round >= MAX_PEER_ROUNDS) break;
         
-        int total_received = 0;
-        while (total_received < (int)piece_size) {
-            int bytes_received = recv(sock, buffer + total_received, (int)piece_size - total_received, 0);
-            if (bytes_received <= 0) break;
-            total_received += bytes_received;
+        candidates = PeerListing();
+        if (pex_enabled) {
+            vector<string> ask;
+            for (const PeerInfo& peer : peers) {
+                if (ask.size() == PEX_BOOTSTRAP_PEERS) break;
+                string addr = peer.ip + ":" + to_string(peer.port);
+                if (pex_asked.insert(addr).second) ask.push_back(addr);
+            }
+            for (const string& addr : pex_from_peers(group_id, filename, ask)) {
+                if (seen.count(addr)) continue;
+                size_t colon = addr.rfind(':');
+                candidates.peers.push_back(make_pair(addr.substr(0, colon), atoi(addr.c_str() + colon + 1)));
+            }
+            if (!candidates.peers.empty()) continue;
         }
+        if (listing.trackerless) break;
         
-        if (total_received > 0) {
-            // Write piece to correct position in file
-            long offset = (long)piece * PIECE_SIZE;
-            fseek(fp, offset, SEEK_SET);
-            fwrite(buffer, 1, total_received, fp);
-            
-            cout << "[DOWNLOAD] Piece " << piece << " downloaded (" << total_received << " bytes)" << endl;
+        string response = send_to_tracker("more_peers " + group_id + " " + filename + " " +
+                                          to_string(DEFAULT_NUMWANT));
+        if (!parse_peers_response(response, candidates)) break;
+        
+        bool any_new = false;
+        for (const auto& p : candidates.peers) {
+            if (!seen.count(p.first + ":" + to_string(p.second))) {
+                any_new = true;
+                break;
+            }
         }
+        if (!any_new) break; // The swarm is exhausted
     }
     
-    fclose(fp);
-    CLOSE_SOCKET(sock);
+    if (peers.empty()) {
+        LOG_ERROR("[DOWNLOAD] No peers with valid bit vectors");
+        return false;
+    }
     
-    cout << "[DOWNLOAD] Finished downloading from " << task.peer_ip << endl;
-}
-
-bool download_file(const string& group_id, const string& filename, const string& dest_path,
-                   const vector<pair<string, int>>& peer_list, long file_size, int num_pieces) {
+    // Rarest-first when the tracker reported swarm-wide availability, with
+    // peers that were fast before planned more pieces. A stream takes pieces
+    // in file order, so there the plan only decides which peers to use.
+    vector<int> order(num_pieces);
+    for (int i = 0; i < num_pieces; i++) order[i] = i;
+    if (!listing.piece_counts.empty()) {
+        weight_peers_by_history(peers);
+        assign_pieces_rarest_first(peers, num_pieces, listing.piece_counts);
+        if (!streaming) {
+            stable_sort(order.begin(), order.end(), [&](int a, int b) {
+                return listing.piece_counts[a] < listing.piece_counts[b];
+            });
+        }
+    } else {
+        assign_pieces_round_robin(peers, num_pieces);
+    }
     
-    cout << "[DOWNLOAD] Starting parallel download of " << filename << endl;
-    cout << "[DOWNLOAD] File size: " << file_size << " bytes, Pieces: " << num_pieces << endl;
-    cout << "[DOWNLOAD] Available peers: " << peer_list.size() << endl;
+    // Our copy of an older version of the file, to take unchanged pieces
+    // from. A file we share (such as that one) is only replaced once the new
+    // one is complete: until then we download next to it.
+    string basis;
+    string write_path = dest_path;
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        auto group = peer_file_map.find(group_id);
+        if (group != peer_file_map.end() && group->second.count(filename) &&
+            (group->second[filename].root != listing.root || listing.root.empty())) {
+            basis = group->second[filename].filepath;
+        }
+        for (const auto& g : peer_file_map) {
+            for (const auto& file : g.second) {
+                if (file.second.filepath == dest_path) write_path = dest_path + ".part";
+            }
+        }
+    }
+    if (listing.version > 1) {
+        LOG_INFO("[DOWNLOAD] " << filename << " is at version " << listing.version
+                 << (basis.empty() ? "" : "; reusing what we can of " + basis));
+    }
     
-    // Get bit vectors from all peers
-    vector<PeerInfo> peers;
-    for (const auto& p : peer_list) {
-        PeerInfo peer;
-        peer.ip = p.first;
-        peer.port = p.second;
-        peer.bit_vector = get_peer_bit_vector(p.first, p.second, group_id, filename);
-        
-        if (!peer.bit_vector.empty()) {
-            peers.push_back(peer);
-            cout << "[DOWNLOAD] Got bit vector from " << p.first << ":" << p.second << endl;
+    // A bundle is written into its files, as its manifest lays them out
+    Manifest manifest;
+    if (!listing.manifest.empty()) {
+        for (size_t i = 0; i < peers.size() && i < MAX_HASH_SOURCES && !manifest; i++) {
+            manifest = get_peer_manifest(peers[i].ip, peers[i].port, group_id, filename, listing.manifest,
+                                         file_size);
+        }
+        if (!manifest) {
+            LOG_ERROR("[DOWNLOAD] No peer could give the manifest of " << filename);
+            return false;
         }
+        register_bundle(write_path, manifest);
+        LOG_INFO("[DOWNLOAD] " << filename << " is a bundle of " << manifest->size() << " files");
     }
     
-    if (peers.empty()) {
-        cerr << "[DOWNLOAD] No peers with valid bit vectors" << endl;
+    // Create and size the destination once, before any thread writes to it
+    if (!create_piece_file(write_path, file_size, manifest, write_path == dest_path)) {
+        LOG_ERROR("[DOWNLOAD] Cannot create destination " << write_path);
         return false;
     }
     
-    // Assign pieces using round-robin
-    assign_pieces_round_robin(peers, num_pieces);
+    // Piece digests, from the first peer that has them, let us copy pieces
+    // we already hold and verify the ones we fetch
+    piece_hashes.clear();
+    if (!listing.root.empty()) {
+        for (size_t i = 0; i < peers.size() && i < MAX_HASH_SOURCES && piece_hashes.empty(); i++) {
+            piece_hashes = get_peer_piece_hashes(peers[i].ip, peers[i].port, group_id, filename, num_pieces,
+                                                 listing.root, weak_sums);
+        }
+        if (piece_hashes.empty()) LOG_WARN("[DOWNLOAD] No peer could give piece hashes for " << filename);
+    }
+    
+    // Serve pieces to the rest of the swarm while we download; announces
+    // report them to the tracker
+    bool share_pieces = false;
+    {
+        lock_guard<mutex> lock(file_map_mutex);
+        if (!peer_file_map[group_id].count(filename)) {
+            LocalFileInfo info;
+            info.filepath = write_path;
+            info.file_size = file_size;
+            info.num_pieces = num_pieces;
+            info.bit_vector.resize(num_pieces, false);
+            if (!piece_hashes.empty()) {
+                info.piece_hashes = piece_hashes;
+                info.weak_sums = weak_sums;
+                info.root = listing.root;
+            }
+            add_shared_file(group_id, filename, info);
+            share_pieces = true;
+        }
+    }
+    
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        FileProgress& progress = download_progress[file_key];
+        progress = FileProgress();
+        progress.num_pieces = num_pieces;
+        progress.file_size = file_size;
+        progress.active = true;
+        progress.started = chrono::steady_clock::now();
+    }
+    
+    PieceScheduler scheduler(num_pieces, order, streaming ? max(1, read_ahead) : 0);
+    
+    if (!piece_hashes.empty()) {
+        vector<bool> local;
+        int copied = copy_local_pieces(write_path, listing.root, file_size, piece_hashes, weak_sums, basis,
+                                       scheduler, local);
+        if (copied > 0) {
+            uint64_t bytes = 0;
+            for (int i = 0; i < num_pieces; i++) {
+                if (local[i]) bytes += piece_length(file_size, i);
+            }
+            record_local_pieces(file_key, copied, bytes);
+            
+            if (share_pieces) {
+                lock_guard<mutex> lock(file_map_mutex);
+                LocalFileInfo& info = peer_file_map[group_id][filename];
+                for (int i = 0; i < num_pieces && i < (int)info.bit_vector.size(); i++) {
+                    if (local[i]) info.bit_vector[i] = true;
+                }
+                shares_changed = true;
+            }
+        }
+    }
+    
+    StreamHandoff handoff(max(1, read_ahead));
+    thread streamer;
+    if (streaming) {
+        streamer = thread(stream_pieces, write_path, stream_path, file_size, num_pieces, &scheduler, &handoff,
+                          started);
+    }
     
     // Create download threads
+    atomic<int> workers(0);
     vector<thread> threads;
+    PexFeed pex;
+    for (const string& addr : seen) pex.known.insert(addr);
+    
+    DownloadTask task;
+    task.group_id = group_id;
+    task.filename = filename;
+    task.dest_path = write_path;
+    task.file_size = file_size;
+    task.share_pieces = share_pieces;
+    task.stream = streaming ? &handoff : NULL;
+    task.piece_hashes = &piece_hashes;
+    task.pex = &pex;
     
     for (auto& peer : peers) {
-        if (peer.assigned_pieces.empty()) continue;
+        if (peer.assigned_pieces.empty() || scheduler.remaining() == 0) continue;
         
-        DownloadTask task;
         task.peer_ip = peer.ip;
         task.peer_port = peer.port;
-        task.group_id = group_id;
-        task.filename = filename;
-        task.dest_path = dest_path;
-        task.pieces = peer.assigned_pieces;
-        task.file_size = file_size;
+        if (!streaming) task.pieces = peer.assigned_pieces;
+        task.have = peer.bit_vector;
+        
+        workers++;
+        threads.emplace_back(download_from_peer, task, &scheduler, &workers);
+    }
+    
+    // Report progress until every peer thread is done, starting threads for
+    // sources our peers tell us about while we are short of them
+    auto last_report = chrono::steady_clock::now();
+    while (true) {
+        string addr;
+        while (workers < PEX_MIN_SOURCES && scheduler.remaining() > 0 && pex.take(addr)) {
+            size_t colon = addr.rfind(':');
+            task.peer_ip = addr.substr(0, colon);
+            task.peer_port = atoi(addr.c_str() + colon + 1);
+            task.pieces.clear();
+            task.have.clear();
+            
+            workers++;
+            threads.emplace_back(download_from_peer, task, &scheduler, &workers);
+        }
+        if (workers == 0) break;
+        if (streaming && scheduler.unblock_window(workers)) {
+            LOG_WARN("[STREAM] No peer can serve piece " << scheduler.front() << " of " << filename
+                     << "; fetching the rest out of order");
+        }
+        
+        this_thread::sleep_for(chrono::milliseconds(100));
+        auto now = chrono::steady_clock::now();
+        if (now - last_report < chrono::milliseconds(PROGRESS_LOG_MS)) continue;
+        last_report = now;
         
-        threads.emplace_back(download_from_peer, task);
+        lock_guard<mutex> lock(stats_mutex);
+        const FileProgress& progress = download_progress[file_key];
+        double eta = progress.eta();
+        LOG_INFO("[DOWNLOAD] " << filename << ": " << progress.done_pieces << "/" << num_pieces
+                 << " pieces, " << format_rate(progress.rate()) << ", ETA "
+                 << (eta >= 0 ? to_string((long)eta) + "s" : string("?")));
     }
     
-    // Wait for all downloads to complete
     for (auto& t : threads) {
         if (t.joinable()) {
             t.join();
         }
     }
     
-    cout << "[DOWNLOAD] Download complete: " << dest_path << endl;
+    // The stream ends once its reader has everything (or can't get it)
+    scheduler.close();
+    if (streamer.joinable()) streamer.join();
+    
+    int missing = scheduler.remaining();
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        FileProgress& progress = download_progress[file_key];
+        progress.active = false;
+        progress.complete = missing == 0;
+        progress.finished = chrono::steady_clock::now();
+        LOG_INFO("[DOWNLOAD] " << filename << ": " << progress.done_pieces << "/" << num_pieces
+                 << " pieces in " << progress.seconds() << "s, " << format_rate(progress.rate()));
+    }
+    if (pex.found > 0) {
+        LOG_INFO("[DOWNLOAD] Peers told us of " << pex.found << " more sources of " << filename);
+    }
+    
+    if (missing > 0) {
+        LOG_ERROR("[DOWNLOAD] " << missing << " pieces of " << filename << " could not be downloaded");
+        return false;
+    }
+    
+    if (write_path != dest_path) {
+        if (!replace_piece_file(write_path, dest_path, manifest)) {
+            LOG_ERROR("[DOWNLOAD] Cannot replace " << dest_path << " with " << write_path);
+            return false;
+        }
+        if (manifest) register_bundle(dest_path, manifest);
+        index_file_pieces(dest_path, piece_hashes);
+    }
+    
+    LOG_INFO("[DOWNLOAD] Download complete: " << dest_path);
     
     return true;
 }
 
 // ==================== SERVER THREAD (Serve other peers) ====================
 
-void handle_peer_request(SOCKET client_socket) {
+void handle_peer_request(SOCKET client_socket, string requester) {
     char buffer[BUFFER_SIZE];
+    bool compressed = false;   // Agreed in HELLO; changes the GET_PIECE header
+    map<string, uint64_t> pex_cursors;   // "group_id/filename" -> changes already sent
+    chrono::steady_clock::time_point pex_last;
+    
+    // Kept across requests, so serving a piece allocates nothing: the parsed
+    // request, the piece buffers, and the file last served with what it was
+    // opened for ("<path>|<content>")
+    vector<string> args;
+    string filepath;
+    string root;
+    string content;
+    string file_key;
+    string open_key;
+    string served_key;
+    unique_ptr<PieceFile> served;
+    PieceBuffer piece_buffer;
+    PieceBuffer packed_buffer;
     
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
         
         if (bytes_received <= 0) break;
         
-        string request(buffer);
-        vector<string> args = split_string(request, ' ');
+        buffer[bytes_received] = '\0';
+        split_words(buffer, strlen(buffer), args);
         
         if (args.empty()) continue;
         
-        string cmd = args[0];
+        const string& cmd = args[0];
         
-        if (cmd == "GET_BITVECTOR" && args.size() >= 3) {
+        if (cmd == "HELLO") {
+            bool offered = false;
+            bool pex = false;
+            for (size_t i = 1; i < args.size(); i++) {
+                if (args[i] == "compress=lz") offered = true;
+                if (args[i] == "pex") pex = pex_enabled;
+            }
+            compressed = offered && compression_enabled;
+            string reply = compressed ? "HELLO compress=lz" : "HELLO";
+            if (pex) reply += " pex";
+            send(client_socket, reply.c_str(), (int)reply.length(), 0);
+        }
+        else if (cmd == "GET_BITVECTOR" && args.size() >= 3) {
             string group_id = args[1];
             string filename = args[2];
             
@@ -404,57 +4580,138 @@ void handle_peer_request(SOCKET client_socket) {
             if (peer_file_map.find(group_id) != peer_file_map.end() &&
                 peer_file_map[group_id].find(filename) != peer_file_map[group_id].end()) {
                 
-                LocalFileInfo& info = peer_file_map[group_id][filename];
-                string response = "BITVECTOR:";
-                
-                for (bool bit : info.bit_vector) {
-                    response += " " + to_string(bit ? 1 : 0);
-                }
-                
+                string response = build_bitvector_response(peer_file_map[group_id][filename].bit_vector);
                 send(client_socket, response.c_str(), (int)response.length(), 0);
             } else {
                 const char* error_msg = "ERROR: File not found";
                 send(client_socket, error_msg, (int)strlen(error_msg), 0);
             }
         }
+        else if (cmd == "GET_HASHES" && args.size() >= 3) {
+            string response(4, '\0');
+            {
+                lock_guard<mutex> lock(file_map_mutex);
+                auto group = peer_file_map.find(args[1]);
+                if (group != peer_file_map.end() && group->second.count(args[2])) {
+                    const LocalFileInfo& info = group->second[args[2]];
+                    if ((int)info.piece_hashes.size() == info.num_pieces &&
+                        info.weak_sums.size() == info.piece_hashes.size()) {
+                        uint32_t count = htonl((uint32_t)info.num_pieces);
+                        memcpy(&response[0], &count, 4);
+                        for (int i = 0; i < info.num_pieces; i++) {
+                            uint32_t weak = htonl(info.weak_sums[i]);
+                            response += info.piece_hashes[i];
+                            response.append((const char*)&weak, 4);
+                        }
+                    }
+                }
+            }
+            send_all(client_socket, response.data(), response.size());
+        }
+        else if (cmd == "GET_MANIFEST" && args.size() >= 3) {
+            // [u32 length][manifest text]; length 0 if it isn't a bundle we have
+            Manifest manifest;
+            {
+                lock_guard<mutex> lock(file_map_mutex);
+                auto group = peer_file_map.find(args[1]);
+                if (group != peer_file_map.end() && group->second.count(args[2])) {
+                    manifest = find_bundle(group->second[args[2]].filepath);
+                }
+            }
+            string text = manifest ? manifest_text(*manifest) : string();
+            uint32_t length = htonl((uint32_t)text.size());
+            string response((const char*)&length, 4);
+            send_all(client_socket, (response + text).data(), response.size() + text.size());
+        }
+        else if (cmd == "PEX" && args.size() >= 4) {
+            // Only for a file we share; the requester's address joins the
+            // list if it is on the IP the connection comes from
+            bool shared;
+            {
+                lock_guard<mutex> lock(file_map_mutex);
+                auto group = peer_file_map.find(args[1]);
+                shared = group != peer_file_map.end() && group->second.count(args[2]);
+            }
+            string response;
+            auto now = chrono::steady_clock::now();
+            if (shared && now - pex_last < chrono::milliseconds(PEX_MIN_INTERVAL_MS)) {
+                response = "PEX:";  // Too soon: nothing this time
+            } else if (shared) {
+                pex_last = now;
+                response = pex_delta(args[1], args[2], args[3], pex_cursors[args[1] + "/" + args[2]]);
+                if (!response.empty() && args[3].compare(0, requester.size() + 1, requester + ":") == 0) {
+                    pex_add(args[1], args[2], args[3]);
+                }
+            }
+            uint32_t length = htonl((uint32_t)response.size());
+            string message((const char*)&length, 4);
+            message += response;
+            send_all(client_socket, message.data(), message.size());
+        }
         else if (cmd == "GET_PIECE" && args.size() >= 4) {
-            string group_id = args[1];
-            string filename = args[2];
-            int piece_num = stoi(args[3]);
+            const string& group_id = args[1];
+            const string& filename = args[2];
+            int piece_num = atoi(args[3].c_str());
+            auto started = chrono::steady_clock::now();
             
-            lock_guard<mutex> lock(file_map_mutex);
-            
-            if (peer_file_map.find(group_id) != peer_file_map.end() &&
-                peer_file_map[group_id].find(filename) != peer_file_map[group_id].end()) {
-                
-                LocalFileInfo& info = peer_file_map[group_id][filename];
-                
-                if (piece_num < (int)info.bit_vector.size() && info.bit_vector[piece_num]) {
-                    // Read piece from file
-                    FILE* fp = fopen(info.filepath.c_str(), "rb");
-                    if (fp) {
-                        long offset = (long)piece_num * PIECE_SIZE;
-                        fseek(fp, offset, SEEK_SET);
-                        
-                        char piece_buffer[PIECE_SIZE];
-                        size_t bytes_read = fread(piece_buffer, 1, PIECE_SIZE, fp);
-                        fclose(fp);
-                        
-                        // Send size header (4 bytes) + piece data
-                        uint32_t size = (uint32_t)bytes_read;
-                        send(client_socket, (char*)&size, sizeof(size), 0);
-                        send(client_socket, piece_buffer, (int)bytes_read, 0);
-                    } else {
-                        uint32_t size = 0;
-                        send(client_socket, (char*)&size, sizeof(size), 0);
+            filepath.clear();
+            root.clear();
+            {
+                lock_guard<mutex> lock(file_map_mutex);
+                auto group = peer_file_map.find(group_id);
+                if (group != peer_file_map.end()) {
+                    auto file = group->second.find(filename);
+                    if (file != group->second.end() && piece_num >= 0 &&
+                        piece_num < (int)file->second.bit_vector.size() && file->second.bit_vector[piece_num]) {
+                        filepath = file->second.filepath;
+                        root = file->second.root;
                     }
-                } else {
-                    uint32_t size = 0;
-                    send(client_socket, (char*)&size, sizeof(size), 0);
                 }
+            }
+            
+            // Read the piece, through the handle from the last request when
+            // it is for the same file and content (the root hash, or the
+            // modification time for a file without one)
+            size_t bytes_read = 0;
+            if (!filepath.empty()) {
+                if (root.empty()) content.assign(filepath).append("@").append(to_string(get_file_mtime(filepath)));
+                else content.assign(root);
+                open_key.assign(filepath).append("|").append(content);
+                if (!served || open_key != served_key) {
+                    served.reset(new PieceFile(filepath, false));
+                    served_key = open_key;
+                }
+                if (!piece_buffer) piece_buffer = PieceBuffer::get();
+                bytes_read = served->read((long)piece_num * PIECE_SIZE, piece_buffer.data(), PIECE_SIZE);
+            }
+            size_t wire_size = bytes_read;
+            
+            if (!compressed) {
+                // Size header (4 bytes) + piece data; size 0 if we can't serve it
+                uint32_t size = (uint32_t)bytes_read;
+                send_parts(client_socket, (const char*)&size, sizeof(size), piece_buffer.data(), bytes_read);
             } else {
-                uint32_t size = 0;
-                send(client_socket, (char*)&size, sizeof(size), 0);
+                // Piece size and wire size, then the data, in one send; the
+                // data is compressed exactly when the two sizes differ
+                const char* data = piece_buffer.data();
+                if (bytes_read > 0) {
+                    if (!packed_buffer) packed_buffer = PieceBuffer::get();
+                    size_t packed = compress_piece(content, piece_num, piece_buffer.data(), bytes_read,
+                                                   packed_buffer.data());
+                    if (packed > 0) {
+                        data = packed_buffer.data();
+                        wire_size = packed;
+                    }
+                }
+                uint32_t header[2] = { htonl((uint32_t)bytes_read), htonl((uint32_t)wire_size) };
+                send_parts(client_socket, (const char*)header, sizeof(header), data, wire_size);
+            }
+            
+            if (bytes_read > 0) {
+                file_key.assign(group_id).append("/").append(filename);
+                record_upload_piece(requester, file_key, bytes_read, wire_size,
+                                    (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                                        chrono::steady_clock::now() - started).count());
             }
         }
     }
@@ -465,7 +4722,7 @@ void handle_peer_request(SOCKET client_socket) {
 void server_thread_func() {
     SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (server_socket == INVALID_SOCKET) {
-        cerr << "[SERVER] Socket creation failed" << endl;
+        LOG_ERROR("[SERVER] Socket creation failed");
         return;
     }
     
@@ -479,18 +4736,18 @@ void server_thread_func() {
     server_addr.sin_port = htons(my_port);
     
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        cerr << "[SERVER] Bind failed on port " << my_port << endl;
+        LOG_ERROR("[SERVER] Bind failed on port " << my_port);
         CLOSE_SOCKET(server_socket);
         return;
     }
     
     if (listen(server_socket, 10) == SOCKET_ERROR) {
-        cerr << "[SERVER] Listen failed" << endl;
+        LOG_ERROR("[SERVER] Listen failed");
         CLOSE_SOCKET(server_socket);
         return;
     }
     
-    cout << "[SERVER] Peer server listening on " << my_ip << ":" << my_port << endl;
+    LOG_INFO("[SERVER] Peer server listening on " << my_ip << ":" << my_port);
     
     while (running) {
         struct sockaddr_in client_addr;
@@ -501,8 +4758,12 @@ void server_thread_func() {
         if (client_socket == INVALID_SOCKET) {
             continue;
         }
+        if (!running) {
+            CLOSE_SOCKET(client_socket);  // The wake-up connection from shutdown
+            break;
+        }
         
-        thread client_thread(handle_peer_request, client_socket);
+        thread client_thread(handle_peer_request, client_socket, string(inet_ntoa(client_addr.sin_addr)));
         client_thread.detach();
     }
     
@@ -519,15 +4780,20 @@ void print_help() {
     cout << "create_group <group_id>                  - Create a new group" << endl;
     cout << "join_group <group_id>                    - Request to join group" << endl;
     cout << "leave_group <group_id>                   - Leave a group" << endl;
-    cout << "list_groups                              - List all groups" << endl;
-    cout << "list_requests <group_id>                 - List pending requests (owner)" << endl;
+    cout << "list_groups [options]                    - List all groups" << endl;
+    cout << "list_requests <group_id> [options]       - List pending requests (owner)" << endl;
     cout << "accept_request <group_id> <user_id>      - Accept join request (owner)" << endl;
     cout << "upload_file <filepath> <group_id>        - Share file with group" << endl;
-    cout << "list_files <group_id>                    - List files in group" << endl;
+    cout << "upload_files <group_id> <file1> [file2 ...] - Share many files at once" << endl;
+    cout << "upload_bundle <directory> <group_id>     - Share a directory as one bundle" << endl;
+    cout << "list_files <group_id> [options]          - List files in group" << endl;
     cout << "download_file <group_id> <filename> <dest> - Download file" << endl;
+    cout << "stream_file <group_id> <filename> <dest> <out> - Download in order, copying to <out> as it arrives" << endl;
     cout << "show_downloads                           - Show local files" << endl;
+    cout << "stats [json [path]]                      - Transfer statistics" << endl;
     cout << "help                                     - Show this help" << endl;
     cout << "quit                                     - Exit client" << endl;
+    cout << "List options: limit=<n> after=<cursor> prefix=<str>" << endl;
     cout << "=========================================\n" << endl;
 }
 
@@ -541,7 +4807,14 @@ void client_thread_func() {
         cout << (logged_in ? ("[" + current_user + "]> ") : "> ");
         
         string input;
-        getline(cin, input);
+        if (!getline(cin, input)) {
+            // End of input (e.g. driven from a script): same as quit
+            if (logged_in) {
+                send_to_tracker("logout");
+            }
+            running = false;
+            break;
+        }
         
         if (input.empty()) continue;
         
@@ -568,108 +4841,183 @@ void client_thread_func() {
             for (const auto& group : peer_file_map) {
                 cout << "Group: " << group.first << endl;
                 for (const auto& file : group.second) {
-                    cout << "  - " << file.first << " (" << file.second.file_size << " bytes)" << endl;
+                    Manifest manifest = find_bundle(file.second.filepath);
+                    cout << "  - " << file.first << " (" << file.second.file_size << " bytes";
+                    if (manifest) cout << ", bundle of " << manifest->size() << " files";
+                    cout << ")" << endl;
                 }
             }
             cout << "==================\n" << endl;
             continue;
         }
         
+        else if (cmd == "stats") {
+            if (args.size() >= 2 && args[1] == "json") {
+                string json = stats_json();
+                if (args.size() >= 3) {
+                    ofstream out(args[2]);
+                    if (out << json << "\n") cout << "Stats written to " << args[2] << endl;
+                    else cout << "ERROR: Cannot write " << args[2] << endl;
+                } else {
+                    cout << json << endl;
+                }
+            } else {
+                cout << "\n" << stats_text() << endl;
+            }
+            continue;
+        }
+        
         // Commands that need tracker communication
         string message = input;
         
         if (cmd == "login") {
-            // Append our server port so tracker knows where we're listening
-            message += " " + to_string(my_port);
+            // Append our server port so tracker knows where we're listening,
+            // and our locality so it can rank nearby peers first
+            message += " " + to_string(advertised_port);
+            if (!my_zone.empty()) message += " zone=" + my_zone;
+            if (!my_coord.empty()) message += " coord=" + my_coord;
         }
         else if (cmd == "upload_file" && args.size() >= 3) {
             string filepath = args[1];
             string group_id = args[2];
             
-            // Check if file exists
-            long file_size = get_file_size(filepath);
-            if (file_size < 0) {
+            // Check if file exists, and hash its pieces
+            LocalFileInfo info;
+            if (!describe_local_file(filepath, info)) {
                 cout << "ERROR: File not found: " << filepath << endl;
                 continue;
             }
             
-            int num_pieces = calculate_num_pieces(file_size);
-            string filename = get_filename(filepath);
-            
             // Store in local file map
             {
                 lock_guard<mutex> lock(file_map_mutex);
-                LocalFileInfo info;
-                info.filepath = filepath;
-                info.file_size = file_size;
-                info.num_pieces = num_pieces;
-                info.bit_vector.resize(num_pieces, true);  // We have all pieces
-                peer_file_map[group_id][filename] = info;
+                add_shared_file(group_id, get_filename(filepath), info);
             }
             
             // Send to tracker with file metadata
             message = "upload_file " + filepath + " " + group_id + " " + 
-                      to_string(file_size) + " " + to_string(num_pieces);
+                      to_string(info.file_size) + " " + to_string(info.num_pieces) + " root=" + info.root;
         }
-        else if (cmd == "download_file" && args.size() >= 4) {
+        else if (cmd == "upload_files" && args.size() >= 3) {
             string group_id = args[1];
-            string filename = args[2];
-            string dest_path = args[3];
+            vector<string> entries;
+            
+            for (size_t i = 2; i < args.size(); i++) {
+                string filepath = args[i];
+                LocalFileInfo info;
+                if (!describe_local_file(filepath, info)) {
+                    cout << "ERROR: File not found: " << filepath << endl;
+                    continue;
+                }
+                {
+                    lock_guard<mutex> lock(file_map_mutex);
+                    add_shared_file(group_id, get_filename(filepath), info);
+                }
+                
+                entries.push_back(filepath + " " + to_string(info.file_size) + " " + to_string(info.num_pieces) +
+                                  " root=" + info.root);
+            }
             
-            // Ask tracker for peer list
-            string response = send_to_tracker("download_file " + group_id + " " + filename);
+            if (entries.empty()) continue;
+            
+            // Up to BULK_ITEMS_PER_COMMAND files per command, many commands per round trip
+            for (const string& result : send_bulk("upload_files " + group_id, entries)) {
+                cout << result << endl;
+                if (result.find("SUCCESS") == 0) pex_join_group(group_id);
+            }
+            continue;
+        }
+        else if (cmd == "upload_bundle" && args.size() >= 3) {
+            string dir = args[1];
+            string group_id = args[2];
+            while (dir.size() > 1 && (dir.back() == '/' || dir.back() == '\\')) dir.pop_back();
             
-            if (response.find("PEERS:") == string::npos) {
-                cout << response << endl;
+            LocalFileInfo info;
+            string manifest_hash;
+            if (!describe_local_bundle(dir, info, manifest_hash)) {
+                cout << "ERROR: Cannot bundle directory: " << dir << endl;
                 continue;
             }
+            {
+                lock_guard<mutex> lock(file_map_mutex);
+                add_shared_file(group_id, get_filename(dir), info);
+            }
             
-            // Parse response: "PEERS: ip1:port1 ip2:port2 ... SIZE:xyz PIECES:n"
-            vector<pair<string, int>> peer_list;
-            long file_size = 0;
-            int num_pieces = 0;
+            message = "upload_file " + dir + " " + group_id + " " + to_string(info.file_size) + " " +
+                      to_string(info.num_pieces) + " root=" + info.root + " manifest=" + manifest_hash;
+        }
+        else if ((cmd == "download_file" && args.size() >= 4) || (cmd == "stream_file" && args.size() >= 5)) {
+            string group_id = args[1];
+            string filename = args[2];
+            string dest_path = args[3];
+            string stream_path = cmd == "stream_file" ? args[4] : "";
             
-            stringstream ss(response);
-            string token;
+            PeerListing listing;
             
-            while (ss >> token) {
-                if (token.find(':') != string::npos && token.find("SIZE") == string::npos && 
-                    token.find("PIECES") == string::npos && token != "PEERS:") {
-                    size_t colon = token.find(':');
-                    string ip = token.substr(0, colon);
-                    int port = stoi(token.substr(colon + 1));
-                    peer_list.push_back({ip, port});
+            // With the DHT, the tracker only checks we may have the file and
+            // describes it; its providers come from the DHT
+            if (dht_enabled) {
+                string response = send_to_tracker("file_info " + group_id + " " + filename);
+                if (!parse_peers_response(response, listing)) {
+                    cout << response << endl;
+                    continue;
                 }
-                else if (token.find("SIZE:") == 0) {
-                    file_size = stol(token.substr(5));
+                for (const string& addr : dht_find_providers(group_id, filename)) {
+                    size_t colon = addr.rfind(':');
+                    listing.peers.push_back(make_pair(addr.substr(0, colon), atoi(addr.c_str() + colon + 1)));
                 }
-                else if (token.find("PIECES:") == 0) {
-                    num_pieces = stoi(token.substr(7));
+                listing.trackerless = !listing.peers.empty();
+                if (listing.peers.empty()) LOG_INFO("[DHT] No providers of " << filename << ", asking the tracker");
+            }
+            
+            // Ask tracker for a bounded sample of the swarm
+            if (listing.peers.empty()) {
+                string response = send_to_tracker("download_file " + group_id + " " + filename + " " +
+                                                  to_string(DEFAULT_NUMWANT));
+                listing = PeerListing();
+                if (!parse_peers_response(response, listing)) {
+                    cout << response << endl;
+                    continue;
                 }
             }
+            long file_size = listing.file_size;
+            int num_pieces = listing.num_pieces;
             
-            if (peer_list.empty()) {
+            if (listing.peers.empty()) {
                 cout << "ERROR: No peers available" << endl;
                 continue;
             }
+            pex_join_group(group_id);
             
             // Start parallel download
-            bool success = download_file(group_id, filename, dest_path, peer_list, file_size, num_pieces);
+            vector<string> piece_hashes;
+            vector<uint32_t> weak_sums;
+            bool success = download_file(group_id, filename, dest_path, listing, piece_hashes, weak_sums,
+                                         stream_path);
             
             if (success) {
                 // Update local file map
+                long long mtime = content_mtime(dest_path);
                 {
                     lock_guard<mutex> lock(file_map_mutex);
                     LocalFileInfo info;
                     info.filepath = dest_path;
                     info.file_size = file_size;
                     info.num_pieces = num_pieces;
+                    info.mtime = mtime;
                     info.bit_vector.resize(num_pieces, true);
-                    peer_file_map[group_id][filename] = info;
+                    if (!piece_hashes.empty()) {
+                        info.piece_hashes = piece_hashes;
+                        info.weak_sums = weak_sums;
+                        info.root = listing.root;
+                    }
+                    add_shared_file(group_id, filename, info);
                 }
                 
-                // Tell tracker we're now a seeder
-                send_to_tracker("update_seeder " + group_id + " " + filename);
+                // Tell tracker we're now a seeder (of this version)
+                string root = listing.root.empty() ? "" : " root=" + listing.root;
+                string reply = send_to_tracker("update_seeder " + group_id + " " + filename + root);
+                if (reply.find("ERROR") == 0) cout << reply << endl;
                 
                 cout << "SUCCESS: File downloaded to " << dest_path << endl;
             } else {
@@ -685,21 +5033,138 @@ void client_thread_func() {
         // Update local state based on response
         if (cmd == "login" && response.find("SUCCESS") != string::npos) {
             logged_in = true;
+            logged_in_session = true;
             current_user = args[1];
+            reannounce_seeded_files();   // Whatever the share index restored
         }
         else if (cmd == "logout" && response.find("SUCCESS") != string::npos) {
             logged_in = false;
+            logged_in_session = false;
             current_user = "";
         }
+        else if (cmd == "leave_group" && args.size() >= 2 && response.find("SUCCESS") != string::npos) {
+            pex_leave_group(args[1]);
+        }
+        else if ((cmd == "upload_file" || cmd == "upload_bundle") && args.size() >= 3 &&
+                 response.find("SUCCESS") != string::npos) {
+            pex_join_group(args[2]);
+        }
     }
 }
 
 // ==================== MAIN ====================
 
+#ifndef P2P_NO_MAIN  // Defined by programs that link the client's functions in (bench/micro.cpp)
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        cout << "Usage: client.exe <IP>:<PORT> <tracker_info_file>" << endl;
+        cout << "Usage: client.exe <IP>:<PORT> <tracker_info_file> [options]" << endl;
         cout << "Example: client.exe 127.0.0.1:6000 tracker_info.txt" << endl;
+        cout << "Options:" << endl;
+        cout << "  --zone=<label>              Zone/rack this client runs in" << endl;
+        cout << "  --coord=<x>,<y>             Network coordinates of this client" << endl;
+        cout << "  --advertise-port=<port>     Port to give the tracker, when peers reach us through" << endl;
+        cout << "                              a forwarder (e.g. bench/netem) instead of directly" << endl;
+        cout << "  --compress=<lz|off>         Compress pieces on connections that agree (default: lz)" << endl;
+        cout << "  --compress-cache=<MB>       Memory for compressed pieces we serve (default: 16)" << endl;
+        cout << "  --data-dir=<dir>            Directory for the share index (default: .)" << endl;
+        cout << "  --no-persist                Don't save or restore what we share" << endl;
+        cout << "  --udp=<on|off>              Heartbeat and look up peers over UDP (default: on)" << endl;
+        cout << "  --pex=<on|off>              Exchange peer lists with other peers (default: on)" << endl;
+        cout << "  --read-ahead=<pieces>       Pieces fetched ahead of a stream_file's position (default: 64)" << endl;
+        cout << "  --dht                       Find peers through a DHT among clients, not the tracker" << endl;
+        cout << "  --dht-bootstrap=<nodes>     ip:port,... of clients to join the DHT through (implies --dht)" << endl;
+        cout << "  --log-level=<level>         debug, info, warn, error or off (default: info)" << endl;
+        cout << "  --log-file=<path>           Append log records to a file instead of stdout" << endl;
+        cout << "  --log-sample=<n>            Keep 1 in n per-piece debug records (default: 1)" << endl;
+        return 1;
+    }
+    
+    LogLevel log_level = LOG_LEVEL_INFO;
+    string log_file;
+    unsigned log_sample = 1;
+    string data_dir = ".";
+    bool persist = true;
+    advertised_port = 0;
+    for (int i = 3; i < argc; i++) {
+        string opt = argv[i];
+        if (opt.find("--zone=") == 0) {
+            my_zone = opt.substr(7);
+        }
+        else if (opt.find("--coord=") == 0) {
+            my_coord = opt.substr(8);
+        }
+        else if (opt.find("--advertise-port=") == 0) {
+            advertised_port = stoi(opt.substr(17));
+        }
+        else if (opt.find("--compress=") == 0) {
+            string mode = opt.substr(11);
+            if (mode != "lz" && mode != "off") {
+                cerr << "ERROR: Unknown compression mode in " << opt << endl;
+                return 1;
+            }
+            compression_enabled = mode == "lz";
+        }
+        else if (opt.find("--compress-cache=") == 0) {
+            compress_cache_limit = (size_t)max(0, stoi(opt.substr(17))) * 1024 * 1024;
+        }
+        else if (opt.find("--data-dir=") == 0) {
+            data_dir = opt.substr(11);
+        }
+        else if (opt == "--no-persist") {
+            persist = false;
+        }
+        else if (opt.find("--udp=") == 0) {
+            string mode = opt.substr(6);
+            if (mode != "on" && mode != "off") {
+                cerr << "ERROR: Unknown UDP mode in " << opt << endl;
+                return 1;
+            }
+            udp_enabled = mode == "on";
+        }
+        else if (opt.find("--pex=") == 0) {
+            string mode = opt.substr(6);
+            if (mode != "on" && mode != "off") {
+                cerr << "ERROR: Unknown PEX mode in " << opt << endl;
+                return 1;
+            }
+            pex_enabled = mode == "on";
+        }
+        else if (opt.find("--read-ahead=") == 0) {
+            read_ahead = max(1, stoi(opt.substr(13)));
+        }
+        else if (opt == "--dht") {
+            dht_enabled = true;
+        }
+        else if (opt.find("--dht-bootstrap=") == 0) {
+            dht_enabled = true;
+            for (const string& node : split_string(opt.substr(16), ',')) {
+                if (node.find(':') == string::npos) {
+                    cerr << "ERROR: Bad DHT node in " << opt << endl;
+                    return 1;
+                }
+                dht_bootstrap.push_back(node);
+            }
+        }
+        else if (opt.find("--log-level=") == 0) {
+            if (!parse_log_level(opt.substr(12), log_level)) {
+                cerr << "ERROR: Unknown log level in " << opt << endl;
+                return 1;
+            }
+        }
+        else if (opt.find("--log-file=") == 0) {
+            log_file = opt.substr(11);
+        }
+        else if (opt.find("--log-sample=") == 0) {
+            log_sample = (unsigned)max(1, stoi(opt.substr(13)));
+        }
+        else {
+            cerr << "ERROR: Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    
+    if (!Logger::instance().start(log_level, log_file, log_sample)) {
+        cerr << "ERROR: Cannot open log file " << log_file << endl;
         return 1;
     }
     
@@ -724,10 +5189,18 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+#ifndef _WIN32
+    // A peer closing its socket mid-send must not kill the client
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    
     my_ip = client_addr.substr(0, colon_pos);
     my_port = stoi(client_addr.substr(colon_pos + 1));
+    if (advertised_port == 0) {
+        advertised_port = my_port;
+    }
     
-    // Read tracker address from file
+    // Read tracker addresses from file, one replica per line
     string tracker_file = argv[2];
     ifstream file(tracker_file);
     if (!file.is_open()) {
@@ -739,48 +5212,102 @@ int main(int argc, char* argv[]) {
     }
     
     string tracker_addr;
-    getline(file, tracker_addr);
+    while (getline(file, tracker_addr)) {
+        if (!tracker_addr.empty() && tracker_addr.back() == '\r') tracker_addr.pop_back();
+        if (tracker_addr.empty()) continue;
+        
+        colon_pos = tracker_addr.find(':');
+        if (colon_pos == string::npos) {
+            cerr << "ERROR: Invalid tracker format" << endl;
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return 1;
+        }
+        
+        TrackerConn t;
+        t.ip = tracker_addr.substr(0, colon_pos);
+        t.port = stoi(tracker_addr.substr(colon_pos + 1));
+        t.sock = INVALID_SOCKET;
+        trackers.push_back(t);
+    }
     file.close();
     
-    colon_pos = tracker_addr.find(':');
-    if (colon_pos == string::npos) {
-        cerr << "ERROR: Invalid tracker format" << endl;
+    if (trackers.empty()) {
+        cerr << "ERROR: No tracker in tracker info file" << endl;
 #ifdef _WIN32
         WSACleanup();
 #endif
         return 1;
     }
     
-    tracker_ip = tracker_addr.substr(0, colon_pos);
-    tracker_port = stoi(tracker_addr.substr(colon_pos + 1));
-    
     cout << "========================================" << endl;
     cout << "  P2P CLIENT (Windows)" << endl;
     cout << "  Client: " << my_ip << ":" << my_port << endl;
-    cout << "  Tracker: " << tracker_ip << ":" << tracker_port << endl;
+    if (advertised_port != my_port) {
+        cout << "  Advertised port: " << advertised_port << endl;
+    }
+    for (const TrackerConn& t : trackers) {
+        cout << "  Tracker: " << t.ip << ":" << t.port << endl;
+    }
     cout << "========================================" << endl;
     
+    // Share again what we shared before the restart; changed files are
+    // re-checked in the background
+    if (persist) share_index_path = data_dir + "/client_" + to_string(my_port) + ".shares";
+    if (persist) session_path = data_dir + "/client_" + to_string(my_port) + ".session";
+    load_session();
+    restore_shares();
+    thread recheck_thread(recheck_shares);
+    thread share_index_thread(share_index_thread_func);
+    
     // Start server thread (to serve other peers)
     thread server_thread(server_thread_func);
+    thread heartbeat_thread(heartbeat_thread_func);
+    if (dht_enabled && !start_dht()) {
+        LOG_WARN("[DHT] Cannot bind UDP " << my_ip << ":" << my_port << ", finding peers through the tracker");
+        dht_enabled = false;
+    }
     
     // Run client thread (user commands)
     client_thread_func();
     
-    // Cleanup
+    // Cleanup; connect to our own server so it wakes from accept() and sees
+    // running is false
     running = false;
+    SOCKET wake = connect_to_server(my_ip, my_port);
+    if (wake != INVALID_SOCKET) {
+        CLOSE_SOCKET(wake);
+    }
     if (server_thread.joinable()) {
         server_thread.join();
     }
+    if (heartbeat_thread.joinable()) {
+        heartbeat_thread.join();
+    }
+    if (recheck_thread.joinable()) {
+        recheck_thread.join();
+    }
+    if (share_index_thread.joinable()) {
+        share_index_thread.join();
+    }
+    if (shares_changed) {
+        save_shares();
+    }
     
-    // Close tracker connection
-    if (tracker_socket != INVALID_SOCKET) {
-        CLOSE_SOCKET(tracker_socket);
+    // Close tracker connections
+    for (TrackerConn& t : trackers) {
+        if (t.sock != INVALID_SOCKET) {
+            CLOSE_SOCKET(t.sock);
+        }
     }
     
 #ifdef _WIN32
     WSACleanup();
 #endif
     
+    Logger::instance().stop();
     cout << "Goodbye!" << endl;
     return 0;
 }
+#endif
@@ -0,0 +1,208 @@
+// Asynchronous leveled logger shared by the tracker and the client
+//
+// Callers format a record and push it into a fixed-size lock-free ring; a
+// background thread drains the ring to stdout or a file and flushes once per
+// pass, so threads never wait on console I/O or on each other. A record that
+// finds the ring full is dropped (and counted) rather than blocking. With a
+// level disabled, a LOG_* statement costs one relaxed atomic load: its
+// arguments are not evaluated.
+//
+// Fatal errors that end the process are still written straight to stderr.
+
+#ifndef P2P_LOGGER_H
+#define P2P_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#define LOG_RING_SIZE 4096     // Records; must be a power of two
+#define LOG_RECORD_SIZE 256    // Longer messages are truncated
+
+enum LogLevel { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR, LOG_LEVEL_OFF };
+
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    // 1 in sample_every() per-command / per-piece records is kept
+    unsigned sample_every() const {
+        return sample_every_.load(std::memory_order_relaxed);
+    }
+
+    // Start draining to path ("" = stdout). Returns false if the file can't
+    // be opened.
+    bool start(LogLevel level, const std::string& path, unsigned sample_every) {
+        level_ = level;
+        sample_every_ = sample_every > 0 ? sample_every : 1;
+
+        if (!path.empty()) {
+            out_ = fopen(path.c_str(), "a");
+            if (!out_) return false;
+        }
+
+        running_ = true;
+        drainer_ = std::thread(&Logger::drain_loop, this);
+        return true;
+    }
+
+    // Drain what's left and stop; for clean shutdown
+    void stop() {
+        if (!running_.exchange(false)) return;
+        if (drainer_.joinable()) drainer_.join();
+        drain();
+        if (out_ != stdout) fclose(out_);
+        out_ = stdout;
+    }
+
+    // Multi-producer enqueue (bounded MPMC ring with per-slot sequence numbers)
+    void push(LogLevel level, const std::string& text) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots_[pos & (LOG_RING_SIZE - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)pos;
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);  // Ring full
+                return;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        slot->time_ms = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        slot->len = text.size() < LOG_RECORD_SIZE ? (unsigned)text.size() : LOG_RECORD_SIZE;
+        memcpy(slot->text, text.data(), slot->len);
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        LogLevel level;
+        long long time_ms;
+        unsigned len;
+        char text[LOG_RECORD_SIZE];
+    };
+
+    Slot slots_[LOG_RING_SIZE];
+    std::atomic<size_t> head_;
+    size_t tail_;                      // Only touched by the draining thread
+    std::atomic<LogLevel> level_;
+    std::atomic<unsigned> sample_every_;
+    std::atomic<unsigned long> dropped_;
+    std::atomic<bool> running_;
+    std::thread drainer_;
+    FILE* out_;
+
+    Logger() : head_(0), tail_(0), level_(LOG_LEVEL_INFO), sample_every_(1), dropped_(0),
+               running_(false), out_(stdout) {
+        for (size_t i = 0; i < LOG_RING_SIZE; i++) slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~Logger() {
+        stop();
+    }
+
+    // Write out every complete record. Returns the number written.
+    size_t drain() {
+        static const char* names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+        std::string batch;
+        size_t count = 0;
+
+        while (true) {
+            Slot& slot = slots_[tail_ & (LOG_RING_SIZE - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) break;
+
+            time_t secs = (time_t)(slot.time_ms / 1000);
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&secs));
+            char prefix[48];
+            snprintf(prefix, sizeof(prefix), "%s.%03d %s ", stamp, (int)(slot.time_ms % 1000),
+                     names[slot.level]);
+
+            batch += prefix;
+            batch.append(slot.text, slot.len);
+            batch += '\n';
+
+            slot.seq.store(tail_ + LOG_RING_SIZE, std::memory_order_release);
+            tail_++;
+            count++;
+        }
+
+        unsigned long dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            batch += "[LOG] " + std::to_string(dropped) + " records dropped (ring full)\n";
+        }
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), out_);
+            fflush(out_);
+        }
+        return count;
+    }
+
+    void drain_loop() {
+        while (running_) {
+            if (drain() == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+    }
+};
+
+// "debug", "info", "warn", "error" or "off"
+inline bool parse_log_level(const std::string& name, LogLevel& level) {
+    if (name == "debug") level = LOG_LEVEL_DEBUG;
+    else if (name == "info") level = LOG_LEVEL_INFO;
+    else if (name == "warn") level = LOG_LEVEL_WARN;
+    else if (name == "error") level = LOG_LEVEL_ERROR;
+    else if (name == "off") level = LOG_LEVEL_OFF;
+    else return false;
+    return true;
+}
+
+#define LOG_AT(level, expr) \
+    do { \
+        if (Logger::instance().enabled(level)) { \
+            std::ostringstream log_stream_; \
+            log_stream_ << expr; \
+            Logger::instance().push(level, log_stream_.str()); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#define LOG_INFO(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+
+// For per-command and per-piece messages: keeps 1 in --log-sample records
+// from each call site
+#define LOG_SAMPLED(level, expr) \
+    do { \
+        if (Logger::instance().enabled(level)) { \
+            static std::atomic<unsigned> log_counter_(0); \
+            if (log_counter_.fetch_add(1, std::memory_order_relaxed) % Logger::instance().sample_every() == 0) { \
+                LOG_AT(level, expr); \
+            } \
+        } \
+    } while (0)
+
+#endif
@@ -12,6 +12,19 @@
 #include <thread>
 #include <fstream>
 #include <algorithm>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <random>
+#include <functional>
+#include <cmath>
+
+#include "logger.h"
 
 
 #ifdef _WIN32
@@ -19,6 +32,7 @@
     #include <winsock2.h>
     #include <ws2tcpip.h>
     #pragma comment(lib, "Ws2_32.lib")
+    #include <io.h>
     typedef int socklen_t;
     #define CLOSE_SOCKET closesocket
 #else
@@ -26,6 +40,7 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <signal.h>
     #define CLOSE_SOCKET close
     typedef int SOCKET;
     #define INVALID_SOCKET -1
@@ -36,15 +51,264 @@ using namespace std;
 
 #define BUFFER_SIZE 65536
 #define PIECE_SIZE 5120  // 5KB
+#define MAX_FILE_SIZE (1LL << 40)   // 1 TiB; larger uploads are refused
+#define MAX_COUNTED_PIECES (1 << 20)   // 5 GiB; larger files get no per-piece availability counts
+
+// ==================== METRICS ====================
+
+// Every thread owns a block of counters and latency histograms that only it
+// writes (relaxed atomic stores, no shared cache lines, no locks). Readers sum
+// the blocks of live threads plus the totals folded in by threads that have
+// exited. Latencies go into log-linear ("HDR-style") histograms: 8 linear
+// sub-buckets per power of two of nanoseconds, so any recorded value is
+// reported within 12.5%.
+
+#define HIST_SUB_BUCKETS 8
+#define HIST_MAX_EXPONENT 40    // ~18 minutes in ns; longer values are clamped
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - 2) * HIST_SUB_BUCKETS)
+
+// Commands with their own metrics; anything else is counted as "other"
+const char* const METRIC_COMMANDS[] = {
+    "create_user", "login", "logout", "create_group", "join_group", "leave_group",
+    "list_groups", "list_requests", "accept_request", "upload_file", "upload_files",
+    "list_files", "download_file", "more_peers", "file_info", "update_seeder", "update_seeders",
+    "announce", "attach", "batch", "tracker_role", "stats", "quit",
+    "udp_connect", "udp_announce", "udp_peers", "udp_scrape", "other"
+};
+const int NUM_METRIC_COMMANDS = sizeof(METRIC_COMMANDS) / sizeof(METRIC_COMMANDS[0]);
+
+int metric_command_index(const string& cmd) {
+    for (int i = 0; i < NUM_METRIC_COMMANDS - 1; i++) {
+        if (cmd == METRIC_COMMANDS[i]) return i;
+    }
+    return NUM_METRIC_COMMANDS - 1;
+}
+
+int hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB_BUCKETS) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= HIST_MAX_EXPONENT) return HIST_BUCKETS - 1;
+    int sub = (int)((ns >> (exponent - 3)) & (HIST_SUB_BUCKETS - 1));
+    return (exponent - 2) * HIST_SUB_BUCKETS + sub;
+}
+
+// Highest value that lands in a bucket
+uint64_t hist_bucket_upper(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) return (uint64_t)bucket;
+    int exponent = bucket / HIST_SUB_BUCKETS + 2;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+}
+
+// Single writer: the owning thread
+inline void bump(atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+struct Histogram {
+    atomic<uint64_t> buckets[HIST_BUCKETS];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum_ns;
+    atomic<uint64_t> max_ns;
+    
+    Histogram() : count(0), sum_ns(0), max_ns(0) {
+        for (int i = 0; i < HIST_BUCKETS; i++) buckets[i].store(0, memory_order_relaxed);
+    }
+    
+    void record(uint64_t ns) {
+        bump(buckets[hist_bucket(ns)], 1);
+        bump(count, 1);
+        bump(sum_ns, ns);
+        if (ns > max_ns.load(memory_order_relaxed)) max_ns.store(ns, memory_order_relaxed);
+    }
+};
+
+// Plain copy of one or more histograms, for reporting
+struct HistogramData {
+    vector<uint64_t> buckets;
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    
+    HistogramData() : buckets(HIST_BUCKETS, 0) {}
+    
+    void add(const Histogram& h) {
+        for (int i = 0; i < HIST_BUCKETS; i++) buckets[i] += h.buckets[i].load(memory_order_relaxed);
+        count += h.count.load(memory_order_relaxed);
+        sum_ns += h.sum_ns.load(memory_order_relaxed);
+        max_ns = max(max_ns, h.max_ns.load(memory_order_relaxed));
+    }
+    
+    void add(const HistogramData& h) {
+        for (int i = 0; i < HIST_BUCKETS; i++) buckets[i] += h.buckets[i];
+        count += h.count;
+        sum_ns += h.sum_ns;
+        max_ns = max(max_ns, h.max_ns);
+    }
+    
+    uint64_t percentile(double p) const {
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return min(hist_bucket_upper(i), max_ns);
+        }
+        return max_ns;
+    }
+};
+
+struct CommandMetrics {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> response_bytes;
+    Histogram latency;
+    
+    CommandMetrics() : calls(0), errors(0), response_bytes(0) {}
+};
+
+struct CommandTotals {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t response_bytes = 0;
+    HistogramData latency;
+    
+    void add(const CommandMetrics& m) {
+        calls += m.calls.load(memory_order_relaxed);
+        errors += m.errors.load(memory_order_relaxed);
+        response_bytes += m.response_bytes.load(memory_order_relaxed);
+        latency.add(m.latency);
+    }
+};
+
+// A connection thread only uses a few command types, so their blocks are
+// allocated on first use
+struct ThreadMetrics {
+    atomic<CommandMetrics*> commands[NUM_METRIC_COMMANDS];
+    Histogram lock_wait;
+    
+    ThreadMetrics() {
+        for (int i = 0; i < NUM_METRIC_COMMANDS; i++) commands[i].store(NULL);
+    }
+    
+    ~ThreadMetrics() {
+        for (int i = 0; i < NUM_METRIC_COMMANDS; i++) delete commands[i].load();
+    }
+    
+    CommandMetrics& command(int index) {
+        CommandMetrics* m = commands[index].load(memory_order_relaxed);
+        if (!m) {
+            m = new CommandMetrics();
+            commands[index].store(m, memory_order_release);
+        }
+        return *m;
+    }
+};
+
+struct MetricsTotals {
+    CommandTotals commands[NUM_METRIC_COMMANDS];
+    HistogramData lock_wait;
+    
+    void add(const ThreadMetrics& t) {
+        for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+            const CommandMetrics* m = t.commands[i].load(memory_order_acquire);
+            if (m) commands[i].add(*m);
+        }
+        lock_wait.add(t.lock_wait);
+    }
+    
+    void add(const MetricsTotals& t) {
+        for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+            commands[i].calls += t.commands[i].calls;
+            commands[i].errors += t.commands[i].errors;
+            commands[i].response_bytes += t.commands[i].response_bytes;
+            commands[i].latency.add(t.commands[i].latency);
+        }
+        lock_wait.add(t.lock_wait);
+    }
+};
+
+mutex metrics_registry_mutex;
+set<ThreadMetrics*> live_thread_metrics;
+MetricsTotals retired_metrics;   // Folded in from exited threads
+
+// Registers the calling thread's block on first use and folds it into
+// retired_metrics when the thread exits
+struct ThreadMetricsHandle {
+    ThreadMetrics* metrics;
+    
+    ThreadMetricsHandle() : metrics(new ThreadMetrics()) {
+        lock_guard<mutex> lock(metrics_registry_mutex);
+        live_thread_metrics.insert(metrics);
+    }
+    
+    ~ThreadMetricsHandle() {
+        lock_guard<mutex> lock(metrics_registry_mutex);
+        retired_metrics.add(*metrics);
+        live_thread_metrics.erase(metrics);
+        delete metrics;
+    }
+};
+
+ThreadMetrics& thread_metrics() {
+    static thread_local ThreadMetricsHandle handle;
+    return *handle.metrics;
+}
+
+MetricsTotals collect_metrics() {
+    MetricsTotals totals;
+    lock_guard<mutex> lock(metrics_registry_mutex);
+    totals.add(retired_metrics);
+    for (const ThreadMetrics* t : live_thread_metrics) totals.add(*t);
+    return totals;
+}
+
+uint64_t elapsed_ns(chrono::steady_clock::time_point start) {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+void record_command(const string& cmd, uint64_t ns, uint64_t response_bytes, bool error) {
+    CommandMetrics& m = thread_metrics().command(metric_command_index(cmd));
+    bump(m.calls, 1);
+    if (error) bump(m.errors, 1);
+    bump(m.response_bytes, response_bytes);
+    m.latency.record(ns);
+}
+
+const chrono::steady_clock::time_point tracker_start = chrono::steady_clock::now();
+atomic<int> active_sessions(0);   // Open client connections
+
+// recursive_mutex that records how long each acquisition waited. The
+// uncontended path is a try_lock and one histogram update.
+class TimedRecursiveMutex {
+public:
+    void lock() {
+        if (m.try_lock()) {
+            thread_metrics().lock_wait.record(0);
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        m.lock();
+        thread_metrics().lock_wait.record(elapsed_ns(start));
+    }
+    
+    bool try_lock() { return m.try_lock(); }
+    void unlock() { m.unlock(); }
+    
+private:
+    recursive_mutex m;
+};
 
 // ==================== DATA STRUCTURES ====================
 
 // tracker_infomap: stores group information
 struct GroupInfo {
     string owner;
-    vector<string> peers;           // Members of the group
-    vector<string> files;           // Files shared in this group
-    vector<string> pending_requests; // Join requests
+    set<string> peers;              // Members of the group
+    set<string> files;              // Files shared in this group
+    set<string> pending_requests;   // Join requests
+    // Ordered sets give O(log n) membership checks and let listings resume
+    // from a cursor (the last name returned)
 };
 
 // user_info: stores user information
@@ -53,61 +317,1672 @@ struct UserInfo {
     string ip;
     int port;
     bool is_active;
-    map<string, vector<string>> group_files; // group_id -> list of files user has shared
+    bool is_live;                            // Heartbeat hasn't lapsed (see LIVENESS)
+    map<string, set<string>> group_files;    // group_id -> files user has shared
+    map<string, set<string>> partial_files;  // group_id -> files user is still downloading
+    string zone;                             // Zone/rack label declared at login ("" = none)
+    string coord;                            // Network coordinates "x,y" declared at login ("" = none)
+    string session;                          // Token handed out at login; attach must present it
+};
+
+// File metadata stored in tracker
+struct FileMetadata {
+    string filename;
+    long file_size;
+    int num_pieces;
+    string sha256_hash;   // Hex SHA-256 over the pieces' SHA-256 digests ("" = not given)
+    int version = 1;      // Bumped each time the file is uploaded with different content
+    string manifest_hash; // Hex SHA-256 of a bundle's manifest ("" = a plain file)
+};
+
+// Pieces held by the users still downloading a file (complete seeders aren't
+// listed), kept in the compact encoding they were announced in, plus the
+// number of those users holding each piece. A file nobody is downloading has
+// no entry, so the common case costs nothing.
+struct FileAvailability {
+    map<string, string> partial;   // user_id -> encoded pieces (see decode_pieces)
+    vector<uint32_t> counts;       // piece -> partial holders
+    vector<pair<uint32_t, uint32_t>> runs;   // counts as (count, pieces) runs, kept by count_pieces
+    string summary;                // runs as sent to downloaders, for summary_complete seeders
+    uint32_t summary_complete = 0;
+};
+
+// Live seeders of one file (logged in, heartbeat current), ordered by when they were last handed out to a
+// downloader (front = longest ago), so a peer list can be sampled in
+// O(numwant) while spreading load evenly across the swarm
+struct Swarm {
+    list<string> order;
+    unordered_map<string, list<string>::iterator> index;
+    
+    size_t size() const { return order.size(); }
+    bool empty() const { return order.empty(); }
+    bool contains(const string& user_id) const { return index.count(user_id) > 0; }
+    
+    // New seeders go to the front so they start receiving traffic right away
+    void insert(const string& user_id) {
+        if (contains(user_id)) return;
+        order.push_front(user_id);
+        index[user_id] = order.begin();
+    }
+    
+    // Used when restoring state, to keep the persisted order
+    void append(const string& user_id) {
+        if (contains(user_id)) return;
+        order.push_back(user_id);
+        index[user_id] = prev(order.end());
+    }
+    
+    void erase(const string& user_id) {
+        auto it = index.find(user_id);
+        if (it == index.end()) return;
+        order.erase(it->second);
+        index.erase(it);
+    }
+    
+    // Mark as just handed out
+    void touch(list<string>::iterator it) {
+        order.splice(order.end(), order, it);
+    }
 };
 
-// File metadata stored in tracker
-struct FileMetadata {
-    string filename;
-    long file_size;
-    int num_pieces;
-    string sha256_hash;
-};
+// Global data structures with mutex protection
+map<string, GroupInfo> tracker_infomap;
+map<string, UserInfo> user_info;
+map<string, map<string, FileMetadata>> file_metadata; // group_id -> filename -> metadata
+map<string, map<string, Swarm>> file_seeders;        // group_id -> filename -> seeding user_ids
+map<string, map<string, FileAvailability>> file_availability;  // group_id -> filename -> partial seeders
+
+// Recursive so a batch can hold it across many commands whose handlers lock
+// it again; acquisition waits are measured (see METRICS)
+TimedRecursiveMutex data_mutex;
+
+// Peer list sizes for download_file / more_peers
+int default_numwant = 50;
+int max_numwant = 200;
+
+// Seconds without a heartbeat before a user's seeders are dropped from peer
+// lists; clients announce every seeder_ttl_sec / 3 seconds
+int seeder_ttl_sec = 90;
+
+// ==================== HELPER FUNCTIONS ====================
+
+vector<string> split_string(const string& str, char delimiter) {
+    vector<string> tokens;
+    stringstream ss(str);
+    string token;
+    while (getline(ss, token, delimiter)) {
+        if (!token.empty()) {
+            tokens.push_back(token);
+        }
+    }
+    return tokens;
+}
+
+// A TCP/UDP port number from a request; 0 if it isn't one
+int parse_port(const string& str) {
+    char* end = NULL;
+    long port = strtol(str.c_str(), &end, 10);
+    if (end == str.c_str() || *end != '\0' || port < 1 || port > 65535) return 0;
+    return (int)port;
+}
+
+// A file's size and piece count from an upload: both numbers, the size at most
+// MAX_FILE_SIZE and the count exactly the pieces that size takes. Checked
+// before the upload is logged, since every replica replays the record.
+bool parse_file_shape(const string& size_str, const string& pieces_str, long& file_size, int& num_pieces) {
+    char* end1 = NULL;
+    char* end2 = NULL;
+    long long size = strtoll(size_str.c_str(), &end1, 10);
+    long long pieces = strtoll(pieces_str.c_str(), &end2, 10);
+    if (end1 == size_str.c_str() || *end1 != '\0' || end2 == pieces_str.c_str() || *end2 != '\0') return false;
+    if (size < 0 || size > MAX_FILE_SIZE || pieces != (size + PIECE_SIZE - 1) / PIECE_SIZE) return false;
+    file_size = (long)size;
+    num_pieces = (int)pieces;
+    return true;
+}
+
+string join_vector(const vector<string>& vec, const string& delimiter) {
+    string result;
+    for (size_t i = 0; i < vec.size(); i++) {
+        result += vec[i];
+        if (i < vec.size() - 1) result += delimiter;
+    }
+    return result;
+}
+
+string base_filename(const string& filepath) {
+    size_t pos = filepath.find_last_of("/\\");
+    if (pos != string::npos) {
+        return filepath.substr(pos + 1);
+    }
+    return filepath;
+}
+
+// Find logged-in user by their IP and port
+// "ip:port" -> the user last found there; checked on use
+unordered_map<string, string> user_address_cache;
+
+string find_user_by_address(const string& ip, int port) {
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
+    string address = ip + ":" + to_string(port);
+    auto cached = user_address_cache.find(address);
+    if (cached != user_address_cache.end()) {
+        auto user = user_info.find(cached->second);
+        if (user != user_info.end() && user->second.is_active && user->second.ip == ip &&
+            user->second.port == port) {
+            return user->first;
+        }
+    }
+    
+    for (const auto& pair : user_info) {
+        if (pair.second.is_active && pair.second.ip == ip && pair.second.port == port) {
+            user_address_cache[address] = pair.first;
+            return pair.first;
+        }
+    }
+    return "";
+}
+
+// The logged-in user at ip:port, if the caller holds that user's session token
+// (handed out at login, presented again by attach); "" otherwise
+string find_session_user(const string& ip, int port, const string& session) {
+    string user_id = find_user_by_address(ip, port);
+    if (user_id.empty() || session.empty()) return "";
+    
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
+    auto user = user_info.find(user_id);
+    return user != user_info.end() && user->second.session == session ? user_id : "";
+}
+
+// Piece availability travels in a compact text form:
+//   "*"             every piece
+//   "-"             no piece
+//   "r<n>,<n>,..."  run lengths, alternating present/missing, starting with present
+//   "x<hex>"        bitmap, four pieces per hex digit, most significant bit first
+bool decode_pieces(const string& enc, int num_pieces, vector<bool>& out) {
+    out.assign(num_pieces, false);
+    if (enc == "*") {
+        out.assign(num_pieces, true);
+        return true;
+    }
+    if (enc == "-") return true;
+    if (enc.size() < 2) return false;
+    
+    if (enc[0] == 'r') {
+        long piece = 0;
+        bool present = true;
+        size_t pos = 1;
+        while (pos < enc.size()) {
+            char* end;
+            long run = strtol(enc.c_str() + pos, &end, 10);
+            if (end == enc.c_str() + pos || run < 0 || (*end != ',' && *end != '\0')) return false;
+            
+            for (long i = piece; i < piece + run && i < num_pieces; i++) out[i] = present;
+            piece += run;
+            present = !present;
+            pos = (end - enc.c_str()) + 1;
+        }
+        return true;
+    }
+    
+    if (enc[0] == 'x') {
+        for (size_t i = 1; i < enc.size(); i++) {
+            char c = enc[i];
+            int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (v < 0) return false;
+            for (int b = 0; b < 4; b++) {
+                size_t piece = (i - 1) * 4 + b;
+                if (piece < (size_t)num_pieces && (v & (8 >> b))) out[piece] = true;
+            }
+        }
+        return true;
+    }
+    
+    return false;
+}
+
+// Whether enc is in the form above, without expanding it (it may be announced
+// for a file of many pieces)
+bool pieces_well_formed(const string& enc) {
+    if (enc == "*" || enc == "-") return true;
+    if (enc.size() < 2) return false;
+    if (enc[0] == 'r') {
+        size_t pos = 1;
+        while (pos < enc.size()) {
+            char* end;
+            long run = strtol(enc.c_str() + pos, &end, 10);
+            if (end == enc.c_str() + pos || run < 0 || (*end != ',' && *end != '\0')) return false;
+            pos = (end - enc.c_str()) + 1;
+        }
+        return true;
+    }
+    return enc[0] == 'x' && enc.find_first_not_of("0123456789abcdef", 1) == string::npos;
+}
+
+// Network coordinates "x,y"
+bool parse_coord(const string& coord, double& x, double& y) {
+    char* end;
+    x = strtod(coord.c_str(), &end);
+    if (end == coord.c_str() || *end != ',') return false;
+    const char* second = end + 1;
+    y = strtod(second, &end);
+    return end != second && *end == '\0';
+}
+
+bool send_all(SOCKET sock, const char* data, size_t len) {
+    while (len > 0) {
+        int sent = send(sock, data, (int)min(len, (size_t)BUFFER_SIZE), 0);
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool recv_exact(SOCKET sock, char* data, size_t len) {
+    while (len > 0) {
+        int r = recv(sock, data, (int)min(len, (size_t)BUFFER_SIZE), 0);
+        if (r <= 0) return false;
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Responses are framed as length-prefixed chunks ([u32 length, network byte
+// order][bytes]) ending with an empty chunk, so a response can be any size and
+// can be sent while it is still being built
+void append_chunk(string& out, const char* data, size_t len) {
+    uint32_t n = htonl((uint32_t)len);
+    out.append((const char*)&n, 4);
+    out.append(data, len);
+}
+
+void send_response(SOCKET client_socket, const string& response) {
+    // One send for chunk and terminator, so Nagle doesn't hold the tail back
+    string frame;
+    frame.reserve(response.length() + 8);
+    append_chunk(frame, response.data(), response.length());
+    append_chunk(frame, "", 0);
+    send_all(client_socket, frame.data(), frame.size());
+}
+
+// Read a whole framed response
+bool read_response(SOCKET sock, string& response) {
+    response.clear();
+    while (true) {
+        uint32_t n;
+        if (!recv_exact(sock, (char*)&n, 4)) return false;
+        n = ntohl(n);
+        if (n == 0) return true;
+        
+        size_t old_size = response.size();
+        response.resize(old_size + n);
+        if (!recv_exact(sock, &response[old_size], n)) return false;
+    }
+}
+
+#define RESPONSE_CHUNK_SIZE 16384
+
+// Builds a response incrementally, sending a chunk whenever enough has
+// accumulated
+struct ResponseStream {
+    SOCKET sock;
+    string pending;
+    size_t bytes_sent;
+    
+    explicit ResponseStream(SOCKET s) : sock(s), bytes_sent(0) {}
+    
+    void write(const string& text) {
+        pending += text;
+        if (pending.size() >= RESPONSE_CHUNK_SIZE) {
+            string frame;
+            append_chunk(frame, pending.data(), pending.size());
+            send_all(sock, frame.data(), frame.size());
+            bytes_sent += frame.size();
+            pending.clear();
+        }
+    }
+    
+    void finish() {
+        string frame;
+        if (!pending.empty()) append_chunk(frame, pending.data(), pending.size());
+        append_chunk(frame, "", 0);
+        send_all(sock, frame.data(), frame.size());
+        bytes_sent += frame.size();
+        pending.clear();
+    }
+};
+
+void set_recv_timeout(SOCKET sock, int ms) {
+#ifdef _WIN32
+    DWORD tv = ms;
+#else
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+}
+
+SOCKET connect_to_server(const string& addr) {
+    size_t colon = addr.find(':');
+    if (colon == string::npos) return INVALID_SOCKET;
+    
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(addr.substr(0, colon).c_str());
+    server_addr.sin_port = htons(stoi(addr.substr(colon + 1)));
+    
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+    
+    return sock;
+}
+
+// ==================== STATE MUTATIONS ====================
+
+// Every change to tracker state is described by a record: the mutation name
+// followed by its arguments. Live commands, WAL replay and snapshot restore all
+// go through apply_record(), so they can never disagree about the result.
+// Caller must hold data_mutex.
+
+// Swarms only hold live seeders, so a user enters or leaves every swarm they
+// seed when their session or heartbeat state changes
+void add_to_swarms(const string& user_id) {
+    const UserInfo& user = user_info[user_id];
+    for (const auto& gf : user.group_files) {
+        for (const string& filename : gf.second) {
+            file_seeders[gf.first][filename].insert(user_id);
+        }
+    }
+}
+
+void remove_from_swarms(const string& user_id) {
+    const UserInfo& user = user_info[user_id];
+    for (const auto& gf : user.group_files) {
+        auto group = file_seeders.find(gf.first);
+        if (group == file_seeders.end()) continue;
+        for (const string& filename : gf.second) {
+            auto swarm = group->second.find(filename);
+            if (swarm != group->second.end()) swarm->second.erase(user_id);
+        }
+    }
+}
+
+// Add (delta = 1) or remove (delta = -1) one partial seeder's pieces from a
+// file's counts. That takes time and memory in the file's size under
+// data_mutex, so files over MAX_COUNTED_PIECES go without counts.
+void count_pieces(FileAvailability& avail, const string& enc, int num_pieces, int delta) {
+    if (num_pieces > MAX_COUNTED_PIECES) return;
+    
+    vector<bool> pieces;
+    if (!decode_pieces(enc, num_pieces, pieces)) return;
+    
+    avail.counts.resize(num_pieces, 0);
+    for (int i = 0; i < num_pieces; i++) {
+        if (pieces[i]) avail.counts[i] += delta;
+    }
+    
+    // Runs change only here, so peer lists needn't walk every piece
+    avail.runs.clear();
+    int run_start = 0;
+    for (int i = 1; i <= num_pieces; i++) {
+        if (i < num_pieces && avail.counts[i] == avail.counts[run_start]) continue;
+        avail.runs.push_back(make_pair(avail.counts[run_start], (uint32_t)(i - run_start)));
+        run_start = i;
+    }
+    avail.summary.clear();
+}
+
+void clear_partial(const string& group_id, const string& filename, const string& user_id, bool leave_swarm) {
+    auto group = file_availability.find(group_id);
+    if (group == file_availability.end()) return;
+    auto file = group->second.find(filename);
+    if (file == group->second.end()) return;
+    auto entry = file->second.partial.find(user_id);
+    if (entry == file->second.partial.end()) return;
+    
+    count_pieces(file->second, entry->second, file_metadata[group_id][filename].num_pieces, -1);
+    file->second.partial.erase(entry);
+    if (file->second.partial.empty()) group->second.erase(file);
+    if (group->second.empty()) file_availability.erase(group);
+    
+    UserInfo& user = user_info[user_id];
+    user.partial_files[group_id].erase(filename);
+    if (user.partial_files[group_id].empty()) user.partial_files.erase(group_id);
+    
+    if (leave_swarm) file_seeders[group_id][filename].erase(user_id);
+}
+
+// A live user still downloading a file reports which pieces it can serve;
+// it joins the swarm so downloaders can use it as a source
+void set_partial(const string& group_id, const string& filename, const string& user_id, const string& enc) {
+    auto group = file_metadata.find(group_id);
+    if (group == file_metadata.end() || group->second.find(filename) == group->second.end()) return;
+    
+    UserInfo& user = user_info[user_id];
+    if (!user.is_live) return;
+    auto gf = user.group_files.find(group_id);
+    if (gf != user.group_files.end() && gf->second.count(filename)) return;  // Already complete
+    
+    clear_partial(group_id, filename, user_id, false);
+    if (enc == "-") {
+        file_seeders[group_id][filename].erase(user_id);
+        return;
+    }
+    
+    FileAvailability& avail = file_availability[group_id][filename];
+    avail.partial[user_id] = enc;
+    count_pieces(avail, enc, group->second[filename].num_pieces, 1);
+    user.partial_files[group_id].insert(filename);
+    file_seeders[group_id][filename].insert(user_id);
+}
+
+// A new version of a file replaces the old one: every other holder has old
+// content, so they stop seeding it until they download the new version.
+// O(users), but new versions are rare.
+void retire_file_holders(const string& group_id, const string& filename, const string& uploader) {
+    auto group = file_availability.find(group_id);
+    if (group != file_availability.end() && group->second.count(filename)) {
+        vector<string> partial;
+        for (const auto& entry : group->second[filename].partial) partial.push_back(entry.first);
+        for (const string& user_id : partial) clear_partial(group_id, filename, user_id, true);
+    }
+    
+    Swarm& swarm = file_seeders[group_id][filename];
+    for (auto& user : user_info) {
+        if (user.first == uploader) continue;
+        auto gf = user.second.group_files.find(group_id);
+        if (gf == user.second.group_files.end() || !gf->second.erase(filename)) continue;
+        swarm.erase(user.first);
+    }
+}
+
+void clear_all_partial(const string& user_id) {
+    map<string, set<string>> files = user_info[user_id].partial_files;
+    for (const auto& gf : files) {
+        for (const string& filename : gf.second) clear_partial(gf.first, filename, user_id, true);
+    }
+}
+
+void apply_record(const vector<string>& rec) {
+    if (rec.empty()) return;
+    const string& op = rec[0];
+    
+    if (op == "create_user" && rec.size() >= 3) {
+        UserInfo new_user;
+        new_user.password = rec[2];
+        new_user.ip = "";
+        new_user.port = 0;
+        new_user.is_active = false;
+        new_user.is_live = false;
+        user_info[rec[1]] = new_user;
+    }
+    else if (op == "login" && rec.size() >= 4) {
+        UserInfo& user = user_info[rec[1]];
+        user.is_active = true;
+        user.is_live = true;
+        user.ip = rec[2];
+        user.port = stoi(rec[3]);
+        user.zone = rec.size() >= 5 ? rec[4] : "";
+        user.coord = rec.size() >= 6 ? rec[5] : "";
+        user.session = rec.size() >= 7 ? rec[6] : "";
+        add_to_swarms(rec[1]);
+    }
+    else if (op == "logout" && rec.size() >= 2) {
+        UserInfo& user = user_info[rec[1]];
+        clear_all_partial(rec[1]);
+        remove_from_swarms(rec[1]);
+        user.is_active = false;
+        user.is_live = false;
+        user.ip = "";
+        user.port = 0;
+        user.zone = "";
+        user.coord = "";
+        user.session = "";
+    }
+    else if (op == "expire" && rec.size() >= 2) {
+        UserInfo& user = user_info[rec[1]];
+        if (user.is_live) {
+            clear_all_partial(rec[1]);
+            remove_from_swarms(rec[1]);
+            user.is_live = false;
+        }
+    }
+    else if (op == "revive" && rec.size() >= 2) {
+        UserInfo& user = user_info[rec[1]];
+        if (user.is_active && !user.is_live) {
+            user.is_live = true;
+            add_to_swarms(rec[1]);
+        }
+    }
+    else if (op == "create_group" && rec.size() >= 3) {
+        GroupInfo new_group;
+        new_group.owner = rec[2];
+        new_group.peers.insert(rec[2]);
+        tracker_infomap[rec[1]] = new_group;
+    }
+    else if (op == "join_group" && rec.size() >= 3) {
+        tracker_infomap[rec[1]].pending_requests.insert(rec[2]);
+    }
+    else if (op == "leave_group" && rec.size() >= 3) {
+        const string& group_id = rec[1];
+        const string& user_id = rec[2];
+        GroupInfo& group = tracker_infomap[group_id];
+        
+        group.peers.erase(user_id);
+        
+        // Remove user's files from this group
+        UserInfo& user = user_info[user_id];
+        if (user.partial_files.count(group_id)) {
+            set<string> partial = user.partial_files[group_id];
+            for (const string& filename : partial) clear_partial(group_id, filename, user_id, true);
+        }
+        if (user.group_files.find(group_id) != user.group_files.end()) {
+            for (const string& filename : user.group_files[group_id]) {
+                if (file_seeders[group_id].find(filename) != file_seeders[group_id].end()) {
+                    file_seeders[group_id][filename].erase(user_id);
+                }
+            }
+            user.group_files.erase(group_id);
+        }
+    }
+    else if (op == "accept_request" && rec.size() >= 3) {
+        GroupInfo& group = tracker_infomap[rec[1]];
+        group.pending_requests.erase(rec[2]);
+        group.peers.insert(rec[2]);
+    }
+    else if (op == "upload_file" && rec.size() >= 6) {
+        const string& group_id = rec[1];
+        const string& filename = rec[2];
+        const string& user_id = rec[5];
+        
+        FileMetadata meta;
+        meta.filename = filename;
+        if (!parse_file_shape(rec[3], rec[4], meta.file_size, meta.num_pieces)) {
+            LOG_WARN("[TRACKER] Skipping upload of " << group_id << "/" << filename << " with bad size " << rec[3]
+                     << "/" << rec[4] << " pieces");
+            return;
+        }
+        if (rec.size() >= 7) meta.sha256_hash = rec[6];
+        if (rec.size() >= 8) meta.manifest_hash = rec[7];
+        
+        auto existing = file_metadata[group_id].find(filename);
+        if (existing != file_metadata[group_id].end()) {
+            const FileMetadata& old = existing->second;
+            meta.version = old.version;
+            bool changed = old.file_size != meta.file_size || old.num_pieces != meta.num_pieces ||
+                           (!old.sha256_hash.empty() && !meta.sha256_hash.empty() &&
+                            old.sha256_hash != meta.sha256_hash) ||
+                           old.manifest_hash != meta.manifest_hash;
+            if (changed) {
+                retire_file_holders(group_id, filename, user_id);
+                meta.version++;
+            }
+        }
+        file_metadata[group_id][filename] = meta;
+        
+        GroupInfo& group = tracker_infomap[group_id];
+        group.files.insert(filename);
+        
+        clear_partial(group_id, filename, user_id, false);
+        UserInfo& user = user_info[user_id];
+        user.group_files[group_id].insert(filename);
+        Swarm& swarm = file_seeders[group_id][filename];
+        if (user.is_live) swarm.insert(user_id);
+    }
+    else if (op == "update_seeder" && rec.size() >= 4) {
+        clear_partial(rec[1], rec[2], rec[3], false);
+        UserInfo& user = user_info[rec[3]];
+        user.group_files[rec[1]].insert(rec[2]);
+        if (user.is_live) file_seeders[rec[1]][rec[2]].insert(rec[3]);
+    }
+    else if (op == "have" && rec.size() >= 5) {
+        set_partial(rec[1], rec[2], rec[3], rec[4]);
+    }
+}
+
+// ==================== PERSISTENCE ====================
+
+// Durable state is a compact binary snapshot plus an append-only write-ahead
+// log of records applied since. Startup loads the snapshot and replays the log
+// tail; a background thread periodically folds the log into a new snapshot.
+//
+// WAL record:  [u32 body_len][u32 checksum][body]
+//              body = [u64 seq][u32 count][count x (u32 len, bytes)]
+// Snapshot:    [magic "P2PSNAP\0"][u32 version][u64 seq][state...][u32 checksum]
+
+#define SNAPSHOT_MAGIC "P2PSNAP"
+#define SNAPSHOT_VERSION 6   // 2 adds partial seeders, 3 zone/coordinates, 4 file versions, 5 bundle manifests,
+                             // 6 session tokens; older versions still load
+
+bool persistence_enabled = false;
+string wal_path;
+string wal_prev_path;      // Log segment being folded into a snapshot
+string snapshot_path;
+long snapshot_every = 100000;      // Records between snapshots
+long snapshot_interval_sec = 300;  // Max seconds between snapshots
+
+// Group commit: appends are buffered under wal_mutex by the command threads and
+// a single flusher thread writes and fsyncs whatever has accumulated, so one
+// fsync covers every command that arrived while the previous one was running.
+FILE* wal_file = NULL;
+mutex wal_mutex;
+condition_variable wal_flush_cv;
+condition_variable wal_durable_cv;
+string wal_pending;
+uint64_t wal_next_seq = 1;
+uint64_t wal_durable_seq = 0;
+uint64_t snapshot_seq = 0;   // Last seq contained in the snapshot on disk
+
+// Highest seq appended by the current thread; handle_client waits for it to be
+// durable before replying
+thread_local uint64_t thread_wal_seq = 0;
+
+uint32_t checksum32(const char* data, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void put_u32(string& out, uint32_t v) {
+    char b[4];
+    for (int i = 0; i < 4; i++) b[i] = (char)((v >> (8 * i)) & 0xff);
+    out.append(b, 4);
+}
+
+void put_u64(string& out, uint64_t v) {
+    put_u32(out, (uint32_t)(v & 0xffffffffu));
+    put_u32(out, (uint32_t)(v >> 32));
+}
+
+void put_str(string& out, const string& s) {
+    put_u32(out, (uint32_t)s.size());
+    out += s;
+}
+
+// Bounds-checked reader over an in-memory buffer; ok turns false on overrun
+struct ByteReader {
+    const char* p;
+    const char* end;
+    bool ok;
+    
+    ByteReader(const char* data, size_t len) : p(data), end(data + len), ok(true) {}
+    
+    size_t remaining() const { return (size_t)(end - p); }
+    
+    uint32_t u32() {
+        if (remaining() < 4) { ok = false; p = end; return 0; }
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++) v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+        p += 4;
+        return v;
+    }
+    
+    uint64_t u64() {
+        uint64_t lo = u32();
+        uint64_t hi = u32();
+        return lo | (hi << 32);
+    }
+    
+    string str() {
+        uint32_t len = u32();
+        if (remaining() < len) { ok = false; p = end; return ""; }
+        string s(p, len);
+        p += len;
+        return s;
+    }
+};
+
+void encode_wal_record(string& out, uint64_t seq, const vector<string>& rec) {
+    string body;
+    put_u64(body, seq);
+    put_u32(body, (uint32_t)rec.size());
+    for (const string& field : rec) {
+        put_str(body, field);
+    }
+    put_u32(out, (uint32_t)body.size());
+    put_u32(out, checksum32(body.data(), body.size()));
+    out += body;
+}
+
+bool sync_file(FILE* fp) {
+    if (fflush(fp) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+bool read_whole_file(const string& path, string& out) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) return false;
+    
+    out.clear();
+    char chunk[BUFFER_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        out.append(chunk, n);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool file_exists(const string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) return false;
+    fclose(fp);
+    return true;
+}
+
+// Append a record to the log. Caller must hold data_mutex so that log order
+// matches apply order. Returns immediately; use wal_wait() for durability.
+uint64_t wal_append(const vector<string>& rec) {
+    if (!persistence_enabled) return 0;
+    
+    lock_guard<mutex> lock(wal_mutex);
+    uint64_t seq = wal_next_seq++;
+    encode_wal_record(wal_pending, seq, rec);
+    thread_wal_seq = seq;
+    wal_flush_cv.notify_one();
+    return seq;
+}
+
+// Block until every record up to seq has been fsynced
+void wal_wait(uint64_t seq) {
+    if (!persistence_enabled || seq == 0) return;
+    
+    unique_lock<mutex> lock(wal_mutex);
+    wal_durable_cv.wait(lock, [seq] { return wal_durable_seq >= seq; });
+}
+
+void wal_flusher_thread() {
+    string batch;
+    
+    while (true) {
+        uint64_t upto;
+        {
+            unique_lock<mutex> lock(wal_mutex);
+            wal_flush_cv.wait(lock, [] { return !wal_pending.empty(); });
+            batch.swap(wal_pending);
+            wal_pending.clear();
+            upto = wal_next_seq - 1;
+        }
+        
+        if (fwrite(batch.data(), 1, batch.size(), wal_file) != batch.size() || !sync_file(wal_file)) {
+            cerr << "[TRACKER] FATAL: WAL write failed" << endl;
+            exit(1);
+        }
+        batch.clear();
+        
+        {
+            lock_guard<mutex> lock(wal_mutex);
+            wal_durable_seq = upto;
+        }
+        wal_durable_cv.notify_all();
+    }
+}
+
+// Serialize the full tracker state. Caller must hold data_mutex.
+void serialize_state(string& out, uint64_t seq) {
+    out.append(SNAPSHOT_MAGIC, 8);
+    put_u32(out, SNAPSHOT_VERSION);
+    put_u64(out, seq);
+    
+    put_u32(out, (uint32_t)user_info.size());
+    for (const auto& pair : user_info) {
+        const UserInfo& user = pair.second;
+        put_str(out, pair.first);
+        put_str(out, user.password);
+        put_str(out, user.ip);
+        put_u32(out, (uint32_t)user.port);
+        // 0 = logged out, 1 = live, 2 = logged in but heartbeat lapsed
+        put_u32(out, !user.is_active ? 0 : user.is_live ? 1 : 2);
+        put_str(out, user.zone);
+        put_str(out, user.coord);
+        put_str(out, user.session);
+        put_u32(out, (uint32_t)user.group_files.size());
+        for (const auto& gf : user.group_files) {
+            put_str(out, gf.first);
+            put_u32(out, (uint32_t)gf.second.size());
+            for (const string& f : gf.second) put_str(out, f);
+        }
+    }
+    
+    put_u32(out, (uint32_t)tracker_infomap.size());
+    for (const auto& pair : tracker_infomap) {
+        const GroupInfo& group = pair.second;
+        put_str(out, pair.first);
+        put_str(out, group.owner);
+        put_u32(out, (uint32_t)group.peers.size());
+        for (const string& p : group.peers) put_str(out, p);
+        put_u32(out, (uint32_t)group.files.size());
+        for (const string& f : group.files) put_str(out, f);
+        put_u32(out, (uint32_t)group.pending_requests.size());
+        for (const string& r : group.pending_requests) put_str(out, r);
+    }
+    
+    put_u32(out, (uint32_t)file_metadata.size());
+    for (const auto& group : file_metadata) {
+        put_str(out, group.first);
+        put_u32(out, (uint32_t)group.second.size());
+        for (const auto& file : group.second) {
+            put_str(out, file.first);
+            put_u64(out, (uint64_t)file.second.file_size);
+            put_u32(out, (uint32_t)file.second.num_pieces);
+            put_str(out, file.second.sha256_hash);
+            put_u32(out, (uint32_t)file.second.version);
+            put_str(out, file.second.manifest_hash);
+        }
+    }
+    
+    put_u32(out, (uint32_t)file_seeders.size());
+    for (const auto& group : file_seeders) {
+        put_str(out, group.first);
+        put_u32(out, (uint32_t)group.second.size());
+        for (const auto& file : group.second) {
+            put_str(out, file.first);
+            put_u32(out, (uint32_t)file.second.size());
+            for (const string& s : file.second.order) put_str(out, s);
+        }
+    }
+    
+    uint32_t npartial = 0;
+    for (const auto& group : file_availability) {
+        for (const auto& file : group.second) npartial += (uint32_t)file.second.partial.size();
+    }
+    put_u32(out, npartial);
+    for (const auto& group : file_availability) {
+        for (const auto& file : group.second) {
+            for (const auto& entry : file.second.partial) {
+                put_str(out, group.first);
+                put_str(out, file.first);
+                put_str(out, entry.first);
+                put_str(out, entry.second);
+            }
+        }
+    }
+    
+    put_u32(out, checksum32(out.data(), out.size()));
+}
+
+// Replace the in-memory state with a serialized snapshot. Entries are written
+// in key order, so inserting with an end() hint keeps the load linear.
+// Caller must hold data_mutex.
+bool deserialize_state(const string& data, uint64_t& seq) {
+    if (data.size() < 24 || memcmp(data.data(), SNAPSHOT_MAGIC, 8) != 0) return false;
+    
+    size_t body_len = data.size() - 4;
+    ByteReader tail(data.data() + body_len, 4);
+    if (tail.u32() != checksum32(data.data(), body_len)) return false;
+    
+    ByteReader in(data.data() + 8, body_len - 8);
+    uint32_t version = in.u32();
+    if (version < 1 || version > SNAPSHOT_VERSION) return false;
+    seq = in.u64();
+    
+    map<string, UserInfo> users;
+    map<string, GroupInfo> groups;
+    map<string, map<string, FileMetadata>> metadata;
+    map<string, map<string, Swarm>> seeders;
+    
+    uint32_t n = in.u32();
+    for (uint32_t i = 0; i < n && in.ok; i++) {
+        string id = in.str();
+        UserInfo user;
+        user.password = in.str();
+        user.ip = in.str();
+        user.port = (int)in.u32();
+        uint32_t state = in.u32();
+        user.is_active = state != 0;
+        user.is_live = state == 1;
+        if (version >= 3) {
+            user.zone = in.str();
+            user.coord = in.str();
+        }
+        if (version >= 6) user.session = in.str();   // Older sessions have none and must log in again
+        uint32_t ngroups = in.u32();
+        for (uint32_t g = 0; g < ngroups && in.ok; g++) {
+            set<string>& files = user.group_files[in.str()];
+            uint32_t nfiles = in.u32();
+            for (uint32_t f = 0; f < nfiles && in.ok; f++) files.emplace_hint(files.end(), in.str());
+        }
+        users.emplace_hint(users.end(), id, user);
+    }
+    
+    n = in.u32();
+    for (uint32_t i = 0; i < n && in.ok; i++) {
+        string id = in.str();
+        GroupInfo group;
+        group.owner = in.str();
+        uint32_t count = in.u32();
+        for (uint32_t j = 0; j < count && in.ok; j++) group.peers.emplace_hint(group.peers.end(), in.str());
+        count = in.u32();
+        for (uint32_t j = 0; j < count && in.ok; j++) group.files.emplace_hint(group.files.end(), in.str());
+        count = in.u32();
+        for (uint32_t j = 0; j < count && in.ok; j++) {
+            group.pending_requests.emplace_hint(group.pending_requests.end(), in.str());
+        }
+        groups.emplace_hint(groups.end(), id, group);
+    }
+    
+    n = in.u32();
+    for (uint32_t i = 0; i < n && in.ok; i++) {
+        map<string, FileMetadata>& files = metadata.emplace_hint(metadata.end(), in.str(),
+                                                                 map<string, FileMetadata>())->second;
+        uint32_t count = in.u32();
+        for (uint32_t j = 0; j < count && in.ok; j++) {
+            FileMetadata meta;
+            meta.filename = in.str();
+            meta.file_size = (long)in.u64();
+            meta.num_pieces = (int)in.u32();
+            meta.sha256_hash = in.str();
+            if (version >= 4) meta.version = (int)in.u32();
+            if (version >= 5) meta.manifest_hash = in.str();
+            files.emplace_hint(files.end(), meta.filename, meta);
+        }
+    }
+    
+    n = in.u32();
+    for (uint32_t i = 0; i < n && in.ok; i++) {
+        map<string, Swarm>& files = seeders.emplace_hint(seeders.end(), in.str(),
+                                                         map<string, Swarm>())->second;
+        uint32_t count = in.u32();
+        for (uint32_t j = 0; j < count && in.ok; j++) {
+            Swarm& swarm = files.emplace_hint(files.end(), in.str(), Swarm())->second;
+            uint32_t nseeders = in.u32();
+            for (uint32_t k = 0; k < nseeders && in.ok; k++) {
+                swarm.append(in.str());
+            }
+        }
+    }
+    
+    vector<vector<string>> partial;
+    if (version >= 2) {
+        n = in.u32();
+        for (uint32_t i = 0; i < n && in.ok; i++) {
+            vector<string> rec(5);
+            rec[0] = "have";
+            for (int k = 1; k < 5; k++) rec[k] = in.str();
+            partial.push_back(rec);
+        }
+    }
+    
+    if (!in.ok) return false;
+    
+    user_info.swap(users);
+    tracker_infomap.swap(groups);
+    file_metadata.swap(metadata);
+    file_seeders.swap(seeders);
+    
+    // Rebuilds the counts and per-user indexes along the way
+    file_availability.clear();
+    for (const auto& rec : partial) apply_record(rec);
+    return true;
+}
+
+bool write_snapshot_file(const string& data) {
+    string tmp_path = snapshot_path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) return false;
+    
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size() && sync_file(fp);
+    fclose(fp);
+    if (!ok) return false;
+    
+#ifdef _WIN32
+    remove(snapshot_path.c_str());
+#endif
+    return rename(tmp_path.c_str(), snapshot_path.c_str()) == 0;
+}
+
+// Replay one log segment, applying records newer than after_seq. Returns the
+// byte length of the valid prefix; anything past it is a torn write.
+size_t replay_wal_file(const string& path, uint64_t after_seq, uint64_t& last_seq, long& applied) {
+    string data;
+    if (!read_whole_file(path, data)) return 0;
+    
+    size_t pos = 0;
+    while (data.size() - pos >= 8) {
+        ByteReader header(data.data() + pos, 8);
+        uint32_t body_len = header.u32();
+        uint32_t check = header.u32();
+        if (data.size() - pos - 8 < body_len) break;
+        
+        const char* body = data.data() + pos + 8;
+        if (checksum32(body, body_len) != check) break;
+        
+        ByteReader in(body, body_len);
+        uint64_t seq = in.u64();
+        uint32_t count = in.u32();
+        vector<string> rec;
+        for (uint32_t i = 0; i < count && in.ok; i++) rec.push_back(in.str());
+        if (!in.ok) break;
+        
+        if (seq > after_seq) {
+            apply_record(rec);
+            applied++;
+        }
+        if (seq > last_seq) last_seq = seq;
+        pos += 8 + body_len;
+    }
+    
+    if (pos < data.size()) {
+        LOG_WARN("[TRACKER] Discarding " << (data.size() - pos) << " bytes of torn WAL tail in "
+             << path);
+    }
+    return pos;
+}
+
+void truncate_file(const string& path, size_t len) {
+    FILE* fp = fopen(path.c_str(), "r+b");
+    if (!fp) return;
+#ifdef _WIN32
+    _chsize(_fileno(fp), (long)len);
+#else
+    if (ftruncate(fileno(fp), (off_t)len) != 0) {
+        LOG_WARN("[TRACKER] Cannot truncate " << path);
+    }
+#endif
+    fclose(fp);
+}
+
+// Fold the log into a fresh snapshot. The state is serialized in memory under
+// data_mutex (with the log drained and rotated at the same instant) and then
+// written out with the lock released. force writes one even if nothing was
+// logged, e.g. after the whole state was replaced from a replication snapshot.
+void take_snapshot(bool force) {
+    if (!persistence_enabled) return;
+    
+    string data;
+    uint64_t last_seq;
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        // No appends can happen while we hold data_mutex; wait for the
+        // flusher to drain everything already appended
+        {
+            lock_guard<mutex> wal_lock(wal_mutex);
+            last_seq = wal_next_seq - 1;
+        }
+        wal_wait(last_seq);
+        
+        if (last_seq == snapshot_seq && !force) return;
+        
+        {
+            lock_guard<mutex> wal_lock(wal_mutex);
+            fclose(wal_file);
+            // A segment left by a failed snapshot is in no snapshot on disk
+            // yet, so the log is added to it instead of replacing it
+            bool rotated;
+            if (!file_exists(wal_prev_path)) {
+                rotated = rename(wal_path.c_str(), wal_prev_path.c_str()) == 0;
+            } else {
+                string segment;
+                FILE* prev = fopen(wal_prev_path.c_str(), "ab");
+                rotated = prev && read_whole_file(wal_path, segment) &&
+                          fwrite(segment.data(), 1, segment.size(), prev) == segment.size() && sync_file(prev);
+                if (prev) fclose(prev);
+            }
+            wal_file = fopen(wal_path.c_str(), rotated ? "wb" : "ab");
+            if (!wal_file) {
+                cerr << "[TRACKER] FATAL: Cannot reopen WAL" << endl;
+                exit(1);
+            }
+            if (!rotated) {
+                LOG_WARN("[TRACKER] Cannot rotate WAL, snapshot postponed");
+                return;
+            }
+        }
+        
+        serialize_state(data, last_seq);
+    }
+    
+    if (!write_snapshot_file(data)) {
+        // Keep the old segment; it is replayed together with the new one, and
+        // the next snapshot folds in both
+        LOG_WARN("[TRACKER] Snapshot write failed");
+        return;
+    }
+    remove(wal_prev_path.c_str());
+    
+    // Only now is the log up to last_seq in a snapshot on disk
+    {
+        lock_guard<mutex> wal_lock(wal_mutex);
+        snapshot_seq = max(snapshot_seq, last_seq);
+    }
+    
+    LOG_INFO("[TRACKER] Snapshot written at seq " << last_seq
+         << " (" << data.size() << " bytes)");
+}
+
+void snapshot_thread() {
+    auto last_snapshot = chrono::steady_clock::now();
+    
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(1));
+        
+        uint64_t pending;
+        {
+            lock_guard<mutex> lock(wal_mutex);
+            pending = wal_next_seq - 1 - snapshot_seq;
+        }
+        
+        auto elapsed = chrono::steady_clock::now() - last_snapshot;
+        if (pending == 0) continue;
+        if ((long)pending < snapshot_every && elapsed < chrono::seconds(snapshot_interval_sec)) continue;
+        
+        take_snapshot(false);
+        last_snapshot = chrono::steady_clock::now();
+    }
+}
+
+// Restore state from disk and start the background log threads
+bool init_persistence(const string& data_dir, int tracker_no) {
+    string prefix = data_dir + "/tracker_" + to_string(tracker_no);
+    snapshot_path = prefix + ".snap";
+    wal_path = prefix + ".wal";
+    wal_prev_path = prefix + ".wal.prev";
+    
+    auto start = chrono::steady_clock::now();
+    uint64_t last_seq = 0;
+    long applied = 0;
+    
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        string data;
+        if (read_whole_file(snapshot_path, data)) {
+            if (!deserialize_state(data, snapshot_seq)) {
+                cerr << "ERROR: Snapshot " << snapshot_path << " is corrupt" << endl;
+                return false;
+            }
+            last_seq = snapshot_seq;
+        }
+        
+        bool had_prev = file_exists(wal_prev_path);
+        if (had_prev) {
+            replay_wal_file(wal_prev_path, snapshot_seq, last_seq, applied);
+        }
+        size_t valid = replay_wal_file(wal_path, snapshot_seq, last_seq, applied);
+        truncate_file(wal_path, valid);
+        
+        wal_next_seq = last_seq + 1;
+        wal_durable_seq = last_seq;
+        
+        // Fold a non-trivial tail into a new snapshot right away so the next
+        // restart is fast and the log starts empty
+        if (applied > 0 || had_prev) {
+            string snap;
+            serialize_state(snap, last_seq);
+            if (!write_snapshot_file(snap)) {
+                cerr << "ERROR: Cannot write snapshot " << snapshot_path << endl;
+                return false;
+            }
+            snapshot_seq = last_seq;
+            remove(wal_prev_path.c_str());
+            truncate_file(wal_path, 0);
+        }
+    }
+    
+    wal_file = fopen(wal_path.c_str(), "ab");
+    if (!wal_file) {
+        cerr << "ERROR: Cannot open WAL " << wal_path << endl;
+        return false;
+    }
+    
+    long ms = (long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    LOG_INFO("[TRACKER] Restored " << user_info.size() << " users, " << tracker_infomap.size()
+         << " groups (snapshot seq " << snapshot_seq << ", " << applied
+         << " WAL records replayed) in " << ms << " ms");
+    
+    persistence_enabled = true;
+    thread(wal_flusher_thread).detach();
+    thread(snapshot_thread).detach();
+    return true;
+}
+
+// ==================== REPLICATION ====================
+
+// Trackers listed in the tracker info file form a primary/backup group. The
+// primary executes every write and streams the resulting records to the
+// backups, which serve read commands. A backup starts from a full state
+// snapshot sent by the primary and then applies the live record stream. When
+// the primary dies, the lowest-numbered live tracker promotes itself and the
+// others follow it. Replication is asynchronous: writes acknowledged by a
+// primary that dies before streaming them can be lost on failover.
+
+vector<string> tracker_addrs;   // All lines of the tracker info file
+int my_tracker_no = 1;
+atomic<bool> is_primary(false);
+string primary_addr;            // Guarded by role_mutex
+mutex role_mutex;
+
+#define REPLICA_MAX_BACKLOG (64 * 1024 * 1024)
+#define MAX_SNAPSHOT_BYTES (4ULL * 1024 * 1024 * 1024)   // Larger snapshot headers are refused
+#define MAX_RECORD_BYTES (16 * 1024 * 1024)              // Larger streamed records are refused
+
+struct ReplicaLink {
+    SOCKET sock;
+    mutex mtx;
+    condition_variable cv;
+    string pending;
+    bool dead;
+};
+
+// Outgoing streams to backups. Guarded by data_mutex so records are queued in
+// exactly the order they were applied.
+vector<shared_ptr<ReplicaLink>> replica_links;
+
+string get_primary_addr() {
+    lock_guard<mutex> lock(role_mutex);
+    return primary_addr;
+}
+
+void set_primary_addr(const string& addr) {
+    lock_guard<mutex> lock(role_mutex);
+    primary_addr = addr;
+}
+
+void replica_sender_thread(shared_ptr<ReplicaLink> link) {
+    string batch;
+    
+    while (true) {
+        {
+            unique_lock<mutex> lock(link->mtx);
+            link->cv.wait(lock, [&link] { return !link->pending.empty() || link->dead; });
+            if (link->dead) break;
+            batch.swap(link->pending);
+            link->pending.clear();
+        }
+        
+        if (!send_all(link->sock, batch.data(), batch.size())) {
+            lock_guard<mutex> lock(link->mtx);
+            link->dead = true;
+            break;
+        }
+        batch.clear();
+    }
+    
+    CLOSE_SOCKET(link->sock);
+    LOG_INFO("[TRACKER] Backup disconnected");
+}
+
+// Queue a record for every connected backup. Caller must hold data_mutex.
+void replicate_record(const vector<string>& rec) {
+    if (replica_links.empty()) return;
+    
+    string frame;
+    encode_wal_record(frame, 0, rec);
+    
+    for (size_t i = 0; i < replica_links.size();) {
+        shared_ptr<ReplicaLink> link = replica_links[i];
+        bool dead;
+        {
+            lock_guard<mutex> lock(link->mtx);
+            // A backup that can't keep up is cut off; it resyncs from a
+            // fresh snapshot when it reconnects
+            if (link->pending.size() > REPLICA_MAX_BACKLOG) {
+                link->dead = true;
+            }
+            dead = link->dead;
+            if (!dead) {
+                link->pending += frame;
+            }
+        }
+        link->cv.notify_one();
+        
+        if (dead) {
+            replica_links.erase(replica_links.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Apply the changes, log them and stream them to backups. Caller must hold
+// data_mutex.
+void commit_record(const vector<string>& rec) {
+    apply_record(rec);
+    wal_append(rec);
+    replicate_record(rec);
+}
+
+// Turn a tracker connection into a replication stream: send a snapshot of the
+// current state, then every record applied after it. Takes ownership of the
+// socket on success. Only another tracker of the info file may ask, from the
+// IP listed for its number, as the stream carries every user's password.
+bool serve_replica(SOCKET sock, const vector<string>& args, const string& client_ip) {
+    char* end = NULL;
+    long tracker_no = args.size() >= 2 ? strtol(args[1].c_str(), &end, 10) : 0;
+    bool known = end && *end == '\0' && tracker_no >= 1 && tracker_no <= (long)tracker_addrs.size() &&
+                 tracker_no != my_tracker_no;
+    if (known) {
+        const string& addr = tracker_addrs[tracker_no - 1];
+        known = addr.substr(0, addr.rfind(':')) == client_ip;
+    }
+    if (!known) {
+        LOG_WARN("[TRACKER] Refused replication to " << client_ip << " (tracker "
+                 << (args.size() >= 2 ? args[1] : "?") << ")");
+        send_response(sock, "ERROR: Not a tracker of this cluster");
+        return false;
+    }
+    
+    if (!is_primary) {
+        string primary = get_primary_addr();
+        send_response(sock, "ERROR: NOT_PRIMARY " + (primary.empty() ? "-" : primary));
+        return false;
+    }
+    
+    shared_ptr<ReplicaLink> link = make_shared<ReplicaLink>();
+    link->sock = sock;
+    link->dead = false;
+    
+    string snap;
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        serialize_state(snap, 0);
+        replica_links.push_back(link);
+    }
+    
+    // Records applied from here on are queued behind the snapshot
+    string header = "SNAPSHOT " + to_string(snap.size()) + "\n";
+    if (!send_all(sock, header.data(), header.size()) || !send_all(sock, snap.data(), snap.size())) {
+        lock_guard<mutex> lock(link->mtx);
+        link->dead = true;
+    }
+    
+    LOG_INFO("[TRACKER] Backup " << (args.size() >= 2 ? args[1] : "?") << " attached ("
+         << snap.size() << " byte snapshot)");
+    
+    thread(replica_sender_thread, link).detach();
+    return true;
+}
+
+// Ask another tracker for its role. Returns "" if it is unreachable.
+string query_role(const string& addr) {
+    SOCKET sock = connect_to_server(addr);
+    if (sock == INVALID_SOCKET) return "";
+    
+    set_recv_timeout(sock, 2000);
+    string request = "tracker_role";
+    string response;
+    
+    if (send(sock, request.c_str(), (int)request.length(), 0) <= 0 || !read_response(sock, response)) {
+        CLOSE_SOCKET(sock);
+        return "";
+    }
+    CLOSE_SOCKET(sock);
+    return response;
+}
+
+// Replicate from the primary at addr until the stream breaks
+void follow_primary(const string& addr) {
+    SOCKET sock = connect_to_server(addr);
+    if (sock == INVALID_SOCKET) return;
+    
+    string request = "replicate " + to_string(my_tracker_no);
+    if (send(sock, request.c_str(), (int)request.length(), 0) <= 0) {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    
+    // Header line: "SNAPSHOT <len>\n" or an error
+    string header;
+    char c;
+    while (header.size() < 256 && recv(sock, &c, 1, 0) == 1) {
+        if (c == '\n') break;
+        header += c;
+    }
+    if (header.find("SNAPSHOT ") != 0) {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    char* end = NULL;
+    unsigned long long snap_size = strtoull(header.c_str() + 9, &end, 10);
+    if (end == header.c_str() + 9 || *end != '\0' || snap_size > MAX_SNAPSHOT_BYTES ||
+        snap_size > (unsigned long long)string().max_size()) {
+        LOG_WARN("[TRACKER] Bad snapshot header from primary " << addr << ": " << header);
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    
+    string snap((size_t)snap_size, '\0');
+    if (!recv_exact(sock, &snap[0], snap.size())) {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    
+    size_t num_users, num_groups;
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        uint64_t ignored;
+        if (!deserialize_state(snap, ignored)) {
+            LOG_WARN("[TRACKER] Invalid snapshot from primary " << addr);
+            CLOSE_SOCKET(sock);
+            return;
+        }
+        num_users = user_info.size();
+        num_groups = tracker_infomap.size();
+    }
+    // The local log no longer describes the installed state; restart it
+    take_snapshot(true);
+    set_primary_addr(addr);
+    
+    LOG_INFO("[TRACKER] Following primary " << addr << " (" << num_users << " users, "
+         << num_groups << " groups)");
+    
+    string body;
+    while (true) {
+        char head[8];
+        if (!recv_exact(sock, head, sizeof(head))) break;
+        
+        ByteReader hr(head, sizeof(head));
+        uint32_t body_len = hr.u32();
+        uint32_t check = hr.u32();
+        if (body_len > MAX_RECORD_BYTES) {
+            LOG_WARN("[TRACKER] Record of " << body_len << " bytes from primary " << addr << " refused");
+            break;
+        }
+        body.resize(body_len);
+        if (body_len > 0 && !recv_exact(sock, &body[0], body_len)) break;
+        if (checksum32(body.data(), body.size()) != check) break;
+        
+        ByteReader in(body.data(), body.size());
+        in.u64();
+        uint32_t count = in.u32();
+        vector<string> rec;
+        for (uint32_t i = 0; i < count && in.ok; i++) rec.push_back(in.str());
+        if (!in.ok) break;
+        
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        commit_record(rec);
+    }
+    
+    CLOSE_SOCKET(sock);
+    set_primary_addr("");
+    LOG_WARN("[TRACKER] Lost primary " << addr);
+}
+
+void arm_heartbeat_timers();
 
-// Global data structures with mutex protection
-map<string, GroupInfo> tracker_infomap;
-map<string, UserInfo> user_info;
-map<string, map<string, FileMetadata>> file_metadata; // group_id -> filename -> metadata
-map<string, map<string, set<string>>> file_seeders;   // group_id -> filename -> set of user_ids
+void promote_to_primary() {
+    set_primary_addr(tracker_addrs[my_tracker_no - 1]);
+    arm_heartbeat_timers();
+    is_primary = true;
+    LOG_INFO("[TRACKER] Acting as primary");
+}
 
-mutex data_mutex;
+// Find the primary and follow it; promote this tracker when it is the
+// lowest-numbered live tracker and nobody else is primary
+void replication_thread() {
+    while (true) {
+        string primary;
+        int lowest_alive = my_tracker_no;
+        
+        for (int i = 1; i <= (int)tracker_addrs.size(); i++) {
+            if (i == my_tracker_no) continue;
+            
+            string role = query_role(tracker_addrs[i - 1]);
+            if (role.empty()) continue;
+            
+            if (i < lowest_alive) lowest_alive = i;
+            if (role.find("ROLE PRIMARY") == 0) {
+                primary = tracker_addrs[i - 1];
+                // Two primaries can coexist after a partition heals; the
+                // higher-numbered one steps down
+                if (is_primary && i > my_tracker_no) primary = "";
+                break;
+            }
+        }
+        
+        if (is_primary) {
+            if (!primary.empty()) {
+                LOG_WARN("[TRACKER] Another primary at " << primary << ", stepping down");
+                is_primary = false;
+                set_primary_addr("");
+            } else {
+                this_thread::sleep_for(chrono::seconds(2));
+                continue;
+            }
+        }
+        
+        if (primary.empty()) {
+            if (lowest_alive == my_tracker_no) {
+                promote_to_primary();
+            } else {
+                this_thread::sleep_for(chrono::milliseconds(500));
+            }
+            continue;
+        }
+        
+        follow_primary(primary);
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+}
 
-// ==================== HELPER FUNCTIONS ====================
+bool is_write_command(const string& cmd) {
+    return cmd == "create_user" || cmd == "login" || cmd == "logout" || cmd == "create_group" ||
+           cmd == "join_group" || cmd == "leave_group" || cmd == "accept_request" ||
+           cmd == "upload_file" || cmd == "upload_files" || cmd == "update_seeder" ||
+           cmd == "update_seeders" || cmd == "announce";
+}
 
-vector<string> split_string(const string& str, char delimiter) {
-    vector<string> tokens;
-    stringstream ss(str);
-    string token;
-    while (getline(ss, token, delimiter)) {
-        if (!token.empty()) {
-            tokens.push_back(token);
+// ==================== LIVENESS ====================
+
+// Logged-in clients announce themselves periodically. The primary keeps each
+// user's heartbeat deadline in a timing wheel and expires users whose deadline
+// passes: their seeders leave every swarm (an "expire" record, so backups and
+// the WAL agree) until the next heartbeat revives them.
+
+// Hashed timing wheel with one-second slots. A heartbeat moves the user to the
+// slot their TTL ends in and each tick only visits the slot that is due, so
+// both cost O(1) per user no matter how many users are tracked.
+struct TimerWheel {
+    vector<vector<string>> slots;
+    unordered_map<string, pair<size_t, size_t>> position;  // user -> (slot, index)
+    size_t current = 0;
+    
+    void init(size_t num_slots) {
+        slots.assign(num_slots, vector<string>());
+        position.clear();
+        current = 0;
+    }
+    
+    void cancel(const string& user_id) {
+        auto it = position.find(user_id);
+        if (it == position.end()) return;
+        
+        // Swap-remove from the slot, fixing up the entry that moved
+        vector<string>& slot = slots[it->second.first];
+        size_t index = it->second.second;
+        if (index + 1 != slot.size()) {
+            slot[index] = slot.back();
+            position[slot[index]].second = index;
         }
+        slot.pop_back();
+        position.erase(it);
     }
-    return tokens;
+    
+    // Fire after `ticks` ticks; ticks must be in [1, slots.size() - 1]
+    void schedule(const string& user_id, size_t ticks) {
+        cancel(user_id);
+        size_t slot = (current + ticks) % slots.size();
+        position[user_id] = make_pair(slot, slots[slot].size());
+        slots[slot].push_back(user_id);
+    }
+    
+    // Advance one tick and return the users that are due
+    vector<string> advance() {
+        current = (current + 1) % slots.size();
+        vector<string> due;
+        due.swap(slots[current]);
+        for (const string& user_id : due) position.erase(user_id);
+        return due;
+    }
+};
+
+TimerWheel heartbeat_wheel;  // Guarded by data_mutex
+
+int heartbeat_interval_sec() {
+    return max(1, seeder_ttl_sec / 3);
 }
 
-string join_vector(const vector<string>& vec, const string& delimiter) {
-    string result;
-    for (size_t i = 0; i < vec.size(); i++) {
-        result += vec[i];
-        if (i < vec.size() - 1) result += delimiter;
+// Record a sign of life from user_id. Caller must hold data_mutex.
+void note_heartbeat(const string& user_id) {
+    if (!is_primary) return;
+    
+    auto it = user_info.find(user_id);
+    if (it == user_info.end() || !it->second.is_active) return;
+    
+    heartbeat_wheel.schedule(user_id, seeder_ttl_sec);
+    if (!it->second.is_live) {
+        commit_record({"revive", user_id});
     }
-    return result;
 }
 
-// Find logged-in user by their IP and port
-string find_user_by_address(const string& ip, int port) {
-    lock_guard<mutex> lock(data_mutex);
+// On becoming primary nobody has heartbeated here yet: give every live user a
+// full TTL to reach us
+void arm_heartbeat_timers() {
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
+    heartbeat_wheel.init(seeder_ttl_sec + 2);
     for (const auto& pair : user_info) {
-        if (pair.second.is_active && pair.second.ip == ip && pair.second.port == port) {
-            return pair.first;
+        if (pair.second.is_active && pair.second.is_live) {
+            heartbeat_wheel.schedule(pair.first, seeder_ttl_sec);
         }
     }
-    return "";
 }
 
-void send_response(SOCKET client_socket, const string& response) {
-    send(client_socket, response.c_str(), (int)response.length(), 0);
+void expiry_thread() {
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(1));
+        
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        if (heartbeat_wheel.slots.empty()) continue;
+        
+        vector<string> due = heartbeat_wheel.advance();
+        if (!is_primary) continue;
+        
+        for (const string& user_id : due) {
+            auto it = user_info.find(user_id);
+            if (it == user_info.end() || !it->second.is_active || !it->second.is_live) continue;
+            
+            commit_record({"expire", user_id});
+            LOG_INFO("[TRACKER] Heartbeat from " << user_id << " lapsed, dropped from swarms");
+        }
+    }
 }
 
 // ==================== COMMAND HANDLERS ====================
@@ -120,23 +1995,32 @@ string handle_create_user(const vector<string>& args, const string& client_ip, i
     string user_id = args[1];
     string password = args[2];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (user_info.find(user_id) != user_info.end()) {
         return "ERROR: User already exists";
     }
     
-    UserInfo new_user;
-    new_user.password = password;
-    new_user.ip = "";
-    new_user.port = 0;
-    new_user.is_active = false;
-    
-    user_info[user_id] = new_user;
+    commit_record({"create_user", user_id, password});
     
     return "SUCCESS: User registered successfully";
 }
 
+// A session token: 128 bits from random_device, in hex
+string new_session_token() {
+    static const char digits[] = "0123456789abcdef";
+    random_device rd;
+    string token;
+    for (int i = 0; i < 4; i++) {
+        uint32_t v = rd();
+        for (int d = 0; d < 8; d++, v >>= 4) token += digits[v & 15];
+    }
+    return token;
+}
+
+// "SUCCESS: Login successful SESSION:<token>". The token is what lets a later
+// connection (or a UDP request) act for the user; logging in again while a
+// session is live replaces it, e.g. for a client that lost its token.
 string handle_login(const vector<string>& args, const string& client_ip, int client_port) {
     if (args.size() < 3) {
         return "ERROR: Usage: login <user_id> <password>";
@@ -145,7 +2029,21 @@ string handle_login(const vector<string>& args, const string& client_ip, int cli
     string user_id = args[1];
     string password = args[2];
     
-    lock_guard<mutex> lock(data_mutex);
+    // Optional locality hints after the port: zone=<label> coord=<x>,<y>
+    string zone;
+    string coord;
+    for (size_t i = 4; i < args.size(); i++) {
+        if (args[i].find("zone=") == 0) {
+            zone = args[i].substr(5);
+        }
+        else if (args[i].find("coord=") == 0) {
+            double x, y;
+            coord = args[i].substr(6);
+            if (!parse_coord(coord, x, y)) return "ERROR: Invalid coordinates, expected coord=<x>,<y>";
+        }
+    }
+    
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (user_info.find(user_id) == user_info.end()) {
         return "ERROR: User does not exist";
@@ -155,27 +2053,22 @@ string handle_login(const vector<string>& args, const string& client_ip, int cli
         return "ERROR: Invalid password";
     }
     
-    if (user_info[user_id].is_active) {
-        return "ERROR: User already logged in";
-    }
-    
-    user_info[user_id].is_active = true;
-    user_info[user_id].ip = client_ip;
-    user_info[user_id].port = client_port;
+    string session = new_session_token();
+    commit_record({"login", user_id, client_ip, to_string(client_port), zone, coord, session});
+    note_heartbeat(user_id);
     
-    return "SUCCESS: Login successful";
+    return "SUCCESS: Login successful SESSION:" + session;
 }
 
 string handle_logout(const vector<string>& args, const string& user_id) {
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (user_info.find(user_id) == user_info.end()) {
         return "ERROR: User not found";
     }
     
-    user_info[user_id].is_active = false;
-    user_info[user_id].ip = "";
-    user_info[user_id].port = 0;
+    commit_record({"logout", user_id});
+    heartbeat_wheel.cancel(user_id);
     
     return "SUCCESS: Logged out successfully";
 }
@@ -187,7 +2080,7 @@ string handle_create_group(const vector<string>& args, const string& user_id) {
     
     string group_id = args[1];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -197,11 +2090,7 @@ string handle_create_group(const vector<string>& args, const string& user_id) {
         return "ERROR: Group already exists";
     }
     
-    GroupInfo new_group;
-    new_group.owner = user_id;
-    new_group.peers.push_back(user_id);
-    
-    tracker_infomap[group_id] = new_group;
+    commit_record({"create_group", group_id, user_id});
     
     return "SUCCESS: Group created successfully";
 }
@@ -213,7 +2102,7 @@ string handle_join_group(const vector<string>& args, const string& user_id) {
     
     string group_id = args[1];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -226,17 +2115,16 @@ string handle_join_group(const vector<string>& args, const string& user_id) {
     GroupInfo& group = tracker_infomap[group_id];
     
     // Check if already a member
-    if (find(group.peers.begin(), group.peers.end(), user_id) != group.peers.end()) {
+    if (group.peers.count(user_id)) {
         return "ERROR: Already a member of this group";
     }
     
     // Check if request already pending
-    if (find(group.pending_requests.begin(), group.pending_requests.end(), user_id) 
-        != group.pending_requests.end()) {
+    if (group.pending_requests.count(user_id)) {
         return "ERROR: Join request already pending";
     }
     
-    group.pending_requests.push_back(user_id);
+    commit_record({"join_group", group_id, user_id});
     
     return "SUCCESS: Join request sent";
 }
@@ -248,7 +2136,7 @@ string handle_leave_group(const vector<string>& args, const string& user_id) {
     
     string group_id = args[1];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -261,8 +2149,7 @@ string handle_leave_group(const vector<string>& args, const string& user_id) {
     GroupInfo& group = tracker_infomap[group_id];
     
     // Check if member
-    auto it = find(group.peers.begin(), group.peers.end(), user_id);
-    if (it == group.peers.end()) {
+    if (!group.peers.count(user_id)) {
         return "ERROR: Not a member of this group";
     }
     
@@ -270,50 +2157,271 @@ string handle_leave_group(const vector<string>& args, const string& user_id) {
         return "ERROR: Owner cannot leave the group. Transfer ownership first.";
     }
     
-    // Remove user from group
-    group.peers.erase(it);
+    // Remove user from group along with the files they were seeding there
+    commit_record({"leave_group", group_id, user_id});
     
-    // Remove user's files from this group
-    if (user_info[user_id].group_files.find(group_id) != user_info[user_id].group_files.end()) {
-        for (const string& filename : user_info[user_id].group_files[group_id]) {
-            if (file_seeders[group_id].find(filename) != file_seeders[group_id].end()) {
-                file_seeders[group_id][filename].erase(user_id);
-            }
+    return "SUCCESS: Left group successfully";
+}
+
+// ==================== LISTINGS ====================
+
+// list_groups / list_files / list_requests accept optional trailing
+// arguments:
+//   limit=<n>     return at most n entries, followed by "NEXT: <cursor>" if
+//                 more remain
+//   after=<name>  resume after the cursor returned by a previous call
+//   prefix=<str>  only names starting with str
+// A listing is streamed page by page, holding data_mutex only while one page
+// is copied out, so a huge group neither blocks other commands nor gets
+// truncated.
+
+#define LIST_PAGE_SIZE 1000
+
+struct ListOptions {
+    string after;
+    bool has_after;
+    string prefix;
+    long limit;   // -1 = everything
+};
+
+bool parse_list_options(const vector<string>& args, size_t first, ListOptions& opts) {
+    opts.has_after = false;
+    opts.limit = -1;
+    
+    for (size_t i = first; i < args.size(); i++) {
+        const string& arg = args[i];
+        if (arg.find("after=") == 0) {
+            opts.after = arg.substr(6);
+            opts.has_after = true;
+        }
+        else if (arg.find("prefix=") == 0) {
+            opts.prefix = arg.substr(7);
+        }
+        else if (arg.find("limit=") == 0) {
+            opts.limit = atol(arg.substr(6).c_str());
+            if (opts.limit <= 0) return false;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline const string& entry_key(const string& name) { return name; }
+
+template <class V>
+inline const string& entry_key(const pair<const string, V>& entry) { return entry.first; }
+
+bool has_prefix(const string& name, const string& prefix) {
+    return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Collect up to max entries of an ordered set/map that come after the cursor
+// and match the prefix, formatting each with format(). Caller must hold
+// data_mutex.
+template <class Container, class Format>
+void collect_page(const Container& entries, const string& after, bool has_after, const string& prefix,
+                  size_t max, vector<pair<string, string>>& page, Format format) {
+    auto it = has_after ? entries.upper_bound(after) : entries.begin();
+    if (!prefix.empty() && (it == entries.end() || entry_key(*it) < prefix)) {
+        it = entries.lower_bound(prefix);
+    }
+    
+    for (; it != entries.end() && page.size() < max; ++it) {
+        const string& key = entry_key(*it);
+        if (!has_prefix(key, prefix)) break;
+        page.push_back(make_pair(key, format(*it)));
+    }
+}
+
+// Drive a paginated listing. fetch(after, has_after, max, page) locks
+// data_mutex, copies out up to max entries and returns false if the listed
+// object disappeared. Returns an error/empty message instead of streaming if
+// nothing matches.
+typedef function<bool(const string&, bool, size_t, vector<pair<string, string>>&)> PageFetcher;
+
+string stream_listing(ResponseStream& out, const string& header, const string& empty_message,
+                      const ListOptions& opts, PageFetcher fetch) {
+    string cursor = opts.after;
+    bool has_cursor = opts.has_after;
+    long remaining = opts.limit;
+    bool started = false;
+    
+    while (remaining != 0) {
+        size_t want = LIST_PAGE_SIZE;
+        if (remaining > 0 && (size_t)remaining < want) want = (size_t)remaining;
+        
+        // Fetch one extra entry to learn whether anything follows the page
+        vector<pair<string, string>> page;
+        if (!fetch(cursor, has_cursor, want + 1, page)) {
+            // The listed object went away between pages
+            if (!started) return "ERROR: Group does not exist";
+            out.finish();
+            return "";
+        }
+        
+        bool more = page.size() > want;
+        if (more) page.pop_back();
+        
+        if (!started) {
+            if (page.empty()) return empty_message;
+            out.write(header);
+            started = true;
+        }
+        
+        for (const auto& entry : page) {
+            out.write(entry.second + "\n");
+        }
+        
+        if (!page.empty()) {
+            cursor = page.back().first;
+            has_cursor = true;
+        }
+        if (remaining > 0) remaining -= (long)page.size();
+        
+        if (!more) {
+            out.finish();
+            return "";
         }
-        user_info[user_id].group_files.erase(group_id);
     }
     
-    return "SUCCESS: Left group successfully";
+    // Stopped at the limit with entries left over
+    out.write("NEXT: " + cursor + "\n");
+    out.finish();
+    return "";
+}
+
+string handle_list_groups(const vector<string>& args, const string& user_id, ResponseStream& out) {
+    ListOptions opts;
+    if (!parse_list_options(args, 1, opts)) {
+        return "ERROR: Usage: list_groups [limit=<n>] [after=<group_id>] [prefix=<str>]";
+    }
+    
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        if (!user_info[user_id].is_active) {
+            return "ERROR: Please login first";
+        }
+    }
+    
+    return stream_listing(out, "GROUPS:\n", opts.prefix.empty() ? "No groups available" : "No matching groups", opts,
+        [&opts](const string& after, bool has_after, size_t max, vector<pair<string, string>>& page) {
+            lock_guard<TimedRecursiveMutex> lock(data_mutex);
+            collect_page(tracker_infomap, after, has_after, opts.prefix, max, page,
+                [](const pair<const string, GroupInfo>& group) {
+                    return group.first + " (Owner: " + group.second.owner + ", Members: "
+                           + to_string(group.second.peers.size()) + ")";
+                });
+            return true;
+        });
+}
+
+string handle_list_requests(const vector<string>& args, const string& user_id, ResponseStream& out) {
+    ListOptions opts;
+    if (args.size() < 2 || !parse_list_options(args, 2, opts)) {
+        return "ERROR: Usage: list_requests <group_id> [limit=<n>] [after=<user_id>] [prefix=<str>]";
+    }
+    
+    string group_id = args[1];
+    
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        if (!user_info[user_id].is_active) {
+            return "ERROR: Please login first";
+        }
+        
+        if (tracker_infomap.find(group_id) == tracker_infomap.end()) {
+            return "ERROR: Group does not exist";
+        }
+        
+        if (tracker_infomap[group_id].owner != user_id) {
+            return "ERROR: Only group owner can view requests";
+        }
+    }
+    
+    return stream_listing(out, "PENDING REQUESTS:\n", "No pending requests", opts,
+        [&opts, &group_id](const string& after, bool has_after, size_t max, vector<pair<string, string>>& page) {
+            lock_guard<TimedRecursiveMutex> lock(data_mutex);
+            auto group = tracker_infomap.find(group_id);
+            if (group == tracker_infomap.end()) return false;
+            
+            collect_page(group->second.pending_requests, after, has_after, opts.prefix, max, page,
+                [](const string& request) { return request; });
+            return true;
+        });
 }
 
-string handle_list_groups(const vector<string>& args, const string& user_id) {
-    lock_guard<mutex> lock(data_mutex);
+string handle_accept_request(const vector<string>& args, const string& user_id) {
+    if (args.size() < 3) {
+        return "ERROR: Usage: accept_request <group_id> <user_id>";
+    }
+    
+    string group_id = args[1];
+    string request_user = args[2];
+    
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
     }
     
-    if (tracker_infomap.empty()) {
-        return "No groups available";
+    if (tracker_infomap.find(group_id) == tracker_infomap.end()) {
+        return "ERROR: Group does not exist";
     }
     
-    string result = "GROUPS:\n";
-    for (const auto& pair : tracker_infomap) {
-        result += pair.first + " (Owner: " + pair.second.owner + ", Members: " 
-                  + to_string(pair.second.peers.size()) + ")\n";
+    GroupInfo& group = tracker_infomap[group_id];
+    
+    if (group.owner != user_id) {
+        return "ERROR: Only group owner can accept requests";
     }
     
-    return result;
+    if (!group.pending_requests.count(request_user)) {
+        return "ERROR: No pending request from this user";
+    }
+    
+    // Remove from pending and add to members
+    commit_record({"accept_request", group_id, request_user});
+    
+    return "SUCCESS: User added to group";
 }
 
-string handle_list_requests(const vector<string>& args, const string& user_id) {
-    if (args.size() < 2) {
-        return "ERROR: Usage: list_requests <group_id>";
+// A SHA-256 in hex given as <key>=<64 hex digits>
+bool parse_digest_arg(const string& arg, const string& key, string& digest) {
+    if (arg.find(key + "=") != 0 || arg.size() != key.size() + 1 + 64) return false;
+    digest = arg.substr(key.size() + 1);
+    return digest.find_first_not_of("0123456789abcdef") == string::npos;
+}
+
+// A file's root hash, given after its piece count as root=<64 hex digits>
+bool parse_root_hash(const string& arg, string& root) {
+    return parse_digest_arg(arg, "root", root);
+}
+
+string handle_upload_file(const vector<string>& args, const string& user_id) {
+    // A bundle (a directory shared as one object) also names its manifest
+    string root;
+    string manifest;
+    if (args.size() < 5 || (args.size() >= 6 && !parse_root_hash(args[5], root)) ||
+        (args.size() >= 7 && (root.empty() || !parse_digest_arg(args[6], "manifest", manifest)))) {
+        return "ERROR: Usage: upload_file <filepath> <group_id> <file_size> <num_pieces> [root=<sha256> "
+               "[manifest=<sha256>]]";
     }
     
-    string group_id = args[1];
+    string filepath = args[1];
+    string group_id = args[2];
+    long file_size;
+    int num_pieces;
+    if (!parse_file_shape(args[3], args[4], file_size, num_pieces)) {
+        return "ERROR: Invalid file size or piece count";
+    }
+    
+    // Extract filename from path
+    string filename = base_filename(filepath);
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -323,33 +2431,238 @@ string handle_list_requests(const vector<string>& args, const string& user_id) {
         return "ERROR: Group does not exist";
     }
     
-    if (tracker_infomap[group_id].owner != user_id) {
-        return "ERROR: Only group owner can view requests";
+    GroupInfo& group = tracker_infomap[group_id];
+    
+    // Check if user is member
+    if (!group.peers.count(user_id)) {
+        return "ERROR: Not a member of this group";
     }
     
-    const vector<string>& requests = tracker_infomap[group_id].pending_requests;
+    // Add file metadata, list it in the group and register the user as seeder
+    vector<string> record = {"upload_file", group_id, filename, to_string(file_size), to_string(num_pieces),
+                             user_id, root};
+    if (!manifest.empty()) record.push_back(manifest);
+    commit_record(record);
     
-    if (requests.empty()) {
-        return "No pending requests";
+    return manifest.empty() ? "SUCCESS: File uploaded successfully" : "SUCCESS: Bundle uploaded successfully";
+}
+
+string handle_list_files(const vector<string>& args, const string& user_id, ResponseStream& out) {
+    ListOptions opts;
+    if (args.size() < 2 || !parse_list_options(args, 2, opts)) {
+        return "ERROR: Usage: list_files <group_id> [limit=<n>] [after=<filename>] [prefix=<str>]";
     }
     
-    string result = "PENDING REQUESTS:\n";
-    for (const string& req : requests) {
-        result += req + "\n";
+    string group_id = args[1];
+    
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        if (!user_info[user_id].is_active) {
+            return "ERROR: Please login first";
+        }
+        
+        if (tracker_infomap.find(group_id) == tracker_infomap.end()) {
+            return "ERROR: Group does not exist";
+        }
+        
+        // Check if user is member
+        if (!tracker_infomap[group_id].peers.count(user_id)) {
+            return "ERROR: Not a member of this group";
+        }
     }
     
-    return result;
+    return stream_listing(out, "FILES:\n", opts.prefix.empty() ? "No files in this group" : "No matching files", opts,
+        [&opts, &group_id](const string& after, bool has_after, size_t max, vector<pair<string, string>>& page) {
+            lock_guard<TimedRecursiveMutex> lock(data_mutex);
+            auto group = tracker_infomap.find(group_id);
+            if (group == tracker_infomap.end()) return false;
+            
+            const map<string, FileMetadata>& metadata = file_metadata[group_id];
+            collect_page(group->second.files, after, has_after, opts.prefix, max, page,
+                [&metadata](const string& file) {
+                    auto meta = metadata.find(file);
+                    if (meta == metadata.end()) return file;
+                    string version = meta->second.version > 1 ? ", v" + to_string(meta->second.version) : "";
+                    string bundle = meta->second.manifest_hash.empty() ? "" : ", bundle";
+                    return file + " (" + to_string(meta->second.file_size) + " bytes" + version + bundle + ")";
+                });
+            return true;
+        });
 }
 
-string handle_accept_request(const vector<string>& args, const string& user_id) {
-    if (args.size() < 3) {
-        return "ERROR: Usage: accept_request <group_id> <user_id>";
+// ==================== LOCALITY ====================
+
+// Peer lists are ranked by network distance to the requester, using the rules
+// given with --locality in order (later rules break ties of earlier ones):
+//   zone    same zone/rack label (declared at login) first
+//   subnet  longest shared IPv4 address prefix first
+//   coord   smallest distance between the declared network coordinates first
+// Peers that lack the information a rule needs rank after those that have it.
+enum LocalityRule { LOCALITY_ZONE, LOCALITY_SUBNET, LOCALITY_COORD };
+
+vector<LocalityRule> locality_rules = {LOCALITY_ZONE, LOCALITY_SUBNET};
+
+bool parse_locality_rules(const string& spec) {
+    vector<LocalityRule> rules;
+    for (const string& name : split_string(spec, ',')) {
+        if (name == "zone") rules.push_back(LOCALITY_ZONE);
+        else if (name == "subnet") rules.push_back(LOCALITY_SUBNET);
+        else if (name == "coord") rules.push_back(LOCALITY_COORD);
+        else if (name != "none") return false;
+    }
+    locality_rules = rules;
+    return true;
+}
+
+int shared_prefix_bits(const string& a, const string& b) {
+    struct in_addr addr_a, addr_b;
+    if (inet_pton(AF_INET, a.c_str(), &addr_a) != 1 || inet_pton(AF_INET, b.c_str(), &addr_b) != 1) return 0;
+    
+    uint32_t diff = ntohl(addr_a.s_addr) ^ ntohl(addr_b.s_addr);
+    int bits = 0;
+    while (bits < 32 && !(diff & (0x80000000u >> bits))) bits++;
+    return bits;
+}
+
+// Smaller is closer; compared rule by rule
+vector<double> locality_key(const UserInfo& requester, const UserInfo& peer) {
+    vector<double> key;
+    for (LocalityRule rule : locality_rules) {
+        if (rule == LOCALITY_ZONE) {
+            if (requester.zone.empty() || peer.zone.empty()) key.push_back(1);
+            else key.push_back(requester.zone == peer.zone ? 0 : 2);
+        }
+        else if (rule == LOCALITY_SUBNET) {
+            key.push_back(32 - shared_prefix_bits(requester.ip, peer.ip));
+        }
+        else {
+            double x1, y1, x2, y2;
+            if (parse_coord(requester.coord, x1, y1) && parse_coord(peer.coord, x2, y2)) {
+                key.push_back(sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2)));
+            } else {
+                key.push_back(HUGE_VAL);
+            }
+        }
+    }
+    return key;
+}
+
+// Pick up to numwant active seeders of a file for user_id, favouring the ones
+// handed out least recently and randomizing among them. Only the front of the
+// swarm is examined, so the cost is O(numwant) regardless of swarm size. With
+// locality rules, a wider window is examined and the nearest candidates are
+// returned, nearest first. Caller must hold data_mutex.
+vector<string> sample_seeders(Swarm& swarm, const string& user_id, int numwant) {
+    static thread_local mt19937 rng(random_device{}());
+    
+    // Consider twice as many candidates as wanted (four times when ranking by
+    // locality) so the choice is randomized but still biased toward least
+    // recent handouts
+    size_t window = locality_rules.empty() ? 2 : 4;
+    size_t want_candidates = (size_t)numwant * window;
+    size_t max_scan = (size_t)numwant * window * 2 + 8;
+    
+    vector<list<string>::iterator> candidates;
+    vector<list<string>::iterator> skipped;
+    auto it = swarm.order.begin();
+    
+    for (size_t scanned = 0; scanned < max_scan && it != swarm.order.end() &&
+         candidates.size() < want_candidates; scanned++, ++it) {
+        if (*it == user_id) continue; // Skip self
+        
+        const UserInfo& seeder = user_info[*it];
+        if (seeder.is_active && seeder.is_live) {
+            candidates.push_back(it);
+        } else {
+            skipped.push_back(it);
+        }
     }
     
+    // Partial Fisher-Yates: the first numwant entries become the sample
+    size_t take = min(candidates.size(), (size_t)numwant);
+    if (locality_rules.empty()) {
+        for (size_t i = 0; i < take; i++) {
+            uniform_int_distribution<size_t> pick(i, candidates.size() - 1);
+            swap(candidates[i], candidates[pick(rng)]);
+        }
+    } else {
+        // Shuffled first so equally close peers share the load
+        shuffle(candidates.begin(), candidates.end(), rng);
+        
+        const UserInfo& requester = user_info[user_id];
+        vector<pair<vector<double>, size_t>> ranked;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            ranked.push_back(make_pair(locality_key(requester, user_info[*candidates[i]]), i));
+        }
+        partial_sort(ranked.begin(), ranked.begin() + take, ranked.end());
+        
+        vector<list<string>::iterator> nearest;
+        for (size_t i = 0; i < take; i++) nearest.push_back(candidates[ranked[i].second]);
+        candidates.swap(nearest);
+    }
+    
+    vector<string> result;
+    for (size_t i = 0; i < take; i++) {
+        result.push_back(*candidates[i]);
+        swarm.touch(candidates[i]);
+    }
+    
+    // Swarms restored from older snapshots may still hold logged-out seeders;
+    // move them to the back too, so they don't clog the front
+    for (auto& s : skipped) {
+        swarm.touch(s);
+    }
+    
+    return result;
+}
+
+// Swarm-wide piece availability as runs of equal counts:
+// "<count>x<pieces>,<count>x<pieces>,..." (one run when nobody is mid-download)
+string availability_summary(const string& group_id, const string& filename, int num_pieces) {
+    Swarm& swarm = file_seeders[group_id][filename];
+    FileAvailability* avail = NULL;
+    auto group = file_availability.find(group_id);
+    if (group != file_availability.end() && group->second.count(filename)) {
+        avail = &group->second[filename];
+    }
+    
+    size_t partial = avail ? avail->partial.size() : 0;
+    uint32_t complete = swarm.size() > partial ? (uint32_t)(swarm.size() - partial) : 0;
+    if (!avail || num_pieces == 0 || avail->runs.empty()) {   // Empty: too large to count
+        return to_string(complete) + "x" + to_string(num_pieces);
+    }
+    
+    // Complete seeders come and go without touching the counts, so the
+    // cached text is only reused while their number is unchanged
+    if (!avail->summary.empty() && avail->summary_complete == complete) return avail->summary;
+    
+    string out;
+    for (const auto& run : avail->runs) {
+        if (!out.empty()) out += ",";
+        out += to_string(complete + run.first) + "x" + to_string(run.second);
+    }
+    avail->summary = out;
+    avail->summary_complete = complete;
+    return out;
+}
+
+// Shared by download_file and more_peers:
+// "PEERS: ip1:port1 ip2:port2/<pieces> ... SIZE:<bytes> PIECES:<n> AVAIL:<summary> [ROOT:<sha256>] [VERSION:<n>]
+//  [MANIFEST:<sha256>]"
+// A peer still downloading the file carries its pieces (see decode_pieces);
+// the others have every piece. ROOT is the uploader's root hash, if it gave one;
+// VERSION counts uploads with changed content, once there has been one.
+string build_peer_response(const vector<string>& args, const string& user_id) {
     string group_id = args[1];
-    string request_user = args[2];
+    string filename = args[2];
+    
+    int numwant = min(default_numwant, max_numwant);
+    if (args.size() >= 4) {
+        numwant = max(1, min(atoi(args[3].c_str()), max_numwant));
+    }
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -361,86 +2674,140 @@ string handle_accept_request(const vector<string>& args, const string& user_id)
     
     GroupInfo& group = tracker_infomap[group_id];
     
-    if (group.owner != user_id) {
-        return "ERROR: Only group owner can accept requests";
+    // Check if user is member
+    if (!group.peers.count(user_id)) {
+        return "ERROR: Not a member of this group";
     }
     
-    auto it = find(group.pending_requests.begin(), group.pending_requests.end(), request_user);
-    if (it == group.pending_requests.end()) {
-        return "ERROR: No pending request from this user";
+    // Check if file exists
+    if (file_seeders[group_id].find(filename) == file_seeders[group_id].end()) {
+        return "ERROR: File not found in group";
+    }
+    
+    vector<string> seeders = sample_seeders(file_seeders[group_id][filename], user_id, numwant);
+    
+    if (seeders.empty()) {
+        return "ERROR: No active seeders available";
+    }
+    
+    // Build peer list with IP:PORT for the sampled seeders
+    string result = "PEERS:";
+    for (const string& seeder : seeders) {
+        const UserInfo& info = user_info[seeder];
+        result += " " + info.ip + ":" + to_string(info.port);
+        
+        auto partial = info.partial_files.find(group_id);
+        if (partial != info.partial_files.end() && partial->second.count(filename)) {
+            result += "/" + file_availability[group_id][filename].partial[seeder];
+        }
+    }
+    
+    // Add file metadata
+    FileMetadata& meta = file_metadata[group_id][filename];
+    result += " SIZE:" + to_string(meta.file_size);
+    result += " PIECES:" + to_string(meta.num_pieces);
+    result += " AVAIL:" + availability_summary(group_id, filename, meta.num_pieces);
+    if (!meta.sha256_hash.empty()) result += " ROOT:" + meta.sha256_hash;
+    if (meta.version > 1) result += " VERSION:" + to_string(meta.version);
+    if (!meta.manifest_hash.empty()) result += " MANIFEST:" + meta.manifest_hash;
+    
+    return result;
+}
+
+string handle_download_file(const vector<string>& args, const string& user_id) {
+    if (args.size() < 3) {
+        return "ERROR: Usage: download_file <group_id> <filename> [numwant]";
     }
     
-    // Remove from pending and add to members
-    group.pending_requests.erase(it);
-    group.peers.push_back(request_user);
-    
-    return "SUCCESS: User added to group";
+    return build_peer_response(args, user_id);
 }
 
-string handle_upload_file(const vector<string>& args, const string& user_id) {
-    if (args.size() < 5) {
-        return "ERROR: Usage: upload_file <filepath> <group_id> <file_size> <num_pieces>";
+// Follow-up to download_file for a client that needs more sources. Seeders
+// just handed out have moved to the back of the swarm, so repeated calls walk
+// through different peers.
+string handle_more_peers(const vector<string>& args, const string& user_id) {
+    if (args.size() < 3) {
+        return "ERROR: Usage: more_peers <group_id> <filename> [numwant]";
     }
     
-    string filepath = args[1];
-    string group_id = args[2];
-    long file_size = stol(args[3]);
-    int num_pieces = stoi(args[4]);
-    
-    // Extract filename from path
-    string filename = filepath;
-    size_t pos = filepath.find_last_of("/\\");
-    if (pos != string::npos) {
-        filename = filepath.substr(pos + 1);
+    return build_peer_response(args, user_id);
+}
+
+// A file's metadata without peers, for clients that find peers some other way
+// (the DHT): "FILE: SIZE:<bytes> PIECES:<n> [ROOT:<sha256>] [VERSION:<n>] [MANIFEST:<sha256>]"
+string handle_file_info(const vector<string>& args, const string& user_id) {
+    if (args.size() < 3) {
+        return "ERROR: Usage: file_info <group_id> <filename>";
     }
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
-    if (!user_info[user_id].is_active) {
+    auto user = user_info.find(user_id);
+    if (user == user_info.end() || !user->second.is_active) {
         return "ERROR: Please login first";
     }
-    
-    if (tracker_infomap.find(group_id) == tracker_infomap.end()) {
+    auto group = tracker_infomap.find(args[1]);
+    if (group == tracker_infomap.end()) {
         return "ERROR: Group does not exist";
     }
-    
-    GroupInfo& group = tracker_infomap[group_id];
-    
-    // Check if user is member
-    if (find(group.peers.begin(), group.peers.end(), user_id) == group.peers.end()) {
+    if (!group->second.peers.count(user_id)) {
         return "ERROR: Not a member of this group";
     }
+    auto files = file_metadata.find(args[1]);
+    if (files == file_metadata.end() || !files->second.count(args[2])) {
+        return "ERROR: File not found in group";
+    }
     
-    // Add file metadata
-    FileMetadata meta;
-    meta.filename = filename;
-    meta.file_size = file_size;
-    meta.num_pieces = num_pieces;
+    const FileMetadata& meta = files->second[args[2]];
+    string result = "FILE: SIZE:" + to_string(meta.file_size) + " PIECES:" + to_string(meta.num_pieces);
+    if (!meta.sha256_hash.empty()) result += " ROOT:" + meta.sha256_hash;
+    if (meta.version > 1) result += " VERSION:" + to_string(meta.version);
+    if (!meta.manifest_hash.empty()) result += " MANIFEST:" + meta.manifest_hash;
+    return result;
+}
+
+string handle_update_seeder(const vector<string>& args, const string& user_id) {
+    string root;
+    if (args.size() < 3 || (args.size() >= 4 && !parse_root_hash(args[3], root))) {
+        return "ERROR: Usage: update_seeder <group_id> <filename> [root=<sha256>]";
+    }
+    
+    string group_id = args[1];
+    string filename = args[2];
     
-    file_metadata[group_id][filename] = meta;
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
-    // Add to group files if not already there
-    if (find(group.files.begin(), group.files.end(), filename) == group.files.end()) {
-        group.files.push_back(filename);
+    if (!user_info[user_id].is_active) {
+        return "ERROR: Please login first";
     }
     
-    // Add user as seeder
-    file_seeders[group_id][filename].insert(user_id);
+    // A download that finished after a new version was uploaded holds old content
+    auto meta = file_metadata[group_id].find(filename);
+    if (!root.empty() && meta != file_metadata[group_id].end() && !meta->second.sha256_hash.empty() &&
+        meta->second.sha256_hash != root) {
+        return "ERROR: File has a newer version";
+    }
     
-    // Track in user's files
-    user_info[user_id].group_files[group_id].push_back(filename);
+    // Add user as seeder for this file (re-announcing is free)
+    if (!file_seeders[group_id][filename].contains(user_id) ||
+        !user_info[user_id].group_files[group_id].count(filename)) {
+        commit_record({"update_seeder", group_id, filename, user_id});
+    }
     
-    return "SUCCESS: File uploaded successfully";
+    return "SUCCESS: Seeder updated";
 }
 
-string handle_list_files(const vector<string>& args, const string& user_id) {
-    if (args.size() < 2) {
-        return "ERROR: Usage: list_files <group_id>";
+// Bulk upload_file: share many files with a group in one command. Each entry
+// may end with its root hash, as in upload_file.
+string handle_upload_files(const vector<string>& args, const string& user_id) {
+    if (args.size() < 5) {
+        return "ERROR: Usage: upload_files <group_id> <filepath> <file_size> <num_pieces> [root=<sha256>] "
+               "[<filepath> <file_size> <num_pieces> [root=<sha256>] ...]";
     }
     
     string group_id = args[1];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -450,38 +2817,55 @@ string handle_list_files(const vector<string>& args, const string& user_id) {
         return "ERROR: Group does not exist";
     }
     
-    GroupInfo& group = tracker_infomap[group_id];
-    
     // Check if user is member
-    if (find(group.peers.begin(), group.peers.end(), user_id) == group.peers.end()) {
+    if (!tracker_infomap[group_id].peers.count(user_id)) {
         return "ERROR: Not a member of this group";
     }
     
-    if (group.files.empty()) {
-        return "No files in this group";
-    }
-    
-    string result = "FILES:\n";
-    for (const string& file : group.files) {
-        result += file;
-        if (file_metadata[group_id].find(file) != file_metadata[group_id].end()) {
-            result += " (" + to_string(file_metadata[group_id][file].file_size) + " bytes)";
+    int uploaded = 0;
+    int invalid = 0;
+    size_t i = 2;
+    while (i < args.size()) {
+        if (i + 2 >= args.size()) {
+            invalid++;
+            break;
+        }
+        const string& filepath = args[i];
+        long file_size;
+        int num_pieces;
+        bool valid = parse_file_shape(args[i + 1], args[i + 2], file_size, num_pieces);
+        i += 3;
+        string root;
+        if (i < args.size() && args[i].find("root=") == 0) {
+            if (!parse_root_hash(args[i], root)) valid = false;
+            i++;
         }
-        result += "\n";
+        if (!valid) {
+            invalid++;
+            continue;
+        }
+        
+        commit_record({"upload_file", group_id, base_filename(filepath), to_string(file_size),
+                       to_string(num_pieces), user_id, root});
+        uploaded++;
     }
     
+    string result = "SUCCESS: " + to_string(uploaded) + " files uploaded";
+    if (invalid > 0) result += " (" + to_string(invalid) + " invalid entries skipped)";
     return result;
 }
 
-string handle_download_file(const vector<string>& args, const string& user_id) {
+// Bulk update_seeder, e.g. to re-announce every seeded file after a reconnect
+// or a client restart. Each filename may be followed by the root hash held,
+// as in update_seeder.
+string handle_update_seeders(const vector<string>& args, const string& user_id) {
     if (args.size() < 3) {
-        return "ERROR: Usage: download_file <group_id> <filename>";
+        return "ERROR: Usage: update_seeders <group_id> <filename> [root=<sha256>] [<filename> ...]";
     }
     
     string group_id = args[1];
-    string filename = args[2];
     
-    lock_guard<mutex> lock(data_mutex);
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
     if (!user_info[user_id].is_active) {
         return "ERROR: Please login first";
@@ -491,60 +2875,372 @@ string handle_download_file(const vector<string>& args, const string& user_id) {
         return "ERROR: Group does not exist";
     }
     
-    GroupInfo& group = tracker_infomap[group_id];
-    
     // Check if user is member
-    if (find(group.peers.begin(), group.peers.end(), user_id) == group.peers.end()) {
+    if (!tracker_infomap[group_id].peers.count(user_id)) {
         return "ERROR: Not a member of this group";
     }
     
-    // Check if file exists
-    if (file_seeders[group_id].find(filename) == file_seeders[group_id].end()) {
-        return "ERROR: File not found in group";
+    const map<string, FileMetadata>& files = file_metadata[group_id];
+    set<string>& shared = user_info[user_id].group_files[group_id];
+    int updated = 0;
+    int unknown = 0;
+    int outdated = 0;
+    
+    for (size_t i = 2; i < args.size(); i++) {
+        const string& filename = args[i];
+        string root;
+        if (i + 1 < args.size() && args[i + 1].find("root=") == 0) {
+            if (!parse_root_hash(args[++i], root)) {
+                unknown++;
+                continue;
+            }
+        }
+        auto meta = files.find(filename);
+        if (meta == files.end()) {
+            unknown++;
+            continue;
+        }
+        if (!root.empty() && !meta->second.sha256_hash.empty() && meta->second.sha256_hash != root) {
+            outdated++;
+            continue;
+        }
+        if (!file_seeders[group_id][filename].contains(user_id) || !shared.count(filename)) {
+            commit_record({"update_seeder", group_id, filename, user_id});
+        }
+        updated++;
     }
     
-    const set<string>& seeders = file_seeders[group_id][filename];
+    string result = "SUCCESS: Seeder updated for " + to_string(updated) + " files";
+    if (unknown > 0) result += " (" + to_string(unknown) + " unknown files skipped)";
+    if (outdated > 0) result += " (" + to_string(outdated) + " files with a newer version skipped)";
+    return result;
+}
+
+// Heartbeat, optionally carrying the pieces of files still being downloaded:
+// "announce [<group_id> <filename> <pieces> ...]". The reply tells the client
+// how often to send it.
+string handle_announce(const vector<string>& args, const string& user_id) {
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
     
-    // Build peer list with IP:PORT for active seeders
-    string result = "PEERS:";
-    bool found_active = false;
+    if (user_id.empty() || !user_info[user_id].is_active) {
+        return "ERROR: Please login first";
+    }
     
-    for (const string& seeder : seeders) {
-        if (seeder == user_id) continue; // Skip self
+    note_heartbeat(user_id);
+    
+    for (size_t i = 1; i + 2 < args.size(); i += 3) {
+        const string& group_id = args[i];
+        const string& filename = args[i + 1];
+        const string& enc = args[i + 2];
+        
+        auto group = tracker_infomap.find(group_id);
+        if (group == tracker_infomap.end() || !group->second.peers.count(user_id)) continue;
+        auto meta = file_metadata[group_id].find(filename);
+        if (meta == file_metadata[group_id].end()) continue;
+        
+        if (!pieces_well_formed(enc)) continue;
         
-        if (user_info[seeder].is_active) {
-            found_active = true;
-            result += " " + user_info[seeder].ip + ":" + to_string(user_info[seeder].port);
+        // Only changes are logged
+        auto avail = file_availability.find(group_id);
+        if (avail != file_availability.end()) {
+            auto file = avail->second.find(filename);
+            if (file != avail->second.end()) {
+                auto entry = file->second.partial.find(user_id);
+                if (entry != file->second.partial.end() && entry->second == enc) continue;
+            }
         }
+        
+        commit_record({"have", group_id, filename, user_id, enc});
     }
     
-    if (!found_active) {
-        return "ERROR: No active seeders available";
+    return "SUCCESS: INTERVAL " + to_string(heartbeat_interval_sec());
+}
+
+// ==================== BATCH ====================
+
+// "batch <count> <bytes>\n" followed by <bytes> bytes holding <count>
+// newline-separated commands. All commands run under a single data_mutex
+// acquisition and share one WAL fsync; the response carries one chunk per
+// command, in order. Listings and session commands (login, logout, attach)
+// can't be batched.
+
+#define MAX_BATCH_BYTES (16 * 1024 * 1024)
+
+bool is_batchable_command(const string& cmd) {
+    return cmd == "create_user" || cmd == "create_group" || cmd == "join_group" ||
+           cmd == "leave_group" || cmd == "accept_request" || cmd == "upload_file" ||
+           cmd == "upload_files" || cmd == "update_seeder" || cmd == "update_seeders" ||
+           cmd == "download_file" || cmd == "more_peers" || cmd == "file_info";
+}
+
+// Run a batchable command
+string execute_command(const vector<string>& args, const string& user_id,
+                       const string& client_ip, int client_port) {
+    const string& cmd = args[0];
+    
+    if (is_write_command(cmd) && !is_primary) {
+        // Backups only serve reads; point the client at the primary
+        string primary = get_primary_addr();
+        return "ERROR: NOT_PRIMARY " + (primary.empty() ? "-" : primary);
+    }
+    
+    if (cmd == "create_user") return handle_create_user(args, client_ip, client_port);
+    if (cmd == "create_group") return handle_create_group(args, user_id);
+    if (cmd == "join_group") return handle_join_group(args, user_id);
+    if (cmd == "leave_group") return handle_leave_group(args, user_id);
+    if (cmd == "accept_request") return handle_accept_request(args, user_id);
+    if (cmd == "upload_file") return handle_upload_file(args, user_id);
+    if (cmd == "upload_files") return handle_upload_files(args, user_id);
+    if (cmd == "update_seeder") return handle_update_seeder(args, user_id);
+    if (cmd == "update_seeders") return handle_update_seeders(args, user_id);
+    if (cmd == "download_file") return handle_download_file(args, user_id);
+    if (cmd == "more_peers") return handle_more_peers(args, user_id);
+    if (cmd == "file_info") return handle_file_info(args, user_id);
+    
+    return "ERROR: Unknown command";
+}
+
+// data holds what has been received so far, starting with the batch header.
+// Returns false if the connection broke.
+bool handle_batch(SOCKET client_socket, string data, const string& user_id,
+                  const string& client_ip, int client_port) {
+    size_t newline = data.find('\n');
+    vector<string> header = split_string(data.substr(0, newline), ' ');
+    long count = header.size() >= 3 ? atol(header[1].c_str()) : -1;
+    long bytes = header.size() >= 3 ? atol(header[2].c_str()) : -1;
+    
+    if (newline == string::npos || count <= 0 || bytes < 0 || bytes > MAX_BATCH_BYTES) {
+        send_response(client_socket, "ERROR: Usage: batch <count> <bytes>\\n<commands>");
+        return true;
+    }
+    
+    string body = data.substr(newline + 1);
+    if ((long)body.size() < bytes) {
+        size_t have = body.size();
+        body.resize(bytes);
+        if (!recv_exact(client_socket, &body[have], bytes - have)) return false;
+    }
+    body.resize(bytes);
+    
+    vector<string> commands = split_string(body, '\n');
+    if ((long)commands.size() != count) {
+        send_response(client_socket, "ERROR: Batch holds " + to_string(commands.size()) +
+                                      " commands, header says " + to_string(count));
+        return true;
+    }
+    
+    vector<string> results;
+    results.reserve(commands.size());
+    {
+        lock_guard<TimedRecursiveMutex> lock(data_mutex);
+        
+        for (const string& command : commands) {
+            vector<string> args = split_string(command, ' ');
+            if (args.empty()) {
+                results.push_back("ERROR: Empty command");
+            } else if (!is_batchable_command(args[0])) {
+                results.push_back("ERROR: " + args[0] + " can't be batched");
+            } else {
+                results.push_back(execute_command(args, user_id, client_ip, client_port));
+            }
+        }
     }
     
-    // Add file metadata
-    FileMetadata& meta = file_metadata[group_id][filename];
-    result += " SIZE:" + to_string(meta.file_size);
-    result += " PIECES:" + to_string(meta.num_pieces);
+    // One fsync covers every change in the batch
+    wal_wait(thread_wal_seq);
     
-    return result;
+    string frame;
+    for (const string& result : results) {
+        append_chunk(frame, result.data(), result.size());
+    }
+    append_chunk(frame, "", 0);
+    return send_all(client_socket, frame.data(), frame.size());
 }
 
-string handle_update_seeder(const vector<string>& args, const string& user_id) {
-    if (args.size() < 3) {
-        return "ERROR: Usage: update_seeder <group_id> <filename>";
+// ==================== METRICS EXPORT ====================
+
+// State-derived gauges, computed when metrics are read
+struct TrackerGauges {
+    size_t users = 0;
+    size_t logged_in = 0;
+    size_t live = 0;
+    size_t groups = 0;
+    size_t files = 0;
+    size_t seeders = 0;         // Sum of swarm sizes
+    size_t max_swarm = 0;
+    size_t partial_seeders = 0;
+};
+
+TrackerGauges collect_gauges() {
+    TrackerGauges g;
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
+    
+    g.users = user_info.size();
+    for (const auto& pair : user_info) {
+        if (pair.second.is_active) g.logged_in++;
+        if (pair.second.is_active && pair.second.is_live) g.live++;
+    }
+    g.groups = tracker_infomap.size();
+    for (const auto& group : file_seeders) {
+        for (const auto& file : group.second) {
+            g.files++;
+            g.seeders += file.second.size();
+            g.max_swarm = max(g.max_swarm, file.second.size());
+        }
+    }
+    for (const auto& group : file_availability) {
+        for (const auto& file : group.second) g.partial_seeders += file.second.partial.size();
+    }
+    return g;
+}
+
+double uptime_seconds() {
+    return elapsed_ns(tracker_start) / 1e9;
+}
+
+string format_us(uint64_t ns) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f", ns / 1000.0);
+    return buf;
+}
+
+// Admin summary: gauges, data_mutex waits and per-command rates/latencies
+string handle_stats() {
+    MetricsTotals totals = collect_metrics();
+    TrackerGauges g = collect_gauges();
+    double uptime = uptime_seconds();
+    
+    stringstream out;
+    out << "STATS uptime_sec=" << (long)uptime << " role=" << (is_primary ? "primary" : "backup")
+        << " sessions=" << active_sessions.load() << " users=" << g.users
+        << " logged_in=" << g.logged_in << " live=" << g.live << " groups=" << g.groups
+        << " files=" << g.files << " seeders=" << g.seeders << " max_swarm=" << g.max_swarm
+        << " partial_seeders=" << g.partial_seeders << "\n";
+    
+    const HistogramData& lw = totals.lock_wait;
+    out << "LOCK data_mutex acquisitions=" << lw.count << " wait_p50_us=" << format_us(lw.percentile(50))
+        << " wait_p99_us=" << format_us(lw.percentile(99)) << " wait_p999_us=" << format_us(lw.percentile(99.9))
+        << " wait_max_us=" << format_us(lw.max_ns) << "\n";
+    
+    out << "COMMAND calls per_sec errors bytes p50_us p99_us p999_us max_us";
+    for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+        const CommandTotals& c = totals.commands[i];
+        if (c.calls == 0) continue;
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.2f", uptime > 0 ? c.calls / uptime : 0.0);
+        out << "\n" << METRIC_COMMANDS[i] << " " << c.calls << " " << rate << " " << c.errors << " "
+            << c.response_bytes << " " << format_us(c.latency.percentile(50)) << " "
+            << format_us(c.latency.percentile(99)) << " " << format_us(c.latency.percentile(99.9)) << " "
+            << format_us(c.latency.max_ns);
+    }
+    return out.str();
+}
+
+// Prometheus histogram buckets (seconds); the finer internal buckets are
+// folded into these
+const double PROM_BUCKETS[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+void prom_histogram(stringstream& out, const string& name, const string& labels, const HistogramData& h) {
+    string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (double le : PROM_BUCKETS) {
+        uint64_t le_ns = (uint64_t)(le * 1e9);
+        while (bucket < HIST_BUCKETS && hist_bucket_upper(bucket) <= le_ns) cumulative += h.buckets[bucket++];
+        out << name << "_bucket{" << labels << sep << "le=\"" << le << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << h.count << "\n";
+    out << name << "_sum{" << labels << "} " << h.sum_ns / 1e9 << "\n";
+    out << name << "_count{" << labels << "} " << h.count << "\n";
+}
+
+string render_prometheus() {
+    MetricsTotals totals = collect_metrics();
+    TrackerGauges g = collect_gauges();
+    stringstream out;
+    
+    out << "# HELP p2p_tracker_commands_total Commands handled.\n# TYPE p2p_tracker_commands_total counter\n";
+    for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+        out << "p2p_tracker_commands_total{command=\"" << METRIC_COMMANDS[i] << "\"} " << totals.commands[i].calls << "\n";
+    }
+    out << "# HELP p2p_tracker_command_errors_total Commands answered with an error.\n"
+        << "# TYPE p2p_tracker_command_errors_total counter\n";
+    for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+        out << "p2p_tracker_command_errors_total{command=\"" << METRIC_COMMANDS[i] << "\"} " << totals.commands[i].errors << "\n";
+    }
+    out << "# HELP p2p_tracker_response_bytes_total Response bytes sent.\n"
+        << "# TYPE p2p_tracker_response_bytes_total counter\n";
+    for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+        out << "p2p_tracker_response_bytes_total{command=\"" << METRIC_COMMANDS[i] << "\"} "
+            << totals.commands[i].response_bytes << "\n";
+    }
+    out << "# HELP p2p_tracker_command_duration_seconds Command latency, including the WAL flush.\n"
+        << "# TYPE p2p_tracker_command_duration_seconds histogram\n";
+    for (int i = 0; i < NUM_METRIC_COMMANDS; i++) {
+        if (totals.commands[i].calls == 0) continue;
+        prom_histogram(out, "p2p_tracker_command_duration_seconds",
+                       string("command=\"") + METRIC_COMMANDS[i] + "\"", totals.commands[i].latency);
+    }
+    out << "# HELP p2p_tracker_lock_wait_seconds Time spent waiting to acquire data_mutex.\n"
+        << "# TYPE p2p_tracker_lock_wait_seconds histogram\n";
+    prom_histogram(out, "p2p_tracker_lock_wait_seconds", "", totals.lock_wait);
+    
+    out << "# TYPE p2p_tracker_uptime_seconds gauge\np2p_tracker_uptime_seconds " << uptime_seconds() << "\n";
+    out << "# TYPE p2p_tracker_is_primary gauge\np2p_tracker_is_primary " << (is_primary ? 1 : 0) << "\n";
+    out << "# TYPE p2p_tracker_sessions gauge\np2p_tracker_sessions " << active_sessions.load() << "\n";
+    out << "# TYPE p2p_tracker_users gauge\np2p_tracker_users " << g.users << "\n";
+    out << "# TYPE p2p_tracker_users_logged_in gauge\np2p_tracker_users_logged_in " << g.logged_in << "\n";
+    out << "# TYPE p2p_tracker_users_live gauge\np2p_tracker_users_live " << g.live << "\n";
+    out << "# TYPE p2p_tracker_groups gauge\np2p_tracker_groups " << g.groups << "\n";
+    out << "# TYPE p2p_tracker_files gauge\np2p_tracker_files " << g.files << "\n";
+    out << "# TYPE p2p_tracker_seeders gauge\np2p_tracker_seeders " << g.seeders << "\n";
+    out << "# TYPE p2p_tracker_swarm_size_max gauge\np2p_tracker_swarm_size_max " << g.max_swarm << "\n";
+    out << "# TYPE p2p_tracker_partial_seeders gauge\np2p_tracker_partial_seeders " << g.partial_seeders << "\n";
+    return out.str();
+}
+
+// Minimal HTTP endpoint for Prometheus: every request gets the exposition
+void metrics_server_thread(SOCKET server_socket) {
+    while (true) {
+        SOCKET sock = accept(server_socket, NULL, NULL);
+        if (sock == INVALID_SOCKET) continue;
+        
+        set_recv_timeout(sock, 1000);
+        char request[4096];
+        recv(sock, request, sizeof(request), 0);  // Contents don't matter
+        
+        string body = render_prometheus();
+        string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                       to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        send_all(sock, reply.data(), reply.size());
+        CLOSE_SOCKET(sock);
     }
+}
+
+bool start_metrics_server(const string& ip, int port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return false;
     
-    string group_id = args[1];
-    string filename = args[2];
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
     
-    lock_guard<mutex> lock(data_mutex);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    addr.sin_port = htons(port);
     
-    // Add user as seeder for this file
-    file_seeders[group_id][filename].insert(user_id);
-    user_info[user_id].group_files[group_id].push_back(filename);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(sock, 16) == SOCKET_ERROR) {
+        CLOSE_SOCKET(sock);
+        return false;
+    }
     
-    return "SUCCESS: Seeder updated";
+    thread(metrics_server_thread, sock).detach();
+    LOG_INFO("[TRACKER] Metrics on http://" << ip << ":" << port << "/metrics");
+    return true;
 }
 
 // ==================== CLIENT HANDLER ====================
@@ -554,6 +3250,7 @@ void handle_client(SOCKET client_socket) {
     string current_user = "";
     string client_ip = "";
     int client_port = 0;
+    string session;           // Token this connection logged in or attached with
     
     // Get client address
     struct sockaddr_in addr;
@@ -561,21 +3258,37 @@ void handle_client(SOCKET client_socket) {
     getpeername(client_socket, (struct sockaddr*)&addr, &addr_len);
     client_ip = inet_ntoa(addr.sin_addr);
     
-    cout << "[TRACKER] Client connected from " << client_ip << endl;
+    struct SessionGauge {
+        SessionGauge() { active_sessions++; }
+        ~SessionGauge() { active_sessions--; }
+    } session_gauge;
+    
+    LOG_INFO("[TRACKER] Client connected from " << client_ip);
     
     while (true) {
         memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
         
         if (bytes_received <= 0) {
-            cout << "[TRACKER] Client disconnected" << endl;
+            LOG_INFO("[TRACKER] Client disconnected");
             // Note: We don't logout on disconnect anymore - user stays active
             // They can reconnect with the same IP:port
             break;
         }
         
-        string command(buffer);
-        cout << "[TRACKER] Received: " << command << endl;
+        string command(buffer, bytes_received);
+        
+        if (command.compare(0, 6, "batch ") == 0) {
+            LOG_SAMPLED(LOG_LEVEL_DEBUG, "[TRACKER] Received: " << command.substr(0, command.find('\n')));
+            auto started = chrono::steady_clock::now();
+            current_user = find_session_user(client_ip, client_port, session);
+            bool ok = handle_batch(client_socket, command, current_user, client_ip, client_port);
+            record_command("batch", elapsed_ns(started), 0, !ok);
+            if (!ok) break;
+            continue;
+        }
+        
+        LOG_SAMPLED(LOG_LEVEL_DEBUG, "[TRACKER] Received: " << command);
         
         vector<string> args = split_string(command, ' ');
         
@@ -586,62 +3299,92 @@ void handle_client(SOCKET client_socket) {
         
         string cmd = args[0];
         string response;
+        ResponseStream stream(client_socket);  // Listings stream their response themselves
+        auto started = chrono::steady_clock::now();
         
         // For login command, get the client port from the command
         if (cmd == "login" && args.size() >= 4) {
-            client_port = stoi(args[3]);
+            int port = parse_port(args[3]);
+            if (port == 0) {
+                send_response(client_socket, "ERROR: Usage: login <user_id> <password> <port>");
+                continue;
+            }
+            client_port = port;
+        }
+        
+        // A reconnecting client re-identifies its listening port and presents
+        // its session token, so an existing session (e.g. one restored from
+        // disk) is picked up again
+        if (cmd == "attach") {
+            int port = args.size() >= 2 ? parse_port(args[1]) : 0;
+            if (port == 0) {
+                send_response(client_socket, "ERROR: Usage: attach <port> [<session>]");
+                continue;
+            }
+            client_port = port;
+            session = args.size() >= 3 ? args[2] : "";
         }
         
-        // Look up current user by IP:port (for session persistence across connections)
-        current_user = find_user_by_address(client_ip, client_port);
+        // Look up current user by IP:port and session token (for session persistence across connections)
+        current_user = find_session_user(client_ip, client_port, session);
         
         // Handle commands
-        if (cmd == "create_user") {
-            response = handle_create_user(args, client_ip, client_port);
+        if (is_write_command(cmd) && !is_primary) {
+            // Backups only serve reads; point the client at the primary
+            string primary = get_primary_addr();
+            response = "ERROR: NOT_PRIMARY " + (primary.empty() ? "-" : primary);
+        }
+        else if (is_batchable_command(cmd)) {
+            response = execute_command(args, current_user, client_ip, client_port);
         }
         else if (cmd == "login") {
             // client_port already parsed above
             response = handle_login(args, client_ip, client_port);
-            // current_user will be found by find_user_by_address on next command
+            size_t token = response.find(" SESSION:");
+            if (token != string::npos) session = response.substr(token + 9);
+            // current_user will be found by find_session_user on next command
         }
         else if (cmd == "logout") {
             response = handle_logout(args, current_user);
             if (response.find("SUCCESS") != string::npos) {
                 current_user = "";
+                session = "";
             }
         }
-        else if (cmd == "create_group") {
-            response = handle_create_group(args, current_user);
-        }
-        else if (cmd == "join_group") {
-            response = handle_join_group(args, current_user);
-        }
-        else if (cmd == "leave_group") {
-            response = handle_leave_group(args, current_user);
-        }
         else if (cmd == "list_groups") {
-            response = handle_list_groups(args, current_user);
+            response = handle_list_groups(args, current_user, stream);
         }
         else if (cmd == "list_requests") {
-            response = handle_list_requests(args, current_user);
+            response = handle_list_requests(args, current_user, stream);
         }
-        else if (cmd == "accept_request") {
-            response = handle_accept_request(args, current_user);
+        else if (cmd == "list_files") {
+            response = handle_list_files(args, current_user, stream);
         }
-        else if (cmd == "upload_file") {
-            response = handle_upload_file(args, current_user);
+        else if (cmd == "announce") {
+            response = handle_announce(args, current_user);
         }
-        else if (cmd == "list_files") {
-            response = handle_list_files(args, current_user);
+        else if (cmd == "attach") {
+            if (!current_user.empty()) {
+                lock_guard<TimedRecursiveMutex> lock(data_mutex);
+                note_heartbeat(current_user);
+            }
+            response = current_user.empty() ? "SUCCESS: Attached" : "SUCCESS: Attached as " + current_user;
         }
-        else if (cmd == "download_file") {
-            response = handle_download_file(args, current_user);
+        else if (cmd == "stats") {
+            response = handle_stats();
         }
-        else if (cmd == "update_seeder") {
-            response = handle_update_seeder(args, current_user);
+        else if (cmd == "tracker_role") {
+            string primary = get_primary_addr();
+            response = is_primary ? "ROLE PRIMARY" : "ROLE BACKUP " + (primary.empty() ? "-" : primary);
+        }
+        else if (cmd == "replicate") {
+            if (serve_replica(client_socket, args, client_ip)) {
+                return;  // The socket now belongs to the replication stream
+            }
+            continue;
         }
         else if (cmd == "quit") {
-            if (!current_user.empty()) {
+            if (!current_user.empty() && is_primary) {
                 handle_logout(args, current_user);
             }
             send_response(client_socket, "BYE");
@@ -651,21 +3394,467 @@ void handle_client(SOCKET client_socket) {
             response = "ERROR: Unknown command";
         }
         
-        send_response(client_socket, response);
+        // Don't acknowledge a change before it is durable
+        wal_wait(thread_wal_seq);
+        
+        record_command(cmd, elapsed_ns(started), response.size() + stream.bytes_sent,
+                       response.compare(0, 5, "ERROR") == 0);
+        
+        // An empty response means it was already streamed
+        if (!response.empty()) {
+            send_response(client_socket, response);
+        }
     }
     
     CLOSE_SOCKET(client_socket);
 }
 
+// ==================== UDP ANNOUNCE ====================
+
+// Heartbeats and peer lookups are small and frequent, so besides the TCP
+// command channel the tracker takes them as single UDP datagrams on its own
+// port: no connection, thread or socket per client. Numbers are in network
+// byte order; a string is [u8 length][bytes], piece encodings [u16 length][bytes].
+//
+//   connect   -> [u64 UDP_PROTOCOL_ID][u32 0][u32 txn]
+//             <- [u32 0][u32 txn][u64 connection_id]
+//   announce  -> [u64 connection_id][u32 1][u32 txn][u16 port][u16 n][n x (group, filename, pieces)]
+//             <- [u32 1][u32 txn][u32 interval_sec]
+//   peers     -> [u64 connection_id][u32 2][u32 txn][u16 port][u8 more][u16 numwant][group][filename]
+//             <- [u32 2][u32 txn][the PEERS text of download_file, or of more_peers if more is 1]
+//   scrape    -> [u64 connection_id][u32 4][u32 txn][u16 port][group][filename]
+//             <- [u32 4][u32 txn][u32 seeders][u32 downloading][u32 version]
+//   error     <- [u32 3][u32 txn][ERROR text]
+//
+// port is the client's listening port, which with the source address names
+// its session, as attach does over TCP. The connection id shows that the
+// client receives datagrams at its source address, so a spoofed one can't act
+// for another user: it is a keyed hash of that address and the current
+// minute, and is accepted for UDP_CONN_ID_MINUTES.
+
+#define UDP_PROTOCOL_ID 0x41727101980ULL
+#define UDP_CONNECT 0
+#define UDP_ANNOUNCE 1
+#define UDP_PEERS 2
+#define UDP_ERROR 3
+#define UDP_SCRAPE 4
+#define UDP_MAX_DATAGRAM 8192   // Larger peer lists are refused; the client asks over TCP
+#define UDP_BATCH 64            // Datagrams taken per receive call
+#define UDP_CONN_ID_MINUTES 2
+
+uint8_t udp_secret[16];
+
+inline uint64_t rotl64(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline uint64_t load_le64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// SipHash-2-4: a keyed hash whose output can't be predicted without the key
+uint64_t siphash24(const uint8_t key[16], const uint8_t* in, size_t len) {
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    auto round = [&]() {
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    };
+    
+    size_t full = len - len % 8;
+    for (size_t i = 0; i < full; i += 8) {
+        uint64_t m = load_le64(in + i);
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++) last |= (uint64_t)in[full + i] << (8 * i);
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t udp_connection_id(const struct sockaddr_in& from, uint64_t minute) {
+    uint8_t in[14];
+    memcpy(in, &from.sin_addr.s_addr, 4);
+    memcpy(in + 4, &from.sin_port, 2);
+    for (int i = 0; i < 8; i++) in[6 + i] = (uint8_t)(minute >> (8 * i));
+    return siphash24(udp_secret, in, sizeof(in));
+}
+
+uint64_t current_minute() {
+    return (uint64_t)chrono::duration_cast<chrono::minutes>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool valid_connection_id(uint64_t id, const struct sockaddr_in& from) {
+    uint64_t now = current_minute();
+    for (uint64_t age = 0; age < UDP_CONN_ID_MINUTES; age++) {
+        if (udp_connection_id(from, now - age) == id) return true;
+    }
+    return false;
+}
+
+// Bounds-checked reader of network-order fields; ok turns false on overrun
+struct NetReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok;
+    
+    NetReader(const char* data, size_t len)
+        : p((const unsigned char*)data), end((const unsigned char*)data + len), ok(true) {}
+    
+    uint64_t uint(int bytes) {
+        if (end - p < bytes) { ok = false; p = end; return 0; }
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+        p += bytes;
+        return v;
+    }
+    
+    string str(int length_bytes) {
+        size_t len = (size_t)uint(length_bytes);
+        if ((size_t)(end - p) < len) { ok = false; p = end; return ""; }
+        string s((const char*)p, len);
+        p += len;
+        return s;
+    }
+};
+
+void put_net(string& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+string udp_reply(uint32_t action, uint32_t txn) {
+    string out;
+    put_net(out, action, 4);
+    put_net(out, txn, 4);
+    return out;
+}
+
+string udp_error(uint32_t txn, const string& message) {
+    return udp_reply(UDP_ERROR, txn) + message;
+}
+
+// Swarm size of one file without the peer list; "" if the user may not see it
+string handle_udp_scrape(const string& group_id, const string& filename, const string& user_id, uint32_t txn) {
+    lock_guard<TimedRecursiveMutex> lock(data_mutex);
+    
+    auto group = tracker_infomap.find(group_id);
+    if (group == tracker_infomap.end() || !group->second.peers.count(user_id)) return "";
+    auto meta = file_metadata[group_id].find(filename);
+    if (meta == file_metadata[group_id].end()) return "";
+    
+    uint32_t seeders = 0;
+    auto files = file_seeders.find(group_id);
+    if (files != file_seeders.end()) {
+        auto swarm = files->second.find(filename);
+        if (swarm != files->second.end()) seeders = (uint32_t)swarm->second.size();
+    }
+    uint32_t downloading = 0;
+    auto avail = file_availability.find(group_id);
+    if (avail != file_availability.end()) {
+        auto file = avail->second.find(filename);
+        if (file != avail->second.end()) downloading = (uint32_t)file->second.partial.size();
+    }
+    
+    string reply = udp_reply(UDP_SCRAPE, txn);
+    put_net(reply, seeders, 4);
+    put_net(reply, downloading, 4);
+    put_net(reply, (uint32_t)meta->second.version, 4);
+    return reply;
+}
+
+// The reply to one datagram; "" to ignore it
+string handle_udp_datagram(const char* data, size_t len, const struct sockaddr_in& from) {
+    NetReader in(data, len);
+    uint64_t id = in.uint(8);
+    uint32_t action = (uint32_t)in.uint(4);
+    uint32_t txn = (uint32_t)in.uint(4);
+    if (!in.ok) return "";
+    
+    auto started = chrono::steady_clock::now();
+    if (action == UDP_CONNECT) {
+        if (id != UDP_PROTOCOL_ID) return "";
+        string reply = udp_reply(UDP_CONNECT, txn);
+        put_net(reply, udp_connection_id(from, current_minute()), 8);
+        record_command("udp_connect", elapsed_ns(started), reply.size(), false);
+        return reply;
+    }
+    if (!valid_connection_id(id, from)) {
+        return udp_error(txn, "ERROR: Invalid connection id");
+    }
+    
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, (void*)&from.sin_addr, ip, sizeof(ip));
+    int port = (int)in.uint(2);
+    string session = in.str(1);
+    string user_id = in.ok ? find_session_user(ip, port, session) : "";
+    if (user_id.empty()) {
+        return udp_error(txn, "ERROR: Please login first");
+    }
+    string response;
+    string metric;
+    
+    if (action == UDP_SCRAPE) {
+        string group_id = in.str(1);
+        string filename = in.str(1);
+        string reply = in.ok ? handle_udp_scrape(group_id, filename, user_id, txn) : "";
+        bool error = reply.empty();
+        if (error) reply = udp_error(txn, "ERROR: File not found in group");
+        record_command("udp_scrape", elapsed_ns(started), reply.size(), error);
+        return reply;
+    }
+    if (action == UDP_ANNOUNCE) {
+        metric = "udp_announce";
+        vector<string> args = {"announce"};
+        int entries = (int)in.uint(2);
+        for (int i = 0; i < entries && in.ok; i++) {
+            args.push_back(in.str(1));
+            args.push_back(in.str(1));
+            args.push_back(in.str(2));
+        }
+        if (!in.ok) {
+            response = "ERROR: Malformed announce";
+        } else if (!is_primary) {
+            string primary = get_primary_addr();
+            response = "ERROR: NOT_PRIMARY " + (primary.empty() ? "-" : primary);
+        } else {
+            response = handle_announce(args, user_id);
+        }
+    }
+    else if (action == UDP_PEERS) {
+        metric = "udp_peers";
+        bool more = in.uint(1) != 0;
+        int numwant = (int)in.uint(2);
+        vector<string> args = {more ? "more_peers" : "download_file"};
+        args.push_back(in.str(1));
+        args.push_back(in.str(1));
+        args.push_back(to_string(numwant));
+        if (!in.ok) {
+            response = "ERROR: Malformed peer request";
+        } else {
+            response = more ? handle_more_peers(args, user_id) : handle_download_file(args, user_id);
+        }
+    }
+    else {
+        return udp_error(txn, "ERROR: Unknown action");
+    }
+    
+    string reply;
+    bool error = response.compare(0, 5, "ERROR") == 0;
+    if (error) {
+        reply = udp_error(txn, response);
+    } else if (action == UDP_ANNOUNCE) {
+        // "SUCCESS: INTERVAL <sec>"
+        size_t pos = response.find("INTERVAL ");
+        reply = udp_reply(UDP_ANNOUNCE, txn);
+        put_net(reply, pos == string::npos ? 0 : (uint32_t)atoi(response.c_str() + pos + 9), 4);
+    } else if (response.size() + 8 > UDP_MAX_DATAGRAM) {
+        error = true;
+        reply = udp_error(txn, "ERROR: Too large for UDP");
+    } else {
+        reply = udp_reply(UDP_PEERS, txn) + response;
+    }
+    record_command(metric, elapsed_ns(started), reply.size(), error);
+    return reply;
+}
+
+// Answers datagrams in batches: one receive call takes whatever has queued up
+// (up to UDP_BATCH), one WAL wait covers every announce in it, and one send
+// call carries the replies
+void udp_server_thread(SOCKET sock) {
+#ifdef __linux__
+    vector<char> buffers((size_t)UDP_BATCH * UDP_MAX_DATAGRAM);
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    struct mmsghdr out[UDP_BATCH];
+    struct iovec out_iovs[UDP_BATCH];
+    string replies[UDP_BATCH];
+    
+    while (true) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovs[i].iov_base = &buffers[(size_t)i * UDP_MAX_DATAGRAM];
+            iovs[i].iov_len = UDP_MAX_DATAGRAM;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        int n = recvmmsg(sock, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+        
+        for (int i = 0; i < n; i++) {
+            replies[i] = handle_udp_datagram((const char*)iovs[i].iov_base, msgs[i].msg_len, addrs[i]);
+        }
+        wal_wait(thread_wal_seq);
+        
+        int count = 0;
+        memset(out, 0, sizeof(out));
+        for (int i = 0; i < n; i++) {
+            if (replies[i].empty()) continue;
+            out_iovs[count].iov_base = &replies[i][0];
+            out_iovs[count].iov_len = replies[i].size();
+            out[count].msg_hdr.msg_iov = &out_iovs[count];
+            out[count].msg_hdr.msg_iovlen = 1;
+            out[count].msg_hdr.msg_name = &addrs[i];
+            out[count].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            count++;
+        }
+        for (int sent = 0; sent < count; ) {
+            int r = sendmmsg(sock, out + sent, count - sent, 0);
+            if (r <= 0) break;  // Dropped, as a datagram may be; the client retransmits
+            sent += r;
+        }
+    }
+#else
+    vector<char> buffer(UDP_MAX_DATAGRAM);
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(sock, buffer.data(), (int)buffer.size(), 0, (struct sockaddr*)&from, &from_len);
+        if (n <= 0) continue;
+        
+        string reply = handle_udp_datagram(buffer.data(), n, from);
+        wal_wait(thread_wal_seq);
+        if (!reply.empty()) {
+            sendto(sock, reply.data(), (int)reply.size(), 0, (struct sockaddr*)&from, from_len);
+        }
+    }
+#endif
+}
+
+bool start_udp_server(const string& ip, int port) {
+    random_device rd;
+    for (uint8_t& b : udp_secret) b = (uint8_t)rd();
+    
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) return false;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    addr.sin_port = htons(port);
+    
+    if (::bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        CLOSE_SOCKET(sock);
+        return false;
+    }
+    
+    thread(udp_server_thread, sock).detach();
+    LOG_INFO("[TRACKER] UDP announces on " << ip << ":" << port);
+    return true;
+}
+
 // ==================== MAIN ====================
 
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        cout << "Usage: tracker.exe <tracker_info_file> <tracker_no>" << endl;
+        cout << "Usage: tracker.exe <tracker_info_file> <tracker_no> [options]" << endl;
         cout << "Example: tracker.exe tracker_info.txt 1" << endl;
+        cout << "Options:" << endl;
+        cout << "  --data-dir=<dir>            Directory for WAL and snapshot (default: .)" << endl;
+        cout << "  --no-persist                Keep state in memory only" << endl;
+        cout << "  --snapshot-every=<n>        WAL records between snapshots (default: 100000)" << endl;
+        cout << "  --snapshot-interval=<sec>   Max seconds between snapshots (default: 300)" << endl;
+        cout << "  --numwant=<n>               Peers returned by download_file (default: 50)" << endl;
+        cout << "  --max-numwant=<n>           Upper bound on a client's numwant (default: 200)" << endl;
+        cout << "  --seeder-ttl=<sec>          Drop seeders silent for this long (default: 90)" << endl;
+        cout << "  --locality=<rules>          Peer ranking: zone,subnet,coord or none (default: zone,subnet)" << endl;
+        cout << "  --log-level=<level>         debug, info, warn, error or off (default: info)" << endl;
+        cout << "  --log-file=<path>           Append log records to a file instead of stdout" << endl;
+        cout << "  --log-sample=<n>            Keep 1 in n per-command debug records (default: 1)" << endl;
+        cout << "  --metrics-port=<port>       Serve Prometheus metrics over HTTP on this port" << endl;
+        cout << "  --no-udp                    Don't take announces and peer lookups over UDP" << endl;
+        return 1;
+    }
+    
+    string data_dir = ".";
+    bool persist = true;
+    LogLevel log_level = LOG_LEVEL_INFO;
+    string log_file;
+    unsigned log_sample = 1;
+    int metrics_port = 0;
+    bool udp = true;
+    for (int i = 3; i < argc; i++) {
+        string opt = argv[i];
+        if (opt.find("--data-dir=") == 0) {
+            data_dir = opt.substr(11);
+        }
+        else if (opt == "--no-persist") {
+            persist = false;
+        }
+        else if (opt.find("--snapshot-every=") == 0) {
+            snapshot_every = stol(opt.substr(17));
+        }
+        else if (opt.find("--snapshot-interval=") == 0) {
+            snapshot_interval_sec = stol(opt.substr(20));
+        }
+        else if (opt.find("--numwant=") == 0) {
+            default_numwant = max(1, stoi(opt.substr(10)));
+        }
+        else if (opt.find("--max-numwant=") == 0) {
+            max_numwant = max(1, stoi(opt.substr(14)));
+        }
+        else if (opt.find("--seeder-ttl=") == 0) {
+            seeder_ttl_sec = max(1, stoi(opt.substr(13)));
+        }
+        else if (opt.find("--log-level=") == 0) {
+            if (!parse_log_level(opt.substr(12), log_level)) {
+                cerr << "ERROR: Unknown log level in " << opt << endl;
+                return 1;
+            }
+        }
+        else if (opt.find("--log-file=") == 0) {
+            log_file = opt.substr(11);
+        }
+        else if (opt.find("--metrics-port=") == 0) {
+            metrics_port = stoi(opt.substr(15));
+        }
+        else if (opt.find("--log-sample=") == 0) {
+            log_sample = (unsigned)max(1, stoi(opt.substr(13)));
+        }
+        else if (opt == "--no-udp") {
+            udp = false;
+        }
+        else if (opt.find("--locality=") == 0) {
+            if (!parse_locality_rules(opt.substr(11))) {
+                cerr << "ERROR: Unknown locality rule in " << opt << endl;
+                return 1;
+            }
+        }
+        else {
+            cerr << "ERROR: Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    
+    if (!Logger::instance().start(log_level, log_file, log_sample)) {
+        cerr << "ERROR: Cannot open log file " << log_file << endl;
         return 1;
     }
     
+#ifndef _WIN32
+    // A peer closing its socket mid-send must not kill the tracker
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    
 #ifdef _WIN32
     // Initialize Winsock
     WSADATA wsaData;
@@ -689,16 +3878,20 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // Every line is a tracker of the replication group; ours is line tracker_no
     string line;
-    int line_no = 0;
-    string tracker_addr;
-    
-    while (getline(file, line) && line_no < tracker_no) {
-        tracker_addr = line;
-        line_no++;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) tracker_addrs.push_back(line);
     }
     file.close();
     
+    string tracker_addr;
+    if (tracker_no >= 1 && tracker_no <= (int)tracker_addrs.size()) {
+        tracker_addr = tracker_addrs[tracker_no - 1];
+        my_tracker_no = tracker_no;
+    }
+    
     if (tracker_addr.empty()) {
         cerr << "ERROR: Tracker address not found in file" << endl;
 #ifdef _WIN32
@@ -720,6 +3913,14 @@ int main(int argc, char* argv[]) {
     string ip = tracker_addr.substr(0, colon_pos);
     int port = stoi(tracker_addr.substr(colon_pos + 1));
     
+    // Restore state before accepting connections
+    if (persist && !init_persistence(data_dir, tracker_no)) {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return 1;
+    }
+    
     // Create socket
     SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (server_socket == INVALID_SOCKET) {
@@ -765,6 +3966,17 @@ int main(int argc, char* argv[]) {
     cout << "  Listening on " << ip << ":" << port << endl;
     cout << "========================================" << endl;
     
+    if (metrics_port > 0 && !start_metrics_server(ip, metrics_port)) {
+        LOG_WARN("[TRACKER] Cannot serve metrics on port " << metrics_port);
+    }
+    if (udp && !start_udp_server(ip, port)) {
+        LOG_WARN("[TRACKER] Cannot take UDP announces on port " << port);
+    }
+    
+    // Join the replication group (a lone tracker simply becomes primary)
+    thread(replication_thread).detach();
+    thread(expiry_thread).detach();
+    
     // Accept connections
     while (true) {
         struct sockaddr_in client_addr;